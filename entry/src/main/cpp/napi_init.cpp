@@ -5,6 +5,7 @@
 #include <cassert>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <deque>
 #include <map>
 #include <set>
@@ -36,25 +37,568 @@ void ResizeWidth(int new_width) {}
 
 // start a terminal
 static napi_value Run(napi_env env, napi_callback_info info) {
+    // sessions are saved in app sandbox when it goes to background
+    SetSnapshotDir("/data/storage/el2/base/files");
     Start();
     return nullptr;
 }
 
 // send data to terminal
 static napi_value Send(napi_env env, napi_callback_info info) {
+    size_t argc = 2;
+    napi_value args[2] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    void *data;
+    size_t length;
+    napi_status ret = napi_get_arraybuffer_info(env, args[0], &data, &length);
+    assert(ret == napi_ok);
+
+    // optional session id, default to the one on screen
+    int32_t session = -1;
+    if (argc >= 2) {
+        napi_get_value_int32(env, args[1], &session);
+    }
+
+    // return bytes accepted, pty backpressure never blocks ui thread
+    size_t accepted = SendData((uint8_t *)data, length, session);
+    napi_value res = nullptr;
+    napi_create_uint32(env, accepted, &res);
+    return res;
+}
+
+// ArkTS key names of keys that do not produce text
+static const std::map<std::string, int> key_names = {
+    {"KEYCODE_ENTER", key_enter},
+    {"KEYCODE_TAB", key_tab},
+    {"KEYCODE_DEL", key_backspace},
+    {"KEYCODE_ESCAPE", key_escape},
+    {"KEYCODE_DPAD_UP", key_up},
+    {"KEYCODE_DPAD_DOWN", key_down},
+    {"KEYCODE_DPAD_RIGHT", key_right},
+    {"KEYCODE_DPAD_LEFT", key_left},
+    {"KEYCODE_MOVE_HOME", key_home},
+    {"KEYCODE_MOVE_END", key_end},
+    {"KEYCODE_INSERT", key_insert},
+    {"KEYCODE_FORWARD_DEL", key_delete},
+    {"KEYCODE_PAGE_UP", key_page_up},
+    {"KEYCODE_PAGE_DOWN", key_page_down},
+    {"KEYCODE_F1", key_f1},
+    {"KEYCODE_F2", key_f2},
+    {"KEYCODE_F3", key_f3},
+    {"KEYCODE_F4", key_f4},
+    {"KEYCODE_F5", key_f5},
+    {"KEYCODE_F6", key_f6},
+    {"KEYCODE_F7", key_f7},
+    {"KEYCODE_F8", key_f8},
+    {"KEYCODE_F9", key_f9},
+    {"KEYCODE_F10", key_f10},
+    {"KEYCODE_F11", key_f11},
+    {"KEYCODE_F12", key_f12},
+    {"KEYCODE_NUMPAD_0", key_kp_0},
+    {"KEYCODE_NUMPAD_1", key_kp_1},
+    {"KEYCODE_NUMPAD_2", key_kp_2},
+    {"KEYCODE_NUMPAD_3", key_kp_3},
+    {"KEYCODE_NUMPAD_4", key_kp_4},
+    {"KEYCODE_NUMPAD_5", key_kp_5},
+    {"KEYCODE_NUMPAD_6", key_kp_6},
+    {"KEYCODE_NUMPAD_7", key_kp_7},
+    {"KEYCODE_NUMPAD_8", key_kp_8},
+    {"KEYCODE_NUMPAD_9", key_kp_9},
+    {"KEYCODE_NUMPAD_DOT", key_kp_decimal},
+    {"KEYCODE_NUMPAD_DIVIDE", key_kp_divide},
+    {"KEYCODE_NUMPAD_MULTIPLY", key_kp_multiply},
+    {"KEYCODE_NUMPAD_SUBTRACT", key_kp_subtract},
+    {"KEYCODE_NUMPAD_ADD", key_kp_add},
+    {"KEYCODE_NUMPAD_ENTER", key_kp_enter},
+    {"KEYCODE_NUMPAD_EQUALS", key_kp_equal},
+};
+
+// encode key natively according to keyboard modes of session
+static napi_value SendKeyEvent(napi_env env, napi_callback_info info) {
+    size_t argc = 4;
+    napi_value args[4] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    char name[64] = {};
+    size_t size = 0;
+    napi_get_value_string_utf8(env, args[0], name, sizeof(name), &size);
+
+    int32_t modifiers = 0;
+    napi_get_value_int32(env, args[1], &modifiers);
+
+    std::string text;
+    if (argc >= 3 && napi_get_value_string_utf8(env, args[2], NULL, 0, &size) == napi_ok) {
+        text.resize(size + 1);
+        napi_get_value_string_utf8(env, args[2], &text[0], text.size(), &size);
+        text.resize(size);
+    }
+
+    // optional session id, default to the one on screen
+    int32_t session = -1;
+    if (argc >= 4) {
+        napi_get_value_int32(env, args[3], &session);
+    }
+
+    int key = key_none;
+    auto it = key_names.find(name);
+    if (it != key_names.end()) {
+        key = it->second;
+    } else if (strcmp(name, "KEYCODE_SPACE") == 0 && text.empty()) {
+        text = " ";
+    }
+
+    size_t accepted = 0;
+    if (key != key_none || !text.empty()) {
+        accepted = SendKey(key, modifiers, text, session);
+    }
+    napi_value res = nullptr;
+    napi_create_uint32(env, accepted, &res);
+    return res;
+}
+
+// report mouse event natively, false if program does not track mouse
+static napi_value SendMouseEvent(napi_env env, napi_callback_info info) {
+    size_t argc = 6;
+    napi_value args[6] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    int32_t action = 0, button = 0, modifiers = 0;
+    double x = 0, y = 0;
+    napi_get_value_int32(env, args[0], &action);
+    napi_get_value_int32(env, args[1], &button);
+    napi_get_value_int32(env, args[2], &modifiers);
+    napi_get_value_double(env, args[3], &x);
+    napi_get_value_double(env, args[4], &y);
+
+    // optional session id, default to the one on screen
+    int32_t session = -1;
+    if (argc >= 6) {
+        napi_get_value_int32(env, args[5], &session);
+    }
+
+    bool tracking = SendMouse(action, button, modifiers, x, y, session);
+    napi_value res = nullptr;
+    napi_get_boolean(env, tracking, &res);
+    return res;
+}
+
+// pointer position for hovered link underline
+static napi_value SetHoverPosition(napi_env env, napi_callback_info info) {
+    size_t argc = 2;
+    napi_value args[2] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    double x = -1, y = -1;
+    napi_get_value_double(env, args[0], &x);
+    napi_get_value_double(env, args[1], &y);
+    SetHover(x, y);
+    return nullptr;
+}
+
+// OSC 8 link under pixel position, empty if none
+static napi_value GetLinkAtPosition(napi_env env, napi_callback_info info) {
+    size_t argc = 3;
+    napi_value args[3] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    double x = 0, y = 0;
+    napi_get_value_double(env, args[0], &x);
+    napi_get_value_double(env, args[1], &y);
+    int32_t session = -1;
+    if (argc >= 3) {
+        napi_get_value_int32(env, args[2], &session);
+    }
+
+    std::string uri = GetLinkAt(x, y, session);
+    napi_value res = nullptr;
+    napi_create_string_utf8(env, uri.c_str(), uri.size(), &res);
+    return res;
+}
+
+// url or file path detected under pixel position, empty if none
+static napi_value GetMatchAtPosition(napi_env env, napi_callback_info info) {
+    size_t argc = 3;
+    napi_value args[3] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    double x = 0, y = 0;
+    napi_get_value_double(env, args[0], &x);
+    napi_get_value_double(env, args[1], &y);
+    int32_t session = -1;
+    if (argc >= 3) {
+        napi_get_value_int32(env, args[2], &session);
+    }
+
+    std::string text = GetMatchAt(x, y, session);
+    napi_value res = nullptr;
+    napi_create_string_utf8(env, text.c_str(), text.size(), &res);
+    return res;
+}
+
+// OSC 133 shell integration, n counts commands from start, negative from the last
+static napi_value ScrollToPromptNumber(napi_env env, napi_callback_info info) {
+    size_t argc = 1;
+    napi_value args[1] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    int64_t n = -1;
+    napi_get_value_int64(env, args[0], &n);
+    napi_value res = nullptr;
+    napi_get_boolean(env, ScrollToPrompt(n), &res);
+    return res;
+}
+
+static napi_value JumpToPromptDelta(napi_env env, napi_callback_info info) {
+    size_t argc = 1;
+    napi_value args[1] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    int32_t delta = 0;
+    napi_get_value_int32(env, args[0], &delta);
+    napi_value res = nullptr;
+    napi_get_boolean(env, JumpToPrompt(delta), &res);
+    return res;
+}
+
+static napi_value CopyOutputOfCommand(napi_env env, napi_callback_info info) {
+    size_t argc = 2;
+    napi_value args[2] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    int64_t n = -1;
+    int32_t session = -1;
+    if (argc >= 1) {
+        napi_get_value_int64(env, args[0], &n);
+    }
+    if (argc >= 2) {
+        napi_get_value_int32(env, args[1], &session);
+    }
+    napi_value res = nullptr;
+    napi_get_boolean(env, CopyCommandOutput(n, session), &res);
+    return res;
+}
+
+// record output of session to asciicast file at path
+static napi_value StartRecordingTo(napi_env env, napi_callback_info info) {
+    size_t argc = 2;
+    napi_value args[2] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    std::string path;
+    size_t size = 0;
+    if (argc >= 1 && napi_get_value_string_utf8(env, args[0], NULL, 0, &size) == napi_ok) {
+        path.resize(size + 1);
+        napi_get_value_string_utf8(env, args[0], &path[0], path.size(), &size);
+        path.resize(size);
+    }
+    int32_t session = -1;
+    if (argc >= 2) {
+        napi_get_value_int32(env, args[1], &session);
+    }
+    napi_value res = nullptr;
+    napi_get_boolean(env, !path.empty() && StartRecording(path, session), &res);
+    return res;
+}
+
+static napi_value StopRecordingOf(napi_env env, napi_callback_info info) {
+    size_t argc = 1;
+    napi_value args[1] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    int32_t session = -1;
+    if (argc >= 1) {
+        napi_get_value_int32(env, args[0], &session);
+    }
+    napi_value res = nullptr;
+    napi_get_boolean(env, StopRecording(session), &res);
+    return res;
+}
+
+static napi_value IsRecordingOf(napi_env env, napi_callback_info info) {
+    size_t argc = 1;
+    napi_value args[1] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    int32_t session = -1;
+    if (argc >= 1) {
+        napi_get_value_int32(env, args[0], &session);
+    }
+    napi_value res = nullptr;
+    napi_get_boolean(env, IsRecording(session), &res);
+    return res;
+}
+
+// marks and timing of a command, undefined if unknown or evicted
+static napi_value GetCommandInfo(napi_env env, napi_callback_info info) {
+    size_t argc = 2;
+    napi_value args[2] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    int64_t n = -1;
+    int32_t session = -1;
+    napi_get_value_int64(env, args[0], &n);
+    if (argc >= 2) {
+        napi_get_value_int32(env, args[1], &session);
+    }
+
+    command_mark command;
+    int64_t index = 0;
+    napi_value res = nullptr, value = nullptr;
+    if (!GetCommand(n, command, index, session)) {
+        napi_get_undefined(env, &res);
+        return res;
+    }
+    napi_create_object(env, &res);
+    napi_create_int64(env, index, &value);
+    napi_set_named_property(env, res, "index", value);
+    napi_get_boolean(env, command.stage == mark_end, &value);
+    napi_set_named_property(env, res, "finished", value);
+    napi_create_int32(env, command.exit_status, &value);
+    napi_set_named_property(env, res, "exitStatus", value);
+    // -1 unless both C and D are seen
+    double duration = command.stage == mark_end && command.start_msec != 0
+                          ? (double)(command.end_msec - command.start_msec)
+                          : -1;
+    napi_create_double(env, duration, &value);
+    napi_set_named_property(env, res, "durationMsec", value);
+    return res;
+}
+
+// selection in session on screen, mode: char=1 word=2 line=3 block=4
+static napi_value StartSelectionAt(napi_env env, napi_callback_info info) {
+    size_t argc = 3;
+    napi_value args[3] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    double x = 0, y = 0;
+    int32_t mode = selection_char;
+    napi_get_value_double(env, args[0], &x);
+    napi_get_value_double(env, args[1], &y);
+    if (argc >= 3) {
+        napi_get_value_int32(env, args[2], &mode);
+    }
+    if (mode < selection_none || mode > selection_block) {
+        mode = selection_char;
+    }
+    StartSelection(x, y, mode);
+    return nullptr;
+}
+
+static napi_value ExtendSelectionTo(napi_env env, napi_callback_info info) {
+    size_t argc = 2;
+    napi_value args[2] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    double x = 0, y = 0;
+    napi_get_value_double(env, args[0], &x);
+    napi_get_value_double(env, args[1], &y);
+    ExtendSelection(x, y);
+    return nullptr;
+}
+
+static napi_value ClearSelectedText(napi_env env, napi_callback_info info) {
+    ClearSelection();
+    return nullptr;
+}
+
+static napi_value SelectAllText(napi_env env, napi_callback_info info) {
+    SelectAll();
+    return nullptr;
+}
+
+static napi_value GetSelectedText(napi_env env, napi_callback_info info) {
+    std::string text = GetSelection();
+    napi_value res = nullptr;
+    napi_create_string_utf8(env, text.c_str(), text.size(), &res);
+    return res;
+}
+
+static napi_value CopySelectedText(napi_env env, napi_callback_info info) {
+    napi_value res = nullptr;
+    napi_get_boolean(env, CopySelection(), &res);
+    return res;
+}
+
+// output triggers for all sessions, array of { text, notify?, highlight? },
+// returns error message, empty if compiled
+static napi_value SetTriggerPatterns(napi_env env, napi_callback_info info) {
     size_t argc = 1;
     napi_value args[1] = {nullptr};
     napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
 
+    uint32_t length = 0;
+    napi_get_array_length(env, args[0], &length);
+    std::vector<trigger_pattern> patterns(length);
+    for (uint32_t i = 0; i < length; i++) {
+        napi_value element = nullptr, value = nullptr;
+        napi_get_element(env, args[0], i, &element);
+
+        size_t size = 0;
+        napi_get_named_property(env, element, "text", &value);
+        if (napi_get_value_string_utf8(env, value, NULL, 0, &size) == napi_ok) {
+            patterns[i].text.resize(size + 1);
+            napi_get_value_string_utf8(env, value, &patterns[i].text[0], patterns[i].text.size(), &size);
+            patterns[i].text.resize(size);
+        }
+        bool has = false;
+        napi_has_named_property(env, element, "notify", &has);
+        if (has) {
+            napi_get_named_property(env, element, "notify", &value);
+            napi_get_value_bool(env, value, &patterns[i].notify);
+        }
+        // background as 0xRRGGBB
+        napi_has_named_property(env, element, "highlight", &has);
+        if (has) {
+            uint32_t color = 0;
+            napi_get_named_property(env, element, "highlight", &value);
+            patterns[i].highlight = napi_get_value_uint32(env, value, &color) == napi_ok;
+            patterns[i].color = color;
+        }
+    }
+
+    std::string error;
+    SetTriggers(std::move(patterns), error);
+    napi_value res = nullptr;
+    napi_create_string_utf8(env, error.c_str(), error.size(), &res);
+    return res;
+}
+
+// input staging buffer shared with ArkTS as an external ArrayBuffer,
+// keys are written there and committed in one call
+static constexpr size_t input_staging_size = 4096;
+static uint8_t input_staging[input_staging_size];
+
+static napi_value GetInputBuffer(napi_env env, napi_callback_info info) {
+    napi_value res = nullptr;
+    // static storage, never freed
+    napi_status ret = napi_create_external_arraybuffer(env, input_staging, input_staging_size, nullptr, nullptr, &res);
+    assert(ret == napi_ok);
+    return res;
+}
+
+// send the first length bytes of input buffer, unaccepted bytes are
+// moved to the front, return how many are left for the next commit
+static napi_value CommitInput(napi_env env, napi_callback_info info) {
+    size_t argc = 2;
+    napi_value args[2] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    uint32_t length = 0;
+    napi_get_value_uint32(env, args[0], &length);
+    if (length > input_staging_size) {
+        length = input_staging_size;
+    }
+
+    // optional session id, default to the one on screen
+    int32_t session = -1;
+    if (argc >= 2) {
+        napi_get_value_int32(env, args[1], &session);
+    }
+
+    size_t accepted = SendData(input_staging, length, session);
+    size_t left = length - accepted;
+    if (left > 0 && accepted > 0) {
+        memmove(input_staging, input_staging + accepted, left);
+    }
+    napi_value res = nullptr;
+    napi_create_uint32(env, left, &res);
+    return res;
+}
+
+// paste content, streamed to pty in chunks
+static napi_value PasteData(napi_env env, napi_callback_info info) {
+    size_t argc = 2;
+    napi_value args[2] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
     void *data;
     size_t length;
     napi_status ret = napi_get_arraybuffer_info(env, args[0], &data, &length);
     assert(ret == napi_ok);
 
-    SendData((uint8_t *)data, length);
+    int32_t session = -1;
+    if (argc >= 2) {
+        napi_get_value_int32(env, args[1], &session);
+    }
+
+    Paste((uint8_t *)data, length, session);
     return nullptr;
 }
 
+// bytes written and total bytes of pastes in progress
+static napi_value PasteProgress(napi_env env, napi_callback_info info) {
+    size_t argc = 1;
+    napi_value args[1] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    int32_t session = -1;
+    if (argc >= 1) {
+        napi_get_value_int32(env, args[0], &session);
+    }
+
+    size_t written, total;
+    GetPasteProgress(session, written, total);
+    napi_value res = nullptr, value = nullptr;
+    napi_create_object(env, &res);
+    napi_create_double(env, written, &value);
+    napi_set_named_property(env, res, "written", value);
+    napi_create_double(env, total, &value);
+    napi_set_named_property(env, res, "total", value);
+    return res;
+}
+
+// create a new session
+static napi_value NewSession(napi_env env, napi_callback_info info) {
+    napi_value res = nullptr;
+    napi_create_int32(env, CreateSession(), &res);
+    return res;
+}
+
+// show session on screen
+static napi_value ShowSession(napi_env env, napi_callback_info info) {
+    size_t argc = 1;
+    napi_value args[1] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    int32_t id = 0;
+    napi_status ret = napi_get_value_int32(env, args[0], &id);
+    assert(ret == napi_ok);
+
+    napi_value res = nullptr;
+    napi_get_boolean(env, SwitchSession(id), &res);
+    return res;
+}
+
+// close session and kill its program
+static napi_value EndSession(napi_env env, napi_callback_info info) {
+    size_t argc = 1;
+    napi_value args[1] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    int32_t id = 0;
+    napi_status ret = napi_get_value_int32(env, args[0], &id);
+    assert(ret == napi_ok);
+
+    napi_value res = nullptr;
+    napi_get_boolean(env, CloseSession(id), &res);
+    return res;
+}
+
+static napi_value ExitStatus(napi_env env, napi_callback_info info) {
+    size_t argc = 1;
+    napi_value args[1] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    int32_t id = 0;
+    napi_status ret = napi_get_value_int32(env, args[0], &id);
+    assert(ret == napi_ok);
+
+    napi_value res = nullptr;
+    napi_create_int32(env, GetExitStatus(id), &res);
+    return res;
+}
+
 static napi_value CreateSurface(napi_env env, napi_callback_info info) {
     size_t argc = 1;
     napi_value args[1] = {nullptr};
@@ -146,39 +690,95 @@ static napi_value Scroll(napi_env env, napi_callback_info info) {
 // TODO
 static napi_value DestroySurface(napi_env env, napi_callback_info info) { return nullptr; }
 
-// TODO
-static pthread_mutex_t pasteboard_lock = PTHREAD_MUTEX_INITIALIZER;
-static std::deque<std::string> copy_queue;
-static int paste_requests = 0;
-static std::deque<std::string> paste_queue;
+// events pushed to ArkTS via a threadsafe function
+struct terminal_event {
+    const char *type;
+    int session = -1;
+    std::string text;
+    int code = 0;
+    int x = 0, y = 0, width = 0, height = 0;
+};
 
-static napi_value CheckCopy(napi_env env, napi_callback_info info) {
-    napi_value res = nullptr;
-    pthread_mutex_lock(&pasteboard_lock);
-    if (!copy_queue.empty()) {
-        std::string content = copy_queue.front();
-        copy_queue.pop_front();
-        napi_create_string_utf8(env, content.c_str(), content.size(), &res);
-    }
-    pthread_mutex_unlock(&pasteboard_lock);
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static napi_threadsafe_function event_handler = nullptr;
+// events before handler is registered
+static std::vector<terminal_event *> pending_events;
 
-    return res;
+static void SetProperty(napi_env env, napi_value object, const char *name, int value) {
+    napi_value res;
+    napi_create_int32(env, value, &res);
+    napi_set_named_property(env, object, name, res);
 }
 
-static napi_value CheckPaste(napi_env env, napi_callback_info info) {
-    napi_value res = nullptr;
-    pthread_mutex_lock(&pasteboard_lock);
-    bool has_paste = false;
-    if (paste_requests > 0) {
-        has_paste = true;
-        paste_requests --;
+// runs in ArkTS thread
+static void CallEventHandler(napi_env env, napi_value js_callback, void *context, void *data) {
+    terminal_event *event = (terminal_event *)data;
+    if (env != nullptr && js_callback != nullptr) {
+        napi_value object, value;
+        napi_create_object(env, &object);
+        napi_create_string_utf8(env, event->type, NAPI_AUTO_LENGTH, &value);
+        napi_set_named_property(env, object, "type", value);
+        SetProperty(env, object, "session", event->session);
+        // text and code carry copies, titles, trigger matches and exit codes
+        napi_create_string_utf8(env, event->text.c_str(), event->text.size(), &value);
+        napi_set_named_property(env, object, "text", value);
+        SetProperty(env, object, "code", event->code);
+        if (strcmp(event->type, "cursor") == 0) {
+            SetProperty(env, object, "x", event->x);
+            SetProperty(env, object, "y", event->y);
+            SetProperty(env, object, "width", event->width);
+            SetProperty(env, object, "height", event->height);
+        }
+
+        napi_value undefined;
+        napi_get_undefined(env, &undefined);
+        napi_call_function(env, undefined, js_callback, 1, &object, nullptr);
     }
-    pthread_mutex_unlock(&pasteboard_lock);
+    delete event;
+}
 
-    napi_get_boolean(env, has_paste, &res);
-    return res;
+// called from native threads, never blocks
+static void PostEvent(terminal_event *event) {
+    pthread_mutex_lock(&event_lock);
+    if (event_handler == nullptr) {
+        pending_events.push_back(event);
+    } else if (napi_call_threadsafe_function(event_handler, event, napi_tsfn_nonblocking) != napi_ok) {
+        OH_LOG_Print(LOG_APP, LOG_WARN, 0x0, LOG_TAG, "Failed to post %{public}s event", event->type);
+        delete event;
+    }
+    pthread_mutex_unlock(&event_lock);
 }
 
+static napi_value SetEventHandler(napi_env env, napi_callback_info info) {
+    size_t argc = 1;
+    napi_value args[1] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    napi_value name;
+    napi_create_string_utf8(env, "terminal_event", NAPI_AUTO_LENGTH, &name);
+    napi_threadsafe_function handler;
+    napi_status res = napi_create_threadsafe_function(env, args[0], nullptr, name, 0, 1, nullptr, nullptr, nullptr,
+                                                      CallEventHandler, &handler);
+    assert(res == napi_ok);
+    // do not keep event loop alive
+    napi_unref_threadsafe_function(env, handler);
+
+    pthread_mutex_lock(&event_lock);
+    if (event_handler != nullptr) {
+        napi_release_threadsafe_function(event_handler, napi_tsfn_release);
+    }
+    event_handler = handler;
+    for (terminal_event *event : pending_events) {
+        napi_call_threadsafe_function(event_handler, event, napi_tsfn_nonblocking);
+    }
+    pending_events.clear();
+    pthread_mutex_unlock(&event_lock);
+    return nullptr;
+}
+
+static pthread_mutex_t pasteboard_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::deque<std::string> paste_queue;
+
 static napi_value PushPaste(napi_env env, napi_callback_info info) {
     size_t argc = 1;
     napi_value args[1] = {nullptr};
@@ -197,20 +797,23 @@ static napi_value PushPaste(napi_env env, napi_callback_info info) {
     pthread_mutex_lock(&pasteboard_lock);
     paste_queue.push_back(s);
     pthread_mutex_unlock(&pasteboard_lock);
+    // io thread sleeps until something happens
+    WakeEventLoop();
 
     return nullptr;
 }
 
-void Copy(std::string base64) {
-    pthread_mutex_lock(&pasteboard_lock);
-    copy_queue.push_back(base64);
-    pthread_mutex_unlock(&pasteboard_lock);
+void Copy(std::string text) {
+    terminal_event *event = new terminal_event;
+    event->type = "copy";
+    event->text = std::move(text);
+    PostEvent(event);
 }
 
 void RequestPaste() {
-    pthread_mutex_lock(&pasteboard_lock);
-    paste_requests++;
-    pthread_mutex_unlock(&pasteboard_lock);
+    terminal_event *event = new terminal_event;
+    event->type = "paste";
+    PostEvent(event);
 }
 
 std::string GetPaste() {
@@ -224,11 +827,63 @@ std::string GetPaste() {
     return res;
 }
 
+void Bell(int session) {
+    terminal_event *event = new terminal_event;
+    event->type = "bell";
+    event->session = session;
+    PostEvent(event);
+}
+
+void SetTitle(int session, std::string title) {
+    terminal_event *event = new terminal_event;
+    event->type = "title";
+    event->session = session;
+    event->text = std::move(title);
+    PostEvent(event);
+}
+
+void ProgramExited(int session, int status) {
+    terminal_event *event = new terminal_event;
+    event->type = "exit";
+    event->session = session;
+    event->code = status;
+    PostEvent(event);
+}
+
+void SessionChanged(int session, bool opened) {
+    terminal_event *event = new terminal_event;
+    event->type = "session";
+    event->session = session;
+    event->code = opened ? 1 : 0;
+    PostEvent(event);
+}
+
+void TriggerMatched(int session, int pattern, const std::string &text) {
+    terminal_event *event = new terminal_event;
+    event->type = "trigger";
+    event->session = session;
+    event->code = pattern;
+    event->text = text;
+    PostEvent(event);
+}
+
+void CursorMoved(int x, int y, int width, int height) {
+    terminal_event *event = new terminal_event;
+    event->type = "cursor";
+    event->x = x;
+    event->y = y;
+    event->width = width;
+    event->height = height;
+    PostEvent(event);
+}
+
 napi_value OnForeground(napi_env env, napi_callback_info info) {
     return nullptr;
 }
 
 napi_value OnBackground(napi_env env, napi_callback_info info) {
+    // app may be killed in background, history is appended since the last save
+    SaveSnapshot();
     return nullptr;
 }
 
@@ -237,12 +892,38 @@ static napi_value Init(napi_env env, napi_value exports) {
     napi_property_descriptor desc[] = {
         {"run", nullptr, Run, nullptr, nullptr, nullptr, napi_default, nullptr},
         {"send", nullptr, Send, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"createSession", nullptr, NewSession, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"switchSession", nullptr, ShowSession, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"closeSession", nullptr, EndSession, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"getExitStatus", nullptr, ExitStatus, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"sendKey", nullptr, SendKeyEvent, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"sendMouse", nullptr, SendMouseEvent, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"setHover", nullptr, SetHoverPosition, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"getLinkAt", nullptr, GetLinkAtPosition, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"getMatchAt", nullptr, GetMatchAtPosition, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"scrollToPrompt", nullptr, ScrollToPromptNumber, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"jumpToPrompt", nullptr, JumpToPromptDelta, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"copyCommandOutput", nullptr, CopyOutputOfCommand, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"getCommand", nullptr, GetCommandInfo, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"startRecording", nullptr, StartRecordingTo, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"stopRecording", nullptr, StopRecordingOf, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"isRecording", nullptr, IsRecordingOf, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"setTriggers", nullptr, SetTriggerPatterns, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"startSelection", nullptr, StartSelectionAt, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"extendSelection", nullptr, ExtendSelectionTo, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"clearSelection", nullptr, ClearSelectedText, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"selectAll", nullptr, SelectAllText, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"getSelection", nullptr, GetSelectedText, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"copySelection", nullptr, CopySelectedText, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"getInputBuffer", nullptr, GetInputBuffer, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"commitInput", nullptr, CommitInput, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"paste", nullptr, PasteData, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"getPasteProgress", nullptr, PasteProgress, nullptr, nullptr, nullptr, napi_default, nullptr},
         {"createSurface", nullptr, CreateSurface, nullptr, nullptr, nullptr, napi_default, nullptr},
         {"destroySurface", nullptr, DestroySurface, nullptr, nullptr, nullptr, napi_default, nullptr},
         {"resizeSurface", nullptr, ResizeSurface, nullptr, nullptr, nullptr, napi_default, nullptr},
         {"scroll", nullptr, Scroll, nullptr, nullptr, nullptr, napi_default, nullptr},
-        {"checkCopy", nullptr, CheckCopy, nullptr, nullptr, nullptr, napi_default, nullptr},
-        {"checkPaste", nullptr, CheckPaste, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"setEventHandler", nullptr, SetEventHandler, nullptr, nullptr, nullptr, napi_default, nullptr},
         {"pushPaste", nullptr, PushPaste, nullptr, nullptr, nullptr, napi_default, nullptr},
         {"onForeground", nullptr, OnForeground, nullptr, nullptr, nullptr, napi_default, nullptr},
         {"onBackground", nullptr, OnBackground, nullptr, nullptr, nullptr, napi_default, nullptr},
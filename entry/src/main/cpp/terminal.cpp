@@ -7,19 +7,35 @@
 #include <GLES3/gl32.h>
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstdarg>
 #include <cstdint>
+#include <cstring>
 #include <deque>
 #include <map>
 #include <set>
 #include <string>
 #include <vector>
 #include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <poll.h>
-#include <pty.h>
 #include <pthread.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <zlib.h>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -54,6 +70,18 @@ void hiprintf(int level, const char * fmt, ...) {
 #define LOG_FATAL(...) hiprintf(7, __VA_ARGS__)
 #endif
 
+// session daemon, see RunDaemon and SetDaemonSocket
+// running as daemon, notifications go to the ui attached
+static bool daemon_server = false;
+// connection of ui to daemon, sessions mirror those of daemon then
+static int daemon_fd = -1;
+// send notification of session to ui, true if running as daemon
+static bool ForwardEvent(int session, int type, int code, const std::string &text);
+// queue request to daemon and wake the thread sending it
+static void QueueDaemonRequest(int type, const std::string &payload);
+// daemon: sessions changed, wake the thread serving ui
+static void MarkDaemonDirty();
+
 // docs for escape codes:
 // https://invisible-island.net/xterm/ctlseqs/ctlseqs.html
 // https://vt100.net/docs/vt220-rm/chapter4.html
@@ -105,6 +133,92 @@ static std::vector<std::string> SplitString(const std::string &str, const std::s
     return result;
 }
 
+static bool StartsWith(const std::string &s, const char *prefix) { return s.compare(0, strlen(prefix), prefix) == 0; }
+
+// map base64 character to its value, 64 for padding, 0xff for others
+struct base64_table {
+    uint8_t values[256];
+
+    base64_table() {
+        memset(values, 0xff, sizeof(values));
+        const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (int i = 0; i < 64; i++) {
+            values[(uint8_t)alphabet[i]] = i;
+        }
+        values['='] = 64;
+    }
+};
+static const base64_table base64_values;
+
+size_t base64_decoder::Decode(const uint8_t *src, size_t length, std::string *out) {
+    const uint8_t *values = base64_values.values;
+    size_t i = 0;
+    while (i < length) {
+        if (count == 0) {
+            // fast path: whole quanta, 4 characters to 3 bytes,
+            // collected in a local buffer to append in batches
+            uint8_t buffer[768];
+            size_t size = 0;
+            while (i + 4 <= length) {
+                uint8_t a = values[src[i]];
+                uint8_t b = values[src[i + 1]];
+                uint8_t c = values[src[i + 2]];
+                uint8_t d = values[src[i + 3]];
+                if ((a | b | c | d) & 0xc0) {
+                    // padding or terminator
+                    break;
+                }
+                uint32_t quantum = (a << 18) | (b << 12) | (c << 6) | d;
+                buffer[size++] = quantum >> 16;
+                buffer[size++] = quantum >> 8;
+                buffer[size++] = quantum;
+                i += 4;
+                if (size == sizeof(buffer)) {
+                    if (out) {
+                        out->append((const char *)buffer, size);
+                    }
+                    size = 0;
+                }
+            }
+            if (out && size > 0) {
+                out->append((const char *)buffer, size);
+            }
+            if (i == length) {
+                break;
+            }
+        }
+
+        // slow path: one character at a time
+        uint8_t value = values[src[i]];
+        if (value == 0xff) {
+            break;
+        }
+        i++;
+        if (value == 64) {
+            // padding ends the quantum early
+            if (out && count == 2) {
+                out->push_back((char)(bits >> 4));
+            } else if (out && count == 3) {
+                out->push_back((char)(bits >> 10));
+                out->push_back((char)(bits >> 2));
+            }
+            Reset();
+            continue;
+        }
+        bits = (bits << 6) | value;
+        count++;
+        if (count == 4) {
+            if (out) {
+                out->push_back((char)(bits >> 16));
+                out->push_back((char)(bits >> 8));
+                out->push_back((char)bits);
+            }
+            Reset();
+        }
+    }
+    return i;
+}
+
 // viewport width/height
 static int vw100 = 0;
 static int vh100 = 0;
@@ -127,6 +241,9 @@ static int baseline_height = 10;
 // scroll offset in y axis
 static float scroll_offset = 0;
 
+// frames drawn, mouse motion is coalesced per frame
+static std::atomic<uint64_t> frame_count{1};
+
 const int MAX_HISTORY_LINES = 5000;
 
 constexpr uint32_t TrueColorFrom(uint8_t index) {
@@ -135,6 +252,10 @@ constexpr uint32_t TrueColorFrom(uint8_t index) {
 
 void terminal_context::ResizeTo(int new_term_row, int new_term_col) {
     int old_term_col = num_cols;
+    if (recording && (new_term_row != num_rows || new_term_col != num_cols)) {
+        std::string size = std::to_string(new_term_col) + "x" + std::to_string(new_term_row);
+        Record('r', (const uint8_t *)size.data(), size.size());
+    }
     num_rows = new_term_row;
     num_cols = new_term_col;
 
@@ -146,6 +267,9 @@ void terminal_context::ResizeTo(int new_term_row, int new_term_col) {
     for (int i = 0; i < num_rows; i++) {
         buffer[i].resize(num_cols);
     }
+    // rows below screen are gone, the rest is scanned again
+    matches.erase(matches.lower_bound(scrolled_lines + num_rows), matches.end());
+    dirty_rows.assign(num_rows, true);
 
     if (row > num_rows - 1) {
         row = num_rows - 1;
@@ -166,6 +290,12 @@ void terminal_context::ResizeTo(int new_term_row, int new_term_col) {
     ioctl(fd, TIOCSWINSZ, &ws);
 }
 
+void terminal_context::MarkDirty(int first, int last) {
+    for (int i = std::max(first, 0); i <= last && i < num_rows; i++) {
+        dirty_rows[i] = true;
+    }
+}
+
 void terminal_context::DropFirstRowIfOverflow() {
     if (row == scroll_bottom + 1) {
         // drop first row in scrolling margin
@@ -175,9 +305,80 @@ void terminal_context::DropFirstRowIfOverflow() {
         buffer.insert(buffer.begin() + scroll_bottom, std::vector<term_char>());
         buffer[scroll_bottom].resize(num_cols);
         row--;
+        // cell of the last character has moved
+        cluster_row = -1;
+
+        // absolute lines of rows outside the margins move by one, and
+        // top row of margin becomes the last history line
+        std::map<uint64_t, std::vector<text_match>> moved;
+        uint64_t base = scrolled_lines;
+        auto move = [&](int i, uint64_t to) {
+            auto it = matches.find(base + i);
+            if (it != matches.end()) {
+                moved[to].swap(it->second);
+                matches.erase(it);
+            }
+        };
+        for (int i = 0; i < scroll_top; i++) {
+            move(i, base + i + 1);
+        }
+        move(scroll_top, base);
+        for (int i = scroll_bottom + 1; i < num_rows; i++) {
+            move(i, base + i + 1);
+        }
+        matches.erase(base + scroll_bottom + 1);
+        for (auto &it : moved) {
+            matches[it.first].swap(it.second);
+        }
+        if (scroll_top > 0 || scroll_bottom < num_rows - 1) {
+            for (auto it = commands.rbegin(); it != commands.rend() && it->line[it->stage] >= base; it++) {
+                for (int k = 0; k <= it->stage; k++) {
+                    if (it->line[k] == base + scroll_top) {
+                        it->line[k] = base;
+                    } else if (it->line[k] >= base && (it->line[k] < base + scroll_top ||
+                                                       it->line[k] > base + scroll_bottom)) {
+                        it->line[k]++;
+                    }
+                }
+            }
+        }
+        if (dirty_rows[scroll_top]) {
+            dirty_history.push_back(base);
+        }
+        dirty_rows.erase(dirty_rows.begin() + scroll_top);
+        dirty_rows.insert(dirty_rows.begin() + scroll_bottom, false);
+        scrolled_lines++;
+
+        // images scroll with text, and leave with history or margin
+        for (auto it = placements.begin(); it != placements.end();) {
+            if (it->row >= scroll_top && it->row <= scroll_bottom) {
+                it->row--;
+            }
+            if ((scroll_top > 0 && it->row == scroll_top - 1) || it->row + MAX_HISTORY_LINES < 0) {
+                it = placements.erase(it);
+            } else {
+                it++;
+            }
+        }
 
         while (history.size() > MAX_HISTORY_LINES) {
+            // links only referenced by evicted lines are freed in batches
+            bool has_links = std::any_of(history.front().begin(), history.front().end(),
+                                         [](const term_char &c) { return c.style.link != 0; });
             history.pop_front();
+            if (has_links && ++links.evicted >= link_sweep_interval) {
+                CollectLinks();
+            }
+        }
+        uint64_t first_line = scrolled_lines - history.size();
+        matches.erase(matches.begin(), matches.lower_bound(first_line));
+        while (!dirty_history.empty() && dirty_history.front() < first_line) {
+            dirty_history.pop_front();
+        }
+        // prompts are numbered from the first, so evicted ones are counted
+        while (!commands.empty() && commands.front().line[mark_prompt] < first_line) {
+            commands.pop_front();
+            commands_evicted++;
         }
     } else if (row >= num_rows) {
         row = num_rows - 1;
@@ -188,17 +389,125 @@ int char_width(uint32_t codepoint) {
     return utf8proc_charwidth(codepoint);
 }
 
+static uint64_t CurrentMsec() {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// whether cursor follows a password prompt, which does not echo
+static bool AfterPasswordPrompt(const std::vector<term_char> &line, int col) {
+    std::string text;
+    for (int i = 0; i < col && i < (int)line.size(); i++) {
+        text += (char)tolower(line[i].code < 0x80 ? line[i].code : ' ');
+    }
+    return text.find("password") != std::string::npos || text.find("passphrase") != std::string::npos;
+}
+
+// predict echo of input sent to program, lock must be held
+void terminal_context::PredictInput(const uint8_t *data, size_t length) {
+    if (remote_session != -1) {
+        // echo is parsed by daemon, nothing would confirm predictions
+        return;
+    }
+    uint64_t now = CurrentMsec();
+    if (!predictions.empty() && now - predictions.front().msec > prediction_timeout) {
+        // typed characters were not echoed
+        predictions.clear();
+        prediction_paused = true;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        uint32_t codepoint = data[i];
+        if (codepoint == '\r') {
+            // new command line
+            predictions.clear();
+            prediction_paused = false;
+            continue;
+        } else if (codepoint == 0x7f || codepoint == 0x08) {
+            // erase the last prediction, the program erases echoed ones
+            if (!predictions.empty()) {
+                predictions.pop_back();
+            }
+            continue;
+        } else if (codepoint < 0x20 || codepoint == 0x1b) {
+            // control characters and escape sequences, e.g. cursor keys
+            predictions.clear();
+            return;
+        } else if (codepoint >= 0x80) {
+            // decode utf8
+            int bytes = codepoint < 0xe0 ? 2 : codepoint < 0xf0 ? 3 : 4;
+            codepoint &= 0x7f >> bytes;
+            for (int j = 1; j < bytes && i + 1 < length; j++) {
+                codepoint = (codepoint << 6) | (data[++i] & 0x3f);
+            }
+        }
+
+        if (prediction_paused || alternate_screen || char_width(codepoint) != 1) {
+            predictions.clear();
+            return;
+        }
+        if (predictions.empty()) {
+            prediction_row = row;
+            prediction_col = col;
+            if (AfterPasswordPrompt(buffer[row], col)) {
+                prediction_paused = true;
+                return;
+            }
+        }
+        if (prediction_col + (int)predictions.size() >= num_cols) {
+            // do not predict line wrap
+            return;
+        }
+        predictions.push_back({codepoint, now});
+    }
+}
+
+// program wrote codepoint at cursor, confirm or roll back predictions
+void terminal_context::ConfirmPrediction(uint32_t codepoint) {
+    if (predictions.empty()) {
+        return;
+    }
+    if (row == prediction_row && col == prediction_col && codepoint == predictions.front().code) {
+        int latency = CurrentMsec() - predictions.front().msec;
+        echo_latency = echo_latency == -1 ? latency : (echo_latency * 7 + latency) / 8;
+        predictions.pop_front();
+        prediction_col++;
+    } else {
+        // program did something else
+        predictions.clear();
+    }
+}
+
+// whether predictions should be drawn now
+bool terminal_context::ShowPredictions(uint64_t msec) const {
+    return !predictions.empty() && echo_latency >= prediction_show_latency && !alternate_screen &&
+           row == prediction_row && col == prediction_col && msec - predictions.front().msec <= prediction_timeout;
+}
+
 void terminal_context::InsertUtf8(uint32_t codepoint) {
     assert(row >= 0 && row < num_rows);
     assert(col >= 0 && col <= num_cols);
 
+    ConfirmPrediction(codepoint);
+
+    // combining marks, variation selectors, ZWJ sequences etc. join the
+    // cell of the last character if cursor is still right after it
+    bool boundary = utf8proc_grapheme_break_stateful(last_codepoint, codepoint, &grapheme_state);
+    last_codepoint = codepoint;
+    if (!boundary && row == cluster_row && col == cluster_end_col) {
+        JoinCluster(codepoint);
+        return;
+    }
+
     int cw = char_width(codepoint);
-    // don't insert zero-width characters
+    // don't insert zero-width characters without a base
     if (cw <= 0) return;
     // can fit if just equal num_cols
     if (col + cw > num_cols) {
         if (enable_wrap) {
             // wrap to next line
+            buffer[row][num_cols - 1].style.wrap = true;
             row ++;
             col = 0;
             DropFirstRowIfOverflow();
@@ -210,6 +519,9 @@ void terminal_context::InsertUtf8(uint32_t codepoint) {
                 col --;
         }
     }
+    dirty_rows[row] = true;
+    int char_col = col;
+    uint32_t code = codepoint;
     if (cw > 1) {
         // place the wide char
         buffer[row][col].code = codepoint;
@@ -219,13 +531,42 @@ void terminal_context::InsertUtf8(uint32_t codepoint) {
             buffer[row][col].code = term_char::WIDE_TAIL;
             buffer[row][col++].style = current_style;
         }
-        // final spacer can't be inserted
-        if (col == num_cols) return;
-        codepoint = term_char::WIDE_TAIL;
+        code = term_char::WIDE_TAIL;
+    }
+    // final spacer can't be inserted
+    if (col < num_cols) {
+        LOG_INFO("column: %d (%d)", col, cw);
+        buffer[row][col].code = code;
+        buffer[row][col++].style = current_style;
+    }
+    cluster_row = row;
+    cluster_col = char_col;
+    cluster_end_col = col;
+    if (triggers) {
+        FeedTriggers(codepoint, char_col);
+    }
+}
+
+void terminal_context::JoinCluster(uint32_t codepoint) {
+    term_char &cell = buffer[cluster_row][cluster_col];
+    std::u32string codepoints = ClusterCodepoints(cell.code);
+    if (codepoints.size() >= max_cluster_codepoints) {
+        // e.g. a flood of combining marks
+        return;
+    }
+    int old_width = CodeWidth(cell.code);
+    cell.code = InternCluster(codepoints + (char32_t)codepoint);
+    dirty_rows[cluster_row] = true;
+
+    // e.g. emoji presentation selector widens a narrow symbol
+    for (int i = old_width; i < CodeWidth(cell.code) && cluster_end_col < num_cols; i++) {
+        buffer[cluster_row][cluster_end_col].code = term_char::WIDE_TAIL;
+        buffer[cluster_row][cluster_end_col++].style = cell.style;
+        col = cluster_end_col;
+    }
+    if (triggers) {
+        FeedTriggers(codepoint, cluster_col);
     }
-    LOG_INFO("column: %d (%d)", col, cw);
-    buffer[row][col].code = codepoint;
-    buffer[row][col++].style = current_style;
 }
 
 // clamp cursor to valid range
@@ -274,15 +615,51 @@ void terminal_context::MoveCursor(int row_diff, int col_diff) {
     SetCursor(row + row_diff, col + col_diff);
 }
 
-// write data to pty until fully sent
-void terminal_context::WriteFull(uint8_t *data, size_t length) {
-    if (fd == -1) {
-        return;
+size_t spsc_ring::Size() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+}
+
+size_t spsc_ring::Free() const {
+    return capacity - Size();
+}
+
+size_t spsc_ring::Push(const uint8_t *src, size_t length) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t count = std::min(length, capacity - (h - t));
+    // copy in at most two parts due to wrap around
+    size_t offset = h & (capacity - 1);
+    size_t first = std::min(count, capacity - offset);
+    memcpy(&data[offset], src, first);
+    memcpy(&data[0], src + first, count - first);
+    head.store(h + count, std::memory_order_release);
+    return count;
+}
+
+bool spsc_ring::PushAll(const uint8_t *src, size_t length) {
+    if (Free() < length) {
+        return false;
     }
+    Push(src, length);
+    return true;
+}
+
+size_t spsc_ring::Peek(const uint8_t **ptr) const {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+    size_t offset = t & (capacity - 1);
+    *ptr = &data[offset];
+    return std::min(h - t, capacity - offset);
+}
+
+void spsc_ring::Pop(size_t length) {
+    tail.store(tail.load(std::memory_order_relaxed) + length, std::memory_order_release);
+}
 
-    // pretty print
+// pretty print data sent to or received from pty
+static void LogBytes(const char *prefix, const uint8_t *data, size_t length) {
     std::string hex;
-    for (int i = 0; i < length; i++) {
+    for (size_t i = 0; i < length; i++) {
         if (data[i] >= 127 || data[i] < 32) {
             char temp[8];
             snprintf(temp, sizeof(temp), "\\x%02x", data[i]);
@@ -291,14 +668,226 @@ void terminal_context::WriteFull(uint8_t *data, size_t length) {
             hex += (char)data[i];
         }
     }
-    LOG_INFO("Send: %s", hex.c_str());
+    LOG_INFO("%s: %s", prefix, hex.c_str());
+}
+
+void terminal_context::WakeWriter() {
+    if (wake_fd == -1) {
+        return;
+    }
+    uint64_t value = 1;
+    write(wake_fd, &value, sizeof(value));
+}
+
+// queue reply to pty, keep the order of replies
+void terminal_context::QueueReply(const uint8_t *data, size_t length) {
+    if (tmux_parent != -1) {
+        // tmux answers programs in its panes
+        return;
+    }
+    // never split a reply, and never overtake older replies
+    if (replies_overflow.empty() && replies.PushAll(data, length)) {
+        WakeWriter();
+        return;
+    }
+    replies_overflow.append((const char *)data, length);
+    DrainRepliesOverflow();
+}
+
+// move overflowed replies into ring
+void terminal_context::DrainRepliesOverflow() {
+    if (replies_overflow.empty()) {
+        return;
+    }
+    size_t pushed = replies.Push((const uint8_t *)replies_overflow.data(), replies_overflow.size());
+    replies_overflow.erase(0, pushed);
+    if (pushed > 0) {
+        WakeWriter();
+    }
+}
+
+// collect readable spans of ring into iovec, return total bytes
+static size_t GatherRing(const spsc_ring &ring, struct iovec *iov, int &iovcnt) {
+    size_t total = ring.Size();
+    size_t t = ring.tail.load(std::memory_order_relaxed);
+    size_t bytes = 0;
+    // at most two spans due to wrap around
+    while (bytes < total) {
+        size_t offset = (t + bytes) & (spsc_ring::capacity - 1);
+        size_t len = std::min(total - bytes, spsc_ring::capacity - offset);
+        iov[iovcnt].iov_base = (void *)&ring.data[offset];
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
+        bytes += len;
+    }
+    return bytes;
+}
+
+// prepare paste for pty: newlines become carriage returns like typed enter,
+// and in bracketed paste mode the content can not end the paste early
+static std::string PreparePaste(const uint8_t *data, size_t length, bool bracketed) {
+    std::string res;
+    res.reserve(length + 12);
+    if (bracketed) {
+        res += "\x1b[200~";
+    }
+    static const char end_marker[] = "\x1b[201~";
+    // copy spans between special bytes at once
+    size_t start = 0;
+    for (size_t i = 0; i < length; i++) {
+        uint8_t ch = data[i];
+        if (ch != '\r' && ch != '\n' && ch != 0x1b) {
+            continue;
+        }
+        res.append((const char *)&data[start], i - start);
+        start = i + 1;
+        if (ch == '\r' && i + 1 < length && data[i + 1] == '\n') {
+            // \r\n -> \r, added by the following \n
+        } else if (ch == '\n') {
+            res += '\r';
+        } else if (ch == 0x1b && bracketed && length - i >= 6 && memcmp(&data[i], end_marker, 6) == 0) {
+            i += 5;
+            start = i + 1;
+        } else {
+            res += ch;
+        }
+    }
+    res.append((const char *)&data[start], length - start);
+    if (bracketed) {
+        res += end_marker;
+    }
+    return res;
+}
+
+// queue paste to be streamed to pty in chunks
+void terminal_context::QueuePaste(const uint8_t *data, size_t length) {
+    // large pastes take a while to prepare, do not block parsing and rendering
+    pthread_mutex_lock(&lock);
+    bool bracketed = bracketed_paste;
+    pthread_mutex_unlock(&lock);
+    std::string paste = PreparePaste(data, length, bracketed);
+
+    pthread_mutex_lock(&lock);
+    if (paste_written == paste_total) {
+        // previous pastes finished, start counting again
+        paste_written = paste_total = 0;
+    }
+    paste_total += paste.size();
+    paste_queue.push_back(std::move(paste));
+    pthread_mutex_unlock(&lock);
+}
+
+// whether anything waits to be written to pty
+bool terminal_context::HasPendingWrites() {
+    if (replies.Size() > 0 || input.Size() > 0 || paste_offset < paste_buffer.size()) {
+        return true;
+    }
+    pthread_mutex_lock(&lock);
+    bool res = !paste_queue.empty();
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+// release written bytes in the order they were gathered
+void terminal_context::ReleaseWritten(const struct iovec *iov, int iovcnt, size_t reply_bytes, size_t input_bytes,
+                                      size_t size) {
+    size_t remaining = size;
+    for (int i = 0; i < iovcnt && remaining > 0; i++) {
+        size_t len = std::min(remaining, iov[i].iov_len);
+        LogBytes("Send", (const uint8_t *)iov[i].iov_base, len);
+        remaining -= len;
+    }
+
+    size_t from_replies = std::min(size, reply_bytes);
+    size_t from_input = std::min(size - from_replies, input_bytes);
+    size_t from_paste = size - from_replies - from_input;
+    replies.Pop(from_replies);
+    input.Pop(from_input);
+    if (from_paste > 0) {
+        paste_offset += from_paste;
+        pthread_mutex_lock(&lock);
+        paste_written += from_paste;
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+// drop everything pending, pty is gone
+void terminal_context::DiscardWrites(size_t reply_bytes, size_t input_bytes) {
+    replies.Pop(reply_bytes);
+    input.Pop(input_bytes);
+    paste_buffer.clear();
+    paste_offset = 0;
+    pthread_mutex_lock(&lock);
+    paste_queue.clear();
+    paste_written = paste_total;
+    pthread_mutex_unlock(&lock);
+}
+
+// collect pending writes into iovec: replies, input, then a chunk of paste
+// return number of iovec used, at most 5
+int terminal_context::GatherWrites(struct iovec *iov, size_t &reply_bytes, size_t &input_bytes) {
+    int iovcnt = 0;
+    reply_bytes = GatherRing(replies, iov, iovcnt);
+    input_bytes = GatherRing(input, iov, iovcnt);
+
+    if (paste_offset == paste_buffer.size()) {
+        // current paste is done, take the next one
+        pthread_mutex_lock(&lock);
+        if (!paste_queue.empty()) {
+            paste_buffer = std::move(paste_queue.front());
+            paste_queue.pop_front();
+        } else {
+            paste_buffer.clear();
+        }
+        paste_offset = 0;
+        pthread_mutex_unlock(&lock);
+    }
+    if (paste_offset < paste_buffer.size()) {
+        // limit paste per write, so keys and replies are not stuck behind it
+        const size_t chunk_size = 4096;
+        iov[iovcnt].iov_base = (void *)&paste_buffer[paste_offset];
+        iov[iovcnt].iov_len = std::min(chunk_size, paste_buffer.size() - paste_offset);
+        iovcnt++;
+    }
+    return iovcnt;
+}
 
-    int written = 0;
-    while (written < length) {
-        int size = write(fd, (uint8_t *)data + written, length - written);
-        assert(size >= 0);
-        written += size;
+// write as much pending data as possible in one syscall
+// return true if pty is full
+bool terminal_context::FlushWrites() {
+    while (fd != -1) {
+        // coalesce replies, input and paste into a single writev
+        struct iovec iov[5];
+        size_t reply_bytes, input_bytes;
+        int iovcnt = GatherWrites(iov, reply_bytes, input_bytes);
+        if (iovcnt == 0) {
+            return false;
+        }
+
+        ssize_t size = writev(fd, iov, iovcnt);
+        if (size < 0) {
+            if (errno == EAGAIN) {
+                return true;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            // pty is gone, discard pending data
+            LOG_WARN("Failed to write to pty: %d", errno);
+            DiscardWrites(reply_bytes, input_bytes);
+            return false;
+        }
+
+        size_t total_bytes = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            total_bytes += iov[i].iov_len;
+        }
+        ReleaseWritten(iov, iovcnt, reply_bytes, input_bytes, size);
+        if ((size_t)size < total_bytes) {
+            // short write, pty buffer is full
+            return true;
+        }
     }
+    return false;
 }
 
 // CAUTION: clobbers temp
@@ -310,7 +899,9 @@ void terminal_context::HandleCSI(uint8_t current) {
     int temp = 0;
     if (current >= 0x40 && current <= 0x7E) {
         // final byte in [0x40, 0x7E]
-        if (current == 'A') {
+        if (escape_overflow) {
+            LOG_WARN("Ignore too long CSI escape sequence: %c", current);
+        } else if (current == 'A') {
             // CSI Ps A, CUU, move cursor up # lines
             int line = read_int_or_default(1);
             if (row >= scroll_top) {
@@ -382,6 +973,7 @@ void terminal_context::HandleCSI(uint8_t current) {
             if (escape_buffer == "" || escape_buffer == "0") {
                 // CSI J, CSI 0 J
                 // erase below
+                MarkDirty(row, num_rows - 1);
                 for (int i = col; i < num_cols; i++) {
                     buffer[row][i] = term_char();
                 }
@@ -391,6 +983,7 @@ void terminal_context::HandleCSI(uint8_t current) {
             } else if (escape_buffer == "1") {
                 // CSI 1 J
                 // erase above
+                MarkDirty(0, row);
                 for (int i = 0; i < row; i++) {
                     std::fill(buffer[i].begin(), buffer[i].end(), term_char());
                 }
@@ -399,15 +992,20 @@ void terminal_context::HandleCSI(uint8_t current) {
                 }
             } else if (escape_buffer == "2") {
                 // CSI 2 J
-                // erase all
+                // erase all, including images on screen
+                MarkDirty(0, num_rows - 1);
                 for (int i = 0; i < num_rows; i++) {
                     std::fill(buffer[i].begin(), buffer[i].end(), term_char());
                 }
+                placements.erase(std::remove_if(placements.begin(), placements.end(),
+                                                [](const graphics_placement &p) { return p.row + p.rows > 0; }),
+                                 placements.end());
             } else {
                 goto unknown;
             }
         } else if (current == 'K') {
             // CSI Ps K, EL, erase in line
+            MarkDirty(row, row);
             if (escape_buffer == "" || escape_buffer == "0") {
                 // CSI K, CSI 0 K
                 // erase to right
@@ -436,6 +1034,7 @@ void terminal_context::HandleCSI(uint8_t current) {
                 // outside the scroll margins, do nothing
             } else {
                 // insert lines from current row, add new rows from scroll bottom
+                MarkDirty(row, scroll_bottom);
                 for (int i = scroll_bottom;i >= row;i --) {
                     if (i - line >= row) {
                         buffer[i] = buffer[i - line];
@@ -453,6 +1052,7 @@ void terminal_context::HandleCSI(uint8_t current) {
                 // outside the scroll margins, do nothing
             } else {
                 // delete lines from current row, add new rows from scroll bottom
+                MarkDirty(row, scroll_bottom);
                 for (int i = row;i <= scroll_bottom;i ++) {
                     if (i + line <= scroll_bottom) {
                         buffer[i] = buffer[i + line];
@@ -466,6 +1066,7 @@ void terminal_context::HandleCSI(uint8_t current) {
         } else if (current == 'P') {
             // CSI Ps P, DCH, delete # characters, move right to left
             int del = read_int_or_default(1);
+            MarkDirty(row, row);
             for (int i = col; i < num_cols; i++) {
                 if (i + del < num_cols) {
                     buffer[row][i] = buffer[row][i + del];
@@ -476,6 +1077,7 @@ void terminal_context::HandleCSI(uint8_t current) {
         } else if (current == 'S') {
             // CSI Ps S, SU, Scroll up Ps lines
             int line = read_int_or_default(1);
+            MarkDirty(scroll_top, scroll_bottom);
             for (int i = scroll_top; i <= scroll_bottom; i++) {
                 if (i + line <= scroll_bottom) {
                     buffer[i] = buffer[i + line];
@@ -486,6 +1088,7 @@ void terminal_context::HandleCSI(uint8_t current) {
         } else if (current == 'X') {
             // CSI Ps X, ECH, erase # characters, do not move others
             int del = read_int_or_default(1);
+            MarkDirty(row, row);
             for (int i = col; i < col + del && i < num_cols; i++) {
                 buffer[row][i] = term_char();
             }
@@ -494,13 +1097,13 @@ void terminal_context::HandleCSI(uint8_t current) {
             // mimic xterm
             // send CSI ? 1 ; 2 c: I am VT100 with Advance Video Option
             uint8_t send_buffer[] = {0x1b, '[', '?', '1', ';', '2', 'c'};
-            WriteFull(send_buffer, sizeof(send_buffer));
+            QueueReply(send_buffer, sizeof(send_buffer));
         } else if (current == 'c' && (escape_buffer == ">" || escape_buffer == ">0")) {
             // CSI > Ps c, Send Device Attributes, Secondary DA
             // mimic xterm
             // send CSI > 0 ; 2 7 6 ; 0 c: I am VT100
             uint8_t send_buffer[] = {0x1b, '[', '>', '0', ';', '2', '7', '6', ';', '0', 'c'};
-            WriteFull(send_buffer, sizeof(send_buffer));
+            QueueReply(send_buffer, sizeof(send_buffer));
         } else if (current == 'd' && escape_buffer != "") {
             // CSI Ps d, VPA, move cursor to row #
             sscanf(escape_buffer.c_str(), "%d", &row);
@@ -549,7 +1152,7 @@ void terminal_context::HandleCSI(uint8_t current) {
             for (auto part : parts) {
                 if (part == "1") {
                     // CSI ? 1 h, Application Cursor Keys (DECCKM)
-                    // TODO
+                    application_cursor = true;
                 } else if (part == "3") {
                     // CSI ? 3 h, Enable 132 Column mode, DECCOLM
                     ResizeTo(num_rows, 132);
@@ -575,18 +1178,32 @@ void terminal_context::HandleCSI(uint8_t current) {
                 } else if (part == "40") {
                     // CSI ? 40 h, Allow 80 -> 132 mode, xterm
                     // TODO
+                } else if (part == "47" || part == "1047" || part == "1049") {
+                    // CSI ? 1049 h, Use Alternate Screen Buffer
+                    // TODO: switch buffer
+                    alternate_screen = true;
+                    predictions.clear();
+                } else if (part == "9") {
+                    // CSI ? 9 h, Send Mouse X & Y on button press
+                    mouse_tracking = mouse_tracking_x10;
                 } else if (part == "1000") {
                     // CSI ? 1000 h, Send Mouse X & Y on button press and release
-                    // TODO
+                    mouse_tracking = mouse_tracking_normal;
                 } else if (part == "1002") {
                     // CSI ? 1002 h, Use Cell Motion Mouse Tracking
-                    // TODO
+                    mouse_tracking = mouse_tracking_button;
+                } else if (part == "1003") {
+                    // CSI ? 1003 h, Use All Motion Mouse Tracking
+                    mouse_tracking = mouse_tracking_any;
+                } else if (part == "1005") {
+                    // CSI ? 1005 h, Enable UTF-8 Mouse Mode
+                    mouse_encoding = mouse_encoding_utf8;
                 } else if (part == "1006") {
                     // CSI ? 1006 h, Enable SGR Mouse Mode
-                    // TODO
+                    mouse_encoding = mouse_encoding_sgr;
                 } else if (part == "2004") {
                     // CSI ? 2004 h, set bracketed paste mode
-                    // TODO
+                    bracketed_paste = true;
                 } else {
                     LOG_WARN("Unknown CSI ? Pm h: %s %c",
                                 escape_buffer.c_str(), current);
@@ -610,7 +1227,7 @@ void terminal_context::HandleCSI(uint8_t current) {
             for (auto part : parts) {
                 if (part == "1") {
                     // CSI ? 1 l, Normal Cursor Keys (DECCKM)
-                    // TODO
+                    application_cursor = false;
                 } else if (part == "3") {
                     // CSI ? 3 l, 80 Column Mode (DECCOLM)
                     ResizeTo(num_rows, 80);
@@ -639,9 +1256,18 @@ void terminal_context::HandleCSI(uint8_t current) {
                 } else if (part == "45") {
                     // CSI ? 40 l, Disable Graphic Print Color Syntax (DECGPCS)
                     // TODO
+                } else if (part == "47" || part == "1047" || part == "1049") {
+                    // CSI ? 1049 l, Use Normal Screen Buffer
+                    alternate_screen = false;
+                } else if (part == "9" || part == "1000" || part == "1002" || part == "1003") {
+                    // CSI ? Pm l, Don't send Mouse X & Y
+                    mouse_tracking = mouse_tracking_off;
+                } else if (part == "1005" || part == "1006") {
+                    // CSI ? 1005 l or CSI ? 1006 l, Disable UTF-8/SGR Mouse Mode
+                    mouse_encoding = mouse_encoding_default;
                 } else if (part == "2004") {
                     // CSI ? 2004 l, reset bracketed paste mode
-                    // TODO
+                    bracketed_paste = false;
                 } else {
                     LOG_WARN("Unknown CSI ? Pm l: %s %c",
                                 escape_buffer.c_str(), current);
@@ -657,8 +1283,10 @@ void terminal_context::HandleCSI(uint8_t current) {
                 std::string part = parts[i];
                 sscanf(part.c_str(), "%d", &param);
                 if (param == 0) {
-                    // reset all attributes to their defaults
+                    // reset all attributes to their defaults, but not the link
+                    uint16_t link = current_style.link;
                     current_style = term_style();
+                    current_style.link = link;
                 } else if (param == 1) {
                     // set bold, CSI 1 m
                     current_style.weight = font_weight::bold;
@@ -680,7 +1308,9 @@ void terminal_context::HandleCSI(uint8_t current) {
                     // TODO
                 } else if (param == 10) {
                     // reset to primary font, CSI 10 m
+                    uint16_t link = current_style.link;
                     current_style = term_style();
+                    current_style.link = link;
                 } else if (param == 21) {
                     // set doubly underlined, CSI 21 m
                     // TODO
@@ -746,13 +1376,31 @@ void terminal_context::HandleCSI(uint8_t current) {
                 }
             }
         } else if (current == 'm' && escape_buffer.size() > 0 && escape_buffer[0] == '>') {
-            // CSI > Pp m, XTMODKEYS, set/reset key modifier options
-            // TODO
+            // CSI > Pp ; Pv m, XTMODKEYS, set/reset key modifier options
+            std::vector<std::string> parts = SplitString(escape_buffer.substr(1), ";");
+            if (parts.size() > 0 && parts[0] == "4") {
+                // Pp = 4, modifyOtherKeys, Pv defaults to 0
+                int value = 0;
+                if (parts.size() > 1) {
+                    sscanf(parts[1].c_str(), "%d", &value);
+                }
+                modify_other_keys = value;
+            }
+        } else if (current == 'n' && escape_buffer.size() > 0 && escape_buffer[0] == '>') {
+            // CSI > Pp n, disable key modifier options
+            if (escape_buffer == ">4") {
+                modify_other_keys = 0;
+            }
+        } else if (current == 'u' && escape_buffer.size() > 0 &&
+                   (escape_buffer[0] == '?' || escape_buffer[0] == '>' || escape_buffer[0] == '<' ||
+                    escape_buffer[0] == '=')) {
+            // kitty keyboard protocol
+            HandleKittyKeyboard();
         } else if (current == 'n' && escape_buffer == "5") {
             // CSI 5 n - Device Status Report
             // send "OK" - ESC [ 0 n
             uint8_t ok_response[] = {0x1B, '[', '0', 'n'};
-            WriteFull(ok_response, sizeof(ok_response));
+            QueueReply(ok_response, sizeof(ok_response));
         } else if (current == 'n' && (escape_buffer == "6")) {
             // CSI Ps n, DSR, Device Status Report
             // Ps = 6: Report Cursor Position (CPR)
@@ -760,7 +1408,7 @@ void terminal_context::HandleCSI(uint8_t current) {
             char send_buffer[128] = {};
             snprintf(send_buffer, sizeof(send_buffer), "\x1b[%d;%dR", row + 1, col + 1);
             int len = strlen(send_buffer);
-            WriteFull((uint8_t *)send_buffer, len);
+            QueueReply((uint8_t *)send_buffer, len);
         } else if (current == 'r') {
             // CSI Ps ; Ps r, Set Scrolling Region [top;bottom]
             std::vector<std::string> parts = SplitString(escape_buffer, ";");
@@ -802,6 +1450,7 @@ void terminal_context::HandleCSI(uint8_t current) {
                     escape_buffer == "")) {
             // CSI Ps @, ICH, Insert Ps (Blank) Character(s)
             int count = read_int_or_default(1);
+            MarkDirty(row, row);
             for (int i = num_cols - 1; i >= col; i--) {
                 if (i - col < count) {
                     buffer[row][i].code = ' ';
@@ -819,7 +1468,7 @@ unknown:
     } else if (current >= 0x20 && current <= 0x3F) {
         // parameter bytes in [0x30, 0x3F],
         // or intermediate bytes in [0x20, 0x2F]
-        escape_buffer += current;
+        AppendEscape(current);
     } else {
         // invalid byte
         // unknown
@@ -829,490 +1478,6082 @@ unknown:
     }
 }
 
-void *terminal_context::TerminalWorker(void * data) {
-    terminal_context *ctx = (terminal_context *)data;
-    ctx->Worker();
-    return NULL;
+// append to escape_buffer, up to max_escape_length
+void terminal_context::AppendEscape(uint8_t current) {
+    if (escape_buffer.size() < max_escape_length) {
+        escape_buffer += current;
+    } else {
+        // keep the last byte, so ST is still recognized
+        escape_overflow = true;
+        escape_buffer[escape_buffer.size() - 1] = current;
+    }
 }
 
-void terminal_context::Parse(uint8_t input) {
-    if (escape_state == state_esc) {
-        if (input == '[' && escape_buffer == "") {
-            // ESC [ = CSI
-            escape_state = state_csi;
-        } else if (input == ']' && escape_buffer == "") {
-            // ESC ] = OSC
-            escape_state = state_osc;
-        } else if (input == '=' && escape_buffer == "") {
-            // ESC =, enter alternate keypad mode
-            // TODO
-            escape_state = state_idle;
-        } else if (input == '>' && escape_buffer == "") {
-            // ESC >, exit alternate keypad mode
-            // TODO
-            escape_state = state_idle;
-        } else if (input == 'A' && escape_buffer == "") {
-            // ESC A, cursor up
-            row --;
-            ClampCursor();
-            escape_state = state_idle;
-        } else if (input == 'B' && escape_buffer == "") {
-            // ESC B, cursor down
-            row ++;
-            ClampCursor();
-            escape_state = state_idle;
-        } else if (input == 'C' && escape_buffer == "") {
-            // ESC C, cursor right
-            col ++;
-            ClampCursor();
-            escape_state = state_idle;
-        } else if (input == 'D' && escape_buffer == "") {
-            // ESC D, IND, cursor down and scroll
-            row += 1;
-            DropFirstRowIfOverflow();
-            escape_state = state_idle;
-        } else if (input == 'E' && escape_buffer == "") {
-            // ESC E, goto to the beginning of next row
-            row ++;
-            col = 0;
-            ClampCursor();
-            escape_state = state_idle;
-        } else if (input == 'H' && escape_buffer == "") {
-            // ESC H, place tab stop at the current position
-            tab_stops[col] = true;
-            escape_state = state_idle;
-        } else if (input == 'M' && escape_buffer == "") {
-            // ESC M, move cursor one line up, scrolls down if at the top margin
-            if (row == scroll_top) {
-                // shift rows down
-                for (int i = scroll_bottom;i > scroll_top;i--) {
-                    buffer[i] = buffer[i-1];
-                }
-                std::fill(buffer[scroll_top].begin(), buffer[scroll_top].end(), term_char());
-            } else {
-                row --;
-                ClampCursor();
+// handle OSC escape sequences, without terminator
+void terminal_context::HandleOSC(const std::string &buffer) {
+    std::vector<std::string> parts = SplitString(buffer, ";");
+    if (parts.size() == 3 && parts[0] == "52" && parts[2] == "?") {
+        // OSC 52 ; Pc ; ? BEL
+        // paste from clipboard
+        // ui of daemon cannot answer it
+        if (!daemon_server) {
+            paste_requested = true;
+            RequestPaste();
+        }
+        LOG_INFO("Request Paste from pasteboard: %s", buffer.c_str());
+    } else if (parts.size() >= 2 && (parts[0] == "0" || parts[0] == "2")) {
+        // OSC 0 ; Pt ST or OSC 2 ; Pt ST
+        // set window title, which may contain ';'
+        std::string new_title = buffer.substr(parts[0].size() + 1);
+        if (new_title != title) {
+            title = new_title;
+            if (!ForwardEvent(id, daemon_event_title, 0, title)) {
+                SetTitle(id, title);
             }
-            escape_state = state_idle;
-        } else if (input == 'P' && escape_buffer == "") {
-            // ESC P = DCS
-            escape_state = state_dcs;
-        } else if (input == '8' && escape_buffer == "#") {
-            // ESC # 8, DECALN fill viewport with a test pattern (E)
-            for (int i = 0;i < num_rows;i++) {
-                for (int j = 0;j < num_cols;j++) {
-                    buffer[i][j] = term_char();
-                    buffer[i][j].code = 'E';
+        }
+    } else if (parts.size() == 2 && parts[0] == "10" && parts[1] == "?") {
+        // OSC 10 ; ? ST
+        // report foreground color: black
+        // send OSI 10 ; r g b : 0 / 0 / 0 ST
+        uint8_t send_buffer[] = {0x1b, ']', '1', '0', ';', 'r', 'g', 'b', ':', '0', '/', '0', '/', '0', '\x1b', '\\'};
+        QueueReply(send_buffer, sizeof(send_buffer));
+    } else if (parts.size() == 2 && parts[0] == "11" && parts[1] == "?") {
+        // OSC 11 ; ? ST
+        // report background color: white
+        // send OSI 11 ; r g b : f / f / f ST
+        uint8_t send_buffer[] = {0x1b, ']', '1', '0', ';', 'r', 'g', 'b', ':', 'f', '/', 'f', '/', 'f', '\x1b', '\\'};
+        QueueReply(send_buffer, sizeof(send_buffer));
+    } else if (parts.size() >= 3 && parts[0] == "8") {
+        // OSC 8 ; params ; uri ST, uri may contain ';'
+        // empty uri ends the link
+        std::string uri = buffer.substr(parts[0].size() + parts[1].size() + 2);
+        if (uri.empty()) {
+            current_style.link = 0;
+        } else {
+            // cells with the same id param and uri belong to the same link
+            std::string link_id;
+            for (auto &param : SplitString(parts[1], ":")) {
+                if (StartsWith(param, "id=")) {
+                    link_id = param.substr(3);
                 }
             }
-            escape_state = state_idle;
-        } else if (input == '7' && escape_buffer == "") {
-            // ESC 7, save cursor
-            save_row = row;
-            save_col = col;
-            save_style = current_style;
-            escape_state = state_idle;
-        } else if (input == '8' && escape_buffer == "") {
-            // ESC 8, restore cursor
-            row = save_row;
-            col = save_col;
-            ClampCursor();
-            current_style = save_style;
-            escape_state = state_idle;
-        } else if (input == '#' || input == '(' || input == ')') {
-            // non terminal
-            escape_buffer += input;
-        } else {
-            // unknown
-            LOG_WARN("Unknown escape sequence after ESC: %s %c",
-                        escape_buffer.c_str(), input);
-            escape_state = state_idle;
+            std::string key = link_id + "\n" + uri;
+            uint16_t link = links.Intern(key);
+            if (link == 0) {
+                CollectLinks();
+                link = links.Intern(key);
+            }
+            current_style.link = link;
         }
-    } else if (escape_state == state_csi) {
-        HandleCSI(input);
-    } else if (escape_state == state_osc) {
-        if (input == '\x07') {
-            // OSC Ps ; Pt BEL
-            std::vector<std::string> parts = SplitString(escape_buffer, ";");
-            if (parts.size() == 3 && parts[0] == "52" && parts[1] == "c" && parts[2] != "?") {
-                // OSC 52 ; c ; BASE64 BEL
-                // copy to clipboard
-                std::string base64 = parts[2];
-                LOG_INFO("Copy to pasteboard in native: %s",
-                            base64.c_str());
-                Copy(base64);
-            } else if (parts.size() == 3 && parts[0] == "52" && parts[1] == "c" && parts[2] == "?") {
-                // OSC 52 ; c ; ? BEL
-                // paste from clipboard
-                RequestPaste();
-                LOG_INFO("Request Paste from pasteboard: %s", escape_buffer.c_str());
+    } else if (parts.size() >= 2 && parts[0] == "133" && parts[1].size() == 1 && parts[1][0] >= 'A' &&
+               parts[1][0] <= 'D') {
+        // OSC 133 ; A/B/C/D [; params] ST, shell integration
+        HandleCommandMark(parts[1][0] - 'A', parts);
+    }
+}
+
+void terminal_context::HandleCommandMark(int mark, const std::vector<std::string> &parts) {
+    uint64_t line = scrolled_lines + row;
+    if (mark == mark_prompt) {
+        // a new prompt, the last command may never finish
+        command_mark command;
+        command.line[mark_prompt] = line;
+        command.col[mark_prompt] = col;
+        commands.push_back(command);
+        return;
+    } else if (commands.empty() || commands.back().stage >= mark) {
+        // out of order
+        return;
+    }
+
+    // skipped marks are at the same position, e.g. D after B for empty command
+    command_mark &command = commands.back();
+    uint64_t now = CurrentMsec();
+    for (int k = command.stage + 1; k <= mark; k++) {
+        command.line[k] = line;
+        command.col[k] = col;
+        if (k == mark_output) {
+            command.start_msec = now;
+        }
+    }
+    if (mark == mark_end) {
+        command.end_msec = now;
+        // OSC 133 ; D ; exit status
+        if (parts.size() >= 3) {
+            sscanf(parts[2].c_str(), "%d", &command.exit_status);
+        }
+    }
+    command.stage = mark;
+}
+
+const command_mark *terminal_context::Command(int64_t n) const {
+    int64_t i = n < 0 ? (int64_t)commands.size() + n : n - (int64_t)commands_evicted;
+    if (i < 0 || i >= (int64_t)commands.size()) {
+        return nullptr;
+    }
+    return &commands[i];
+}
+
+std::string terminal_context::CommandOutput(const command_mark &command) const {
+    if (command.stage < mark_output) {
+        return "";
+    } else if (command.stage == mark_output) {
+        // still running
+        return TextBetween(command.line[mark_output], command.col[mark_output], scrolled_lines + row, col);
+    }
+    return TextBetween(command.line[mark_output], command.col[mark_output], command.line[mark_end],
+                       command.col[mark_end]);
+}
+
+uint16_t link_table::Intern(const std::string &key) {
+    auto it = ids.find(key);
+    if (it != ids.end()) {
+        return it->second;
+    }
+    uint16_t id;
+    if (!free_ids.empty()) {
+        id = free_ids.back();
+        free_ids.pop_back();
+        keys[id - 1] = key;
+    } else if (keys.size() < max_links) {
+        keys.push_back(key);
+        refs.push_back(0);
+        id = keys.size();
+    } else {
+        return 0;
+    }
+    ids[key] = id;
+    return id;
+}
+
+std::string link_table::Uri(uint16_t id) const {
+    if (id == 0 || id > keys.size() || keys[id - 1].empty()) {
+        return "";
+    }
+    return keys[id - 1].substr(keys[id - 1].find('\n') + 1);
+}
+
+void link_table::Sweep() {
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (refs[i] == 0 && !keys[i].empty()) {
+            ids.erase(keys[i]);
+            std::string().swap(keys[i]);
+            free_ids.push_back(i + 1);
+        }
+    }
+    evicted = 0;
+}
+
+// count references to links and free unused ones
+void terminal_context::CollectLinks() {
+    std::fill(links.refs.begin(), links.refs.end(), 0);
+    // styles of future cells keep their link too
+    for (uint16_t link : {current_style.link, save_style.link}) {
+        if (link != 0) {
+            links.refs[link - 1]++;
+        }
+    }
+    auto count = [this](const std::vector<term_char> &line) {
+        for (auto &c : line) {
+            if (c.style.link != 0) {
+                links.refs[c.style.link - 1]++;
             }
-            escape_state = state_idle;
-        } else if (input == '\\' && escape_buffer.size() > 0 && escape_buffer[escape_buffer.size() - 1] == '\x1b') {
-            // ST is ESC \
-            // OSC Ps ; Pt ST
-            std::vector<std::string> parts = SplitString(escape_buffer.substr(0, escape_buffer.size() - 1), ";");
-            if (parts.size() == 2 && parts[0] == "10" && parts[1] == "?") {
-                // OSC 10 ; ? ST
-                // report foreground color: black
-                // send OSI 10 ; r g b : 0 / 0 / 0 ST
-                uint8_t send_buffer[] = {0x1b, ']', '1', '0', ';', 'r', 'g', 'b', ':', '0', '/', '0', '/', '0', '\x1b', '\\'};
-                WriteFull(send_buffer, sizeof(send_buffer));
-            } else if (parts.size() == 2 && parts[0] == "11" && parts[1] == "?") {
-                // OSC 11 ; ? ST
-                // report background color: white
-                // send OSI 11 ; r g b : f / f / f ST
-                uint8_t send_buffer[] = {0x1b, ']', '1', '0', ';', 'r', 'g', 'b', ':', 'f', '/', 'f', '/', 'f', '\x1b', '\\'};
-                WriteFull(send_buffer, sizeof(send_buffer));
+        }
+    };
+    std::for_each(buffer.begin(), buffer.end(), count);
+    std::for_each(history.begin(), history.end(), count);
+    links.Sweep();
+}
+
+const std::vector<term_char> *terminal_context::AbsoluteLine(uint64_t line) const {
+    uint64_t first_line = scrolled_lines - history.size();
+    if (line < first_line) {
+        return nullptr;
+    } else if (line < scrolled_lines) {
+        return &history[line - first_line];
+    } else if (line < scrolled_lines + num_rows) {
+        return &buffer[line - scrolled_lines];
+    }
+    return nullptr;
+}
+
+static bool IsUrlChar(char c) { return isalnum(c) || strchr("-._~:/?#[]@!$&'()*+,;=%", c); }
+
+static bool IsPathChar(char c) { return isalnum(c) || strchr("-._~/+@%", c); }
+
+// urls and file paths in text of one byte per cell, as offset and length
+static std::vector<std::pair<size_t, size_t>> FindMatches(const std::string &text) {
+    std::vector<std::pair<size_t, size_t>> found;
+    // scheme://..., trailing punctuation and unbalanced brackets are not part of it
+    size_t from = 0;
+    size_t pos;
+    while ((pos = text.find("://", from)) != std::string::npos) {
+        size_t begin = pos;
+        while (begin > 0 && (isalnum(text[begin - 1]) || strchr("+.-", text[begin - 1]))) {
+            begin--;
+        }
+        size_t end = pos + 3;
+        int parens = 0;
+        while (end < text.size() && IsUrlChar(text[end])) {
+            parens += text[end] == '(' ? 1 : text[end] == ')' ? -1 : 0;
+            if (parens < 0) {
+                break;
             }
-            escape_state = state_idle;
-        } else if ((input >= ' ' && input < 127) || input == '\x1b') {
-            // printable character
-            escape_buffer += input;
-        } else {
-            // unknown
-            LOG_WARN("Unknown escape sequence in OSC: %s %c",
-                        escape_buffer.c_str(), input);
-            escape_state = state_idle;
+            end++;
         }
-    } else if (escape_state == state_dcs) {
-        if (input == '\\' && escape_buffer.size() > 0 && escape_buffer[escape_buffer.size() - 1] == '\x1b') {
-            // ST
-            escape_state = state_idle;
-        } else if (input >= ' ' && input < 127 && input == '\x1b') {
-            // printable character
-            escape_buffer += input;
-        } else {
-            // unknown
-            LOG_WARN("Unknown escape sequence in DCS: %s %c",
-                        escape_buffer.c_str(), input);
-            escape_state = state_idle;
+        while (end > pos + 3 && strchr(".,:;!?'", text[end - 1])) {
+            end--;
         }
-    } else if (escape_state == state_idle) {
-        // escape state is idle
-        if (utf8_state == state_initial) {
-            if (input >= ' ' && input <= 0x7f) {
-                // printable
-                if (insert_mode) {
-                    // move characters rightward
-                    for (int i = num_cols - 1;i > col;i--) {
-                        buffer[row][i] = buffer[row][i - 1];
-                    }
-                }
-                InsertUtf8(input);
-            } else if (input >= 0xc2 && input <= 0xdf) {
-                // 2-byte utf8
-                utf8_state = state_2byte_2;
-                current_utf8 = (uint32_t)(input & 0x1f) << 6;
-            } else if (input == 0xe0) {
-                // 3-byte utf8 starting with e0
-                utf8_state = state_3byte_2_e0;
-                current_utf8 = (uint32_t)(input & 0x0f) << 12;
-            } else if (input >= 0xe1 && input <= 0xef) {
-                // 3-byte utf8 starting with non-e0
-                utf8_state = state_3byte_2_non_e0;
-                current_utf8 = (uint32_t)(input & 0x0f) << 12;
-            } else if (input == 0xf0) {
-                // 4-byte utf8 starting with f0
-                utf8_state = state_4byte_2_f0;
-                current_utf8 = (uint32_t)(input & 0x07) << 18;
-            } else if (input >= 0xf1 && input <= 0xf3) {
-                // 4-byte utf8 starting with f1 to f3
-                utf8_state = state_4byte_2_f1_f3;
-                current_utf8 = (uint32_t)(input & 0x07) << 18;
-            } else if (input == 0xf4) {
-                // 4-byte utf8 starting with f4
-                utf8_state = state_4byte_2_f4;
-                current_utf8 = (uint32_t)(input & 0x07) << 18;
-            } else if (input == '\r') {
-                col = 0;
-            } else if (input == '\n') {
-                // CUD1=\n, cursor down by 1
-                row += 1;
-                DropFirstRowIfOverflow();
-            } else if (input == '\b') {
-                // CUB1=^H, cursor backward by 1
-                if (col > 0) {
-                    col -= 1;
-                }
-            } else if (input == '\t') {
-                // goto next tab stop
-                col ++;
-                while (col < num_cols && !tab_stops[col]) {
-                    col ++;
+        if (begin < pos && isalpha(text[begin]) && end > pos + 3) {
+            found.push_back({begin, end - begin});
+        }
+        from = std::max(end, pos + 3);
+    }
+
+    // /abs, ./rel, ../rel, ~/home or dir/file.ext, with optional :line:col
+    std::vector<std::pair<size_t, size_t>> urls = found;
+    for (size_t i = 0; i < text.size();) {
+        bool boundary = i == 0 || strchr(" \"'`([<{=:,", text[i - 1]);
+        auto url = std::find_if(urls.begin(), urls.end(),
+                                [i](const std::pair<size_t, size_t> &u) { return i >= u.first && i < u.first + u.second; });
+        if (url != urls.end()) {
+            i = url->first + url->second;
+            continue;
+        } else if (!boundary || !IsPathChar(text[i])) {
+            i++;
+            continue;
+        }
+        size_t end = i;
+        while (end < text.size() && IsPathChar(text[end])) {
+            end++;
+        }
+        while (end > i && text[end - 1] == '.') {
+            end--;
+        }
+        std::string token = text.substr(i, end - i);
+        size_t slash = token.rfind('/');
+        size_t dot = token.rfind('.');
+        bool prefixed = token.size() > 1 && (token[0] == '/' || StartsWith(token, "./") ||
+                                             StartsWith(token, "../") || StartsWith(token, "~/"));
+        bool extension = slash != std::string::npos && dot != std::string::npos && dot > slash + 1 &&
+                         dot + 1 < token.size() && isalpha(token[dot + 1]);
+        bool named = std::any_of(token.begin(), token.end(), [](char c) { return isalnum(c); });
+        if (slash != std::string::npos && named && (prefixed || extension)) {
+            for (int part = 0; part < 2 && end + 1 < text.size() && text[end] == ':' && isdigit(text[end + 1]);
+                 part++) {
+                end++;
+                while (end < text.size() && isdigit(text[end])) {
+                    end++;
                 }
-                ClampCursor();
-            } else if (input == 0x1b) {
-                escape_buffer = "";
-                escape_state = state_esc;
             }
-        } else if (utf8_state == state_2byte_2) {
-            // expecting the second byte of 2-byte utf-8
-            if (input >= 0x80 && input <= 0xbf) {
-                current_utf8 |= (input & 0x3f);
-                InsertUtf8(current_utf8);
+            found.push_back({i, end - i});
+        }
+        i = std::max(end, i + 1);
+    }
+    return found;
+}
+
+// scan the logical line around line across wrapped rows
+void terminal_context::ScanLine(uint64_t line) {
+    auto wrapped = [this](uint64_t line) {
+        const std::vector<term_char> *r = AbsoluteLine(line);
+        return r && !r->empty() && r->back().style.wrap;
+    };
+    uint64_t begin = line;
+    uint64_t end = line + 1;
+    while (line - begin < max_match_rows && begin > 0 && wrapped(begin - 1)) {
+        begin--;
+    }
+    while (end - line < max_match_rows && AbsoluteLine(end) && wrapped(end - 1)) {
+        end++;
+    }
+
+    // one byte per cell, others than printable ascii cannot be matched
+    std::string text;
+    std::vector<std::pair<uint64_t, int>> cells;
+    for (uint64_t l = begin; l < end; l++) {
+        matches.erase(l);
+        if (l >= scrolled_lines) {
+            dirty_rows[l - scrolled_lines] = false;
+        }
+        const std::vector<term_char> &r = *AbsoluteLine(l);
+        for (int c = 0; c < (int)r.size(); c++) {
+            if (r[c].code != term_char::WIDE_TAIL) {
+                text += r[c].code > ' ' && r[c].code < 0x7f ? (char)r[c].code : ' ';
+                cells.push_back({l, c});
             }
-            utf8_state = state_initial;
-        } else if (utf8_state == state_3byte_2_e0) {
-            // expecting the second byte of 3-byte utf-8 starting with 0xe0
-            if (input >= 0xa0 && input <= 0xbf) {
-                current_utf8 |= (uint32_t)(input & 0x3f) << 6;
-                utf8_state = state_3byte_3;
+        }
+    }
+
+    for (auto &m : FindMatches(text)) {
+        std::string match = text.substr(m.first, m.second);
+        for (size_t k = m.first; k < m.first + m.second; k++) {
+            std::vector<text_match> &spans = matches[cells[k].first];
+            if (k == m.first || cells[k].first != cells[k - 1].first) {
+                spans.push_back({cells[k].second, cells[k].second + 1, match});
             } else {
-                utf8_state = state_initial;
+                spans.back().end_col = cells[k].second + 1;
             }
-        } else if (utf8_state == state_3byte_2_non_e0) {
-            // expecting the second byte of 3-byte utf-8 starting with non-0xe0
-            if (input >= 0x80 && input <= 0xbf) {
-                current_utf8 |= (uint32_t)(input & 0x3f) << 6;
-                utf8_state = state_3byte_3;
+        }
+    }
+}
+
+// changed rows since the last scan, cost follows output rather than screen size
+void terminal_context::ScanMatches() {
+    while (!dirty_history.empty()) {
+        uint64_t line = dirty_history.front();
+        dirty_history.pop_front();
+        if (AbsoluteLine(line)) {
+            ScanLine(line);
+        }
+    }
+    for (int i = 0; i < num_rows; i++) {
+        if (dirty_rows[i]) {
+            ScanLine(scrolled_lines + i);
+        }
+    }
+}
+
+// decode OSC 52 payload, return bytes consumed
+size_t terminal_context::ConsumeClipboard(const uint8_t *data, size_t length) {
+    size_t consumed = clipboard_decoder.Decode(data, length, clipboard_rejected ? nullptr : &clipboard);
+    if (!clipboard_rejected && clipboard.size() > max_clipboard_size) {
+        LOG_WARN("Reject copy larger than %zu bytes", max_clipboard_size);
+        clipboard_rejected = true;
+        std::string().swap(clipboard);
+    }
+    return consumed;
+}
+
+// OSC 52 payload is terminated
+void terminal_context::FinishClipboard() {
+    if (!clipboard_rejected) {
+        LOG_INFO("Copy to pasteboard in native: %zu bytes", clipboard.size());
+        if (!ForwardEvent(id, daemon_event_copy, 0, clipboard)) {
+            Copy(std::move(clipboard));
+        }
+    }
+    // release memory
+    std::string().swap(clipboard);
+    clipboard_rejected = false;
+    clipboard_decoder.Reset();
+}
+
+// serial numbers of images, see graphics_image::serial
+static std::atomic<uint64_t> graphics_serial(0);
+
+// parse keys of APC G, e.g. a=T,f=100,i=1
+// values are numbers, or a single character stored as is
+static std::map<char, int> ParseGraphicsKeys(const std::string &keys) {
+    std::map<char, int> result;
+    for (auto &part : SplitString(keys, ",")) {
+        if (part.size() < 3 || part[1] != '=') {
+            continue;
+        }
+        const char *value = part.c_str() + 2;
+        if (isdigit(*value)) {
+            // ids use all 32 bits
+            result[part[0]] = (int)strtoul(value, nullptr, 10);
+        } else if (*value == '-') {
+            result[part[0]] = atoi(value);
+        } else if (part.size() == 3) {
+            result[part[0]] = *value;
+        }
+    }
+    return result;
+}
+
+static int GraphicsKey(const std::map<char, int> &keys, char key, int fallback = 0) {
+    auto it = keys.find(key);
+    return it == keys.end() ? fallback : it->second;
+}
+
+// inflate zlib stream, refuse output larger than limit
+static bool Inflate(const std::string &input, std::string &output, size_t limit) {
+    z_stream stream = {};
+    if (inflateInit(&stream) != Z_OK) {
+        return false;
+    }
+    stream.next_in = (Bytef *)input.data();
+    stream.avail_in = input.size();
+    int res = Z_OK;
+    char buffer[65536];
+    while (res == Z_OK) {
+        stream.next_out = (Bytef *)buffer;
+        stream.avail_out = sizeof(buffer);
+        res = inflate(&stream, Z_NO_FLUSH);
+        output.append(buffer, sizeof(buffer) - stream.avail_out);
+        if (output.size() > limit) {
+            res = Z_MEM_ERROR;
+        }
+    }
+    inflateEnd(&stream);
+    return res == Z_STREAM_END;
+}
+
+static uint32_t ReadBigEndian32(const uint8_t *p) { return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+// decode PNG to RGBA, for f=100
+// interlaced images and transparent color keys are not supported
+static bool DecodePng(const std::string &png, graphics_image &image, std::string &error) {
+    if (png.size() < 8 || memcmp(png.data(), "\x89PNG\r\n\x1a\n", 8) != 0) {
+        error = "EBADPNG:not a PNG";
+        return false;
+    }
+    uint32_t width = 0, height = 0;
+    int depth = 0, color_type = 0, interlace = 0;
+    // RGBA entries
+    std::string palette;
+    std::string compressed;
+    const uint8_t *data = (const uint8_t *)png.data();
+    size_t pos = 8;
+    while (pos + 12 <= png.size()) {
+        uint32_t length = ReadBigEndian32(data + pos);
+        if (length > png.size() - pos - 12) {
+            break;
+        }
+        const uint8_t *chunk = data + pos + 8;
+        std::string type = png.substr(pos + 4, 4);
+        if (type == "IHDR" && length >= 13) {
+            width = ReadBigEndian32(chunk);
+            height = ReadBigEndian32(chunk + 4);
+            depth = chunk[8];
+            color_type = chunk[9];
+            interlace = chunk[12];
+        } else if (type == "PLTE") {
+            for (uint32_t i = 0; i + 3 <= length; i += 3) {
+                palette.append((const char *)chunk + i, 3);
+                palette += '\xff';
+            }
+        } else if (type == "tRNS" && color_type == 3) {
+            for (uint32_t i = 0; i < length && i * 4 < palette.size(); i++) {
+                palette[i * 4 + 3] = chunk[i];
+            }
+        } else if (type == "IDAT") {
+            compressed.append((const char *)chunk, length);
+        } else if (type == "IEND") {
+            break;
+        }
+        pos += 12 + length;
+    }
+
+    // samples per pixel of each color type
+    static const int channels_of_type[] = {1, 0, 3, 1, 2, 0, 4};
+    int channels = color_type <= 6 ? channels_of_type[color_type] : 0;
+    bool valid_depth = depth == 8 || (depth == 16 && color_type != 3) ||
+                       ((depth == 1 || depth == 2 || depth == 4) && (color_type == 0 || color_type == 3));
+    if (width == 0 || height == 0 || channels == 0 || !valid_depth) {
+        error = "EBADPNG:invalid header";
+        return false;
+    } else if (interlace != 0) {
+        error = "EBADPNG:interlaced PNG is not supported";
+        return false;
+    } else if ((uint64_t)width * height * 4 > max_graphics_transfer) {
+        error = "EFBIG:image is too large";
+        return false;
+    }
+
+    // each line starts with its filter type
+    size_t bits = channels * depth;
+    size_t stride = (width * bits + 7) / 8;
+    size_t bpp = std::max((size_t)1, bits / 8);
+    std::string raw;
+    raw.reserve(height * (stride + 1));
+    if (!Inflate(compressed, raw, height * (stride + 1)) || raw.size() != height * (stride + 1)) {
+        error = "EBADPNG:corrupted image data";
+        return false;
+    }
+    uint8_t *lines = (uint8_t *)&raw[0];
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t filter = lines[y * (stride + 1)];
+        uint8_t *line = lines + y * (stride + 1) + 1;
+        const uint8_t *prev = y > 0 ? line - (stride + 1) : nullptr;
+        for (size_t x = 0; x < stride; x++) {
+            int a = x >= bpp ? line[x - bpp] : 0;
+            int b = prev ? prev[x] : 0;
+            int c = prev && x >= bpp ? prev[x - bpp] : 0;
+            if (filter == 1) {
+                line[x] += a;
+            } else if (filter == 2) {
+                line[x] += b;
+            } else if (filter == 3) {
+                line[x] += (a + b) / 2;
+            } else if (filter == 4) {
+                // paeth predictor
+                int p = a + b - c;
+                int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+                line[x] += pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+            } else if (filter != 0) {
+                error = "EBADPNG:invalid filter";
+                return false;
+            }
+        }
+    }
+
+    image.width = width;
+    image.height = height;
+    image.pixels.resize((size_t)width * height * 4);
+    uint8_t *out = (uint8_t *)&image.pixels[0];
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *line = lines + y * (stride + 1) + 1;
+        for (uint32_t x = 0; x < width; x++, out += 4) {
+            // 8 bit samples, 16 bit ones keep the high byte
+            uint8_t samples[4];
+            for (int i = 0; i < channels; i++) {
+                if (depth >= 8) {
+                    samples[i] = line[(x * channels + i) * (depth / 8)];
+                } else {
+                    size_t bit = x * depth;
+                    int value = (line[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1);
+                    samples[i] = color_type == 3 ? value : value * 255 / ((1 << depth) - 1);
+                }
+            }
+            if (color_type == 3) {
+                if (samples[0] * 4u + 4 <= palette.size()) {
+                    memcpy(out, &palette[samples[0] * 4], 4);
+                } else {
+                    out[0] = out[1] = out[2] = 0;
+                    out[3] = 255;
+                }
+            } else if (channels <= 2) {
+                out[0] = out[1] = out[2] = samples[0];
+                out[3] = channels == 2 ? samples[1] : 255;
             } else {
-                utf8_state = state_initial;
+                out[0] = samples[0];
+                out[1] = samples[1];
+                out[2] = samples[2];
+                out[3] = channels == 4 ? samples[3] : 255;
             }
-        } else if (utf8_state == state_3byte_3) {
-            // expecting the third byte of 3-byte utf-8 starting with 0xe0
-            if (input >= 0x80 && input <= 0xbf) {
-                current_utf8 |= (input & 0x3f);
-                InsertUtf8(current_utf8);
+        }
+    }
+    return true;
+}
+
+// temporary file of graphics protocol: directly in temp dir, named so,
+// resolve it to path that is safe to remove
+static bool TemporaryGraphicsPath(const std::string &name, std::string &path) {
+    size_t slash = name.rfind('/');
+    if (slash == std::string::npos) {
+        return false;
+    }
+    for (auto &component : SplitString(name, "/")) {
+        if (component == "..") {
+            return false;
+        }
+    }
+    std::string base = name.substr(slash + 1);
+    if (base.find("tty-graphics-protocol") == std::string::npos) {
+        return false;
+    }
+
+    const char *tmpdir = getenv("TMPDIR");
+    char dir[PATH_MAX], temp[PATH_MAX];
+    std::string parent = slash == 0 ? "/" : name.substr(0, slash);
+    if (!realpath(parent.c_str(), dir) || !realpath(tmpdir && tmpdir[0] ? tmpdir : "/tmp", temp) ||
+        strcmp(dir, temp) != 0) {
+        return false;
+    }
+    path = std::string(dir) + "/" + base;
+    return true;
+}
+
+// read image data from file (t=f), temporary file (t=t) or shared memory (t=s),
+// the latter two are removed after reading
+static bool ReadGraphicsFile(int medium, const std::string &name, size_t offset, size_t size, std::string &data,
+                             std::string &error) {
+    int fd = -1;
+    std::string temporary;
+    if (medium == 's') {
+        fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    } else if (name.empty() || name[0] != '/' || StartsWith(name, "/proc/") || StartsWith(name, "/sys/") ||
+               StartsWith(name, "/dev/")) {
+        // never read devices or kernel files for programs
+        error = "EINVAL:path is not allowed";
+        return false;
+    } else if (medium == 't' && !TemporaryGraphicsPath(name, temporary)) {
+        // it is removed, so never let programs point elsewhere
+        error = "EINVAL:not a temporary file of graphics protocol";
+        return false;
+    } else if (medium == 't') {
+        fd = open(temporary.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOFOLLOW);
+    } else {
+        fd = open(name.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    }
+    if (fd < 0) {
+        error = std::string("EBADF:") + strerror(errno);
+        return false;
+    }
+
+    struct stat st = {};
+    bool success = false;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        error = "EINVAL:not a regular file";
+    } else if (offset > (size_t)st.st_size) {
+        error = "ENODATA:offset is beyond end of file";
+    } else {
+        size_t count = st.st_size - offset;
+        if (size > 0) {
+            count = std::min(count, size);
+        }
+        if (count > max_graphics_transfer) {
+            error = "EFBIG:file is too large";
+        } else {
+            data.resize(count);
+            size_t done = 0;
+            while (done < count) {
+                ssize_t res = pread(fd, &data[done], count - done, offset + done);
+                if (res <= 0) {
+                    break;
+                }
+                done += res;
+            }
+            success = done == count;
+            if (!success) {
+                error = "ENODATA:failed to read file";
+            }
+        }
+    }
+    close(fd);
+
+    if (medium == 't') {
+        unlink(temporary.c_str());
+    } else if (medium == 's') {
+        shm_unlink(name.c_str());
+    }
+    return success;
+}
+
+// decode APC G payload, return bytes consumed
+size_t terminal_context::ConsumeGraphics(const uint8_t *data, size_t length) {
+    size_t consumed = graphics_decoder.Decode(data, length, graphics_rejected ? nullptr : &graphics_payload);
+    if (!graphics_rejected && graphics_payload.size() > max_graphics_transfer) {
+        LOG_WARN("Reject image larger than %zu bytes", max_graphics_transfer);
+        graphics_rejected = true;
+        std::string().swap(graphics_payload);
+    }
+    return consumed;
+}
+
+// APC G chunk is terminated, escape_buffer holds G keys ; ESC
+void terminal_context::FinishGraphics() {
+    std::string keys = escape_buffer.substr(1, escape_buffer.find_first_of(";\x1b") - 1);
+    if (!graphics_more) {
+        // later chunks only carry m=
+        graphics_keys = keys;
+    }
+    graphics_more = GraphicsKey(ParseGraphicsKeys(keys), 'm') == 1;
+    if (graphics_more) {
+        return;
+    }
+
+    if (graphics_rejected) {
+        ReplyGraphics(ParseGraphicsKeys(graphics_keys), "EFBIG:image is too large");
+    } else {
+        HandleGraphics(graphics_keys, graphics_payload);
+    }
+    // release memory
+    std::string().swap(graphics_payload);
+    graphics_keys.clear();
+    graphics_rejected = false;
+    graphics_decoder.Reset();
+}
+
+// handle command of kitty graphics protocol
+void terminal_context::HandleGraphics(const std::string &keys_string, std::string &payload) {
+    std::map<char, int> keys = ParseGraphicsKeys(keys_string);
+    int action = GraphicsKey(keys, 'a', 't');
+    if (action == 't' || action == 'T' || action == 'q') {
+        // transmit, transmit and display, or query support
+        graphics_image image;
+        std::string error;
+        if (!LoadImage(keys, payload, image, error)) {
+            LOG_WARN("Failed to load image: %s", error.c_str());
+            ReplyGraphics(keys, error);
+            return;
+        }
+        if (action == 'q') {
+            ReplyGraphics(keys, "OK");
+            return;
+        }
+
+        image.id = GraphicsKey(keys, 'i');
+        image.number = GraphicsKey(keys, 'I');
+        if (image.id == 0) {
+            // pick an unused id, reported along with I=
+            image.id = UnusedImageId();
+            if (image.number != 0) {
+                keys['i'] = image.id;
+            }
+        }
+        uint32_t id = image.id;
+        StoreImage(std::move(image));
+        if (action == 'T') {
+            PlaceImage(keys, images[id]);
+        }
+        ReplyGraphics(keys, "OK");
+    } else if (action == 'p') {
+        // display transmitted image, by i= or the newest with I=
+        uint32_t id = GraphicsKey(keys, 'i');
+        uint32_t number = GraphicsKey(keys, 'I');
+        const graphics_image *image = nullptr;
+        for (auto &pair : images) {
+            if ((id != 0 && pair.first == id) ||
+                (id == 0 && number != 0 && pair.second.number == number &&
+                 (!image || pair.second.serial > image->serial))) {
+                image = &pair.second;
+            }
+        }
+        if (!image) {
+            ReplyGraphics(keys, "ENOENT:image not found");
+            return;
+        }
+        keys['i'] = image->id;
+        PlaceImage(keys, *image);
+        ReplyGraphics(keys, "OK");
+    } else if (action == 'd') {
+        DeleteImages(keys);
+    } else {
+        // animation is not supported
+        ReplyGraphics(keys, "EINVAL:unsupported action");
+    }
+}
+
+// read, decompress and decode image, payload is consumed
+bool terminal_context::LoadImage(const std::map<char, int> &keys, std::string &payload, graphics_image &image,
+                                 std::string &error) {
+    std::string data;
+    int medium = GraphicsKey(keys, 't', 'd');
+    if (medium == 'd') {
+        data.swap(payload);
+    } else if (medium == 'f' || medium == 't' || medium == 's') {
+        // payload is path or name of shared memory, data never goes through pty
+        if (!ReadGraphicsFile(medium, payload, (uint32_t)GraphicsKey(keys, 'O'), (uint32_t)GraphicsKey(keys, 'S'),
+                              data, error)) {
+            return false;
+        }
+    } else {
+        error = "EINVAL:unsupported transmission medium";
+        return false;
+    }
+
+    if (GraphicsKey(keys, 'o') == 'z') {
+        std::string inflated;
+        if (!Inflate(data, inflated, max_graphics_transfer)) {
+            error = "EINVAL:failed to inflate";
+            return false;
+        }
+        data.swap(inflated);
+    }
+
+    int format = GraphicsKey(keys, 'f', 32);
+    if (format == 100) {
+        return DecodePng(data, image, error);
+    } else if (format != 24 && format != 32) {
+        error = "EINVAL:unsupported format";
+        return false;
+    }
+
+    // raw pixels, size is given by s= and v=
+    int width = GraphicsKey(keys, 's');
+    int height = GraphicsKey(keys, 'v');
+    size_t bytes = format / 8;
+    if (width <= 0 || height <= 0 || (uint64_t)width * height * 4 > max_graphics_transfer) {
+        error = "EINVAL:invalid image size";
+        return false;
+    } else if (data.size() < (size_t)width * height * bytes) {
+        error = "ENODATA:insufficient image data";
+        return false;
+    }
+    image.width = width;
+    image.height = height;
+    if (format == 32) {
+        data.resize((size_t)width * height * 4);
+        image.pixels.swap(data);
+    } else {
+        image.pixels.resize((size_t)width * height * 4);
+        for (size_t i = 0; i < (size_t)width * height; i++) {
+            memcpy(&image.pixels[i * 4], &data[i * 3], 3);
+            image.pixels[i * 4 + 3] = '\xff';
+        }
+    }
+    return true;
+}
+
+// keep image, evict older ones beyond max_graphics_storage
+void terminal_context::StoreImage(graphics_image &&image) {
+    uint32_t id = image.id;
+    auto old = images.find(id);
+    if (old != images.end()) {
+        // replaced along with its placements
+        graphics_storage -= old->second.pixels.size();
+        images.erase(old);
+        placements.erase(std::remove_if(placements.begin(), placements.end(),
+                                        [id](const graphics_placement &p) { return p.image_id == id; }),
+                         placements.end());
+    }
+    image.serial = ++graphics_serial;
+    graphics_storage += image.pixels.size();
+    images[id] = std::move(image);
+
+    while (graphics_storage > max_graphics_storage) {
+        // oldest image not on screen first, then the oldest one
+        const graphics_image *victim = nullptr;
+        bool victim_placed = true;
+        for (auto &pair : images) {
+            if (pair.first == id) {
+                continue;
+            }
+            uint32_t other = pair.first;
+            bool placed = std::any_of(placements.begin(), placements.end(),
+                                      [other](const graphics_placement &p) { return p.image_id == other; });
+            if (!victim || (victim_placed && !placed) ||
+                (placed == victim_placed && pair.second.serial < victim->serial)) {
+                victim = &pair.second;
+                victim_placed = placed;
+            }
+        }
+        if (!victim) {
+            break;
+        }
+        uint32_t victim_id = victim->id;
+        LOG_INFO("Evict image %u of %zu bytes", victim_id, victim->pixels.size());
+        graphics_storage -= victim->pixels.size();
+        images.erase(victim_id);
+        placements.erase(std::remove_if(placements.begin(), placements.end(),
+                                        [victim_id](const graphics_placement &p) { return p.image_id == victim_id; }),
+                         placements.end());
+    }
+}
+
+// place image at cursor, and move cursor after it unless C=1
+void terminal_context::PlaceImage(const std::map<char, int> &keys, const graphics_image &image) {
+    graphics_placement placement;
+    placement.image_id = image.id;
+    placement.id = GraphicsKey(keys, 'p');
+    placement.row = row;
+    placement.col = col;
+    placement.source_x = std::max(0, std::min(GraphicsKey(keys, 'x'), image.width - 1));
+    placement.source_y = std::max(0, std::min(GraphicsKey(keys, 'y'), image.height - 1));
+    int source_width = GraphicsKey(keys, 'w');
+    int source_height = GraphicsKey(keys, 'h');
+    placement.source_width = source_width > 0 ? std::min(source_width, image.width - placement.source_x)
+                                              : image.width - placement.source_x;
+    placement.source_height = source_height > 0 ? std::min(source_height, image.height - placement.source_y)
+                                                 : image.height - placement.source_y;
+    placement.offset_x = std::max(0, std::min(GraphicsKey(keys, 'X'), font_width - 1));
+    placement.offset_y = std::max(0, std::min(GraphicsKey(keys, 'Y'), font_height - 1));
+    placement.z = GraphicsKey(keys, 'z');
+
+    // image is scaled to c x r cells, at most the screen, missing one keeps aspect ratio
+    int cols = std::min(GraphicsKey(keys, 'c'), num_cols);
+    int rows = std::min(GraphicsKey(keys, 'r'), num_rows);
+    int64_t width = placement.source_width;
+    int64_t height = placement.source_height;
+    if (cols > 0 && rows > 0) {
+        width = (int64_t)cols * font_width - placement.offset_x;
+        height = (int64_t)rows * font_height - placement.offset_y;
+    } else if (cols > 0) {
+        width = (int64_t)cols * font_width - placement.offset_x;
+        height = width * placement.source_height / placement.source_width;
+    } else if (rows > 0) {
+        height = (int64_t)rows * font_height - placement.offset_y;
+        width = height * placement.source_width / placement.source_height;
+    }
+    // side kept by aspect ratio of a thin image can be huge
+    placement.width = std::min<int64_t>(width, max_placement_pixels);
+    placement.height = std::min<int64_t>(height, max_placement_pixels);
+    placement.cols = std::max(1, (placement.offset_x + placement.width + font_width - 1) / font_width);
+    placement.rows = std::max(1, (placement.offset_y + placement.height + font_height - 1) / font_height);
+
+    // same placement id of an image is moved
+    if (placement.id != 0) {
+        placements.erase(std::remove_if(placements.begin(), placements.end(),
+                                        [&](const graphics_placement &p) {
+                                            return p.image_id == placement.image_id && p.id == placement.id;
+                                        }),
+                         placements.end());
+    }
+    placements.push_back(placement);
+
+    if (GraphicsKey(keys, 'C') != 1) {
+        // scrolling past a screen only drops history
+        for (int i = 1; i < std::min(placement.rows, num_rows + 1); i++) {
+            row++;
+            DropFirstRowIfOverflow();
+        }
+        col += placement.cols;
+        ClampCursor();
+    }
+}
+
+// delete placements selected by d=, upper case also frees images without placements
+void terminal_context::DeleteImages(const std::map<char, int> &keys) {
+    int target = GraphicsKey(keys, 'd', 'a');
+    bool free_images = isupper(target);
+    target = tolower(target);
+    uint32_t id = GraphicsKey(keys, 'i');
+    uint32_t number = GraphicsKey(keys, 'I');
+    uint32_t placement_id = GraphicsKey(keys, 'p');
+    int x = GraphicsKey(keys, 'x') - 1;
+    int y = GraphicsKey(keys, 'y') - 1;
+    int z = GraphicsKey(keys, 'z');
+    if (target == 'n') {
+        // newest image with the number
+        uint64_t serial = 0;
+        id = 0;
+        for (auto &pair : images) {
+            if (pair.second.number == number && pair.second.serial > serial) {
+                id = pair.first;
+                serial = pair.second.serial;
+            }
+        }
+        target = 'i';
+    }
+
+    // image selected by id
+    auto selected = [&](uint32_t image_id) {
+        return (target == 'i' && image_id == id) ||
+               (target == 'r' && image_id >= (uint32_t)(x + 1) && image_id <= (uint32_t)(y + 1));
+    };
+    std::set<uint32_t> affected;
+    placements.erase(std::remove_if(placements.begin(), placements.end(),
+                                    [&](const graphics_placement &p) {
+                                        bool in_col = x >= p.col && x < p.col + p.cols;
+                                        bool in_row = y >= p.row && y < p.row + p.rows;
+                                        bool match = false;
+                                        if (target == 'a') {
+                                            match = p.row + p.rows > 0;
+                                        } else if (target == 'i') {
+                                            match = selected(p.image_id) && (!placement_id || p.id == placement_id);
+                                        } else if (target == 'r') {
+                                            match = selected(p.image_id);
+                                        } else if (target == 'c') {
+                                            match = col >= p.col && col < p.col + p.cols && row >= p.row &&
+                                                    row < p.row + p.rows;
+                                        } else if (target == 'p') {
+                                            match = in_col && in_row;
+                                        } else if (target == 'x') {
+                                            match = in_col;
+                                        } else if (target == 'y') {
+                                            match = in_row;
+                                        } else if (target == 'z') {
+                                            match = p.z == z;
+                                        }
+                                        if (match) {
+                                            affected.insert(p.image_id);
+                                        }
+                                        return match;
+                                    }),
+                     placements.end());
+
+    if (free_images) {
+        for (auto it = images.begin(); it != images.end();) {
+            uint32_t image_id = it->first;
+            bool placed = std::any_of(placements.begin(), placements.end(),
+                                      [image_id](const graphics_placement &p) { return p.image_id == image_id; });
+            if (!placed && (affected.count(image_id) || selected(image_id))) {
+                graphics_storage -= it->second.pixels.size();
+                it = images.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+}
+
+// reply to APC G, only if it has an id and q= allows it
+void terminal_context::ReplyGraphics(const std::map<char, int> &keys, const std::string &message) {
+    uint32_t id = GraphicsKey(keys, 'i');
+    uint32_t number = GraphicsKey(keys, 'I');
+    uint32_t placement_id = GraphicsKey(keys, 'p');
+    int quiet = GraphicsKey(keys, 'q');
+    if ((id == 0 && number == 0) || quiet >= 2 || (quiet == 1 && message == "OK")) {
+        return;
+    }
+    // send ESC _ G i=id,I=number,p=placement ; message ST
+    std::string reply = "\x1b_G";
+    if (id != 0) {
+        reply += "i=" + std::to_string(id);
+    }
+    if (number != 0) {
+        reply += std::string(id != 0 ? "," : "") + "I=" + std::to_string(number);
+    }
+    if (placement_id != 0) {
+        reply += ",p=" + std::to_string(placement_id);
+    }
+    reply += ";" + message + "\x1b\\";
+    QueueReply((const uint8_t *)reply.data(), reply.size());
+}
+
+// pick an image id not used by programs
+uint32_t terminal_context::UnusedImageId() const {
+    uint32_t id = 0x80000000;
+    while (images.find(id) != images.end()) {
+        id++;
+    }
+    return id;
+}
+
+// percent of full intensity, as used by sixel colors
+static uint32_t PercentRGB(int r, int g, int b) {
+    return PACK_RGB(std::min(r, 100) * 255 / 100, std::min(g, 100) * 255 / 100, std::min(b, 100) * 255 / 100);
+}
+
+// sixel HLS: hue 0 is blue, lightness and saturation in percent
+static uint32_t SixelHLS(int h, int l, int s) {
+    float hue = ((h + 240) % 360) / 60.0;
+    float lightness = std::min(l, 100) / 100.0;
+    float saturation = std::min(s, 100) / 100.0;
+    float chroma = (1 - fabsf(2 * lightness - 1)) * saturation;
+    float x = chroma * (1 - fabsf(fmodf(hue, 2) - 1));
+    float rgb[3] = {0, 0, 0};
+    int sector = (int)hue % 6;
+    static const int order[6][3] = {{0, 1, 2}, {1, 0, 2}, {2, 0, 1}, {2, 1, 0}, {1, 2, 0}, {0, 2, 1}};
+    rgb[order[sector][0]] = chroma;
+    rgb[order[sector][1]] = x;
+    float m = lightness - chroma / 2;
+    return PACK_RGB((int)((rgb[0] + m) * 255 + 0.5), (int)((rgb[1] + m) * 255 + 0.5), (int)((rgb[2] + m) * 255 + 0.5));
+}
+
+void sixel_decoder::Start(const std::string &dcs_params) {
+    *this = sixel_decoder();
+    // DCS P1 ; P2 ; P3 q, P2 = 1 keeps unpainted pixels transparent
+    std::vector<std::string> parts = SplitString(dcs_params, ";");
+    transparent = parts.size() >= 2 && atoi(parts[1].c_str()) == 1;
+
+    // VT340 default colors
+    static const uint8_t defaults[16][3] = {{0, 0, 0},    {20, 20, 80}, {80, 13, 13}, {20, 80, 20},
+                                            {80, 20, 80}, {20, 80, 80}, {80, 80, 20}, {53, 53, 53},
+                                            {26, 26, 26}, {33, 33, 60}, {60, 26, 26}, {33, 60, 33},
+                                            {60, 33, 60}, {33, 60, 60}, {60, 60, 33}, {80, 80, 80}};
+    for (int i = 0; i < sixel_registers; i++) {
+        palette[i] = i < 16 ? PercentRGB(defaults[i][0], defaults[i][1], defaults[i][2]) : 0;
+    }
+}
+
+void sixel_decoder::EndCommand() {
+    if (command == '!') {
+        // ! Pn, repeat next sixel
+        repeat = params.empty() ? 1 : std::max(1, params[0]);
+    } else if (command == '#' && !params.empty()) {
+        // # Pc, select color, or # Pc ; Pu ; Px ; Py ; Pz, define it
+        color = params[0] % sixel_registers;
+        if (params.size() >= 5 && params[1] == 1) {
+            palette[color] = SixelHLS(params[2], params[3], params[4]);
+        } else if (params.size() >= 5 && params[1] == 2) {
+            palette[color] = PercentRGB(params[2], params[3], params[4]);
+        }
+    } else if (command == '"' && params.size() >= 4 && !overflow) {
+        // " Pan ; Pad ; Ph ; Pv, raster attributes, reserve rows
+        size_t height = std::max(0, params[3]);
+        if ((size_t)std::max(0, params[2]) * height <= max_sixel_pixels && height > rows.size()) {
+            rows.reserve(height);
+        }
+    }
+    command = 0;
+    params.clear();
+}
+
+void sixel_decoder::Paint(int bits) {
+    int count = repeat;
+    repeat = 1;
+    if (overflow) {
+        return;
+    }
+    // blank sixels only grow width, they count as one row
+    int64_t new_width = std::max<int64_t>(width, (int64_t)x + count);
+    int64_t height = std::max<int64_t>(rows.size(), bits ? (int64_t)y + 6 : 1);
+    if (new_width * height > (int64_t)max_sixel_pixels) {
+        Drop();
+        return;
+    }
+    width = new_width;
+    for (int i = 0; i < 6; i++) {
+        if (bits & (1 << i)) {
+            if ((int)rows.size() <= y + i) {
+                rows.resize(y + i + 1);
+            }
+            std::vector<uint16_t> &line = rows[y + i];
+            if ((int)line.size() < x + count) {
+                line.resize(x + count);
+            }
+            std::fill(line.begin() + x, line.begin() + x + count, color + 1);
+        }
+    }
+    x += count;
+}
+
+void sixel_decoder::Drop() {
+    LOG_WARN("Drop sixel image larger than %zu pixels", max_sixel_pixels);
+    overflow = true;
+    std::vector<std::vector<uint16_t>>().swap(rows);
+}
+
+size_t sixel_decoder::Decode(const uint8_t *src, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        uint8_t ch = src[i];
+        if (ch == '\x1b') {
+            return i;
+        } else if (command != 0 && ch >= '0' && ch <= '9') {
+            if (params.empty()) {
+                params.push_back(0);
+            }
+            params.back() = std::min(params.back() * 10 + (ch - '0'), 1000000);
+            continue;
+        } else if (command != 0 && ch == ';') {
+            if (params.empty()) {
+                params.push_back(0);
+            }
+            params.push_back(0);
+            continue;
+        } else if (command != 0) {
+            EndCommand();
+        }
+
+        if (ch >= '?' && ch <= '~') {
+            Paint(ch - '?');
+        } else if (ch == '!' || ch == '#' || ch == '"') {
+            command = ch;
+        } else if (ch == '$') {
+            // graphics carriage return
+            x = 0;
+        } else if (ch == '-' && !overflow) {
+            // graphics new line, next band must fit even if one pixel wide
+            x = 0;
+            if ((int64_t)y + 12 > (int64_t)max_sixel_pixels) {
+                Drop();
+            } else {
+                y += 6;
+            }
+        }
+    }
+    return length;
+}
+
+bool sixel_decoder::Finish(graphics_image &image, uint32_t background) {
+    if (command != 0) {
+        EndCommand();
+    }
+    if (overflow || width == 0 || rows.empty()) {
+        return false;
+    }
+    image.width = width;
+    image.height = rows.size();
+    image.pixels.resize((size_t)image.width * image.height * 4);
+    uint8_t *out = (uint8_t *)&image.pixels[0];
+    for (auto &line : rows) {
+        for (int x = 0; x < width; x++, out += 4) {
+            uint16_t index = x < (int)line.size() ? line[x] : 0;
+            uint32_t rgb = index ? palette[index - 1] : background;
+            out[0] = rgb >> 16;
+            out[1] = rgb >> 8;
+            out[2] = rgb;
+            out[3] = index || !transparent ? 255 : 0;
+        }
+        // release memory as it goes
+        std::vector<uint16_t>().swap(line);
+    }
+    return true;
+}
+
+// sixel image is terminated, place it at cursor and move cursor below it
+void terminal_context::FinishSixel() {
+    graphics_image image;
+    if (sixel.Finish(image, term_style().back.value)) {
+        image.id = UnusedImageId();
+        uint32_t id = image.id;
+        StoreImage(std::move(image));
+        PlaceImage({{'C', 1}}, images[id]);
+        for (int i = 0; i < std::min(placements.back().rows, num_rows); i++) {
+            row++;
+            DropFirstRowIfOverflow();
+        }
+    }
+    // release memory
+    sixel = sixel_decoder();
+}
+
+// handle CSI u sequences of kitty keyboard protocol
+void terminal_context::HandleKittyKeyboard() {
+    int flags = 0;
+    int mode = 1;
+    sscanf(escape_buffer.c_str() + 1, "%d;%d", &flags, &mode);
+    if (escape_buffer[0] == '?') {
+        // CSI ? u, query flags
+        // send CSI ? flags u
+        std::string reply = "\x1b[?" + std::to_string(kitty_keyboard) + "u";
+        QueueReply((const uint8_t *)reply.data(), reply.size());
+    } else if (escape_buffer[0] == '>') {
+        // CSI > flags u, push flags
+        kitty_keyboard_stack.push_back(kitty_keyboard);
+        if (kitty_keyboard_stack.size() > max_kitty_keyboard_stack) {
+            // oldest entry is evicted
+            kitty_keyboard_stack.erase(kitty_keyboard_stack.begin());
+        }
+        kitty_keyboard = flags;
+    } else if (escape_buffer[0] == '<') {
+        // CSI < number u, pop number entries, defaults to 1
+        int count = escape_buffer.size() > 1 ? flags : 1;
+        for (int i = 0; i < count; i++) {
+            if (kitty_keyboard_stack.empty()) {
+                // popping everything resets flags
+                kitty_keyboard = 0;
+                break;
+            }
+            kitty_keyboard = kitty_keyboard_stack.back();
+            kitty_keyboard_stack.pop_back();
+        }
+    } else if (escape_buffer[0] == '=') {
+        // CSI = flags ; mode u, 1 sets, 2 adds, 3 removes flags
+        if (mode == 1) {
+            kitty_keyboard = flags;
+        } else if (mode == 2) {
+            kitty_keyboard |= flags;
+        } else if (mode == 3) {
+            kitty_keyboard &= ~flags;
+        }
+    }
+}
+
+// first codepoint of utf8 text, 0 if empty
+static uint32_t FirstCodepoint(const std::string &text) {
+    if (text.empty()) {
+        return 0;
+    }
+    uint8_t first = text[0];
+    int length = first < 0x80 ? 1 : first < 0xe0 ? 2 : first < 0xf0 ? 3 : 4;
+    uint32_t codepoint = length == 1 ? first : first & (0x7f >> length);
+    for (int i = 1; i < length && i < (int)text.size(); i++) {
+        codepoint = (codepoint << 6) | (text[i] & 0x3f);
+    }
+    return codepoint;
+}
+
+// ESC [ number ; modifiers final, number is omitted when it and modifiers are default
+static void AppendKeyCSI(std::string &out, uint32_t number, int modifiers, char final) {
+    out += "\x1b[";
+    if (number != 1 || modifiers != 0) {
+        out += std::to_string(number);
+    }
+    if (modifiers != 0) {
+        out += ";" + std::to_string(modifiers + 1);
+    }
+    out += final;
+}
+
+// control character for Ctrl + ch like xterm, -1 if none
+static int ControlCharacter(uint32_t ch) {
+    if ((ch >= 'a' && ch <= 'z') || (ch >= '@' && ch <= '_')) {
+        return ch & 0x1f;
+    } else if (ch == ' ' || ch == '2') {
+        return 0x00;
+    } else if (ch >= '3' && ch <= '7') {
+        // Ctrl-3 to Ctrl-7 are ESC, FS, GS, RS, US
+        return ch - '3' + 0x1b;
+    } else if (ch == '/') {
+        return 0x1f;
+    } else if (ch == '?' || ch == '8') {
+        return 0x7f;
+    }
+    return -1;
+}
+
+// encode key press according to keyboard modes, lock must be held
+// key is one of terminal_keys, text is utf8 produced by text keys
+std::string terminal_context::EncodeKey(int key, int modifiers, const std::string &text) const {
+    std::string out;
+    modifiers &= mod_shift | mod_alt | mod_ctrl | mod_super;
+    bool kitty = kitty_keyboard & (kitty_disambiguate | kitty_report_all_keys);
+    bool report_all = kitty_keyboard & kitty_report_all_keys;
+
+    // keys with a letter final: cursor keys and F1-F4
+    static const char letter_finals[] = {
+        'A', 'B', 'C', 'D', 'H', 'F', // up, down, right, left, home, end
+    };
+    static const char function_finals[] = {'P', 'Q', 'R', 'S'};
+    // keys with a number and ~ final: insert to page down, F5-F12
+    static const int tilde_numbers[] = {2, 3, 5, 6};
+    static const int function_numbers[] = {15, 17, 18, 19, 20, 21, 23, 24};
+    // keypad in application mode, SS3 final
+    static const char keypad_finals[] = {'p', 'q', 'r', 's', 't', 'u', 'v', 'w',
+                                         'x', 'y', 'n', 'o', 'j', 'm', 'k', 'M', 'X'};
+    // kitty codes of keypad keys
+    static const uint32_t kitty_keypad_base = 57399;
+
+    if (key >= key_up && key <= key_end) {
+        char final = letter_finals[key - key_up];
+        if (modifiers == 0 && application_cursor && !report_all) {
+            // SS3 final
+            out = std::string("\x1bO") + final;
+        } else {
+            AppendKeyCSI(out, 1, modifiers, final);
+        }
+    } else if (key >= key_insert && key <= key_page_down) {
+        AppendKeyCSI(out, tilde_numbers[key - key_insert], modifiers, '~');
+    } else if (key >= key_f1 && key <= key_f4) {
+        if (kitty && key == key_f3) {
+            // CSI R is taken by cursor position report
+            AppendKeyCSI(out, 13, modifiers, '~');
+        } else if (modifiers == 0 && !report_all) {
+            out = std::string("\x1bO") + function_finals[key - key_f1];
+        } else {
+            AppendKeyCSI(out, 1, modifiers, function_finals[key - key_f1]);
+        }
+    } else if (key >= key_f5 && key <= key_f12) {
+        AppendKeyCSI(out, function_numbers[key - key_f5], modifiers, '~');
+    } else if (key >= key_kp_0 && key <= key_kp_equal) {
+        if (kitty) {
+            AppendKeyCSI(out, kitty_keypad_base + (key - key_kp_0), modifiers, 'u');
+        } else if (application_keypad) {
+            out = std::string("\x1bO") + keypad_finals[key - key_kp_0];
+        } else if (key == key_kp_enter) {
+            out = "\r";
+        } else {
+            out = text;
+        }
+    } else if (key >= key_enter && key <= key_escape) {
+        static const uint8_t codes[] = {'\r', '\t', 0x7f, 0x1b};
+        uint8_t code = codes[key - key_enter];
+        if (kitty && (report_all || modifiers != 0 || key == key_escape)) {
+            // CSI code ; modifiers u, Escape is always disambiguated
+            AppendKeyCSI(out, code, modifiers, 'u');
+        } else if (modifiers != 0 && modify_other_keys >= 2 && modifiers != mod_shift) {
+            // CSI 27 ; modifiers ; code ~
+            out = "\x1b[27;" + std::to_string(modifiers + 1) + ";" + std::to_string(code) + "~";
+        } else if (key == key_tab && (modifiers & mod_shift)) {
+            // CBT, back tab
+            out = "\x1b[Z";
+        } else {
+            if (key == key_backspace && (modifiers & mod_ctrl)) {
+                code = 0x08;
+            }
+            if (modifiers & mod_alt) {
+                out += '\x1b';
+            }
+            out += (char)code;
+        }
+    } else if (key == key_none && !text.empty()) {
+        uint32_t ch = FirstCodepoint(text);
+        if (kitty && (report_all || (modifiers & ~mod_shift))) {
+            // CSI unshifted code ; modifiers u
+            uint32_t code = ch;
+            if ((modifiers & mod_shift) && ch >= 'A' && ch <= 'Z') {
+                code = ch - 'A' + 'a';
+            }
+            AppendKeyCSI(out, code, modifiers, 'u');
+        } else if ((modifiers & ~mod_shift) == 0) {
+            // plain text
+            out = text;
+        } else if (modify_other_keys >= 2 ||
+                   (modify_other_keys == 1 && (modifiers & mod_ctrl) && ControlCharacter(ch) == -1)) {
+            // CSI 27 ; modifiers ; code ~
+            out = "\x1b[27;" + std::to_string(modifiers + 1) + ";" + std::to_string(ch) + "~";
+        } else {
+            if (modifiers & mod_alt) {
+                // meta sends escape
+                out += '\x1b';
+            }
+            int control = (modifiers & mod_ctrl) ? ControlCharacter(ch) : -1;
+            if (control != -1) {
+                out += (char)control;
+            } else {
+                out += text;
+            }
+        }
+    }
+    return out;
+}
+
+// append utf8 encoded codepoint
+static void AppendUtf8(std::string &out, uint32_t codepoint) {
+    if (codepoint < 0x80) {
+        out += (char)codepoint;
+    } else if (codepoint < 0x800) {
+        out += (char)(0xc0 | (codepoint >> 6));
+        out += (char)(0x80 | (codepoint & 0x3f));
+    } else if (codepoint < 0x10000) {
+        out += (char)(0xe0 | (codepoint >> 12));
+        out += (char)(0x80 | ((codepoint >> 6) & 0x3f));
+        out += (char)(0x80 | (codepoint & 0x3f));
+    } else {
+        out += (char)(0xf0 | (codepoint >> 18));
+        out += (char)(0x80 | ((codepoint >> 12) & 0x3f));
+        out += (char)(0x80 | ((codepoint >> 6) & 0x3f));
+        out += (char)(0x80 | (codepoint & 0x3f));
+    }
+}
+
+std::string terminal_context::TextBetween(uint64_t from_line, int from_col, uint64_t to_line, int to_col) const {
+    // codes are appended in place, copying all of history allocates
+    // only while the result grows
+    std::string text;
+    for (uint64_t l = std::max(from_line, scrolled_lines - history.size()); l <= to_line; l++) {
+        const std::vector<term_char> *r = AbsoluteLine(l);
+        if (!r) {
+            break;
+        }
+        int begin = l == from_line ? from_col : 0;
+        int end = l == to_line ? std::min(to_col, (int)r->size()) : r->size();
+        size_t start = text.size();
+        for (int c = begin; c < end; c++) {
+            if ((*r)[c].code != term_char::WIDE_TAIL) {
+                AppendCode(text, (*r)[c].code);
+            }
+        }
+        bool wrapped = !r->empty() && r->back().style.wrap;
+        if (l == to_line || !wrapped) {
+            // trailing blanks are not output
+            size_t last = text.find_last_not_of(' ');
+            text.resize(last == std::string::npos || last < start ? start : last + 1);
+        }
+        if (l != to_line && !wrapped) {
+            text += '\n';
+        }
+    }
+    return text;
+}
+
+// word selection stops where the class changes: blanks are class 0, word
+// characters including those of urls and paths are class 1, and other ascii
+// punctuation is its own class, non-ascii characters are word characters
+static const std::vector<uint8_t> word_classes = [] {
+    std::vector<uint8_t> classes(128);
+    for (int c = 0; c < 128; c++) {
+        if (c <= ' ' || c == 0x7f) {
+            classes[c] = 0;
+        } else if (isalnum(c) || strchr("_-./~:@%+?=#&$!*", c)) {
+            classes[c] = 1;
+        } else {
+            classes[c] = c;
+        }
+    }
+    return classes;
+}();
+
+static int WordClass(uint32_t code) { return code < 128 ? word_classes[code] : 1; }
+
+// first cell of word at pos, following soft wraps
+static cell_position WordStart(const terminal_context &term, cell_position pos) {
+    const std::vector<term_char> *r = term.AbsoluteLine(pos.line);
+    if (!r || pos.col >= (int)r->size()) {
+        return pos;
+    }
+    int word_class = WordClass((*r)[pos.col].code);
+    while (true) {
+        if (pos.col > 0) {
+            if (WordClass((*r)[pos.col - 1].code) != word_class) {
+                break;
+            }
+            pos.col--;
+        } else {
+            const std::vector<term_char> *prev = pos.line > 0 ? term.AbsoluteLine(pos.line - 1) : nullptr;
+            if (!prev || prev->empty() || !prev->back().style.wrap || WordClass(prev->back().code) != word_class) {
+                break;
+            }
+            r = prev;
+            pos.line--;
+            pos.col = r->size() - 1;
+        }
+    }
+    return pos;
+}
+
+// position after the last cell of word at pos, following soft wraps
+static cell_position WordEnd(const terminal_context &term, cell_position pos) {
+    const std::vector<term_char> *r = term.AbsoluteLine(pos.line);
+    if (!r || pos.col >= (int)r->size()) {
+        return pos;
+    }
+    int word_class = WordClass((*r)[pos.col].code);
+    pos.col++;
+    while (true) {
+        if (pos.col < (int)r->size()) {
+            if (WordClass((*r)[pos.col].code) != word_class) {
+                break;
+            }
+            pos.col++;
+        } else {
+            const std::vector<term_char> *next = r->back().style.wrap ? term.AbsoluteLine(pos.line + 1) : nullptr;
+            if (!next || next->empty() || WordClass((*next)[0].code) != word_class) {
+                break;
+            }
+            r = next;
+            pos.line++;
+            pos.col = 1;
+        }
+    }
+    return pos;
+}
+
+bool terminal_context::SelectionBounds(cell_position &from, cell_position &to) const {
+    if (selection.mode == selection_none) {
+        return false;
+    }
+    from = selection.anchor;
+    to = selection.extent;
+    if (selection.mode == selection_block) {
+        // corners are boundaries between cells
+        if (from.line > to.line) {
+            std::swap(from.line, to.line);
+        }
+        if (from.col > to.col) {
+            std::swap(from.col, to.col);
+        }
+        return from.col < to.col && to.line >= scrolled_lines - history.size();
+    }
+    if (to.line < from.line || (to.line == from.line && to.col < from.col)) {
+        std::swap(from, to);
+    }
+    if (selection.mode == selection_char) {
+        // boundaries between cells, wide characters are selected whole
+        if (from.line == to.line && from.col == to.col) {
+            return false;
+        }
+        const std::vector<term_char> *r = AbsoluteLine(from.line);
+        if (r && from.col > 0 && from.col < (int)r->size() && (*r)[from.col].code == term_char::WIDE_TAIL) {
+            from.col--;
+        }
+        r = AbsoluteLine(to.line);
+        if (r && to.col < (int)r->size() && (*r)[to.col].code == term_char::WIDE_TAIL) {
+            to.col++;
+        }
+    } else if (selection.mode == selection_word) {
+        from = WordStart(*this, from);
+        to = WordEnd(*this, to);
+    } else if (selection.mode == selection_line) {
+        from.col = 0;
+        const std::vector<term_char> *r;
+        while (from.line > 0 && (r = AbsoluteLine(from.line - 1)) && !r->empty() && r->back().style.wrap) {
+            from.line--;
+        }
+        while ((r = AbsoluteLine(to.line)) && !r->empty() && r->back().style.wrap && AbsoluteLine(to.line + 1)) {
+            to.line++;
+        }
+        to.col = r ? r->size() : num_cols;
+    }
+    return to.line >= scrolled_lines - history.size();
+}
+
+void terminal_context::SelectedColumns(const cell_position &from, const cell_position &to, uint64_t line,
+                                       int &begin, int &end) const {
+    begin = end = 0;
+    if (selection.mode == selection_none || line < from.line || line > to.line) {
+        return;
+    }
+    if (selection.mode == selection_block) {
+        begin = from.col;
+        end = to.col;
+        return;
+    }
+    begin = line == from.line ? from.col : 0;
+    end = line == to.line ? to.col : num_cols;
+}
+
+std::string terminal_context::SelectedText() const {
+    cell_position from, to;
+    if (!SelectionBounds(from, to)) {
+        return "";
+    }
+    if (selection.mode != selection_block) {
+        return TextBetween(from.line, from.col, to.line, to.col);
+    }
+    std::string text;
+    for (uint64_t l = std::max(from.line, scrolled_lines - history.size()); l <= to.line; l++) {
+        text += TextBetween(l, from.col, l, to.col);
+        if (l != to.line) {
+            text += '\n';
+        }
+    }
+    return text;
+}
+
+uint64_t snapshot_reader::Varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (data == end) {
+            break;
+        }
+        uint8_t byte = *data++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    ok = false;
+    return 0;
+}
+
+std::string snapshot_reader::String() {
+    uint64_t length = Varint();
+    if (!ok || length > (uint64_t)(end - data)) {
+        ok = false;
+        return "";
+    }
+    std::string result((const char *)data, length);
+    data += length;
+    return result;
+}
+
+static void PutVarint(std::string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+static void PutString(std::string &out, const std::string &str) {
+    PutVarint(out, str.size());
+    out += str;
+}
+
+static void PutStyle(std::string &out, const term_style &style) {
+    PutVarint(out, style.fore.value);
+    PutVarint(out, style.back.value);
+    PutVarint(out, style.weight | (style.blink << 1) | (style.wrap << 2));
+    PutVarint(out, style.link);
+}
+
+static bool GetStyle(snapshot_reader &in, term_style &style, size_t num_links) {
+    style.fore = in.Varint();
+    style.back = in.Varint();
+    uint64_t bits = in.Varint();
+    uint64_t link = in.Varint();
+    if (link > num_links) {
+        return false;
+    }
+    style.weight = (font_weight)(bits & 1);
+    style.blink = bits & 2;
+    style.wrap = bits & 4;
+    style.link = link;
+    return in.ok;
+}
+
+static bool SameStyle(const term_style &a, const term_style &b) {
+    return a.fore.value == b.fore.value && a.back.value == b.back.value && a.weight == b.weight &&
+           a.blink == b.blink && a.wrap == b.wrap && a.link == b.link;
+}
+
+// cells of row as varint code << 3 | flags, a style follows if it differs
+// from the previous cell, clusters are spelled out since they are interned
+// anew, and repeated cells are counted
+enum snapshot_cell_flags {
+    snapshot_cell_style = 1,
+    snapshot_cell_cluster = 2,
+    snapshot_cell_repeat = 4,
+};
+
+// cells from begin to end, style of a cell that differs from the
+// previous one is written by put_style, the first is compared to default
+template <typename PutStyleFn>
+static void PutCells(std::string &out, const term_char *begin, const term_char *end, PutStyleFn put_style) {
+    term_style style;
+    for (const term_char *c = begin; c < end;) {
+        size_t repeat = 1;
+        while (c + repeat < end && c[repeat].code == c->code && SameStyle(c[repeat].style, c->style)) {
+            repeat++;
+        }
+        bool new_style = !SameStyle(c->style, style);
+        bool cluster = c->code >= term_char::CLUSTER_BASE;
+        std::u32string codepoints;
+        if (cluster) {
+            codepoints = ClusterCodepoints(c->code);
+        }
+        uint64_t code = cluster ? codepoints.size() : c->code;
+        PutVarint(out, code << 3 | (new_style ? snapshot_cell_style : 0) | (cluster ? snapshot_cell_cluster : 0) |
+                           (repeat > 1 ? snapshot_cell_repeat : 0));
+        if (new_style) {
+            put_style(c->style);
+            style = c->style;
+        }
+        for (char32_t codepoint : codepoints) {
+            PutVarint(out, codepoint);
+        }
+        if (repeat > 1) {
+            PutVarint(out, repeat);
+        }
+        c += repeat;
+    }
+}
+
+template <typename GetStyleFn>
+static bool GetCells(snapshot_reader &in, term_char *begin, term_char *end, GetStyleFn get_style) {
+    term_style style;
+    for (term_char *c = begin; c < end;) {
+        uint64_t header = in.Varint();
+        uint64_t code = header >> 3;
+        if ((header & snapshot_cell_style) && !get_style(style)) {
+            return false;
+        }
+        if (header & snapshot_cell_cluster) {
+            if (code == 0 || code > max_cluster_codepoints) {
+                return false;
+            }
+            // a single codepoint is interned as itself, so it must not
+            // look like a cluster code
+            std::u32string codepoints;
+            for (uint64_t k = 0; k < code; k++) {
+                uint64_t codepoint = in.Varint();
+                if (codepoint > 0x10ffff) {
+                    return false;
+                }
+                codepoints += (char32_t)codepoint;
+            }
+            code = InternCluster(codepoints);
+        } else if (code > 0x10ffff && code != term_char::WIDE_TAIL) {
+            return false;
+        }
+        uint64_t repeat = (header & snapshot_cell_repeat) ? in.Varint() : 1;
+        if (!in.ok || repeat == 0 || repeat > (uint64_t)(end - c)) {
+            return false;
+        }
+        for (uint64_t k = 0; k < repeat; k++, c++) {
+            c->code = code;
+            c->style = style;
+        }
+    }
+    return in.ok;
+}
+
+static void PutRow(std::string &out, const std::vector<term_char> &row) {
+    PutVarint(out, row.size());
+    PutCells(out, row.data(), row.data() + row.size(), [&](const term_style &style) { PutStyle(out, style); });
+}
+
+static bool GetRow(snapshot_reader &in, std::vector<term_char> &row, size_t num_links) {
+    uint64_t size = in.Varint();
+    if (!in.ok || size > max_snapshot_size) {
+        return false;
+    }
+    row.resize(size);
+    return GetCells(in, row.data(), row.data() + size,
+                    [&](term_style &style) { return GetStyle(in, style, num_links); });
+}
+
+// escape states with decoders of their own are not saved,
+// they restart from idle
+static bool SavedEscapeState(escape_states state) {
+    return state == state_idle || state == state_esc || state == state_csi || state == state_osc ||
+           state == state_dcs;
+}
+
+void terminal_context::EncodeModes(std::string &out) const {
+    PutVarint(out, num_rows);
+    PutVarint(out, num_cols);
+    PutVarint(out, links.keys.size());
+    for (auto &key : links.keys) {
+        PutString(out, key);
+    }
+    for (int value : {scroll_top, scroll_bottom, save_row, save_col}) {
+        PutVarint(out, value);
+    }
+    PutStyle(out, save_style);
+    PutStyle(out, current_style);
+    uint64_t modes = 0;
+    int bit = 0;
+    for (bool mode : {show_cursor, enable_wrap, reverse_video, origin_mode, insert_mode, bracketed_paste,
+                      application_cursor, application_keypad, alternate_screen}) {
+        modes |= (uint64_t)mode << bit++;
+    }
+    PutVarint(out, modes);
+    PutVarint(out, modify_other_keys);
+    PutVarint(out, kitty_keyboard);
+    PutVarint(out, kitty_keyboard_stack.size());
+    for (int flags : kitty_keyboard_stack) {
+        PutVarint(out, flags);
+    }
+    PutVarint(out, mouse_tracking);
+    PutVarint(out, mouse_encoding);
+    PutVarint(out, tab_size);
+    for (int i = 0; i < num_cols; i += 8) {
+        uint8_t bits = 0;
+        for (int k = 0; k < 8 && i + k < num_cols; k++) {
+            bits |= tab_stops[i + k] << k;
+        }
+        out += (char)bits;
+    }
+    bool saved_escape = SavedEscapeState(escape_state);
+    PutVarint(out, saved_escape ? escape_state : state_idle);
+    PutString(out, saved_escape ? escape_buffer : "");
+    PutVarint(out, utf8_state);
+    PutVarint(out, current_utf8);
+    PutString(out, title);
+
+    PutVarint(out, commands_evicted);
+    PutVarint(out, commands.size());
+    for (auto &command : commands) {
+        for (int k = 0; k < 4; k++) {
+            PutVarint(out, command.line[k]);
+            PutVarint(out, command.col[k]);
+        }
+        PutVarint(out, command.stage);
+        PutVarint(out, command.exit_status + 1);
+        PutVarint(out, command.start_msec);
+        PutVarint(out, command.end_msec);
+    }
+}
+
+bool terminal_context::DecodeModes(snapshot_reader &in) {
+    uint64_t new_rows = in.Varint();
+    uint64_t new_cols = in.Varint();
+    uint64_t num_links = in.Varint();
+    if (!in.ok || new_rows < 2 || new_cols < 1 || new_rows > max_snapshot_size || new_cols > max_snapshot_size ||
+        num_links > max_links) {
+        return false;
+    }
+    if ((int)new_rows != num_rows || (int)new_cols != num_cols) {
+        ResizeTo(new_rows, new_cols);
+    }
+    links = link_table();
+    for (uint64_t i = 0; i < num_links; i++) {
+        links.keys.push_back(in.String());
+        links.refs.push_back(0);
+        if (links.keys.back().empty()) {
+            links.free_ids.push_back(i + 1);
+        } else {
+            links.ids[links.keys.back()] = i + 1;
+        }
+    }
+    for (int *value : {&scroll_top, &scroll_bottom, &save_row, &save_col}) {
+        *value = std::min<uint64_t>(in.Varint(), max_snapshot_size);
+    }
+    if (!GetStyle(in, save_style, num_links) || !GetStyle(in, current_style, num_links)) {
+        return false;
+    }
+    uint64_t modes = in.Varint();
+    int bit = 0;
+    for (bool *mode : {&show_cursor, &enable_wrap, &reverse_video, &origin_mode, &insert_mode, &bracketed_paste,
+                       &application_cursor, &application_keypad, &alternate_screen}) {
+        *mode = (modes >> bit++) & 1;
+    }
+    modify_other_keys = std::min<uint64_t>(in.Varint(), 2);
+    kitty_keyboard = in.Varint() & 31;
+    uint64_t stack_size = in.Varint();
+    if (stack_size > max_kitty_keyboard_stack) {
+        return false;
+    }
+    kitty_keyboard_stack.clear();
+    for (uint64_t i = 0; i < stack_size; i++) {
+        kitty_keyboard_stack.push_back(in.Varint() & 31);
+    }
+    mouse_tracking = std::min<uint64_t>(in.Varint(), mouse_tracking_any);
+    mouse_encoding = std::min<uint64_t>(in.Varint(), mouse_encoding_sgr);
+    tab_size = std::max<uint64_t>(1, std::min<uint64_t>(in.Varint(), max_snapshot_size));
+    for (int i = 0; i < num_cols; i += 8) {
+        uint8_t bits = 0;
+        if (in.data < in.end) {
+            bits = *in.data++;
+        } else {
+            in.ok = false;
+        }
+        for (int k = 0; k < 8 && i + k < num_cols; k++) {
+            tab_stops[i + k] = (bits >> k) & 1;
+        }
+    }
+    uint64_t saved_escape = in.Varint();
+    escape_state = saved_escape <= state_dcs && SavedEscapeState((escape_states)saved_escape)
+                       ? (escape_states)saved_escape
+                       : state_idle;
+    escape_buffer = in.String();
+    escape_overflow = false;
+    uint64_t saved_utf8 = in.Varint();
+    utf8_state = saved_utf8 <= state_4byte_4 ? (utf8_states)saved_utf8 : state_initial;
+    current_utf8 = in.Varint();
+    title = in.String();
+
+    commands_evicted = in.Varint();
+    uint64_t num_commands = in.Varint();
+    commands.clear();
+    for (uint64_t i = 0; i < num_commands && in.ok; i++) {
+        command_mark command;
+        for (int k = 0; k < 4; k++) {
+            command.line[k] = in.Varint();
+            command.col[k] = std::min<uint64_t>(in.Varint(), max_snapshot_size);
+        }
+        command.stage = std::min<uint64_t>(in.Varint(), mark_end);
+        command.exit_status = (int)in.Varint() - 1;
+        command.start_msec = in.Varint();
+        command.end_msec = in.Varint();
+        commands.push_back(command);
+    }
+
+    if (scroll_top >= scroll_bottom || scroll_bottom >= num_rows) {
+        scroll_top = 0;
+        scroll_bottom = num_rows - 1;
+    }
+    save_row = std::min(save_row, num_rows - 1);
+    save_col = std::min(save_col, num_cols - 1);
+    return in.ok;
+}
+
+void terminal_context::EncodeState(std::string &out) const {
+    PutVarint(out, scrolled_lines);
+    PutVarint(out, row);
+    PutVarint(out, col);
+    EncodeModes(out);
+    for (auto &r : buffer) {
+        PutRow(out, r);
+    }
+}
+
+bool terminal_context::DecodeState(snapshot_reader &in) {
+    scrolled_lines = in.Varint();
+    uint64_t new_row = in.Varint();
+    uint64_t new_col = in.Varint();
+    if (!DecodeModes(in)) {
+        return false;
+    }
+    // col is num_cols while wrap is pending
+    row = std::min<uint64_t>(new_row, num_rows - 1);
+    col = std::min<uint64_t>(new_col, num_cols);
+    for (auto &r : buffer) {
+        if (!GetRow(in, r, links.keys.size())) {
+            return false;
+        }
+        r.resize(num_cols);
+    }
+    cluster_row = -1;
+    matches.clear();
+    dirty_history.clear();
+    MarkDirty(0, num_rows - 1);
+    selection = text_selection();
+    return in.ok;
+}
+
+static void PutSnapshotHeader(std::string &out, uint64_t history_first, uint64_t history_size,
+                              uint64_t history_bytes) {
+    PutVarint(out, snapshot_magic);
+    PutVarint(out, snapshot_version);
+    PutVarint(out, history_first);
+    PutVarint(out, history_size);
+    PutVarint(out, history_bytes);
+}
+
+void terminal_context::EncodeSnapshot(std::string &state, std::string &history_data, bool &rewrite) {
+    // evicted lines are skipped on restore, the file is compacted
+    // once they are as many as those kept
+    uint64_t first_line = scrolled_lines - history.size();
+    rewrite = snapshot_stale || snapshot_end < first_line || first_line - snapshot_first > MAX_HISTORY_LINES;
+    if (rewrite) {
+        snapshot_first = snapshot_end = first_line;
+        snapshot_bytes = 0;
+        snapshot_stale = false;
+    }
+    for (uint64_t l = snapshot_end; l < scrolled_lines; l++) {
+        PutRow(history_data, history[l - first_line]);
+    }
+    snapshot_end = scrolled_lines;
+    snapshot_bytes += history_data.size();
+
+    PutSnapshotHeader(state, snapshot_first, history.size(), snapshot_bytes);
+    EncodeState(state);
+}
+
+void terminal_context::EncodeAll(std::string &state, std::string &history_data) const {
+    for (auto &r : history) {
+        PutRow(history_data, r);
+    }
+    PutSnapshotHeader(state, scrolled_lines - history.size(), history.size(), history_data.size());
+    EncodeState(state);
+}
+
+bool terminal_context::DecodeSnapshot(const std::string &state, const std::string &history_data) {
+    snapshot_reader in = {(const uint8_t *)state.data(), (const uint8_t *)state.data() + state.size()};
+    if (in.Varint() != snapshot_magic || in.Varint() != snapshot_version) {
+        return false;
+    }
+    uint64_t history_first = in.Varint();
+    uint64_t history_size = in.Varint();
+    uint64_t history_bytes = in.Varint();
+    if (!DecodeState(in)) {
+        return false;
+    }
+
+    // history file may be torn or from another save, then it is dropped
+    // and written again by the next save
+    history.clear();
+    bool history_ok = history_bytes <= history_data.size() && history_size <= MAX_HISTORY_LINES &&
+                      history_first + history_size <= scrolled_lines;
+    snapshot_reader history_in = {(const uint8_t *)history_data.data(),
+                                  (const uint8_t *)history_data.data() + std::min<uint64_t>(history_bytes,
+                                                                                            history_data.size())};
+    std::vector<term_char> line;
+    for (uint64_t l = history_first; history_ok && history_in.data < history_in.end; l++) {
+        history_ok = GetRow(history_in, line, links.keys.size()) && l < scrolled_lines;
+        if (history_ok && l >= scrolled_lines - history_size) {
+            history.push_back(line);
+        }
+    }
+    if (!history_ok || history.size() != history_size) {
+        history.clear();
+    }
+    snapshot_first = history_first;
+    snapshot_end = scrolled_lines;
+    snapshot_bytes = history_bytes;
+    // lines appended after a torn write would not line up
+    snapshot_stale = history.size() != history_size || history_data.size() != history_bytes;
+    CollectLinks();
+    return true;
+}
+
+bool trigger_automaton::Compile(std::vector<trigger_pattern> &&new_patterns, std::string &error) {
+    if (new_patterns.size() > max_trigger_patterns) {
+        error = "too many patterns";
+        return false;
+    }
+    for (auto &pattern : new_patterns) {
+        if (pattern.text.empty() || pattern.text.size() > max_trigger_length) {
+            error = "pattern is empty or too long: " + pattern.text;
+            return false;
+        }
+    }
+    patterns = std::move(new_patterns);
+
+    // bytes of patterns get their own classes, the rest lead back to root
+    std::fill(std::begin(classes), std::end(classes), 0);
+    num_classes = 1;
+    for (auto &pattern : patterns) {
+        for (uint8_t byte : pattern.text) {
+            if (classes[byte] == 0) {
+                classes[byte] = num_classes++;
+            }
+        }
+    }
+
+    // trie, 0 is root and also no child
+    next.assign(num_classes, 0);
+    output.assign(1, -1);
+    for (size_t i = 0; i < patterns.size(); i++) {
+        uint32_t state = 0;
+        for (uint8_t byte : patterns[i].text) {
+            size_t index = state * num_classes + classes[byte];
+            if (next[index] == 0) {
+                if (next.size() + num_classes > max_trigger_table) {
+                    error = "patterns are too large";
+                    return false;
+                }
+                next[index] = output.size();
+                output.push_back(-1);
+                next.resize(next.size() + num_classes, 0);
+            }
+            state = next[index];
+        }
+        if (output[state] == -1) {
+            output[state] = i;
+        }
+    }
+
+    // breadth first, missing transitions follow those of the failure state,
+    // which is shallower and complete already
+    std::vector<uint32_t> fail(output.size(), 0);
+    std::deque<uint32_t> queue;
+    for (size_t c = 0; c < num_classes; c++) {
+        if (next[c] != 0) {
+            queue.push_back(next[c]);
+        }
+    }
+    while (!queue.empty()) {
+        uint32_t state = queue.front();
+        queue.pop_front();
+        for (size_t c = 0; c < num_classes; c++) {
+            uint32_t &child = next[state * num_classes + c];
+            uint32_t fallback = next[fail[state] * num_classes + c];
+            if (child != 0) {
+                fail[child] = fallback;
+                if (output[child] == -1) {
+                    output[child] = output[fallback];
+                }
+                queue.push_back(child);
+            } else {
+                child = fallback;
+            }
+        }
+    }
+    return true;
+}
+
+void terminal_context::UseTriggers(std::shared_ptr<const trigger_automaton> automaton) {
+    triggers = std::move(automaton);
+    trigger_state = 0;
+    trigger_lines.assign(triggers ? triggers->patterns.size() : 0, UINT64_MAX);
+}
+
+void terminal_context::FeedTriggers(uint32_t codepoint, int char_col) {
+    uint64_t line = scrolled_lines + row;
+    std::string bytes;
+    AppendUtf8(bytes, codepoint);
+    for (uint8_t byte : bytes) {
+        trigger_cells[trigger_fed++ % max_trigger_length] = {line, char_col};
+        trigger_state = triggers->Step(trigger_state, byte);
+        int32_t matched = triggers->output[trigger_state];
+        if (matched < 0) {
+            continue;
+        }
+
+        const trigger_pattern &pattern = triggers->patterns[matched];
+        if (pattern.highlight) {
+            for (size_t k = 1; k <= pattern.text.size(); k++) {
+                const cell_position &cell = trigger_cells[(trigger_fed - k) % max_trigger_length];
+                auto *r = const_cast<std::vector<term_char> *>(AbsoluteLine(cell.line));
+                if (r && cell.col < (int)r->size()) {
+                    (*r)[cell.col].style.back = pattern.color;
+                    // history line already saved is changed
+                    if (cell.line < snapshot_end) {
+                        snapshot_stale = true;
+                    }
+                }
+            }
+        }
+        if (pattern.notify && trigger_lines[matched] != line) {
+            trigger_lines[matched] = line;
+            if (!ForwardEvent(id, daemon_event_trigger, matched, pattern.text)) {
+                TriggerMatched(id, matched, pattern.text);
+            }
+        }
+    }
+}
+
+// interned grapheme clusters, written by io thread and read by render thread
+struct grapheme_cluster {
+    std::u32string codepoints;
+    int width;
+};
+static pthread_mutex_t clusters_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<grapheme_cluster> clusters;
+static std::map<std::u32string, uint32_t> cluster_codes;
+
+// emoji presentation and regional indicator pairs (flags) are wide
+static int ClusterWidth(const std::u32string &codepoints) {
+    int width = std::max(char_width(codepoints[0]), 1);
+    for (char32_t c : codepoints) {
+        if (c == 0xfe0f || (c >= 0x1f1e6 && c <= 0x1f1ff)) {
+            width = 2;
+        }
+    }
+    return width;
+}
+
+uint32_t InternCluster(const std::u32string &codepoints) {
+    if (codepoints.size() == 1) {
+        return codepoints[0];
+    }
+    uint32_t code = codepoints[0];
+    pthread_mutex_lock(&clusters_lock);
+    auto it = cluster_codes.find(codepoints);
+    if (it != cluster_codes.end()) {
+        code = it->second;
+    } else if (clusters.size() < max_clusters) {
+        code = term_char::CLUSTER_BASE + clusters.size();
+        clusters.push_back({codepoints, ClusterWidth(codepoints)});
+        cluster_codes[codepoints] = code;
+    }
+    pthread_mutex_unlock(&clusters_lock);
+    return code;
+}
+
+std::u32string ClusterCodepoints(uint32_t code) {
+    if (code < term_char::CLUSTER_BASE) {
+        return std::u32string(1, code);
+    }
+    pthread_mutex_lock(&clusters_lock);
+    std::u32string codepoints = clusters[code - term_char::CLUSTER_BASE].codepoints;
+    pthread_mutex_unlock(&clusters_lock);
+    return codepoints;
+}
+
+int CodeWidth(uint32_t code) {
+    if (code < term_char::CLUSTER_BASE) {
+        return char_width(code);
+    }
+    pthread_mutex_lock(&clusters_lock);
+    int width = clusters[code - term_char::CLUSTER_BASE].width;
+    pthread_mutex_unlock(&clusters_lock);
+    return width;
+}
+
+void AppendCode(std::string &out, uint32_t code) {
+    if (code < term_char::CLUSTER_BASE) {
+        AppendUtf8(out, code);
+        return;
+    }
+    for (char32_t c : ClusterCodepoints(code)) {
+        AppendUtf8(out, c);
+    }
+}
+
+// encode mouse event according to tracking mode and encoding, empty if not reported
+std::string terminal_context::EncodeMouse(int action, int button, int modifiers, int mouse_row,
+                                          int mouse_col) const {
+    bool wheel = button == mouse_wheel_up || button == mouse_wheel_down;
+    if (mouse_tracking == mouse_tracking_off) {
+        return "";
+    } else if (action == mouse_release && (wheel || mouse_tracking == mouse_tracking_x10)) {
+        return "";
+    } else if (action == mouse_motion && (mouse_tracking < mouse_tracking_button ||
+                                          (mouse_tracking == mouse_tracking_button && button == mouse_no_button))) {
+        return "";
+    }
+
+    // button code: 0-2 buttons, 3 release or no button, 64-65 wheel,
+    // plus 32 for motion, and 4 shift, 8 meta, 16 control
+    int code = wheel ? 64 + button - mouse_wheel_up : button;
+    if (action == mouse_release && mouse_encoding != mouse_encoding_sgr) {
+        // button is unknown in release report
+        code = 3;
+    }
+    if (action == mouse_motion) {
+        code += 32;
+    }
+    if (mouse_tracking != mouse_tracking_x10) {
+        code |= ((modifiers & mod_shift) ? 4 : 0) | ((modifiers & mod_alt) ? 8 : 0) | ((modifiers & mod_ctrl) ? 16 : 0);
+    }
+
+    std::string out;
+    if (mouse_encoding == mouse_encoding_sgr) {
+        // CSI < Cb ; Cx ; Cy M/m, m for release
+        out = "\x1b[<" + std::to_string(code) + ";" + std::to_string(mouse_col + 1) + ";" +
+              std::to_string(mouse_row + 1) + (action == mouse_release ? "m" : "M");
+    } else {
+        // CSI M Cb Cx Cy, each value plus 32
+        // a byte in default encoding, or a utf8 encoded codepoint
+        int limit = mouse_encoding == mouse_encoding_utf8 ? 0x7ff : 0xff;
+        if (mouse_col + 1 + 32 > limit || mouse_row + 1 + 32 > limit) {
+            // not representable
+            return "";
+        }
+        out = "\x1b[M";
+        for (int value : {code + 32, mouse_col + 1 + 32, mouse_row + 1 + 32}) {
+            if (mouse_encoding == mouse_encoding_utf8) {
+                AppendUtf8(out, value);
+            } else {
+                out += (char)value;
+            }
+        }
+    }
+    return out;
+}
+
+// bytes to send for mouse event at cell, lock must be held
+std::string terminal_context::MouseReport(int action, int button, int modifiers, int new_row, int new_col,
+                                          uint64_t frame) {
+    std::string out;
+    if (action == mouse_motion) {
+        if (new_row == mouse_row && new_col == mouse_col) {
+            // same cell
+            return out;
+        }
+        mouse_row = new_row;
+        mouse_col = new_col;
+        std::string report = EncodeMouse(action, mouse_button, modifiers, new_row, new_col);
+        if (report.empty()) {
+            return out;
+        } else if (frame == mouse_frame) {
+            // replace motion already reported in this frame
+            mouse_pending = report;
+            return out;
+        }
+        mouse_frame = frame;
+        mouse_pending.clear();
+        return report;
+    }
+
+    // flush coalesced motion first to keep order
+    out.swap(mouse_pending);
+    out += EncodeMouse(action, button, modifiers, new_row, new_col);
+    if (button <= mouse_right) {
+        mouse_button = action == mouse_press ? button : mouse_no_button;
+    }
+    mouse_row = new_row;
+    mouse_col = new_col;
+    return out;
+}
+
+// coalesced motion to send when frame ends, lock must be held
+std::string terminal_context::FlushMouseMotion() {
+    std::string out;
+    out.swap(mouse_pending);
+    return out;
+}
+
+void terminal_context::Parse(uint8_t input) {
+    if (escape_state == state_esc) {
+        if (input == '[' && escape_buffer == "") {
+            // ESC [ = CSI
+            escape_state = state_csi;
+        } else if (input == ']' && escape_buffer == "") {
+            // ESC ] = OSC
+            escape_state = state_osc;
+        } else if (input == '=' && escape_buffer == "") {
+            // ESC =, enter alternate keypad mode
+            application_keypad = true;
+            escape_state = state_idle;
+        } else if (input == '>' && escape_buffer == "") {
+            // ESC >, exit alternate keypad mode
+            application_keypad = false;
+            escape_state = state_idle;
+        } else if (input == 'A' && escape_buffer == "") {
+            // ESC A, cursor up
+            row --;
+            ClampCursor();
+            escape_state = state_idle;
+        } else if (input == 'B' && escape_buffer == "") {
+            // ESC B, cursor down
+            row ++;
+            ClampCursor();
+            escape_state = state_idle;
+        } else if (input == 'C' && escape_buffer == "") {
+            // ESC C, cursor right
+            col ++;
+            ClampCursor();
+            escape_state = state_idle;
+        } else if (input == 'D' && escape_buffer == "") {
+            // ESC D, IND, cursor down and scroll
+            row += 1;
+            DropFirstRowIfOverflow();
+            escape_state = state_idle;
+        } else if (input == 'E' && escape_buffer == "") {
+            // ESC E, goto to the beginning of next row
+            row ++;
+            col = 0;
+            ClampCursor();
+            escape_state = state_idle;
+        } else if (input == 'H' && escape_buffer == "") {
+            // ESC H, place tab stop at the current position
+            tab_stops[col] = true;
+            escape_state = state_idle;
+        } else if (input == 'M' && escape_buffer == "") {
+            // ESC M, move cursor one line up, scrolls down if at the top margin
+            if (row == scroll_top) {
+                // shift rows down
+                MarkDirty(scroll_top, scroll_bottom);
+                for (int i = scroll_bottom;i > scroll_top;i--) {
+                    buffer[i] = buffer[i-1];
+                }
+                std::fill(buffer[scroll_top].begin(), buffer[scroll_top].end(), term_char());
+            } else {
+                row --;
+                ClampCursor();
+            }
+            escape_state = state_idle;
+        } else if (input == 'P' && escape_buffer == "") {
+            // ESC P = DCS
+            escape_state = state_dcs;
+        } else if (input == '_' && escape_buffer == "") {
+            // ESC _ = APC
+            escape_state = state_apc;
+        } else if (input == '8' && escape_buffer == "#") {
+            // ESC # 8, DECALN fill viewport with a test pattern (E)
+            MarkDirty(0, num_rows - 1);
+            for (int i = 0;i < num_rows;i++) {
+                for (int j = 0;j < num_cols;j++) {
+                    buffer[i][j] = term_char();
+                    buffer[i][j].code = 'E';
+                }
+            }
+            escape_state = state_idle;
+        } else if (input == '7' && escape_buffer == "") {
+            // ESC 7, save cursor
+            save_row = row;
+            save_col = col;
+            save_style = current_style;
+            escape_state = state_idle;
+        } else if (input == '8' && escape_buffer == "") {
+            // ESC 8, restore cursor
+            row = save_row;
+            col = save_col;
+            ClampCursor();
+            current_style = save_style;
+            escape_state = state_idle;
+        } else if (input == '#' || input == '(' || input == ')') {
+            // non terminal
+            AppendEscape(input);
+        } else {
+            // unknown
+            LOG_WARN("Unknown escape sequence after ESC: %s %c",
+                        escape_buffer.c_str(), input);
+            escape_state = state_idle;
+        }
+    } else if (escape_state == state_csi) {
+        HandleCSI(input);
+    } else if (escape_state == state_osc) {
+        if (input == '\x07') {
+            // OSC Ps ; Pt BEL
+            if (!escape_overflow) {
+                HandleOSC(escape_buffer);
+            }
+            escape_state = state_idle;
+        } else if (input == '\\' && escape_buffer.size() > 0 && escape_buffer[escape_buffer.size() - 1] == '\x1b') {
+            // ST is ESC \
+            // OSC Ps ; Pt ST
+            if (!escape_overflow) {
+                HandleOSC(escape_buffer.substr(0, escape_buffer.size() - 1));
+            }
+            escape_state = state_idle;
+        } else if ((input >= ' ' && input < 127) || input == '\x1b') {
+            // printable character
+            AppendEscape(input);
+            if (input == ';' && escape_buffer.compare(0, 3, "52;") == 0 &&
+                std::count(escape_buffer.begin(), escape_buffer.end(), ';') == 2) {
+                // OSC 52 ; Pc ; Pd, decode Pd as it streams in
+                escape_state = state_osc_52;
+                clipboard_decoder.Reset();
+                clipboard_rejected = false;
+            }
+        } else {
+            // unknown
+            LOG_WARN("Unknown escape sequence in OSC: %s %c",
+                        escape_buffer.c_str(), input);
+            escape_state = state_idle;
+        }
+    } else if (escape_state == state_osc_52) {
+        if (input == '\x07') {
+            // OSC 52 ; Pc ; BASE64 BEL
+            FinishClipboard();
+            escape_state = state_idle;
+        } else if (input == '\\' && escape_buffer[escape_buffer.size() - 1] == '\x1b') {
+            // OSC 52 ; Pc ; BASE64 ST
+            FinishClipboard();
+            escape_state = state_idle;
+        } else if (input == '\x1b') {
+            AppendEscape(input);
+        } else if (input == '?' && escape_buffer[escape_buffer.size() - 1] == ';' && clipboard.empty() &&
+                   clipboard_decoder.count == 0 && !clipboard_rejected) {
+            // OSC 52 ; Pc ; ? is a paste request, not a copy
+            AppendEscape(input);
+            escape_state = state_osc;
+        } else if (ConsumeClipboard(&input, 1) == 0) {
+            // unknown
+            LOG_WARN("Unknown character in OSC 52: %c", input);
+            std::string().swap(clipboard);
+            escape_state = state_idle;
+        }
+    } else if (escape_state == state_dcs) {
+        if (input == '\\' && escape_buffer.size() > 0 && escape_buffer[escape_buffer.size() - 1] == '\x1b') {
+            // ST
+            escape_state = state_idle;
+        } else if (input == 'q' && escape_buffer.find_first_not_of("0123456789;") == std::string::npos) {
+            // DCS P1 ; P2 ; P3 q, sixel
+            sixel.Start(escape_buffer);
+            escape_buffer.clear();
+            escape_state = state_sixel;
+        } else if ((input >= ' ' && input < 127) || input == '\x1b') {
+            // printable character
+            AppendEscape(input);
+            if (input == 'p' && escape_buffer == "1000p") {
+                // DCS 1000 p, tmux control mode
+                StartTmux();
+            }
+        } else {
+            // unknown
+            LOG_WARN("Unknown escape sequence in DCS: %s %c",
+                        escape_buffer.c_str(), input);
+            escape_state = state_idle;
+        }
+    } else if (escape_state == state_apc) {
+        if (input == '\\' && escape_buffer.size() > 0 && escape_buffer[escape_buffer.size() - 1] == '\x1b') {
+            // ST
+            if (escape_buffer[0] == 'G' && !escape_overflow) {
+                // APC G keys ST, kitty graphics without payload
+                FinishGraphics();
+            }
+            escape_state = state_idle;
+        } else if (input == ';' && escape_buffer.size() > 0 && escape_buffer[0] == 'G' && !escape_overflow) {
+            // APC G keys ; payload ST, decode payload as it streams in
+            AppendEscape(input);
+            escape_state = state_graphics;
+            if (!graphics_more) {
+                graphics_decoder.Reset();
+            }
+        } else if ((input >= ' ' && input < 127) || input == '\x1b') {
+            // printable character
+            AppendEscape(input);
+        } else {
+            // unknown
+            LOG_WARN("Unknown escape sequence in APC: %s %c",
+                        escape_buffer.c_str(), input);
+            escape_state = state_idle;
+        }
+    } else if (escape_state == state_graphics) {
+        if (input == '\\' && escape_buffer[escape_buffer.size() - 1] == '\x1b') {
+            // APC G keys ; payload ST
+            FinishGraphics();
+            escape_state = state_idle;
+        } else if (input == '\x1b') {
+            AppendEscape(input);
+        } else if (ConsumeGraphics(&input, 1) == 0) {
+            // unknown
+            LOG_WARN("Unknown character in APC G: %c", input);
+            std::string().swap(graphics_payload);
+            graphics_more = false;
+            escape_state = state_idle;
+        }
+    } else if (escape_state == state_sixel) {
+        if (input == '\\' && escape_buffer.size() > 0 && escape_buffer[escape_buffer.size() - 1] == '\x1b') {
+            // DCS q sixel ST
+            FinishSixel();
+            escape_state = state_idle;
+        } else if (input == '\x1b') {
+            AppendEscape(input);
+        } else {
+            sixel.Decode(&input, 1);
+        }
+    } else if (escape_state == state_tmux) {
+        if (input == '\n') {
+            if (!tmux.line.empty() && tmux.line.back() == '\r') {
+                tmux.line.pop_back();
+            }
+            std::string line;
+            line.swap(tmux.line);
+            HandleTmuxLine(line);
+        } else if (input == '\\' && tmux.line == "\x1b") {
+            // ST after %exit
+            ExitTmux();
+        } else {
+            AppendTmuxLine((const char *)&input, 1);
+        }
+    } else if (escape_state == state_idle) {
+        // escape state is idle
+        if (utf8_state == state_initial) {
+            if (input >= ' ' && input <= 0x7f) {
+                // printable
+                if (insert_mode) {
+                    // move characters rightward
+                    for (int i = num_cols - 1;i > col;i--) {
+                        buffer[row][i] = buffer[row][i - 1];
+                    }
+                }
+                InsertUtf8(input);
+            } else if (input >= 0xc2 && input <= 0xdf) {
+                // 2-byte utf8
+                utf8_state = state_2byte_2;
+                current_utf8 = (uint32_t)(input & 0x1f) << 6;
+            } else if (input == 0xe0) {
+                // 3-byte utf8 starting with e0
+                utf8_state = state_3byte_2_e0;
+                current_utf8 = (uint32_t)(input & 0x0f) << 12;
+            } else if (input >= 0xe1 && input <= 0xef) {
+                // 3-byte utf8 starting with non-e0
+                utf8_state = state_3byte_2_non_e0;
+                current_utf8 = (uint32_t)(input & 0x0f) << 12;
+            } else if (input == 0xf0) {
+                // 4-byte utf8 starting with f0
+                utf8_state = state_4byte_2_f0;
+                current_utf8 = (uint32_t)(input & 0x07) << 18;
+            } else if (input >= 0xf1 && input <= 0xf3) {
+                // 4-byte utf8 starting with f1 to f3
+                utf8_state = state_4byte_2_f1_f3;
+                current_utf8 = (uint32_t)(input & 0x07) << 18;
+            } else if (input == 0xf4) {
+                // 4-byte utf8 starting with f4
+                utf8_state = state_4byte_2_f4;
+                current_utf8 = (uint32_t)(input & 0x07) << 18;
+            } else if (input == '\r') {
+                col = 0;
+            } else if (input == '\n') {
+                // CUD1=\n, cursor down by 1, triggers match within a line
+                trigger_state = 0;
+                row += 1;
+                DropFirstRowIfOverflow();
+            } else if (input == 0x07) {
+                // BEL
+                if (!ForwardEvent(id, daemon_event_bell, 0, "")) {
+                    Bell(id);
+                }
+            } else if (input == '\b') {
+                // CUB1=^H, cursor backward by 1
+                if (col > 0) {
+                    col -= 1;
+                }
+            } else if (input == '\t') {
+                // goto next tab stop
+                col ++;
+                while (col < num_cols && !tab_stops[col]) {
+                    col ++;
+                }
+                ClampCursor();
+            } else if (input == 0x1b) {
+                escape_buffer = "";
+                escape_overflow = false;
+                escape_state = state_esc;
+            }
+        } else if (utf8_state == state_2byte_2) {
+            // expecting the second byte of 2-byte utf-8
+            if (input >= 0x80 && input <= 0xbf) {
+                current_utf8 |= (input & 0x3f);
+                InsertUtf8(current_utf8);
+            }
+            utf8_state = state_initial;
+        } else if (utf8_state == state_3byte_2_e0) {
+            // expecting the second byte of 3-byte utf-8 starting with 0xe0
+            if (input >= 0xa0 && input <= 0xbf) {
+                current_utf8 |= (uint32_t)(input & 0x3f) << 6;
+                utf8_state = state_3byte_3;
+            } else {
+                utf8_state = state_initial;
+            }
+        } else if (utf8_state == state_3byte_2_non_e0) {
+            // expecting the second byte of 3-byte utf-8 starting with non-0xe0
+            if (input >= 0x80 && input <= 0xbf) {
+                current_utf8 |= (uint32_t)(input & 0x3f) << 6;
+                utf8_state = state_3byte_3;
+            } else {
+                utf8_state = state_initial;
+            }
+        } else if (utf8_state == state_3byte_3) {
+            // expecting the third byte of 3-byte utf-8 starting with 0xe0
+            if (input >= 0x80 && input <= 0xbf) {
+                current_utf8 |= (input & 0x3f);
+                InsertUtf8(current_utf8);
+            }
+            utf8_state = state_initial;
+        } else if (utf8_state == state_4byte_2_f0) {
+            // expecting the second byte of 4-byte utf-8 starting with 0xf0
+            if (input >= 0x90 && input <= 0xbf) {
+                current_utf8 |= (uint32_t)(input & 0x3f) << 12;
+                utf8_state = state_4byte_3;
+            } else {
+                utf8_state = state_initial;
+            }
+        } else if (utf8_state == state_4byte_2_f1_f3) {
+            // expecting the second byte of 4-byte utf-8 starting with 0xf0 to 0xf3
+            if (input >= 0x80 && input <= 0xbf) {
+                current_utf8 |= (uint32_t)(input & 0x3f) << 12;
+                utf8_state = state_4byte_3;
+            } else {
+                utf8_state = state_initial;
+            }
+        } else if (utf8_state == state_4byte_2_f4) {
+            // expecting the second byte of 4-byte utf-8 starting with 0xf4
+            if (input >= 0x80 && input <= 0x8f) {
+                current_utf8 |= (uint32_t)(input & 0x3f) << 12;
+                utf8_state = state_4byte_3;
+            } else {
+                utf8_state = state_initial;
+            }
+        } else if (utf8_state == state_4byte_3) {
+            // expecting the third byte of 4-byte utf-8
+            if (input >= 0x80 && input <= 0xbf) {
+                current_utf8 |= (uint32_t)(input & 0x3f) << 6;
+                utf8_state = state_4byte_4;
+            } else {
+                utf8_state = state_initial;
+            }
+        } else if (utf8_state == state_4byte_4) {
+            // expecting the third byte of 4-byte utf-8
+            if (input >= 0x80 && input <= 0xbf) {
+                current_utf8 |= (input & 0x3f);
+                InsertUtf8(current_utf8);
+            }
+            utf8_state = state_initial;
+        } else {
+            assert(false && "unreachable utf8 state");
+        }
+    } else {
+        assert(false && "unreachable escape state");
+    }
+}
+
+// all sessions, keyed by id
+// protects sessions and active_term
+static pthread_rwlock_t sessions_lock = PTHREAD_RWLOCK_INITIALIZER;
+static std::map<int, terminal_context *> sessions;
+static int next_session_id = 1;
+// the session shown on screen
+static terminal_context *active_term = nullptr;
+// compiled output triggers, given to new sessions
+static std::shared_ptr<const trigger_automaton> triggers;
+// where sessions are saved, set before Start
+static std::string snapshot_dir;
+
+// single io thread serving all sessions
+static int epoll_fd = -1;
+// eventfd to wake up io thread
+static int loop_wake_fd = -1;
+
+// how io thread waits for pty, pidfd and eventfd
+enum io_engines {
+    // epoll_wait, then read/writev syscalls
+    io_engine_epoll,
+    // io_uring: multishot reads into provided buffers, writev submitted in batches
+    io_engine_uring,
+};
+static io_engines io_engine = io_engine_epoll;
+
+// what epoll event or io_uring completion refers to:
+// kind in high bits, session id or pid in low bits
+enum loop_event_kind : uint32_t {
+    // loop_wake_fd
+    loop_event_wake = 0,
+    // pty of session
+    loop_event_pty = 1,
+    // pidfd of program in session
+    loop_event_exit = 2,
+    // pidfd of program whose session is closed
+    loop_event_orphan = 3,
+    // io_uring writev to pty of session
+    loop_event_write = 4,
+    // io_uring poll for pty of session to become writable, linked to writev
+    loop_event_write_wait = 5,
+};
+
+static uint64_t LoopEvent(loop_event_kind kind, uint32_t value) { return ((uint64_t)kind << 32) | value; }
+
+// pidfd of programs to reap after their session is closed, keyed by pid
+// only accessed by io thread
+static std::map<pid_t, int> orphans;
+// closed sessions hand over their pidfd here, protected by sessions_lock
+static std::vector<std::pair<pid_t, int>> new_orphans;
+
+// tmux panes to create or free, only accessed by io thread
+static bool tmux_changed = false;
+
+// parse "%12" or "@3" id after prefix character, -1 if invalid
+static int ParseTmuxId(const std::string &s, size_t pos, char prefix) {
+    if (pos >= s.size() || s[pos] != prefix) {
+        return -1;
+    }
+    return atoi(s.c_str() + pos + 1);
+}
+
+// tmux control mode starts, lock must be held
+void terminal_context::StartTmux() {
+    LOG_INFO("Session %d enters tmux control mode", id);
+    escape_state = state_tmux;
+    tmux = tmux_client();
+    // first block answers the command that started tmux
+    tmux.commands.push_back({tmux_command_ignore, -1});
+    // windows follow our size, panes are created from layouts
+    SendTmuxCommand(tmux_command_ignore, -1,
+                    "refresh-client -C " + std::to_string(num_cols) + "x" + std::to_string(num_rows));
+    SendTmuxCommand(tmux_command_list_windows, -1, "list-windows -F \"#{window_id} #{window_layout}\"");
+}
+
+// queue command to tmux, io thread writes it
+// return false if too many are queued
+bool terminal_context::SendTmuxCommand(tmux_command_kinds kind, int pane, const std::string &command) {
+    if (tmux.outgoing.size() + command.size() >= max_tmux_outgoing) {
+        return false;
+    }
+    tmux.commands.push_back({kind, pane});
+    tmux.outgoing += command;
+    tmux.outgoing += '\n';
+    WakeWriter();
+    return true;
+}
+
+// move queued tmux commands into replies, called by io thread
+void terminal_context::FlushTmuxCommands() {
+    std::string outgoing;
+    pthread_mutex_lock(&lock);
+    outgoing.swap(tmux.outgoing);
+    pthread_mutex_unlock(&lock);
+    if (!outgoing.empty()) {
+        QueueReply((const uint8_t *)outgoing.data(), outgoing.size());
+    }
+}
+
+// a line of tmux control mode, without newline
+// collect line from tmux, up to max_tmux_line
+void terminal_context::AppendTmuxLine(const char *data, size_t length) {
+    if (tmux.line.size() + length > max_tmux_line) {
+        LOG_WARN("Tmux line exceeds %zu bytes, leaving control mode", max_tmux_line);
+        ExitTmux();
+        return;
+    }
+    tmux.line.append(data, length);
+}
+
+void terminal_context::HandleTmuxLine(const std::string &line) {
+    if (tmux.in_block) {
+        if (StartsWith(line, "%end ") || StartsWith(line, "%error ")) {
+            tmux.in_block = false;
+            if (!tmux.commands.empty()) {
+                tmux_command command = tmux.commands.front();
+                tmux.commands.pop_front();
+                HandleTmuxResponse(command, StartsWith(line, "%end "));
+            }
+            tmux.block.clear();
+        } else {
+            tmux.block.push_back(line);
+        }
+    } else if (StartsWith(line, "%begin ")) {
+        // %begin time number flags
+        tmux.in_block = true;
+        tmux.block.clear();
+    } else if (StartsWith(line, "%output ")) {
+        // %output %pane data
+        size_t space = line.find(' ', 8);
+        int pane = ParseTmuxId(line, 8, '%');
+        if (pane != -1 && space != std::string::npos) {
+            HandleTmuxOutput(pane, line.substr(space + 1));
+        }
+    } else if (StartsWith(line, "%extended-output ")) {
+        // %extended-output %pane age ... : data
+        size_t colon = line.find(" : ");
+        int pane = ParseTmuxId(line, 17, '%');
+        if (pane != -1 && colon != std::string::npos) {
+            HandleTmuxOutput(pane, line.substr(colon + 3));
+        }
+    } else if (StartsWith(line, "%layout-change ")) {
+        // %layout-change @window layout visible-layout flags
+        std::vector<std::string> parts = SplitString(line, " ");
+        int window = ParseTmuxId(line, 15, '@');
+        if (window != -1 && parts.size() >= 3) {
+            HandleTmuxLayout(window, parts[2]);
+        }
+    } else if (StartsWith(line, "%window-add ")) {
+        // learn layout of new window
+        SendTmuxCommand(tmux_command_list_windows, -1, "list-windows -F \"#{window_id} #{window_layout}\"");
+    } else if (StartsWith(line, "%window-close ") || StartsWith(line, "%unlinked-window-close ")) {
+        int window = ParseTmuxId(line, line.find(' ') + 1, '@');
+        std::vector<int> closed;
+        for (auto &pair : tmux.pane_windows) {
+            if (pair.second == window) {
+                closed.push_back(pair.first);
+            }
+        }
+        for (int pane : closed) {
+            CloseTmuxPane(pane);
+        }
+    }
+    // %exit is followed by ST, which leaves control mode
+}
+
+// answer of a command sent to tmux, lines are in tmux.block
+void terminal_context::HandleTmuxResponse(const tmux_command &command, bool success) {
+    if (command.kind == tmux_command_list_windows && success) {
+        // @window layout
+        for (auto &line : tmux.block) {
+            size_t space = line.find(' ');
+            int window = ParseTmuxId(line, 0, '@');
+            if (window != -1 && space != std::string::npos) {
+                HandleTmuxLayout(window, line.substr(space + 1));
+            }
+        }
+    } else if (command.kind == tmux_command_capture && success) {
+        // visible content and history, with escape sequences
+        std::string content;
+        for (size_t i = 0; i < tmux.block.size(); i++) {
+            if (i > 0) {
+                content += "\r\n";
+            }
+            content += tmux.block[i];
+        }
+        content += "\x1b[0m";
+        auto it = tmux.panes.find(command.pane);
+        auto session = it == tmux.panes.end() ? sessions.end() : sessions.find(it->second);
+        if (session != sessions.end()) {
+            session->second->HandleOutput((const uint8_t *)content.data(), content.size());
+        }
+    } else if (command.kind == tmux_command_cursor) {
+        // cursor_x cursor_y, then output that arrived meanwhile
+        std::string content;
+        int x = 0, y = 0;
+        if (success && tmux.block.size() == 1 && sscanf(tmux.block[0].c_str(), "%d %d", &x, &y) == 2) {
+            content = "\x1b[" + std::to_string(y + 1) + ";" + std::to_string(x + 1) + "H";
+        }
+        auto held = tmux.held_output.find(command.pane);
+        if (held != tmux.held_output.end()) {
+            content += held->second;
+            tmux.held_output.erase(held);
+        }
+        auto it = tmux.panes.find(command.pane);
+        auto session = it == tmux.panes.end() ? sessions.end() : sessions.find(it->second);
+        if (session != sessions.end()) {
+            session->second->HandleOutput((const uint8_t *)content.data(), content.size());
+        }
+    }
+}
+
+// collect panes of a tmux layout: checksum,WxH,X,Y followed by
+// ,pane for a pane, or {...} / [...] for panes split horizontally / vertically
+static void ParseTmuxLayout(const char *&p, std::vector<std::pair<int, tmux_new_pane>> &panes) {
+    int cols = 0, rows = 0, x = 0, y = 0, consumed = 0;
+    if (sscanf(p, "%dx%d,%d,%d%n", &cols, &rows, &x, &y, &consumed) != 4) {
+        p += strlen(p);
+        return;
+    }
+    p += consumed;
+    if (*p == ',') {
+        p++;
+        panes.push_back({atoi(p), {-1, rows, cols}});
+        while (isdigit(*p)) {
+            p++;
+        }
+    } else if (*p == '{' || *p == '[') {
+        char close = *p == '{' ? '}' : ']';
+        p++;
+        while (*p && *p != close) {
+            ParseTmuxLayout(p, panes);
+            if (*p == ',') {
+                p++;
+            }
+        }
+        if (*p == close) {
+            p++;
+        }
+    }
+}
+
+// window has a new layout: resize, create and close its panes
+void terminal_context::HandleTmuxLayout(int window, const std::string &layout) {
+    // skip checksum
+    size_t comma = layout.find(',');
+    if (comma == std::string::npos) {
+        return;
+    }
+    std::vector<std::pair<int, tmux_new_pane>> layout_panes;
+    const char *p = layout.c_str() + comma + 1;
+    ParseTmuxLayout(p, layout_panes);
+
+    std::vector<int> closed;
+    for (auto &pair : tmux.pane_windows) {
+        if (pair.second == window) {
+            closed.push_back(pair.first);
+        }
+    }
+    for (auto &pair : layout_panes) {
+        int pane = pair.first;
+        tmux_new_pane size = pair.second;
+        size.window = window;
+        closed.erase(std::remove(closed.begin(), closed.end(), pane), closed.end());
+        tmux.pane_windows[pane] = window;
+
+        auto it = tmux.panes.find(pane);
+        if (it != tmux.panes.end()) {
+            auto session = sessions.find(it->second);
+            if (session != sessions.end()) {
+                terminal_context *ctx = session->second;
+                pthread_mutex_lock(&ctx->lock);
+                if (ctx->num_rows != size.rows || ctx->num_cols != size.cols) {
+                    ctx->ResizeTo(size.rows, size.cols);
+                }
+                pthread_mutex_unlock(&ctx->lock);
+            }
+        } else {
+            // output is held until initial content arrives
+            tmux.new_panes[pane] = size;
+            tmux.held_output[pane];
+            tmux_changed = true;
+        }
+    }
+    for (int pane : closed) {
+        CloseTmuxPane(pane);
+    }
+}
+
+// pane has output, escaped as \ooo for characters below space and backslash
+void terminal_context::HandleTmuxOutput(int pane, const std::string &data) {
+    std::string output;
+    output.reserve(data.size());
+    for (size_t i = 0; i < data.size(); i++) {
+        if (data[i] == '\\' && i + 3 < data.size() && isdigit(data[i + 1])) {
+            output += (char)(((data[i + 1] - '0') << 6) | ((data[i + 2] - '0') << 3) | (data[i + 3] - '0'));
+            i += 3;
+        } else {
+            output += data[i];
+        }
+    }
+
+    auto held = tmux.held_output.find(pane);
+    if (held != tmux.held_output.end() || tmux.panes.find(pane) == tmux.panes.end()) {
+        // not ready yet, or not in a known layout yet
+        std::string &buffer = tmux.held_output[pane];
+        if (buffer.size() + output.size() <= max_tmux_held_output) {
+            buffer += output;
+        } else {
+            LOG_WARN("Drop %zu bytes of output of tmux pane %d", output.size(), pane);
+        }
+        return;
+    }
+    auto session = sessions.find(tmux.panes[pane]);
+    if (session != sessions.end()) {
+        session->second->HandleOutput((const uint8_t *)output.data(), output.size());
+    }
+}
+
+// pane is gone, its session is freed by io thread later
+void terminal_context::CloseTmuxPane(int pane) {
+    auto it = tmux.panes.find(pane);
+    if (it != tmux.panes.end()) {
+        tmux.closed_sessions.push_back(it->second);
+        tmux.panes.erase(it);
+    }
+    tmux.pane_windows.erase(pane);
+    tmux.new_panes.erase(pane);
+    tmux.held_output.erase(pane);
+    tmux_changed = true;
+}
+
+// tmux control mode ends
+void terminal_context::ExitTmux() {
+    LOG_INFO("Session %d leaves tmux control mode", id);
+    std::vector<int> closed = std::move(tmux.closed_sessions);
+    for (auto &pair : tmux.panes) {
+        closed.push_back(pair.second);
+    }
+    tmux = tmux_client();
+    tmux.closed_sessions = std::move(closed);
+    tmux_changed = true;
+    escape_state = state_idle;
+}
+
+// create and free sessions of tmux panes
+// called by io thread without sessions_lock
+static void ApplyTmuxChanges() {
+    if (!tmux_changed) {
+        return;
+    }
+    tmux_changed = false;
+
+    pthread_rwlock_wrlock(&sessions_lock);
+    // panes are freed below, only visit their clients
+    std::vector<terminal_context *> clients;
+    for (auto &pair : sessions) {
+        if (pair.second->tmux_parent == -1) {
+            clients.push_back(pair.second);
+        }
+    }
+    for (terminal_context *client : clients) {
+        pthread_mutex_lock(&client->lock);
+        std::vector<int> closed = std::move(client->tmux.closed_sessions);
+        std::map<int, tmux_new_pane> new_panes = std::move(client->tmux.new_panes);
+        client->tmux.closed_sessions.clear();
+        client->tmux.new_panes.clear();
+        pthread_mutex_unlock(&client->lock);
+
+        for (int id : closed) {
+            auto it = sessions.find(id);
+            if (it == sessions.end()) {
+                continue;
+            }
+            terminal_context *ctx = it->second;
+            sessions.erase(it);
+            if (active_term == ctx) {
+                active_term = client;
+                scroll_offset = 0.0;
+            }
+            delete ctx;
+            if (!daemon_server) {
+                SessionChanged(id, false);
+            }
+        }
+
+        for (auto &pair : new_panes) {
+            terminal_context *ctx = new terminal_context;
+            ctx->id = next_session_id++;
+            ctx->tmux_parent = client->id;
+            ctx->tmux_pane = pair.first;
+            ctx->ResizeTo(pair.second.rows, pair.second.cols);
+            ctx->UseTriggers(triggers);
+            sessions[ctx->id] = ctx;
+
+            // fetch initial content, it includes output held so far,
+            // newer output is held until then
+            pthread_mutex_lock(&client->lock);
+            std::string target = " -t %" + std::to_string(pair.first);
+            client->tmux.panes[pair.first] = ctx->id;
+            client->tmux.held_output[pair.first].clear();
+            client->SendTmuxCommand(tmux_command_capture, pair.first,
+                                    "capture-pane -p -e" + target + " -S -" + std::to_string(MAX_HISTORY_LINES));
+            client->SendTmuxCommand(tmux_command_cursor, pair.first,
+                                    "display-message -p" + target + " \"#{cursor_x} #{cursor_y}\"");
+            pthread_mutex_unlock(&client->lock);
+
+            if (active_term == client) {
+                // show the first pane instead of control mode
+                active_term = ctx;
+                scroll_offset = 0.0;
+            }
+            LOG_INFO("Created session %d for tmux pane %d", ctx->id, pair.first);
+            // ui of daemon learns it with the other sessions
+            if (!daemon_server) {
+                SessionChanged(ctx->id, true);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    MarkDaemonDirty();
+}
+
+// send input of tmux pane as send-keys commands, return bytes accepted
+// called with sessions_lock held
+static size_t SendToTmuxPane(terminal_context *pane, const uint8_t *data, size_t length) {
+    auto it = sessions.find(pane->tmux_parent);
+    if (it == sessions.end()) {
+        return 0;
+    }
+    terminal_context *client = it->second;
+
+    size_t accepted = 0;
+    pthread_mutex_lock(&client->lock);
+    while (client->escape_state == state_tmux && accepted < length) {
+        size_t chunk = std::min(length - accepted, (size_t)256);
+        std::string command = "send-keys -t %" + std::to_string(pane->tmux_pane) + " -H";
+        for (size_t i = 0; i < chunk; i++) {
+            char hex[4];
+            snprintf(hex, sizeof(hex), " %02x", data[accepted + i]);
+            command += hex;
+        }
+        if (!client->SendTmuxCommand(tmux_command_ignore, -1, command)) {
+            break;
+        }
+        accepted += chunk;
+    }
+    pthread_mutex_unlock(&client->lock);
+    return accepted;
+}
+
+// stream queued pastes of tmux panes as send-keys, only as fast as the
+// client pty takes them, so nothing is cut off at max_tmux_outgoing
+// called by io thread with sessions_lock held, return true if any was sent
+static bool FeedTmuxPastes(terminal_context *client) {
+    bool sent = false;
+    for (auto &pair : sessions) {
+        terminal_context *pane = pair.second;
+        if (pane->tmux_parent != client->id) {
+            continue;
+        }
+        // hex encoded commands are about three times the paste chunk
+        while (client->replies_overflow.empty() && client->replies.Free() >= spsc_ring::capacity / 2 &&
+               pane->HasPendingWrites()) {
+            struct iovec iov[5];
+            size_t reply_bytes, input_bytes;
+            int iovcnt = pane->GatherWrites(iov, reply_bytes, input_bytes);
+            size_t accepted = 0;
+            for (int i = 0; i < iovcnt; i++) {
+                size_t res = SendToTmuxPane(pane, (const uint8_t *)iov[i].iov_base, iov[i].iov_len);
+                accepted += res;
+                if (res < iov[i].iov_len) {
+                    break;
+                }
+            }
+            if (accepted == 0) {
+                // control mode has ended
+                break;
+            }
+            pane->ReleaseWritten(iov, iovcnt, reply_bytes, input_bytes, accepted);
+            client->FlushTmuxCommands();
+            sent = true;
+        }
+    }
+    return sent;
+}
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+// get a pidfd, -1 if kernel does not support it
+static int PidfdOpen(pid_t pid) {
+    int res = syscall(SYS_pidfd_open, pid, 0);
+    if (res >= 0) {
+        fcntl(res, F_SETFD, FD_CLOEXEC);
+    }
+    return res;
+}
+
+// reap child without blocking, return exit status or -1
+static int Reap(pid_t pid) {
+    int status;
+    pid_t res;
+    do {
+        res = waitpid(pid, &status, WNOHANG);
+    } while (res < 0 && errno == EINTR);
+    if (res != pid) {
+        return -1;
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+// minimal io_uring on raw syscalls
+// submission queue is only touched by io thread,
+// Cancel goes through io_uring_register and is safe from any thread
+struct uring {
+    int ring_fd = -1;
+
+    // submission queue
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    unsigned to_submit = 0;
+
+    // completion queue
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    struct io_uring_cqe *cqes = nullptr;
+
+    // buffers provided to multishot reads, shared by all sessions
+    static constexpr int buf_count = 64;
+    static constexpr int buf_size = 4096;
+    static constexpr int buf_group = 0;
+    struct io_uring_buf_ring *buf_ring = nullptr;
+    std::vector<uint8_t> buf_data;
+    uint16_t buf_tail = 0;
+
+    bool Setup();
+    struct io_uring_sqe *NextSqe();
+    // submit queued sqes, and wait for at least one completion if asked
+    int Enter(bool wait);
+    // move completions out of the ring
+    void TakeCompletions(std::vector<struct io_uring_cqe> &out);
+    uint8_t *Buffer(int bid) { return &buf_data[bid * buf_size]; }
+    void RecycleBuffer(int bid);
+
+    void ReadMultishot(int fd, uint64_t user_data);
+    void Poll(int fd, uint32_t events, uint64_t user_data, bool multishot);
+    void Writev(int fd, const struct iovec *iov, int iovcnt, uint64_t user_data, uint64_t wait_user_data);
+    // cancel all requests on fd and wait for them
+    void Cancel(int fd);
+};
+static uring io_ring;
+
+// not in older kernel headers, available since linux 6.7
+static constexpr uint8_t uring_op_read_multishot = 49;
+
+bool uring::Setup() {
+    struct io_uring_params params = {};
+    int res = syscall(SYS_io_uring_setup, 256, &params);
+    if (res < 0) {
+        LOG_WARN("io_uring is unavailable: %d", errno);
+        return false;
+    }
+    ring_fd = res;
+
+    // multishot read and sync cancel are required
+    std::vector<uint8_t> probe_data(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe *probe = (struct io_uring_probe *)probe_data.data();
+    res = syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256);
+    if (res < 0 || probe->last_op < uring_op_read_multishot ||
+        !(probe->ops[uring_op_read_multishot].flags & IO_URING_OP_SUPPORTED) ||
+        !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        LOG_WARN("io_uring lacks multishot read: %d", probe->last_op);
+        close(ring_fd);
+        ring_fd = -1;
+        return false;
+    }
+
+    // sq and cq share one mapping
+    size_t ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    uint8_t *ring = (uint8_t *)mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                                    IORING_OFF_SQ_RING);
+    sqes = (struct io_uring_sqe *)mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe),
+                                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    assert(ring != MAP_FAILED && sqes != MAP_FAILED);
+    sq_head = (unsigned *)(ring + params.sq_off.head);
+    sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    sq_array = (unsigned *)(ring + params.sq_off.array);
+    sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    cq_head = (unsigned *)(ring + params.cq_off.head);
+    cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    // register provided buffers, the ring itself must be page aligned
+    buf_ring = (struct io_uring_buf_ring *)mmap(nullptr, buf_count * sizeof(struct io_uring_buf),
+                                                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(buf_ring != MAP_FAILED);
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid = buf_group;
+    res = syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    assert(res == 0);
+    buf_data.resize(buf_count * buf_size);
+    for (int i = 0; i < buf_count; i++) {
+        RecycleBuffer(i);
+    }
+    return true;
+}
+
+struct io_uring_sqe *uring::NextSqe() {
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+        // full, submit what we have
+        Enter(false);
+        tail = *sq_tail;
+    }
+    unsigned index = tail & sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    to_submit++;
+    return sqe;
+}
+
+int uring::Enter(bool wait) {
+    int res;
+    do {
+        res = syscall(SYS_io_uring_enter, ring_fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                      nullptr, 0);
+    } while (res < 0 && errno == EINTR);
+    if (res >= 0) {
+        to_submit -= std::min((unsigned)res, to_submit);
+    }
+    return res;
+}
+
+void uring::TakeCompletions(std::vector<struct io_uring_cqe> &out) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        out.push_back(cqes[head & cq_mask]);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+void uring::RecycleBuffer(int bid) {
+    // bufs[] is misplaced in C++ due to the empty struct in __DECLARE_FLEX_ARRAY,
+    // entries start at the beginning of the ring, overlapping the tail
+    struct io_uring_buf *buf = (struct io_uring_buf *)buf_ring + (buf_tail & (buf_count - 1));
+    buf->addr = (uint64_t)Buffer(bid);
+    buf->len = buf_size;
+    buf->bid = bid;
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+void uring::ReadMultishot(int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = NextSqe();
+    sqe->opcode = uring_op_read_multishot;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buf_group;
+    sqe->user_data = user_data;
+}
+
+void uring::Poll(int fd, uint32_t events, uint64_t user_data, bool multishot) {
+    struct io_uring_sqe *sqe = NextSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+}
+
+void uring::Writev(int fd, const struct iovec *iov, int iovcnt, uint64_t user_data, uint64_t wait_user_data) {
+    // pty is non blocking: wait for room in kernel instead of getting EAGAIN
+    struct io_uring_sqe *sqe = NextSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = wait_user_data;
+
+    sqe = NextSqe();
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)iov;
+    sqe->len = iovcnt;
+    sqe->user_data = user_data;
+}
+
+void uring::Cancel(int fd) {
+    struct io_uring_sync_cancel_reg reg = {};
+    reg.fd = fd;
+    reg.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    reg.timeout.tv_sec = -1;
+    reg.timeout.tv_nsec = -1;
+    syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_SYNC_CANCEL, &reg, 1);
+}
+
+// io_uring state of each session, only accessed by io thread
+struct uring_session {
+    // pty that has a multishot read armed
+    int fd = -1;
+    // writev in flight, iovec must live until it completes
+    bool writing = false;
+    struct iovec iov[5];
+    int iovcnt = 0;
+    size_t reply_bytes = 0;
+    size_t input_bytes = 0;
+};
+static std::map<int, uring_session> uring_sessions;
+// completions taken out of order by TakeQueuedOutput, handled next by io loop
+static std::vector<struct io_uring_cqe> uring_backlog;
+
+// io_uring: handle output that the cancelled multishot read of session
+// had already taken, so it is not parsed after the program restarted
+static void TakeQueuedOutput(terminal_context *ctx) {
+    io_ring.TakeCompletions(uring_backlog);
+    size_t kept = 0;
+    for (size_t i = 0; i < uring_backlog.size(); i++) {
+        struct io_uring_cqe cqe = uring_backlog[i];
+        if (cqe.user_data != LoopEvent(loop_event_pty, ctx->id)) {
+            uring_backlog[kept++] = cqe;
+            continue;
+        }
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            int bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe.res > 0) {
+                ctx->HandleOutput(io_ring.Buffer(bid), cqe.res);
+            }
+            io_ring.RecycleBuffer(bid);
+        }
+    }
+    uring_backlog.resize(kept);
+}
+
+// recordings of sessions, see RecordingWriter
+static pthread_mutex_t recording_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recording_cond = PTHREAD_COND_INITIALIZER;
+static std::vector<std::shared_ptr<session_recording>> recordings;
+static bool recording_started = false;
+// writer has taken output it is writing, see FinishRecordings
+static bool recording_busy = false;
+static pthread_cond_t recording_idle = PTHREAD_COND_INITIALIZER;
+
+static uint64_t MonotonicUsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void terminal_context::Record(char type, const uint8_t *data, size_t length) {
+    recording_event event = {MonotonicUsec() - recording->start_usec, (uint32_t)length, type};
+    pthread_mutex_lock(&recording_lock);
+    bool wake = recording->pending.empty();
+    if (recording->pending.size() + sizeof(event) + length > max_recording_pending) {
+        recording->dropped += length;
+    } else {
+        recording->pending.append((const char *)&event, sizeof(event));
+        recording->pending.append((const char *)data, length);
+    }
+    pthread_mutex_unlock(&recording_lock);
+    // writer takes all that arrives meanwhile in one go
+    if (wake) {
+        pthread_cond_signal(&recording_cond);
+    }
+}
+
+// append output as json string content, invalid utf8 becomes U+FFFD and
+// a sequence cut at the end is kept in tail for the next output
+static void AppendJsonOutput(std::string &out, std::string &tail, const uint8_t *data, size_t length) {
+    std::string joined;
+    if (!tail.empty()) {
+        joined = tail;
+        joined.append((const char *)data, length);
+        data = (const uint8_t *)joined.data();
+        length = joined.size();
+        tail.clear();
+    }
+    for (size_t i = 0; i < length;) {
+        uint8_t c = data[i];
+        if (c < 0x80) {
+            switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if (c < 0x20) {
+                    char temp[8];
+                    snprintf(temp, sizeof(temp), "\\u%04x", c);
+                    out += temp;
+                } else {
+                    out += (char)c;
+                }
+            }
+            i++;
+            continue;
+        }
+
+        // lead byte, then bounds of second byte that rule out
+        // overlong forms, surrogates and codepoints past U+10FFFF
+        size_t size = 0;
+        uint8_t low = 0x80, high = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) {
+            size = 2;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            size = 3;
+            low = c == 0xe0 ? 0xa0 : 0x80;
+            high = c == 0xed ? 0x9f : 0xbf;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            size = 4;
+            low = c == 0xf0 ? 0x90 : 0x80;
+            high = c == 0xf4 ? 0x8f : 0xbf;
+        }
+        size_t valid = size > 0 ? 1 : 0;
+        while (valid > 0 && valid < size && i + valid < length) {
+            uint8_t next = data[i + valid];
+            if (valid == 1 ? (next < low || next > high) : (next & 0xc0) != 0x80) {
+                break;
+            }
+            valid++;
+        }
+        if (valid > 0 && valid < size && i + valid == length) {
+            tail.assign((const char *)&data[i], valid);
+            break;
+        }
+        if (valid == 0 || valid < size) {
+            out += "\xef\xbf\xbd";
+            i += std::max<size_t>(valid, 1);
+        } else {
+            out.append((const char *)&data[i], size);
+            i += size;
+        }
+    }
+}
+
+// write all iovecs, false on error
+static bool WriteAllv(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t res = writev(fd, iov, iovcnt);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        while (iovcnt > 0 && (size_t)res >= iov->iov_len) {
+            res -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + res;
+            iov->iov_len -= res;
+        }
+    }
+    return true;
+}
+
+// format events taken from pending as lines of asciicast, batched into writev
+static void WriteRecording(session_recording &recording, const std::string &events, std::vector<std::string> &lines) {
+    struct iovec iov[recording_batch];
+    int count = 0;
+    for (size_t offset = 0; offset + sizeof(recording_event) <= events.size();) {
+        recording_event event;
+        memcpy(&event, &events[offset], sizeof(event));
+        const uint8_t *data = (const uint8_t *)&events[offset + sizeof(event)];
+        offset += sizeof(event) + event.length;
+
+        std::string &line = lines[count];
+        line.clear();
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), "[%llu.%06llu, \"%c\", \"", (unsigned long long)event.usec / 1000000,
+                 (unsigned long long)event.usec % 1000000, event.type);
+        line += prefix;
+        if (event.type == 'o') {
+            AppendJsonOutput(line, recording.utf8_tail, data, event.length);
+        } else {
+            line.append((const char *)data, event.length);
+        }
+        line += "\"]\n";
+        iov[count].iov_base = (void *)line.data();
+        iov[count].iov_len = line.size();
+        count++;
+
+        if (count == recording_batch || offset >= events.size()) {
+            if (recording.fd != -1 && !WriteAllv(recording.fd, iov, count)) {
+                LOG_ERROR("Failed to write recording: %s", strerror(errno));
+                close(recording.fd);
+                recording.fd = -1;
+            }
+            count = 0;
+        }
+    }
+}
+
+// writes recordings so that io thread never waits on disk
+static void *RecordingWriter(void *) {
+    pthread_setname_np(pthread_self(), "recording");
+    std::vector<std::string> lines(recording_batch);
+    std::vector<std::shared_ptr<session_recording>> taken;
+    std::vector<std::string> events;
+    std::vector<bool> finished;
+    pthread_mutex_lock(&recording_lock);
+    while (true) {
+        // take all that is pending, a recording no session refers to
+        // any more is finished
+        taken.clear();
+        events.clear();
+        finished.clear();
+        for (auto it = recordings.begin(); it != recordings.end();) {
+            std::shared_ptr<session_recording> &recording = *it;
+            bool stopped = recording.use_count() == 1;
+            if (!recording->pending.empty() || stopped) {
+                taken.push_back(recording);
+                events.emplace_back();
+                events.back().swap(recording->pending);
+                finished.push_back(stopped);
+            }
+            it = stopped ? recordings.erase(it) : std::next(it);
+        }
+        if (taken.empty()) {
+            recording_busy = false;
+            pthread_cond_broadcast(&recording_idle);
+            // sessions closed while idle are noticed within a second
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&recording_cond, &recording_lock, &deadline);
+            continue;
+        }
+        recording_busy = true;
+        pthread_mutex_unlock(&recording_lock);
+
+        for (size_t i = 0; i < taken.size(); i++) {
+            WriteRecording(*taken[i], events[i], lines);
+            if (finished[i] && taken[i]->fd != -1) {
+                if (taken[i]->dropped > 0) {
+                    LOG_WARN("Recording dropped %llu bytes of output", (unsigned long long)taken[i]->dropped);
+                }
+                close(taken[i]->fd);
+                taken[i]->fd = -1;
+            }
+        }
+        taken.clear();
+        pthread_mutex_lock(&recording_lock);
+    }
+    return nullptr;
+}
+
+bool StartRecording(const std::string &path, int session) {
+    pthread_rwlock_rdlock(&sessions_lock);
+    terminal_context *ctx = active_term;
+    if (session != -1) {
+        auto it = sessions.find(session);
+        ctx = it == sessions.end() ? nullptr : it->second;
+    }
+    if (!ctx) {
+        pthread_rwlock_unlock(&sessions_lock);
+        return false;
+    }
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        pthread_rwlock_unlock(&sessions_lock);
+        LOG_ERROR("Failed to record to %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    auto recording = std::make_shared<session_recording>();
+    recording->fd = fd;
+
+    // header goes first, output starts after it
+    pthread_mutex_lock(&ctx->lock);
+    char header[128];
+    snprintf(header, sizeof(header), "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %lld}\n",
+             ctx->num_cols, ctx->num_rows, (long long)time(nullptr));
+    if (write(fd, header, strlen(header)) != (ssize_t)strlen(header)) {
+        pthread_mutex_unlock(&ctx->lock);
+        pthread_rwlock_unlock(&sessions_lock);
+        LOG_ERROR("Failed to record to %s: %s", path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+    recording->start_usec = MonotonicUsec();
+    // a recording replaced is finished by writer
+    ctx->recording = recording;
+    pthread_mutex_unlock(&ctx->lock);
+    pthread_rwlock_unlock(&sessions_lock);
+
+    pthread_mutex_lock(&recording_lock);
+    recordings.push_back(recording);
+    if (!recording_started) {
+        recording_started = true;
+        pthread_t writer_thread;
+        pthread_create(&writer_thread, NULL, RecordingWriter, NULL);
+    }
+    pthread_mutex_unlock(&recording_lock);
+    pthread_cond_signal(&recording_cond);
+    LOG_INFO("Recording session %d to %s", ctx->id, path.c_str());
+    return true;
+}
+
+bool StopRecording(int session) {
+    pthread_rwlock_rdlock(&sessions_lock);
+    terminal_context *ctx = active_term;
+    if (session != -1) {
+        auto it = sessions.find(session);
+        ctx = it == sessions.end() ? nullptr : it->second;
+    }
+    bool stopped = false;
+    if (ctx) {
+        pthread_mutex_lock(&ctx->lock);
+        stopped = ctx->recording != nullptr;
+        ctx->recording.reset();
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    pthread_cond_signal(&recording_cond);
+    return stopped;
+}
+
+void FinishRecordings() {
+    pthread_rwlock_rdlock(&sessions_lock);
+    for (auto &pair : sessions) {
+        pthread_mutex_lock(&pair.second->lock);
+        pair.second->recording.reset();
+        pthread_mutex_unlock(&pair.second->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+
+    pthread_mutex_lock(&recording_lock);
+    pthread_cond_signal(&recording_cond);
+    while (!recordings.empty() || recording_busy) {
+        pthread_cond_wait(&recording_idle, &recording_lock);
+    }
+    pthread_mutex_unlock(&recording_lock);
+}
+
+bool IsRecording(int session) {
+    pthread_rwlock_rdlock(&sessions_lock);
+    terminal_context *ctx = active_term;
+    if (session != -1) {
+        auto it = sessions.find(session);
+        ctx = it == sessions.end() ? nullptr : it->second;
+    }
+    bool recording = false;
+    if (ctx) {
+        pthread_mutex_lock(&ctx->lock);
+        recording = ctx->recording != nullptr;
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return recording;
+}
+
+// feed program output to terminal Parse
+void terminal_context::HandleOutput(const uint8_t *data, size_t length) {
+    LogBytes("Got", data, length);
+
+    // parse output
+    pthread_mutex_lock(&lock);
+    if (recording) {
+        Record('o', data, length);
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (escape_state == state_osc_52) {
+            // decode copied text in bulk until the terminator
+            i += ConsumeClipboard(&data[i], length - i);
+            if (i == length) {
+                break;
+            }
+        } else if (escape_state == state_graphics) {
+            // decode image data in bulk until the terminator
+            i += ConsumeGraphics(&data[i], length - i);
+            if (i == length) {
+                break;
+            }
+        } else if (escape_state == state_sixel) {
+            // rasterize sixels in bulk until the terminator
+            i += sixel.Decode(&data[i], length - i);
+            if (i == length) {
+                break;
+            }
+        } else if (escape_state == state_tmux && data[i] != '\x1b' && tmux.line != "\x1b") {
+            // collect tmux line in bulk until newline
+            const uint8_t *end = (const uint8_t *)memchr(&data[i], '\n', length - i);
+            size_t count = (end ? end : data + length) - &data[i];
+            AppendTmuxLine((const char *)&data[i], count);
+            i += count;
+            if (i == length) {
+                break;
+            }
+        }
+        Parse(data[i]);
+    }
+    pthread_mutex_unlock(&lock);
+    MarkDaemonDirty();
+
+    // large replies are moved into ring when writer catches up
+    DrainRepliesOverflow();
+}
+
+// read from pty and feed to terminal Parse
+// called by io thread when pty is readable
+ssize_t terminal_context::HandleRead() {
+    uint8_t buffer[1024];
+    ssize_t r = read(fd, buffer, sizeof(buffer) - 1);
+    if (r > 0) {
+        HandleOutput(buffer, r);
+    } else if (r < 0 && errno == EIO) {
+        HandleHangup();
+    }
+    return r;
+}
+
+// all slave fds of pty are closed
+void terminal_context::HandleHangup() {
+    LOG_INFO("Pty of session %d hung up", id);
+    if (pid_fd != -1) {
+        // pidfd tells when the child exits, stop polling the hung up pty meanwhile
+        // a finished multishot read is not rearmed
+        if (io_engine == io_engine_epoll) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        }
+    } else {
+        // no pidfd, this is the only sign of child exit
+        exit_status = ::Reap(pid);
+        Restart();
+    }
+}
+
+// reap child, drain its output and restart
+// called by io thread when pidfd is readable
+void terminal_context::HandleExit() {
+    exit_status = ::Reap(pid);
+    LOG_INFO("Program %d exited: %d", pid, exit_status);
+
+    // show what it printed before exit
+    if (io_engine == io_engine_uring && fd != -1) {
+        // otherwise the armed read races with us,
+        // cancel is synchronous so all it read is queued by now
+        io_ring.Cancel(fd);
+        TakeQueuedOutput(this);
+    }
+    // only what is there now, a background job still holding the pty
+    // could keep it readable forever, read once if unknown
+    int pending = 0;
+    if (fd != -1 && ioctl(fd, FIONREAD, &pending) != 0) {
+        pending = 1;
+    }
+    while (fd != -1 && pending > 0) {
+        ssize_t r = HandleRead();
+        if (r <= 0) {
+            break;
+        }
+        pending -= r;
+    }
+    Restart();
+}
+
+// print message and launch a new program
+void terminal_context::Restart() {
+    pthread_mutex_lock(&lock);
+    // closing fd also removes it from epoll,
+    // but io_uring requests keep the file open until cancelled
+    if (io_engine == io_engine_uring) {
+        io_ring.Cancel(fd);
+        if (pid_fd != -1) {
+            io_ring.Cancel(pid_fd);
+        }
+        // new pty is armed when io thread wakes up
+        uring_sessions[id].fd = -1;
+    }
+    close(fd);
+    fd = -1;
+    if (pid_fd != -1) {
+        close(pid_fd);
+        pid_fd = -1;
+    }
+    pid = -1;
+    want_write = false;
+
+    // print message in a separate line
+    if (col > 0) {
+        row += 1;
+        DropFirstRowIfOverflow();
+        col = 0;
+    }
+
+    std::string message = "[program exited with code " + std::to_string(exit_status) + ", restarting]";
+    for (char ch : message) {
+        InsertUtf8(ch);
+    }
+
+    row += 1;
+    DropFirstRowIfOverflow();
+    col = 0;
+
+    // keyboard modes of the exited program do not apply to the new shell
+    application_cursor = false;
+    application_keypad = false;
+    modify_other_keys = 0;
+    kitty_keyboard = 0;
+    kitty_keyboard_stack.clear();
+    mouse_tracking = mouse_tracking_off;
+    mouse_encoding = mouse_encoding_default;
+    alternate_screen = false;
+    predictions.clear();
+    prediction_paused = false;
+    images.clear();
+    placements.clear();
+    graphics_storage = 0;
+
+    if (!ForwardEvent(id, daemon_event_exit, exit_status, "")) {
+        ProgramExited(id, exit_status);
+    }
+    Spawn();
+    pthread_mutex_unlock(&lock);
+}
+
+// ask io thread to wait for POLLOUT or not
+void terminal_context::UpdateWriteInterest(bool pty_full) {
+    if (pty_full == want_write || fd == -1 || epoll_fd == -1) {
+        return;
+    }
+    want_write = pty_full;
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | (want_write ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.u64 = LoopEvent(loop_event_pty, id);
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+// a pre-spawned shell waiting on a ready pty,
+// so new sessions and restarts do not wait for fork & exec
+struct standby_shell {
+    int fd = -1;
+    pid_t pid = -1;
+    int pid_fd = -1;
+};
+static pthread_mutex_t standby_lock = PTHREAD_MUTEX_INITIALIZER;
+static standby_shell standby;
+// a thread is spawning the next standby shell, protected by standby_lock
+static bool standby_refilling = false;
+
+extern char **environ;
+
+// spawn shell on a new pty
+// posix_spawn uses vfork semantics, address space of this process is not copied
+static bool SpawnShell(int rows, int cols, standby_shell *shell) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0) {
+        LOG_ERROR("Failed to open pty: %d", errno);
+        return false;
+    }
+    char slave_path[64];
+    if (grantpt(master) != 0 || unlockpt(master) != 0 || ptsname_r(master, slave_path, sizeof(slave_path)) != 0) {
+        LOG_ERROR("Failed to setup pty: %d", errno);
+        close(master);
+        return false;
+    }
+
+    struct winsize ws = {};
+    ws.ws_col = cols;
+    ws.ws_row = rows;
+    ioctl(master, TIOCSWINSZ, &ws);
+
+    // the child becomes session leader first,
+    // then opening the tty makes it the controlling terminal
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, slave_path, O_RDWR, 0);
+    posix_spawn_file_actions_adddup2(&actions, 0, 1);
+    posix_spawn_file_actions_adddup2(&actions, 0, 2);
+
+    // do not inherit signal mask and handlers of this process
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigset_t defaults;
+    sigfillset(&defaults);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+#ifdef STANDALONE
+    const char *program = "/bin/bash";
+    char **envp = environ;
+#else
+    // override HOME to /storage/Users/currentUser since it is writable
+    const char *home = "/storage/Users/currentUser";
+    std::map<std::string, std::string> env_map;
+    for (char **env = environ; *env; env++) {
+        const char *eq = strchr(*env, '=');
+        if (eq) {
+            env_map[std::string(*env, eq - *env)] = eq + 1;
+        }
+    }
+    env_map["PATH"] = "/data/app/bin:/data/service/hnp/bin:/bin:"
+                      "/usr/local/bin:/usr/bin:/system/bin:/vendor/bin";
+    env_map["HOME"] = home;
+    env_map["PWD"] = home;
+    // set LD_LIRBARY_PATH for shared libraries
+    env_map["LD_LIBRARY_PATH"] = "/data/app/base.org/base_1.0/lib";
+    // override TMPDIR for tmux
+    env_map["TMUX_TMPDIR"] = "/data/storage/el2/base/cache";
+    std::vector<std::string> env_storage;
+    for (auto &pair : env_map) {
+        env_storage.push_back(pair.first + "=" + pair.second);
+    }
+    std::vector<char *> env_list;
+    for (auto &env : env_storage) {
+        env_list.push_back((char *)env.c_str());
+    }
+    env_list.push_back(nullptr);
+    char **envp = env_list.data();
+    posix_spawn_file_actions_addchdir_np(&actions, home);
+    //const char *program = "/data/app/bin/bash";
+    const char *program = "/bin/sh";
+#endif
+
+    char *argv[] = {(char *)program, nullptr};
+    pid_t pid = -1;
+    int res = posix_spawn(&pid, program, &actions, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (res != 0) {
+        LOG_ERROR("Failed to spawn %s: %d", program, res);
+        close(master);
+        return false;
+    }
+
+    // set as non blocking
+    res = fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    assert(res == 0);
+
+    shell->fd = master;
+    shell->pid = pid;
+    // a standby shell that dies early is reaped when adopted
+    shell->pid_fd = PidfdOpen(pid);
+    return true;
+}
+
+// spawn standby shell without holding standby_lock,
+// so adopting the current one never waits for it
+static void *StandbyRefiller(void *) {
+    pthread_setname_np(pthread_self(), "standby shell");
+    int rows = vh100 >= font_height ? vh100 / font_height : 24;
+    int cols = vw100 >= font_width ? vw100 / font_width : 80;
+    standby_shell shell;
+    SpawnShell(rows, cols, &shell);
+
+    // only this thread fills the slot, it is still empty
+    pthread_mutex_lock(&standby_lock);
+    standby = shell;
+    standby_refilling = false;
+    pthread_mutex_unlock(&standby_lock);
+    return NULL;
+}
+
+// prepare a standby shell for the next session or restart
+// called by io thread, pty and program are set up by a short-lived
+// thread so that io of other sessions does not wait for them
+static void RefillStandby() {
+    pthread_mutex_lock(&standby_lock);
+    if (standby.fd == -1 && !standby_refilling) {
+        pthread_t refill_thread;
+        standby_refilling = pthread_create(&refill_thread, NULL, StandbyRefiller, NULL) == 0;
+        if (standby_refilling) {
+            pthread_detach(refill_thread);
+        }
+    }
+    pthread_mutex_unlock(&standby_lock);
+}
+
+// launch shell on a pty, adopting the standby shell if ready,
+// and register it to io thread
+// assume lock is held
+void terminal_context::Spawn() {
+    standby_shell shell;
+    pthread_mutex_lock(&standby_lock);
+    std::swap(shell, standby);
+    pthread_mutex_unlock(&standby_lock);
+
+    if (shell.fd != -1) {
+        // the shell may have started with another size
+        LOG_INFO("Adopted standby shell %d", shell.pid);
+        struct winsize ws = {};
+        ws.ws_col = num_cols;
+        ws.ws_row = num_rows;
+        ioctl(shell.fd, TIOCSWINSZ, &ws);
+    } else if (!SpawnShell(num_rows, num_cols, &shell)) {
+        return;
+    }
+    fd = shell.fd;
+    pid = shell.pid;
+    pid_fd = shell.pid_fd;
+
+    // let io thread poll it, io_uring arms it when woken up
+    if (epoll_fd != -1) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = LoopEvent(loop_event_pty, id);
+        int res = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        assert(res == 0);
+        if (pid_fd != -1) {
+            ev.data.u64 = LoopEvent(loop_event_exit, id);
+            res = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pid_fd, &ev);
+            assert(res == 0);
+        }
+    }
+
+    // io thread refills standby shell when woken up
+    WakeEventLoop();
+}
+
+// answer OSC 52 paste request, prefer the session that asked for it
+static void DeliverPaste() {
+    if (daemon_server) {
+        return;
+    }
+    std::string paste = GetPaste();
+    if (paste.size() == 0) {
+        return;
+    }
+
+    terminal_context *target = active_term;
+    for (auto &pair : sessions) {
+        if (pair.second->paste_requested) {
+            target = pair.second;
+            break;
+        }
+    }
+    if (!target) {
+        return;
+    }
+    target->paste_requested = false;
+
+    // send OSC 52 ; c ; BASE64 ST
+    LOG_INFO("Paste from pasteboard: %s",
+                paste.c_str());
+    std::string resp = "\x1b]52;c;" + paste + "\x1b\\";
+    target->QueueReply((uint8_t *)resp.c_str(), resp.size());
+}
+
+// program of closed session has exited
+static void ReapOrphan(pid_t pid) {
+    // readable pidfd means it has exited,
+    // closing pidfd also removes it from epoll
+    auto it = orphans.find(pid);
+    if (it != orphans.end()) {
+        Reap(pid);
+        close(it->second);
+        orphans.erase(it);
+    }
+}
+
+// io_uring: arm reads of a new pty and wait for its program to exit
+static void UringWatch(terminal_context *ctx) {
+    uring_session &us = uring_sessions[ctx->id];
+    if (ctx->fd == -1 || us.fd == ctx->fd) {
+        return;
+    }
+    us.fd = ctx->fd;
+    io_ring.ReadMultishot(ctx->fd, LoopEvent(loop_event_pty, ctx->id));
+    if (ctx->pid_fd != -1) {
+        io_ring.Poll(ctx->pid_fd, POLLIN, LoopEvent(loop_event_exit, ctx->id), false);
+    }
+}
+
+// write pending data of session with the current engine
+static void FlushSession(terminal_context *ctx) {
+    if (!ctx->HasPendingWrites()) {
+        return;
+    }
+    if (io_engine == io_engine_epoll) {
+        ctx->UpdateWriteInterest(ctx->FlushWrites());
+        return;
+    }
+
+    // one writev in flight per session keeps the order,
+    // the next one is submitted when it completes
+    uring_session &us = uring_sessions[ctx->id];
+    if (us.writing || ctx->fd == -1 || us.fd != ctx->fd) {
+        return;
+    }
+    us.iovcnt = ctx->GatherWrites(us.iov, us.reply_bytes, us.input_bytes);
+    if (us.iovcnt == 0) {
+        return;
+    }
+    us.writing = true;
+    io_ring.Writev(ctx->fd, us.iov, us.iovcnt, LoopEvent(loop_event_write, ctx->id),
+                   LoopEvent(loop_event_write_wait, ctx->id));
+}
+
+// new data to write, paste is ready, or sessions changed
+// called by io thread with sessions_lock held
+static void HandleWake() {
+    uint64_t counter;
+    read(loop_wake_fd, &counter, sizeof(counter));
+
+    DeliverPaste();
+    RefillStandby();
+
+    // keep watching programs of closed sessions until they exit
+    for (auto &orphan : new_orphans) {
+        orphans[orphan.first] = orphan.second;
+        if (io_engine == io_engine_uring) {
+            io_ring.Poll(orphan.second, POLLIN, LoopEvent(loop_event_orphan, orphan.first), false);
+        } else {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.u64 = LoopEvent(loop_event_orphan, orphan.first);
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, orphan.second, &ev);
+        }
+    }
+    new_orphans.clear();
+
+    if (io_engine == io_engine_uring) {
+        // forget closed sessions once their last write completed
+        for (auto it = uring_sessions.begin(); it != uring_sessions.end();) {
+            if (!it->second.writing && sessions.find(it->first) == sessions.end()) {
+                it = uring_sessions.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    for (auto &pair : sessions) {
+        terminal_context *ctx = pair.second;
+        if (io_engine == io_engine_uring) {
+            UringWatch(ctx);
+        }
+        ctx->FlushTmuxCommands();
+        FeedTmuxPastes(ctx);
+        ctx->DrainRepliesOverflow();
+        FlushSession(ctx);
+    }
+}
+
+static void *EventLoop(void *) {
+    pthread_setname_np(pthread_self(), "terminal io");
+
+    // no timeout: only wake up when something happens
+    struct epoll_event events[64];
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("Failed to wait in io thread: %d", errno);
+            break;
+        }
+
+        pthread_rwlock_rdlock(&sessions_lock);
+        for (int i = 0; i < n; i++) {
+            loop_event_kind kind = (loop_event_kind)(events[i].data.u64 >> 32);
+            uint32_t value = (uint32_t)events[i].data.u64;
+            if (kind == loop_event_wake) {
+                HandleWake();
+                continue;
+            } else if (kind == loop_event_orphan) {
+                ReapOrphan(value);
+                continue;
+            }
+
+            auto it = sessions.find(value);
+            if (it == sessions.end()) {
+                // closed session
+                continue;
+            }
+            terminal_context *ctx = it->second;
+            if (kind == loop_event_exit) {
+                ctx->HandleExit();
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                ctx->UpdateWriteInterest(ctx->FlushWrites());
+                // room for more of a paste to its tmux panes
+                if (FeedTmuxPastes(ctx)) {
+                    FlushSession(ctx);
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ctx->HandleRead();
+            }
+        }
+        pthread_rwlock_unlock(&sessions_lock);
+        ApplyTmuxChanges();
+    }
+    return NULL;
+}
+
+// handle one io_uring completion
+// called by io thread with sessions_lock held
+static void HandleCompletion(const struct io_uring_cqe &cqe) {
+    loop_event_kind kind = (loop_event_kind)(cqe.user_data >> 32);
+    uint32_t value = (uint32_t)cqe.user_data;
+    if (kind == loop_event_wake) {
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            io_ring.Poll(loop_wake_fd, POLLIN, LoopEvent(loop_event_wake, 0), true);
+        }
+        HandleWake();
+        return;
+    } else if (kind == loop_event_orphan) {
+        ReapOrphan(value);
+        return;
+    } else if (kind == loop_event_write_wait) {
+        // only failures get here, the linked writev reports them as well
+        return;
+    }
+
+    int bid = -1;
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+    auto it = sessions.find(value);
+    if (it == sessions.end()) {
+        // closed session
+        if (bid != -1) {
+            io_ring.RecycleBuffer(bid);
+        }
+        if (kind == loop_event_write) {
+            uring_sessions.erase(value);
+        }
+        return;
+    }
+    terminal_context *ctx = it->second;
+    uring_session &us = uring_sessions[ctx->id];
+
+    if (kind == loop_event_pty) {
+        if (bid != -1) {
+            if (cqe.res > 0) {
+                ctx->HandleOutput(io_ring.Buffer(bid), cqe.res);
+            }
+            io_ring.RecycleBuffer(bid);
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            if (cqe.res == -EIO || cqe.res == 0) {
+                ctx->HandleHangup();
+            } else if (cqe.res != -ECANCELED && us.fd == ctx->fd) {
+                // e.g. ran out of buffers, read again
+                io_ring.ReadMultishot(ctx->fd, LoopEvent(loop_event_pty, ctx->id));
+            }
+        }
+    } else if (kind == loop_event_exit) {
+        if (cqe.res != -ECANCELED) {
+            ctx->HandleExit();
+        }
+    } else if (kind == loop_event_write) {
+        us.writing = false;
+        if (cqe.res > 0) {
+            ctx->ReleaseWritten(us.iov, us.iovcnt, us.reply_bytes, us.input_bytes, cqe.res);
+        } else if (cqe.res != -ECANCELED && cqe.res != -EAGAIN && cqe.res != -EINTR) {
+            // pty is gone, discard pending data
+            LOG_WARN("Failed to write to pty: %d", -cqe.res);
+            ctx->DiscardWrites(us.reply_bytes, us.input_bytes);
+        }
+        // room for more of a paste to its tmux panes
+        FeedTmuxPastes(ctx);
+        FlushSession(ctx);
+    }
+}
+
+static void *UringLoop(void *) {
+    pthread_setname_np(pthread_self(), "terminal io");
+
+    // one syscall submits pending requests and waits for completions
+    std::vector<struct io_uring_cqe> completions;
+    while (1) {
+        // do not wait while completions taken early are left
+        if (io_ring.Enter(uring_backlog.empty()) < 0 && errno != EBUSY && errno != EAGAIN) {
+            LOG_ERROR("Failed to wait in io thread: %d", errno);
+            break;
+        }
+        completions.clear();
+        completions.swap(uring_backlog);
+        io_ring.TakeCompletions(completions);
+
+        pthread_rwlock_rdlock(&sessions_lock);
+        // handle program exits after output that came in the same batch
+        for (auto &cqe : completions) {
+            if ((cqe.user_data >> 32) != loop_event_exit) {
+                HandleCompletion(cqe);
+            }
+        }
+        for (auto &cqe : completions) {
+            if ((cqe.user_data >> 32) == loop_event_exit) {
+                HandleCompletion(cqe);
+            }
+        }
+        pthread_rwlock_unlock(&sessions_lock);
+        ApplyTmuxChanges();
+    }
+    return NULL;
+}
+
+// wake up io thread, e.g. paste is ready
+void WakeEventLoop() {
+    if (loop_wake_fd == -1) {
+        return;
+    }
+    uint64_t value = 1;
+    write(loop_wake_fd, &value, sizeof(value));
+}
+
+// https://learnopengl.com/In-Practice/Text-Rendering
+struct ivec2 {
+    int x;
+    int y;
+
+    ivec2(int x, int y) {
+        this->x = x;
+        this->y = y;
+    }
+    ivec2() { this->x = this->y = 0; }
+};
+
+// glyph info
+struct character {
+    // location within the large texture
+    float left;
+    float right;
+    float top;
+    float bottom;
+    // x, y offset from origin for bearing etc.
+    int xoff;
+    int yoff;
+    // glyph size
+    int width;
+    int height;
+};
+
+// record info for each character
+// map from (codepoint, font weight) to character
+static std::map<std::pair<uint32_t, enum font_weight>, struct character> characters;
+// code points to load from the font
+static std::set<uint32_t> codepoints_to_load;
+// do we need to reload font due to missing glyphs?
+static bool need_rebuild_atlas = false;
+// id of texture for glyphs
+static GLuint atlas_texture_id;
+// there is a limit on how big a texture can be
+static int atlas_width = 8192;
+
+static void ResizeTo(int new_term_row, int new_term_col, bool update_viewport = true) {
+    // update viewport
+    if (update_viewport) {
+        vw100 = new_term_col * font_width;
+        vh100 = new_term_row * font_height;
+    }
+
+    if (daemon_fd != -1) {
+        // mirrors are resized by daemon, this keeps them drawn meanwhile
+        std::string payload;
+        PutVarint(payload, new_term_row);
+        PutVarint(payload, new_term_col);
+        QueueDaemonRequest(daemon_resize, payload);
+    }
+
+    // all sessions share the same window
+    for (auto &pair : sessions) {
+        terminal_context *ctx = pair.second;
+        if (ctx->tmux_parent != -1) {
+            // tmux decides pane sizes via layouts
+            continue;
+        }
+        pthread_mutex_lock(&ctx->lock);
+        ctx->ResizeTo(new_term_row, new_term_col);
+        if (ctx->escape_state == state_tmux) {
+            ctx->SendTmuxCommand(tmux_command_ignore, -1,
+                                 "refresh-client -C " + std::to_string(new_term_col) + "x" +
+                                     std::to_string(new_term_row));
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+}
+
+// fnv-1a over cells, never 0
+static uint64_t RowHash(const std::vector<term_char> &row) {
+    uint64_t hash = 0xcbf29ce484222325;
+    auto mix = [&](uint64_t value) { hash = (hash ^ value) * 0x100000001b3; };
+    for (auto &c : row) {
+        mix(c.code);
+        mix(c.style.fore.value);
+        mix(c.style.back.value);
+        mix(c.style.weight | (c.style.blink << 1) | (c.style.wrap << 2) | (c.style.link << 3));
+    }
+    return hash | 1;
+}
+
+static std::pair<uint64_t, uint32_t> StyleKey(const term_style &style) {
+    return {(uint64_t)style.fore.value << 32 | style.back.value,
+            style.weight | (style.blink << 1) | (style.wrap << 2) | ((uint32_t)style.link << 3)};
+}
+
+static bool SameCell(const term_char &a, const term_char &b) {
+    return a.code == b.code && SameStyle(a.style, b.style);
+}
+
+void grid_encoder::Sync(const terminal_context &ctx) {
+    session = ctx.id;
+    num_rows = ctx.num_rows;
+    num_cols = ctx.num_cols;
+    scrolled_lines = ctx.scrolled_lines;
+    row = ctx.row;
+    col = ctx.col;
+    show_cursor = ctx.show_cursor;
+    frames = 0;
+    rows.assign(ctx.buffer.begin(), ctx.buffer.end());
+    hashes.clear();
+    for (auto &r : rows) {
+        hashes.push_back(RowHash(r));
+    }
+    // default style is always there, spans start from it
+    styles.clear();
+    styles[StyleKey(term_style())] = 0;
+}
+
+void grid_encoder::Keyframe(const terminal_context &ctx, std::string &out) {
+    session = ctx.id;
+    num_rows = ctx.num_rows;
+    num_cols = ctx.num_cols;
+    scrolled_lines = ctx.scrolled_lines;
+    frames = 0;
+    // viewer blanks its rows, so only what is not blank is sent
+    rows.assign(num_rows, std::vector<term_char>(num_cols));
+    hashes.assign(num_rows, 0);
+    styles.clear();
+    styles[StyleKey(term_style())] = 0;
+    // cursor is sent again
+    row = -1;
+    PutVarint(out, grid_keyframe);
+    PutVarint(out, num_rows);
+    PutVarint(out, num_cols);
+}
+
+uint32_t grid_encoder::StyleIndex(const term_style &style, std::string &out) {
+    auto it = styles.find(StyleKey(style));
+    if (it != styles.end()) {
+        return it->second;
+    }
+    uint32_t index = styles.size();
+    styles[StyleKey(style)] = index;
+    PutVarint(out, grid_style);
+    PutVarint(out, index);
+    PutStyle(out, style);
+    return index;
+}
+
+bool grid_encoder::Encode(const terminal_context &ctx, std::string &out) {
+    size_t start = out.size();
+    if (ctx.id != session || ctx.num_rows != num_rows || ctx.num_cols != num_cols || ++frames >= grid_keyframe_frames ||
+        styles.size() >= max_grid_styles) {
+        Keyframe(ctx, out);
+    } else if (ctx.scrolled_lines > scrolled_lines) {
+        // rows moved up are not sent again
+        int shift = std::min<uint64_t>(ctx.scrolled_lines - scrolled_lines, num_rows);
+        rows.erase(rows.begin(), rows.begin() + shift);
+        rows.resize(num_rows, std::vector<term_char>(num_cols));
+        hashes.erase(hashes.begin(), hashes.begin() + shift);
+        hashes.resize(num_rows, 0);
+        scrolled_lines = ctx.scrolled_lines;
+        PutVarint(out, grid_scroll);
+        PutVarint(out, shift);
+    }
+
+    for (int i = 0; i < num_rows; i++) {
+        // rows with the same hash are taken as unchanged
+        const std::vector<term_char> &current = ctx.buffer[i];
+        uint64_t hash = RowHash(current);
+        if (hash == hashes[i]) {
+            continue;
+        }
+        hashes[i] = hash;
+
+        // spans of changed cells, joined over short gaps
+        std::vector<term_char> &sent = rows[i];
+        int c = 0;
+        while (c < num_cols) {
+            while (c < num_cols && SameCell(current[c], sent[c])) {
+                c++;
+            }
+            if (c == num_cols) {
+                break;
+            }
+            int begin = c, end = c + 1, same = 0;
+            for (c++; c < num_cols && same < grid_span_gap; c++) {
+                if (SameCell(current[c], sent[c])) {
+                    same++;
+                } else {
+                    same = 0;
+                    end = c + 1;
+                }
+            }
+            c = end;
+
+            // styles go before span using them
+            std::string span;
+            PutCells(span, &current[begin], &current[end],
+                     [&](const term_style &style) { PutVarint(span, StyleIndex(style, out)); });
+            PutVarint(out, grid_span);
+            PutVarint(out, i);
+            PutVarint(out, begin);
+            PutVarint(out, end - begin);
+            out += span;
+            std::copy(&current[begin], &current[end], &sent[begin]);
+        }
+    }
+
+    if (ctx.row != row || ctx.col != col || ctx.show_cursor != show_cursor) {
+        row = ctx.row;
+        col = ctx.col;
+        show_cursor = ctx.show_cursor;
+        PutVarint(out, grid_cursor);
+        PutVarint(out, row);
+        PutVarint(out, col);
+        PutVarint(out, show_cursor);
+    }
+    return out.size() > start;
+}
+
+void grid_mirror::Sync(const std::vector<std::vector<term_char>> &screen, int new_row, int new_col) {
+    rows = screen;
+    num_rows = rows.size();
+    num_cols = rows.empty() ? 0 : rows[0].size();
+    row = new_row;
+    col = new_col;
+    dirty_rows.assign(num_rows, false);
+    styles.assign(1, term_style());
+}
+
+bool grid_mirror::Apply(snapshot_reader &in) {
+    while (in.ok && in.data < in.end) {
+        uint64_t op = in.Varint();
+        if (op == grid_keyframe) {
+            uint64_t new_rows = in.Varint();
+            uint64_t new_cols = in.Varint();
+            if (!in.ok || new_rows > max_snapshot_size || new_cols > max_snapshot_size) {
+                return false;
+            }
+            num_rows = new_rows;
+            num_cols = new_cols;
+            rows.assign(num_rows, std::vector<term_char>(num_cols));
+            dirty_rows.assign(num_rows, true);
+            styles.assign(1, term_style());
+        } else if (op == grid_scroll) {
+            uint64_t shift = in.Varint();
+            if (!in.ok || shift > (uint64_t)num_rows) {
+                return false;
+            }
+            rows.erase(rows.begin(), rows.begin() + shift);
+            rows.resize(num_rows, std::vector<term_char>(num_cols));
+            dirty_rows.erase(dirty_rows.begin(), dirty_rows.begin() + shift);
+            dirty_rows.resize(num_rows, true);
+        } else if (op == grid_style) {
+            uint64_t index = in.Varint();
+            term_style style;
+            if (!GetStyle(in, style, max_links) || index > styles.size() || index >= max_grid_styles) {
+                return false;
+            }
+            if (index == styles.size()) {
+                styles.push_back(style);
+            } else {
+                styles[index] = style;
+            }
+        } else if (op == grid_span) {
+            uint64_t r = in.Varint();
+            uint64_t begin = in.Varint();
+            uint64_t count = in.Varint();
+            if (!in.ok || r >= (uint64_t)num_rows || begin > (uint64_t)num_cols || count > num_cols - begin) {
+                return false;
+            }
+            term_char *cells = rows[r].data() + begin;
+            bool valid = GetCells(in, cells, cells + count, [&](term_style &style) {
+                uint64_t index = in.Varint();
+                if (index >= styles.size()) {
+                    return false;
+                }
+                style = styles[index];
+                return true;
+            });
+            if (!valid) {
+                return false;
+            }
+            dirty_rows[r] = true;
+        } else if (op == grid_cursor) {
+            uint64_t r = in.Varint();
+            uint64_t c = in.Varint();
+            if (!in.ok || r >= (uint64_t)num_rows || c > (uint64_t)num_cols) {
+                return false;
+            }
+            row = r;
+            col = c;
+            show_cursor = in.Varint();
+        } else {
+            return false;
+        }
+    }
+    return in.ok;
+}
+
+bool grid_mirror::Receive(std::string &buffer) {
+    size_t offset = 0;
+    bool valid = true;
+    while (valid) {
+        snapshot_reader in = {(const uint8_t *)buffer.data() + offset, (const uint8_t *)buffer.data() + buffer.size()};
+        uint64_t length = in.Varint();
+        if (!in.ok || length > (uint64_t)(in.end - in.data)) {
+            break;
+        }
+        snapshot_reader frame = {in.data, in.data + length};
+        valid = Apply(frame);
+        offset = in.data + length - (const uint8_t *)buffer.data();
+    }
+    buffer.erase(0, offset);
+    return valid;
+}
+
+// path of daemon socket, set before Start
+static std::string daemon_socket;
+// wakes thread of ui talking to daemon, wake_fd of mirrored sessions
+static int daemon_wake_fd = -1;
+// requests of ui, or notifications of daemon waiting for ui
+static pthread_mutex_t daemon_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::string daemon_outgoing;
+// ui: sessions waiting for daemon to create them, by tag of request
+// protected by sessions_lock
+static std::map<int, int> pending_creates;
+static int next_daemon_tag = 1;
+// daemon: tags of sessions created by request of ui, protected by daemon_lock
+static std::map<int, int> daemon_tags;
+// ui: messages received but not handled yet
+static std::string daemon_received;
+// daemon: wakes thread serving ui, set until it looked at the sessions
+static int daemon_dirty_fd = -1;
+static std::atomic<bool> daemon_dirty(false);
+
+static void MarkDaemonDirty() {
+    if (daemon_dirty_fd != -1 && !daemon_dirty.exchange(true)) {
+        uint64_t value = 1;
+        write(daemon_dirty_fd, &value, sizeof(value));
+    }
+}
+
+static void PutMessage(std::string &out, int type, const std::string &payload) {
+    PutVarint(out, type);
+    PutVarint(out, payload.size());
+    out += payload;
+}
+
+// take next complete message at offset, false if incomplete
+static bool TakeMessage(const std::string &buffer, size_t &offset, int &type, snapshot_reader &payload) {
+    snapshot_reader in = {(const uint8_t *)buffer.data() + offset, (const uint8_t *)buffer.data() + buffer.size()};
+    type = in.Varint();
+    uint64_t length = in.Varint();
+    if (!in.ok || length > (uint64_t)(in.end - in.data)) {
+        return false;
+    }
+    payload = {in.data, in.data + length};
+    offset = in.data + length - (const uint8_t *)buffer.data();
+    return true;
+}
+
+void SetDaemonSocket(const std::string &path) {
+    daemon_socket = path;
+}
+
+static bool ForwardEvent(int session, int type, int code, const std::string &text) {
+    if (!daemon_server) {
+        return false;
+    }
+    std::string payload;
+    PutVarint(payload, session);
+    PutVarint(payload, type);
+    PutVarint(payload, code);
+    PutString(payload, text);
+    pthread_mutex_lock(&daemon_lock);
+    // kept for the next ui while none is attached
+    if (daemon_outgoing.size() < max_daemon_events) {
+        PutMessage(daemon_outgoing, daemon_event, payload);
+    }
+    pthread_mutex_unlock(&daemon_lock);
+    MarkDaemonDirty();
+    return true;
+}
+
+static void QueueDaemonRequest(int type, const std::string &payload) {
+    pthread_mutex_lock(&daemon_lock);
+    PutMessage(daemon_outgoing, type, payload);
+    pthread_mutex_unlock(&daemon_lock);
+    uint64_t value = 1;
+    write(daemon_wake_fd, &value, sizeof(value));
+}
+
+// what ui has of a session of daemon, updates are the difference
+struct daemon_mirror {
+    uint64_t scrolled_lines = 0;
+    std::string modes;
+    grid_encoder grid;
+};
+
+// append changes of session since what ui has, lock must be held
+static void EncodeDaemonUpdate(const terminal_context &ctx, daemon_mirror &mirror, std::string &out) {
+    std::string payload;
+    if (ctx.scrolled_lines > mirror.scrolled_lines) {
+        // lines scrolled into history are sent once, ui moves its screen up as many
+        uint64_t scrolled = ctx.scrolled_lines - mirror.scrolled_lines;
+        uint64_t first_line = ctx.scrolled_lines - ctx.history.size();
+        uint64_t from = std::max(mirror.scrolled_lines, first_line);
+        PutVarint(payload, ctx.id);
+        PutVarint(payload, scrolled);
+        PutVarint(payload, ctx.scrolled_lines - from);
+        for (uint64_t l = from; l < ctx.scrolled_lines; l++) {
+            PutRow(payload, ctx.history[l - first_line]);
+        }
+        PutMessage(out, daemon_history, payload);
+        mirror.scrolled_lines = ctx.scrolled_lines;
+    }
+
+    // links and size come before rows using them
+    std::string modes;
+    ctx.EncodeModes(modes);
+    if (modes != mirror.modes) {
+        payload.clear();
+        PutVarint(payload, ctx.id);
+        payload += modes;
+        PutMessage(out, daemon_modes, payload);
+        mirror.modes.swap(modes);
+    }
+
+    // ui scrolls its grid with history, a keyframe follows a resize
+    payload.clear();
+    PutVarint(payload, ctx.id);
+    if (mirror.grid.Encode(ctx, payload)) {
+        PutMessage(out, daemon_rows, payload);
+    }
+}
+
+// handle request of ui, pending is input that programs did not take yet
+static void HandleDaemonRequest(int type, snapshot_reader &in, std::map<int, std::string> &pending) {
+    if (type == daemon_input) {
+        int session = in.Varint();
+        pending[session].append((const char *)in.data, in.end - in.data);
+    } else if (type == daemon_resize) {
+        int rows = in.Varint();
+        int cols = in.Varint();
+        if (in.ok && rows >= 2 && cols >= 1 && rows <= max_snapshot_size && cols <= max_snapshot_size) {
+            Resize(cols * font_width, rows * font_height);
+        }
+    } else if (type == daemon_create) {
+        int tag = in.Varint();
+        int session = CreateSession();
+        pthread_mutex_lock(&daemon_lock);
+        daemon_tags[session] = tag;
+        pthread_mutex_unlock(&daemon_lock);
+    } else if (type == daemon_close) {
+        CloseSession(in.Varint());
+    } else if (type == daemon_triggers) {
+        std::vector<trigger_pattern> patterns(std::min<uint64_t>(in.Varint(), max_trigger_patterns + 1));
+        for (auto &pattern : patterns) {
+            pattern.text = in.String();
+            uint64_t flags = in.Varint();
+            pattern.notify = flags & 1;
+            pattern.highlight = flags & 2;
+            pattern.color = in.Varint();
+        }
+        std::string error;
+        if (in.ok && !SetTriggers(patterns, error)) {
+            LOG_WARN("Invalid triggers from ui: %s", error.c_str());
+        }
+    }
+}
+
+// serve ui at fd until it leaves or another one attaches,
+// return false once all sessions are closed
+static bool ServeDaemonClient(int fd, int listen_fd) {
+    std::map<int, daemon_mirror> mirrors;
+    std::map<int, std::string> pending;
+    std::string in, out;
+    bool ready = false;
+    // sleep until sessions change, then compare them at most this often
+    bool dirty = true;
+    uint64_t last_update = 0;
+    while (true) {
+        uint64_t now = CurrentMsec();
+        bool update = dirty && now - last_update >= daemon_update_msec && out.size() < max_daemon_outgoing;
+        if (update) {
+            // changes from now on wake us again
+            daemon_dirty = false;
+            dirty = false;
+            last_update = now;
+        }
+
+        pthread_rwlock_rdlock(&sessions_lock);
+        if (sessions.empty()) {
+            pthread_rwlock_unlock(&sessions_lock);
+            return false;
+        }
+        // a slow ui gets updates less often, they are never dropped
+        for (auto &pair : sessions) {
+            if (!update) {
+                break;
+            } else if (out.size() >= max_daemon_outgoing) {
+                // the rest after ui caught up
+                dirty = true;
+                break;
+            }
+            terminal_context *ctx = pair.second;
+            auto it = mirrors.find(pair.first);
+            if (it != mirrors.end()) {
+                pthread_mutex_lock(&ctx->lock);
+                EncodeDaemonUpdate(*ctx, it->second, out);
+                pthread_mutex_unlock(&ctx->lock);
+                continue;
+            }
+
+            // new session, or all of them after attaching
+            std::string state, history_data;
+            daemon_mirror &mirror = mirrors[pair.first];
+            pthread_mutex_lock(&ctx->lock);
+            ctx->EncodeAll(state, history_data);
+            mirror.scrolled_lines = ctx->scrolled_lines;
+            ctx->EncodeModes(mirror.modes);
+            mirror.grid.Sync(*ctx);
+            pthread_mutex_unlock(&ctx->lock);
+
+            int tag = 0;
+            pthread_mutex_lock(&daemon_lock);
+            auto tag_it = daemon_tags.find(pair.first);
+            if (tag_it != daemon_tags.end()) {
+                tag = tag_it->second;
+                daemon_tags.erase(tag_it);
+            }
+            pthread_mutex_unlock(&daemon_lock);
+            std::string payload;
+            PutVarint(payload, pair.first);
+            PutVarint(payload, tag);
+            PutString(payload, state);
+            payload += history_data;
+            PutMessage(out, daemon_session, payload);
+        }
+        for (auto it = mirrors.begin(); update && it != mirrors.end();) {
+            if (sessions.count(it->first) == 0) {
+                std::string payload;
+                PutVarint(payload, it->first);
+                PutMessage(out, daemon_closed, payload);
+                pending.erase(it->first);
+                it = mirrors.erase(it);
+            } else {
+                it++;
+            }
+        }
+        pthread_rwlock_unlock(&sessions_lock);
+
+        // notifications follow the sessions they are about
+        if (update) {
+            pthread_mutex_lock(&daemon_lock);
+            out += daemon_outgoing;
+            daemon_outgoing.clear();
+            pthread_mutex_unlock(&daemon_lock);
+            if (!ready) {
+                PutMessage(out, daemon_ready, "");
+                ready = true;
+            }
+        }
+
+        // input is retried as programs consume it,
+        // and dropped once its session is gone
+        bool pending_full = false;
+        for (auto it = pending.begin(); it != pending.end();) {
+            size_t accepted = SendData((const uint8_t *)it->second.data(), it->second.size(), it->first);
+            it->second.erase(0, accepted);
+            if (accepted == 0) {
+                pthread_rwlock_rdlock(&sessions_lock);
+                if (sessions.find(it->first) == sessions.end()) {
+                    it->second.clear();
+                }
+                pthread_rwlock_unlock(&sessions_lock);
+            }
+            pending_full = pending_full || it->second.size() >= max_daemon_pending_input;
+            it = it->second.empty() ? pending.erase(it) : std::next(it);
+        }
+
+        // a full outgoing buffer waits for POLLOUT instead,
+        // input is retried while programs consume it
+        int timeout = -1;
+        if (dirty && out.size() < max_daemon_outgoing) {
+            timeout = std::max<int64_t>(0, (int64_t)(last_update + daemon_update_msec - CurrentMsec()));
+        } else if (!pending.empty()) {
+            timeout = daemon_update_msec;
+        }
+        // ui is not read while a session has too much input pending
+        struct pollfd fds[3] = {{fd, (short)((pending_full ? 0 : POLLIN) | (out.empty() ? 0 : POLLOUT)), 0},
+                                {listen_fd, POLLIN, 0},
+                                {daemon_dirty_fd, POLLIN, 0}};
+        if (poll(fds, 3, timeout) < 0 && errno != EINTR) {
+            return true;
+        }
+        if (fds[1].revents & POLLIN) {
+            // ui restarted, the new one takes over
+            return true;
+        }
+        if (fds[2].revents & POLLIN) {
+            uint64_t value;
+            read(daemon_dirty_fd, &value, sizeof(value));
+            dirty = true;
+        }
+        if (fds[0].revents & POLLOUT) {
+            ssize_t res = send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+            if (res > 0) {
+                out.erase(0, res);
+            }
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            char buffer[65536];
+            ssize_t res = read(fd, buffer, sizeof(buffer));
+            if (res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR)) {
+                return true;
             }
-            utf8_state = state_initial;
-        } else if (utf8_state == state_4byte_2_f0) {
-            // expecting the second byte of 4-byte utf-8 starting with 0xf0
-            if (input >= 0x90 && input <= 0xbf) {
-                current_utf8 |= (uint32_t)(input & 0x3f) << 12;
-                utf8_state = state_4byte_3;
-            } else {
-                utf8_state = state_initial;
+            in.append(buffer, std::max<ssize_t>(res, 0));
+            size_t offset = 0;
+            int type;
+            snapshot_reader payload;
+            while (TakeMessage(in, offset, type, payload)) {
+                HandleDaemonRequest(type, payload, pending);
+                dirty = true;
             }
-        } else if (utf8_state == state_4byte_2_f1_f3) {
-            // expecting the second byte of 4-byte utf-8 starting with 0xf0 to 0xf3
-            if (input >= 0x80 && input <= 0xbf) {
-                current_utf8 |= (uint32_t)(input & 0x3f) << 12;
-                utf8_state = state_4byte_3;
-            } else {
-                utf8_state = state_initial;
+            in.erase(0, offset);
+        }
+    }
+}
+
+// listen at path, replacing a stale socket, -1 on failure
+static int ListenUnix(const std::string &path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        LOG_ERROR("Socket path too long: %s", path.c_str());
+        return -1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 4) != 0) {
+        LOG_ERROR("Failed to listen at %s: %s", path.c_str(), strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+    return listen_fd;
+}
+
+void RunDaemon(const std::string &path) {
+    daemon_server = true;
+    int listen_fd = ListenUnix(path);
+    if (listen_fd == -1) {
+        return;
+    }
+    LOG_INFO("Daemon listening at %s", path.c_str());
+
+    daemon_dirty_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    Start();
+    bool running = true;
+    while (running) {
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0) {
+            pthread_rwlock_rdlock(&sessions_lock);
+            running = !sessions.empty();
+            pthread_rwlock_unlock(&sessions_lock);
+            continue;
+        }
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd != -1) {
+            LOG_INFO("Ui attached to daemon: fd %d", fd);
+            running = ServeDaemonClient(fd, listen_fd);
+            close(fd);
+        }
+    }
+    close(listen_fd);
+    unlink(path.c_str());
+    LOG_INFO("Daemon exits: %s", path.c_str());
+}
+
+// mirror of daemon session, sessions_lock must be held
+static terminal_context *FindMirror(int remote) {
+    for (auto &pair : sessions) {
+        if (pair.second->remote_session == remote) {
+            return pair.second;
+        }
+    }
+    return nullptr;
+}
+
+// add session of daemon, or the one waiting for it
+static void AddMirror(snapshot_reader &in, bool announce) {
+    int remote = in.Varint();
+    int tag = in.Varint();
+    std::string state = in.String();
+    std::string history_data((const char *)in.data, in.end - in.data);
+
+    pthread_rwlock_wrlock(&sessions_lock);
+    terminal_context *ctx = nullptr;
+    auto it = pending_creates.find(tag);
+    if (tag != 0 && it != pending_creates.end()) {
+        auto session = sessions.find(it->second);
+        ctx = session == sessions.end() ? nullptr : session->second;
+        pending_creates.erase(it);
+        announce = false;
+    }
+    if (!ctx) {
+        ctx = new terminal_context;
+        ctx->id = next_session_id++;
+        sessions[ctx->id] = ctx;
+    }
+    pthread_mutex_lock(&ctx->lock);
+    ctx->remote_session = remote;
+    ctx->wake_fd = daemon_wake_fd;
+    if (!ctx->DecodeSnapshot(state, history_data)) {
+        LOG_WARN("Invalid state of daemon session %d", remote);
+    }
+    ctx->remote_grid.Sync(ctx->buffer, ctx->row, ctx->col);
+    // history is in no snapshot file of ui yet
+    ctx->snapshot_stale = true;
+    pthread_mutex_unlock(&ctx->lock);
+    if (!active_term) {
+        active_term = ctx;
+    }
+    int id = ctx->id;
+    pthread_rwlock_unlock(&sessions_lock);
+    // input typed meanwhile can go now
+    ctx->WakeWriter();
+    if (announce) {
+        SessionChanged(id, true);
+    }
+}
+
+// lines scrolled into history of daemon, screen moves up as many
+static void ScrollMirror(terminal_context &ctx, snapshot_reader &in) {
+    uint64_t scrolled = in.Varint();
+    uint64_t count = in.Varint();
+    std::vector<term_char> line;
+    for (uint64_t i = 0; i < count && GetRow(in, line, ctx.links.keys.size()); i++) {
+        ctx.history.push_back(line);
+    }
+    while (ctx.history.size() > MAX_HISTORY_LINES) {
+        ctx.history.pop_front();
+    }
+    size_t shift = std::min<uint64_t>(scrolled, ctx.buffer.size());
+    ctx.buffer.erase(ctx.buffer.begin(), ctx.buffer.begin() + shift);
+    ctx.buffer.resize(ctx.num_rows, std::vector<term_char>(ctx.num_cols));
+    ctx.scrolled_lines += scrolled;
+    ctx.matches.erase(ctx.matches.begin(), ctx.matches.lower_bound(ctx.scrolled_lines - ctx.history.size()));
+    ctx.MarkDirty(ctx.num_rows - shift, ctx.num_rows - 1);
+}
+
+static void UpdateMirrorRows(terminal_context &ctx, snapshot_reader &in) {
+    grid_mirror &grid = ctx.remote_grid;
+    if (!grid.Apply(in)) {
+        // fixed by next keyframe
+        LOG_WARN("Invalid rows of daemon session %d", ctx.remote_session);
+    }
+    for (int i = 0; i < grid.num_rows && i < ctx.num_rows; i++) {
+        if (grid.dirty_rows[i]) {
+            grid.dirty_rows[i] = false;
+            ctx.buffer[i] = grid.rows[i];
+            ctx.buffer[i].resize(ctx.num_cols);
+            ctx.MarkDirty(i, i);
+        }
+    }
+    ctx.row = std::min(grid.row, ctx.num_rows - 1);
+    ctx.col = std::min(grid.col, ctx.num_cols);
+}
+
+// handle message of daemon, ready is set once all sessions are sent
+static void HandleDaemonMessage(int type, snapshot_reader &in, bool &ready) {
+    if (type == daemon_ready) {
+        ready = true;
+        return;
+    } else if (type == daemon_session) {
+        AddMirror(in, ready);
+        return;
+    }
+
+    int remote = in.Varint();
+    int id = -1;
+    int event = -1, code = 0;
+    std::string text;
+    pthread_rwlock_rdlock(&sessions_lock);
+    terminal_context *ctx = FindMirror(remote);
+    if (ctx) {
+        id = ctx->id;
+        pthread_mutex_lock(&ctx->lock);
+        if (type == daemon_history) {
+            ScrollMirror(*ctx, in);
+        } else if (type == daemon_modes) {
+            if (!ctx->DecodeModes(in)) {
+                LOG_WARN("Invalid modes of daemon session %d", remote);
             }
-        } else if (utf8_state == state_4byte_2_f4) {
-            // expecting the second byte of 4-byte utf-8 starting with 0xf4
-            if (input >= 0x80 && input <= 0x8f) {
-                current_utf8 |= (uint32_t)(input & 0x3f) << 12;
-                utf8_state = state_4byte_3;
-            } else {
-                utf8_state = state_initial;
+        } else if (type == daemon_rows) {
+            UpdateMirrorRows(*ctx, in);
+        } else if (type == daemon_event) {
+            event = in.Varint();
+            code = in.Varint();
+            text = in.String();
+            if (event == daemon_event_exit) {
+                ctx->exit_status = code;
             }
-        } else if (utf8_state == state_4byte_3) {
-            // expecting the third byte of 4-byte utf-8
-            if (input >= 0x80 && input <= 0xbf) {
-                current_utf8 |= (uint32_t)(input & 0x3f) << 6;
-                utf8_state = state_4byte_4;
-            } else {
-                utf8_state = state_initial;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+
+    if (ctx && type == daemon_closed) {
+        // same as closing it in ui, except daemon is not told
+        pthread_rwlock_wrlock(&sessions_lock);
+        ctx = FindMirror(remote);
+        if (ctx) {
+            ctx->remote_session = -1;
+        }
+        pthread_rwlock_unlock(&sessions_lock);
+        CloseSession(id);
+        SessionChanged(id, false);
+    }
+    // notifications are delivered without locks, like those of io thread
+    if (event == daemon_event_bell) {
+        Bell(id);
+    } else if (event == daemon_event_title) {
+        SetTitle(id, text);
+    } else if (event == daemon_event_exit) {
+        ProgramExited(id, code);
+    } else if (event == daemon_event_trigger) {
+        TriggerMatched(id, code, text);
+    } else if (event == daemon_event_copy) {
+        Copy(text);
+    }
+}
+
+// read from daemon and handle complete messages, false if it is gone
+static bool ReceiveDaemon(bool &ready) {
+    char buffer[65536];
+    ssize_t res = read(daemon_fd, buffer, sizeof(buffer));
+    if (res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR)) {
+        return false;
+    }
+    daemon_received.append(buffer, std::max<ssize_t>(res, 0));
+    size_t offset = 0;
+    int type;
+    snapshot_reader payload;
+    while (TakeMessage(daemon_received, offset, type, payload)) {
+        HandleDaemonMessage(type, payload, ready);
+    }
+    daemon_received.erase(0, offset);
+    return true;
+}
+
+// append requests and input of mirrored sessions,
+// return true if some input is left for later
+static bool GatherDaemonInput(std::string &out) {
+    pthread_mutex_lock(&daemon_lock);
+    out += daemon_outgoing;
+    daemon_outgoing.clear();
+    pthread_mutex_unlock(&daemon_lock);
+
+    bool more = false;
+    pthread_rwlock_rdlock(&sessions_lock);
+    for (auto &pair : sessions) {
+        terminal_context *ctx = pair.second;
+        if (ctx->remote_session < 0) {
+            continue;
+        }
+        // replies, keys, then a chunk of paste like writes to pty
+        struct iovec iov[5];
+        size_t reply_bytes, input_bytes;
+        int iovcnt = ctx->GatherWrites(iov, reply_bytes, input_bytes);
+        std::string payload;
+        PutVarint(payload, ctx->remote_session);
+        size_t size = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            payload.append((const char *)iov[i].iov_base, iov[i].iov_len);
+            size += iov[i].iov_len;
+        }
+        if (size > 0) {
+            PutMessage(out, daemon_input, payload);
+            ctx->ReleaseWritten(iov, iovcnt, reply_bytes, input_bytes, size);
+            more = more || ctx->HasPendingWrites();
+        }
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return more;
+}
+
+static void *DaemonClient(void *) {
+    pthread_setname_np(pthread_self(), "daemon client");
+    std::string out;
+    bool ready = true;
+    while (true) {
+        bool more = out.size() < max_daemon_outgoing && GatherDaemonInput(out);
+        struct pollfd fds[2] = {{daemon_fd, (short)(POLLIN | (out.empty() ? 0 : POLLOUT)), 0},
+                                {daemon_wake_fd, POLLIN, 0}};
+        if (poll(fds, 2, more && out.size() < max_daemon_outgoing ? 0 : -1) < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t value;
+            read(daemon_wake_fd, &value, sizeof(value));
+        }
+        if (fds[0].revents & POLLOUT) {
+            ssize_t res = send(daemon_fd, out.data(), out.size(), MSG_NOSIGNAL);
+            if (res > 0) {
+                out.erase(0, res);
             }
-        } else if (utf8_state == state_4byte_4) {
-            // expecting the third byte of 4-byte utf-8
-            if (input >= 0x80 && input <= 0xbf) {
-                current_utf8 |= (input & 0x3f);
-                InsertUtf8(current_utf8);
+        }
+        if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) && !ReceiveDaemon(ready)) {
+            break;
+        }
+    }
+    // sessions stay on screen, their programs are unreachable
+    LOG_ERROR("Lost connection to daemon at %s", daemon_socket.c_str());
+    pthread_rwlock_wrlock(&sessions_lock);
+    for (auto &pair : sessions) {
+        pair.second->remote_session = -1;
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return nullptr;
+}
+
+static int ConnectDaemon() {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (daemon_socket.size() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, daemon_socket.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// attach to daemon, forking it if none is running, and receive
+// all sessions so that the first frame shows them
+static bool AttachDaemon() {
+    int fd = ConnectDaemon();
+    if (fd == -1) {
+        // threads and window of ui may already exist, so the forked children
+        // only exec a fresh daemon, see main. the grandchild is not waited for
+        // and keeps running when ui is gone
+        const char *argv[] = {"termony", "--daemon", daemon_socket.c_str(), nullptr};
+        pid_t pid = fork();
+        if (pid == 0) {
+            setsid();
+            if (fork() == 0) {
+                execv("/proc/self/exe", (char *const *)argv);
+            }
+            _exit(0);
+        } else if (pid > 0) {
+            waitpid(pid, nullptr, 0);
+            for (int i = 0; i < 100 && fd == -1; i++) {
+                usleep(10000);
+                fd = ConnectDaemon();
             }
-            utf8_state = state_initial;
-        } else {
-            assert(false && "unreachable utf8 state");
         }
-    } else {
-        assert(false && "unreachable escape state");
     }
+    if (fd == -1) {
+        return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    daemon_fd = fd;
+    daemon_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    bool ready = false;
+    uint64_t deadline = CurrentMsec() + 1000;
+    while (!ready && CurrentMsec() < deadline) {
+        struct pollfd pfd = {daemon_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) > 0 && !ReceiveDaemon(ready)) {
+            break;
+        }
+    }
+    LOG_INFO("Attached to daemon at %s", daemon_socket.c_str());
+    pthread_t client_thread;
+    pthread_create(&client_thread, NULL, DaemonClient, NULL);
+    return true;
 }
 
-void terminal_context::Worker() {
-    pthread_setname_np(pthread_self(), "terminal worker");
+// viewer of screen and what it has of it, see ServeGridViewers
+struct grid_viewer {
+    int fd = -1;
+    grid_encoder grid;
+    std::string out;
+};
 
-    int temp = 0;
-    // poll from fd, and render
-    struct timeval tv;
-    while (1) {
-        struct pollfd fds[1];
-        fds[0].fd = fd;
-        fds[0].events = POLLIN;
-        int res = poll(fds, 1, 100);
-
-        uint8_t buffer[1024];
-        if (res > 0) {
-            ssize_t r = read(fd, buffer, sizeof(buffer) - 1);
-            if (r > 0) {
-                // pretty print
-                std::string hex;
-                for (int i = 0; i < r; i++) {
-                    if (buffer[i] >= 127 || buffer[i] < 32) {
-                        char temp[8];
-                        snprintf(temp, sizeof(temp), "\\x%02x", buffer[i]);
-                        hex += temp;
-                    } else {
-                        hex += (char)buffer[i];
-                    }
+static void *GridViewers(void *arg) {
+    pthread_setname_np(pthread_self(), "grid viewers");
+    int listen_fd = (int)(intptr_t)arg;
+    std::vector<grid_viewer> viewers;
+    std::vector<struct pollfd> fds;
+    std::string frame;
+    while (true) {
+        // a viewer gets next frame once it took the last one,
+        // so a slow one gets fewer frames with more in each
+        pthread_rwlock_rdlock(&sessions_lock);
+        terminal_context *ctx = active_term;
+        if (ctx) {
+            pthread_mutex_lock(&ctx->lock);
+            for (auto &viewer : viewers) {
+                frame.clear();
+                if (viewer.out.empty() && viewer.grid.Encode(*ctx, frame)) {
+                    PutVarint(viewer.out, frame.size());
+                    viewer.out += frame;
                 }
-                LOG_INFO("Got: %s", hex.c_str());
+            }
+            pthread_mutex_unlock(&ctx->lock);
+        }
+        pthread_rwlock_unlock(&sessions_lock);
 
-                // parse output
-                pthread_mutex_lock(&lock);
-                for (int i = 0; i < r; i++) {
-                    Parse(buffer[i]);
-                }
-                pthread_mutex_unlock(&lock);
-            } else if (r < 0 && errno == EIO) {
-                // handle child exit
-                LOG_INFO("Program exited: %ld %d", r, errno);
-                // relaunch
-                pthread_mutex_lock(&lock);
-                close(fd);
-                fd = -1;
-
-                // print message in a separate line
-                if (col > 0) {
-                    row += 1;
-                    DropFirstRowIfOverflow();
-                    col = 0;
+        fds.assign(1, {listen_fd, POLLIN, 0});
+        for (auto &viewer : viewers) {
+            fds.push_back({viewer.fd, (short)(POLLIN | (viewer.out.empty() ? 0 : POLLOUT)), 0});
+        }
+        if (poll(fds.data(), fds.size(), daemon_update_msec) < 0 && errno != EINTR) {
+            LOG_ERROR("Failed to poll viewers: %s", strerror(errno));
+            break;
+        }
+        for (size_t i = viewers.size(); i-- > 0;) {
+            grid_viewer &viewer = viewers[i];
+            short revents = fds[i + 1].revents;
+            bool gone = revents & POLLERR;
+            if (revents & POLLOUT) {
+                ssize_t res = send(viewer.fd, viewer.out.data(), viewer.out.size(), MSG_NOSIGNAL);
+                if (res > 0) {
+                    viewer.out.erase(0, res);
                 }
+                gone = gone || (res < 0 && errno != EAGAIN && errno != EINTR);
+            }
+            if (revents & (POLLIN | POLLHUP)) {
+                // viewers only read, anything sent is ignored
+                char buffer[256];
+                ssize_t res = read(viewer.fd, buffer, sizeof(buffer));
+                gone = gone || res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR);
+            }
+            if (gone) {
+                LOG_INFO("Viewer left: fd %d", viewer.fd);
+                close(viewer.fd);
+                viewers.erase(viewers.begin() + i);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd != -1) {
+                LOG_INFO("Viewer attached: fd %d", fd);
+                viewers.emplace_back();
+                viewers.back().fd = fd;
+            }
+        }
+    }
+    return nullptr;
+}
 
-                std::string message = "[program exited, restarting]";
-                for (char ch : message) {
-                    InsertUtf8(ch);
-                }
+void ServeGridViewers(const std::string &path) {
+    int listen_fd = ListenUnix(path);
+    if (listen_fd == -1) {
+        return;
+    }
+    LOG_INFO("Serving viewers at %s", path.c_str());
+    pthread_t viewers_thread;
+    pthread_create(&viewers_thread, NULL, GridViewers, (void *)(intptr_t)listen_fd);
+}
 
-                row += 1;
-                DropFirstRowIfOverflow();
-                col = 0;
+static std::string SnapshotPath(int index) {
+    return snapshot_dir + "/session-" + std::to_string(index);
+}
 
-                Fork();
-                pthread_mutex_unlock(&lock);
-                break;
-            }
+static bool ReadSnapshotFile(const std::string &path, std::string &data) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st = {};
+    fstat(fd, &st);
+    data.resize(st.st_size);
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t res = read(fd, &data[offset], data.size() - offset);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        } else if (res <= 0) {
+            break;
         }
+        offset += res;
+    }
+    data.resize(offset);
+    close(fd);
+    return true;
+}
 
-        // check if anything to paste
-        std::string paste = GetPaste();
-        if (paste.size() > 0) {
-            // send OSC 52 ; c ; BASE64 ST
-            LOG_INFO("Paste from pasteboard: %s",
-                        paste.c_str());
-            std::string resp = "\x1b]52;c;" + paste + "\x1b\\";
-            WriteFull((uint8_t *)resp.c_str(), resp.size());
+static bool WriteSnapshotFile(const std::string &path, const std::string &data, int flags) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0600);
+    if (fd == -1) {
+        return false;
+    }
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t res = write(fd, data.data() + offset, data.size() - offset);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        } else if (res <= 0) {
+            break;
         }
+        offset += res;
     }
-    return;
+    return close(fd) == 0 && offset == data.size();
 }
 
-// fork & create pty
-// assume lock is held
-void terminal_context::Fork() {
-    struct winsize ws = {};
-    ws.ws_col = num_cols;
-    ws.ws_row = num_rows;
+void Start() {
+    // sessions outlive ui when they run in daemon
+    if (!daemon_socket.empty() && !daemon_server) {
+        if (daemon_fd != -1 || AttachDaemon()) {
+            return;
+        }
+        LOG_WARN("Daemon at %s is not available, sessions run in ui", daemon_socket.c_str());
+    }
+
+    pthread_rwlock_wrlock(&sessions_lock);
+    if (loop_wake_fd != -1) {
+        pthread_rwlock_unlock(&sessions_lock);
+        return;
+    }
 
-    int pid = forkpty(&fd, nullptr, nullptr, &ws);
-    if (!pid) {
+    // start io thread, it serves all sessions
+    loop_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(loop_wake_fd != -1);
+
+    // prefer io_uring when kernel supports it
+    bool try_uring = true;
 #ifdef STANDALONE
-        execl("/bin/bash", "/bin/bash", nullptr);
-#else
-        // override HOME to /storage/Users/currentUser since it is writable
-        const char *home = "/storage/Users/currentUser";
-        setenv("PATH",
-            "/data/app/bin:/data/service/hnp/bin:/bin:"
-            "/usr/local/bin:/usr/bin:/system/bin:/vendor/bin", 1);
-        setenv("HOME", home, 1);
-        setenv("PWD", home, 1);
-        // set LD_LIRBARY_PATH for shared libraries
-        setenv("LD_LIBRARY_PATH", "/data/app/base.org/base_1.0/lib", 1);
-        // override TMPDIR for tmux
-        setenv("TMUX_TMPDIR", "/data/storage/el2/base/cache", 1);
-        chdir(home);
-        //execl("/data/app/bin/bash", "/data/app/bin/bash", nullptr);
-        execl("/bin/sh", "/bin/sh", nullptr);
+    // TERMONY_IO_ENGINE=epoll or uring, for comparison
+    const char *engine_name = getenv("TERMONY_IO_ENGINE");
+    if (engine_name && strcmp(engine_name, "epoll") == 0) {
+        try_uring = false;
+    }
 #endif
+    if (try_uring && io_ring.Setup()) {
+        io_engine = io_engine_uring;
+        io_ring.Poll(loop_wake_fd, POLLIN, LoopEvent(loop_event_wake, 0), true);
+    } else {
+        io_engine = io_engine_epoll;
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        assert(epoll_fd != -1);
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = LoopEvent(loop_event_wake, 0);
+        int res = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, loop_wake_fd, &ev);
+        assert(res == 0);
+    }
+    LOG_INFO("Using %s for pty io", io_engine == io_engine_uring ? "io_uring" : "epoll");
+
+    pthread_t io_thread;
+    pthread_create(&io_thread, NULL, io_engine == io_engine_uring ? UringLoop : EventLoop, NULL);
+    pthread_rwlock_unlock(&sessions_lock);
+
+    // sessions saved when app went to background come back with their
+    // screens, before the first frame is drawn
+    int restored = 0;
+    while (!snapshot_dir.empty() && restored < max_snapshot_sessions &&
+           access(SnapshotPath(restored).c_str(), R_OK) == 0) {
+        int id = CreateSession(SnapshotPath(restored));
+        // history is appended to the file it came from
+        pthread_rwlock_rdlock(&sessions_lock);
+        auto it = sessions.find(id);
+        if (it != sessions.end()) {
+            pthread_mutex_lock(&it->second->lock);
+            it->second->snapshot_index = restored;
+            pthread_mutex_unlock(&it->second->lock);
+        }
+        pthread_rwlock_unlock(&sessions_lock);
+        restored++;
     }
+    if (restored == 0) {
+        CreateSession();
+    }
+}
 
-    // set as non blocking
-    int res = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
-    assert(res == 0);
+// create a new session, return its id
+int CreateSession(const std::string &snapshot) {
+    terminal_context *ctx = new terminal_context;
+    std::string state, history_data;
+    if (!snapshot.empty() && ReadSnapshotFile(snapshot, state)) {
+        ReadSnapshotFile(snapshot + ".history", history_data);
+        if (!ctx->DecodeSnapshot(state, history_data)) {
+            LOG_WARN("Ignored invalid snapshot %s", snapshot.c_str());
+            delete ctx;
+            ctx = new terminal_context;
+        } else {
+            // a new program is started, its output begins on a new line
+            ctx->escape_state = state_idle;
+            ctx->escape_buffer.clear();
+            ctx->utf8_state = state_initial;
+            if (ctx->col > 0) {
+                ctx->row++;
+                ctx->DropFirstRowIfOverflow();
+                ctx->col = 0;
+            }
+        }
+    }
+    ctx->wake_fd = loop_wake_fd;
+
+    pthread_rwlock_wrlock(&sessions_lock);
+    ctx->id = next_session_id++;
+    // setup terminal, default to 80x24
+    if (vw100 >= font_width && vh100 >= font_height) {
+        ctx->ResizeTo(vh100 / font_height, vw100 / font_width);
+    } else if (ctx->num_rows == 0) {
+        ctx->ResizeTo(24, 80);
+    }
+    pthread_mutex_lock(&ctx->lock);
+    if (daemon_fd != -1) {
+        // daemon creates it, input waits until it is mirrored
+        ctx->remote_session = -2;
+        ctx->wake_fd = daemon_wake_fd;
+        int tag = next_daemon_tag++;
+        pending_creates[tag] = ctx->id;
+        std::string payload;
+        PutVarint(payload, tag);
+        QueueDaemonRequest(daemon_create, payload);
+    } else {
+        ctx->UseTriggers(triggers);
+        ctx->Spawn();
+    }
+    pthread_mutex_unlock(&ctx->lock);
 
-    // start terminal worker in another thread
-    pthread_t terminal_thread;
-    pthread_create(&terminal_thread, NULL, TerminalWorker, this);
+    sessions[ctx->id] = ctx;
+    if (!active_term) {
+        active_term = ctx;
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    LOG_INFO("Created session %d", ctx->id);
+    return ctx->id;
 }
 
-static terminal_context term;
+void SetSnapshotDir(const std::string &dir) {
+    snapshot_dir = dir;
+}
 
-// https://learnopengl.com/In-Practice/Text-Rendering
-struct ivec2 {
-    int x;
-    int y;
+bool SaveSessionSnapshot(terminal_context *ctx, int index) {
+    std::string state, history_data;
+    bool rewrite = false;
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->snapshot_index != index) {
+        // history file is of another session, e.g. after switching
+        ctx->snapshot_index = index;
+        ctx->snapshot_stale = true;
+    }
+    ctx->EncodeSnapshot(state, history_data, rewrite);
+    pthread_mutex_unlock(&ctx->lock);
+
+    // state refers to history written before it
+    std::string path = SnapshotPath(index);
+    if (!WriteSnapshotFile(path + ".history", history_data, rewrite ? O_TRUNC : O_APPEND) ||
+        !WriteSnapshotFile(path + ".tmp", state, O_TRUNC) || rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+        LOG_WARN("Failed to save snapshot %s: %s", path.c_str(), strerror(errno));
+        pthread_mutex_lock(&ctx->lock);
+        ctx->snapshot_stale = true;
+        pthread_mutex_unlock(&ctx->lock);
+        return false;
+    }
+    return true;
+}
 
-    ivec2(int x, int y) {
-        this->x = x;
-        this->y = y;
+bool SaveSnapshot() {
+    if (snapshot_dir.empty()) {
+        return false;
     }
-    ivec2() { this->x = this->y = 0; }
-};
+    bool success = true;
+    pthread_rwlock_rdlock(&sessions_lock);
+    // session on screen is saved first, so it is shown after restore,
+    // tmux panes are recreated by tmux
+    std::vector<terminal_context *> saved;
+    if (active_term && active_term->tmux_parent == -1) {
+        saved.push_back(active_term);
+    }
+    for (auto &pair : sessions) {
+        if (pair.second != active_term && pair.second->tmux_parent == -1 &&
+            saved.size() < max_snapshot_sessions) {
+            saved.push_back(pair.second);
+        }
+    }
+    for (auto &pair : sessions) {
+        if (std::find(saved.begin(), saved.end(), pair.second) == saved.end()) {
+            // its file is taken by others
+            pthread_mutex_lock(&pair.second->lock);
+            pair.second->snapshot_index = -1;
+            pthread_mutex_unlock(&pair.second->lock);
+        }
+    }
+    for (size_t i = 0; i < saved.size(); i++) {
+        if (!SaveSessionSnapshot(saved[i], i)) {
+            success = false;
+        }
+    }
+    pthread_rwlock_unlock(&sessions_lock);
 
-// glyph info
-struct character {
-    // location within the large texture
-    float left;
-    float right;
-    float top;
-    float bottom;
-    // x, y offset from origin for bearing etc.
-    int xoff;
-    int yoff;
-    // glyph size
-    int width;
-    int height;
-};
+    // sessions closed since the last save
+    for (size_t i = saved.size(); unlink(SnapshotPath(i).c_str()) == 0; i++) {
+        unlink((SnapshotPath(i) + ".history").c_str());
+    }
+    return success;
+}
+
+// show session on screen
+bool SwitchSession(int id) {
+    pthread_rwlock_wrlock(&sessions_lock);
+    auto it = sessions.find(id);
+    bool found = it != sessions.end();
+    if (found) {
+        active_term = it->second;
+        // start from the bottom of new session
+        scroll_offset = 0.0;
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return found;
+}
+
+// close session and kill its program
+bool CloseSession(int id) {
+    pthread_rwlock_wrlock(&sessions_lock);
+    auto it = sessions.find(id);
+    if (it == sessions.end()) {
+        pthread_rwlock_unlock(&sessions_lock);
+        return false;
+    }
+    // io thread and render thread hold sessions_lock while using it,
+    // so it is safe to free now
+    terminal_context *ctx = it->second;
+    if (ctx->tmux_parent != -1) {
+        // tmux closes the pane, then io thread frees the session
+        auto parent = sessions.find(ctx->tmux_parent);
+        if (parent != sessions.end()) {
+            pthread_mutex_lock(&parent->second->lock);
+            parent->second->SendTmuxCommand(tmux_command_ignore, -1, "kill-pane -t %" + std::to_string(ctx->tmux_pane));
+            pthread_mutex_unlock(&parent->second->lock);
+        }
+        pthread_rwlock_unlock(&sessions_lock);
+        return true;
+    }
+    if (ctx->remote_session >= 0) {
+        // mirror goes now, daemon closes the session
+        std::string payload;
+        PutVarint(payload, ctx->remote_session);
+        QueueDaemonRequest(daemon_close, payload);
+    }
+    // panes of tmux go with it
+    for (auto pane = sessions.begin(); pane != sessions.end();) {
+        if (pane->second->tmux_parent == id) {
+            if (active_term == pane->second) {
+                active_term = ctx;
+            }
+            if (!daemon_server) {
+                SessionChanged(pane->first, false);
+            }
+            delete pane->second;
+            pane = sessions.erase(pane);
+        } else {
+            pane++;
+        }
+    }
+    sessions.erase(it);
+    if (active_term == ctx) {
+        active_term = sessions.empty() ? nullptr : sessions.begin()->second;
+        scroll_offset = 0.0;
+    }
+
+    // io_uring requests use the ring buffers of ctx,
+    // they must be gone before it is freed
+    if (io_engine == io_engine_uring && ctx->fd != -1) {
+        io_ring.Cancel(ctx->fd);
+    }
+    if (ctx->fd != -1) {
+        close(ctx->fd);
+    }
+    if (ctx->pid > 0) {
+        kill(ctx->pid, SIGHUP);
+    }
+    if (ctx->pid_fd != -1) {
+        // io thread reaps it after it exits
+        if (io_engine == io_engine_uring) {
+            io_ring.Cancel(ctx->pid_fd);
+        } else {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ctx->pid_fd, NULL);
+        }
+        new_orphans.push_back({ctx->pid, ctx->pid_fd});
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    WakeEventLoop();
+    MarkDaemonDirty();
+    LOG_INFO("Closed session %d", id);
+    delete ctx;
+    return true;
+}
+
+// exit status of last program in session, -1 if none exited yet
+int GetExitStatus(int id) {
+    int status = -1;
+    pthread_rwlock_rdlock(&sessions_lock);
+    auto it = sessions.find(id);
+    if (it != sessions.end()) {
+        status = it->second->exit_status;
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return status;
+}
+
+size_t SendData(const uint8_t *data, size_t length, int session) {
+    size_t accepted = 0;
+    pthread_rwlock_rdlock(&sessions_lock);
+    terminal_context *ctx = active_term;
+    if (session != -1) {
+        auto it = sessions.find(session);
+        ctx = it == sessions.end() ? nullptr : it->second;
+    }
+    if (ctx && ctx->tmux_parent != -1) {
+        if (ctx == active_term) {
+            // reset scroll offset to bottom
+            scroll_offset = 0.0;
+        }
+
+        // tmux pane, input goes to its control mode client,
+        // only predict what it took
+        accepted = SendToTmuxPane(ctx, data, length);
+        pthread_mutex_lock(&ctx->lock);
+        ctx->PredictInput(data, accepted);
+        pthread_mutex_unlock(&ctx->lock);
+    } else if (ctx && (ctx->fd != -1 || ctx->remote_session != -1)) {
+        if (ctx == active_term) {
+            // reset scroll offset to bottom
+            scroll_offset = 0.0;
+        }
+
+        // never block the caller, io thread does the actual write
+        // predict before echo can be parsed
+        pthread_mutex_lock(&ctx->lock);
+        accepted = ctx->input.Push(data, length);
+        ctx->PredictInput(data, accepted);
+        pthread_mutex_unlock(&ctx->lock);
+        if (accepted > 0) {
+            ctx->WakeWriter();
+        }
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return accepted;
+}
 
-// record info for each character
-// map from (codepoint, font weight) to character
-static std::map<std::pair<uint32_t, enum font_weight>, struct character> characters;
-// code points to load from the font
-static std::set<uint32_t> codepoints_to_load;
-// do we need to reload font due to missing glyphs?
-static bool need_rebuild_atlas = false;
-// id of texture for glyphs
-static GLuint atlas_texture_id;
-// there is a limit on how big a texture can be
-static int atlas_width = 8192;
+size_t SendKey(int key, int modifiers, const std::string &text, int session) {
+    size_t accepted = 0;
+    pthread_rwlock_rdlock(&sessions_lock);
+    terminal_context *ctx = active_term;
+    if (session != -1) {
+        auto it = sessions.find(session);
+        ctx = it == sessions.end() ? nullptr : it->second;
+    }
+    if (ctx && ctx->tmux_parent != -1) {
+        if (ctx == active_term) {
+            // reset scroll offset to bottom
+            scroll_offset = 0.0;
+        }
 
-static void ResizeTo(int new_term_row, int new_term_col, bool update_viewport = true) {
-    // update viewport
-    if (update_viewport) {
-        vw100 = new_term_col * font_width;
-        vh100 = new_term_row * font_height;
+        // tmux pane, keys are encoded by its keyboard modes
+        pthread_mutex_lock(&ctx->lock);
+        std::string data = ctx->EncodeKey(key, modifiers, text);
+        pthread_mutex_unlock(&ctx->lock);
+        accepted = SendToTmuxPane(ctx, (const uint8_t *)data.data(), data.size());
+        pthread_mutex_lock(&ctx->lock);
+        ctx->PredictInput((const uint8_t *)data.data(), accepted);
+        pthread_mutex_unlock(&ctx->lock);
+    } else if (ctx && (ctx->fd != -1 || ctx->remote_session != -1)) {
+        if (ctx == active_term) {
+            // reset scroll offset to bottom
+            scroll_offset = 0.0;
+        }
+
+        // keyboard modes are changed by io thread,
+        // and predict before echo can be parsed
+        pthread_mutex_lock(&ctx->lock);
+        std::string data = ctx->EncodeKey(key, modifiers, text);
+        // a key is never sent partially
+        if (!data.empty() && ctx->input.PushAll((const uint8_t *)data.data(), data.size())) {
+            accepted = data.size();
+            ctx->PredictInput((const uint8_t *)data.data(), data.size());
+        }
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (accepted > 0) {
+            ctx->WakeWriter();
+        }
     }
+    pthread_rwlock_unlock(&sessions_lock);
+    return accepted;
+}
 
-    term.ResizeTo(new_term_row, new_term_col);
+// queue mouse report in the same lock section that produced it, so reports
+// keep their order, and the ring has a single producer at a time
+// lock must be held, return false if nothing was queued
+static bool QueueMouseReport(terminal_context *ctx, const std::string &data) {
+    // a tmux pane takes it as send-keys from io thread, like a paste
+    return !data.empty() && ctx->input.PushAll((const uint8_t *)data.data(), data.size());
 }
 
-void Start() {
-    pthread_mutex_lock(&term.lock);
-    if (term.fd != -1) {
-        return;
+// wake the thread that writes input of session
+static void WakeMouseWriter(terminal_context *ctx) {
+    if (ctx->tmux_parent != -1) {
+        WakeEventLoop();
+    } else {
+        ctx->WakeWriter();
     }
+}
 
-    // setup terminal, default to 80x24
-    term.ResizeTo(24, 80);
+bool SendMouse(int action, int button, int modifiers, int x, int y, int session) {
+    bool tracking = false;
+    pthread_rwlock_rdlock(&sessions_lock);
+    terminal_context *ctx = active_term;
+    if (session != -1) {
+        auto it = sessions.find(session);
+        ctx = it == sessions.end() ? nullptr : it->second;
+    }
+    if (ctx && (ctx->fd != -1 || ctx->tmux_parent != -1 || ctx->remote_session != -1)) {
+        bool queued = false;
+        pthread_mutex_lock(&ctx->lock);
+        tracking = ctx->mouse_tracking != mouse_tracking_off;
+        if (tracking) {
+            int new_row = std::max(0, std::min(y / font_height, ctx->num_rows - 1));
+            int new_col = std::max(0, std::min(x / font_width, ctx->num_cols - 1));
+            queued = QueueMouseReport(ctx, ctx->MouseReport(action, button, modifiers, new_row, new_col, frame_count));
+        }
+        pthread_mutex_unlock(&ctx->lock);
 
-    term.Fork();
+        if (queued) {
+            WakeMouseWriter(ctx);
+        }
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return tracking;
+}
 
-    pthread_mutex_unlock(&term.lock);
+// send last motion of each session coalesced in the frame just drawn
+static void FlushMouseMotion() {
+    pthread_rwlock_rdlock(&sessions_lock);
+    for (auto &pair : sessions) {
+        terminal_context *ctx = pair.second;
+        pthread_mutex_lock(&ctx->lock);
+        bool queued = QueueMouseReport(ctx, ctx->FlushMouseMotion());
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (queued) {
+            WakeMouseWriter(ctx);
+        }
+    }
+    pthread_rwlock_unlock(&sessions_lock);
 }
 
-void SendData(uint8_t *data, size_t length) {
-    if (term.fd == -1) {
-        return;
+void Paste(const uint8_t *data, size_t length, int session) {
+    pthread_rwlock_rdlock(&sessions_lock);
+    terminal_context *ctx = active_term;
+    if (session != -1) {
+        auto it = sessions.find(session);
+        ctx = it == sessions.end() ? nullptr : it->second;
+    }
+    if (ctx) {
+        if (ctx == active_term) {
+            // reset scroll offset to bottom
+            scroll_offset = 0.0;
+        }
+
+        // io thread streams it in chunks as the program consumes it,
+        // to a tmux pane as send-keys as fast as its client takes them
+        ctx->QueuePaste(data, length);
+        if (ctx->tmux_parent != -1) {
+            WakeEventLoop();
+        } else {
+            ctx->WakeWriter();
+        }
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+}
+
+bool GetPasteProgress(int session, size_t &written, size_t &total) {
+    written = total = 0;
+    pthread_rwlock_rdlock(&sessions_lock);
+    terminal_context *ctx = active_term;
+    if (session != -1) {
+        auto it = sessions.find(session);
+        ctx = it == sessions.end() ? nullptr : it->second;
+    }
+    if (ctx) {
+        pthread_mutex_lock(&ctx->lock);
+        written = ctx->paste_written;
+        total = ctx->paste_total;
+        pthread_mutex_unlock(&ctx->lock);
     }
+    pthread_rwlock_unlock(&sessions_lock);
+    return written < total;
+}
+
+// glyph pixels, relative to pen position on baseline
+struct glyph_bitmap {
+    int left = 0;
+    int top = 0;
+    int width = 0;
+    int rows = 0;
+    std::vector<uint8_t> pixels;
+};
 
-    // reset scroll offset to bottom
-    scroll_offset = 0.0;
+// render glyph of cell code, a cluster is composed into one bitmap from
+// its base and combining marks, false if face lacks the base character
+static bool LoadGlyph(FT_Face face, uint32_t code, glyph_bitmap &glyph) {
+    std::u32string codepoints = ClusterCodepoints(code);
+    std::vector<glyph_bitmap> parts;
+    for (size_t i = 0; i < codepoints.size(); i++) {
+        char32_t c = codepoints[i];
+        if (c == 0x200d) {
+            // no shaping for ZWJ sequences, the first emoji stands for it
+            break;
+        } else if (i > 0 && (char_width(c) != 0 || (c >= 0xfe00 && c <= 0xfe0f))) {
+            // selectors are not drawn, nor spacing codepoints after the base
+            continue;
+        }
+        FT_ULong glyph_index = FT_Get_Char_Index(face, c);
+        // allow NUL to be loaded
+        if (i == 0 && c && !glyph_index) {
+            return false;
+        } else if (i > 0 && !glyph_index) {
+            continue;
+        }
+        FT_Load_Glyph(face, glyph_index, FT_LOAD_RENDER);
+        auto bits = face->glyph->bitmap;
+        glyph_bitmap part;
+        part.left = face->glyph->bitmap_left;
+        part.top = face->glyph->bitmap_top;
+        part.width = bits.width;
+        part.rows = bits.rows;
+        part.pixels.resize(part.width * part.rows);
+        for (int y = 0; y < part.rows; y++) {
+            memcpy(&part.pixels[y * part.width], bits.buffer + y * bits.pitch, part.width);
+        }
+        parts.push_back(std::move(part));
+    }
+    if (parts.size() == 1) {
+        glyph = std::move(parts[0]);
+        return true;
+    }
 
-    term.WriteFull(data, length);
+    // union of all parts, drawn over each other at the same pen position
+    int left = INT32_MAX, right = INT32_MIN, top = INT32_MIN, bottom = INT32_MAX;
+    for (auto &part : parts) {
+        left = std::min(left, part.left);
+        right = std::max(right, part.left + part.width);
+        top = std::max(top, part.top);
+        bottom = std::min(bottom, part.top - part.rows);
+    }
+    glyph.left = left;
+    glyph.top = top;
+    glyph.width = right - left;
+    glyph.rows = top - bottom;
+    glyph.pixels.assign(glyph.width * glyph.rows, 0);
+    for (auto &part : parts) {
+        for (int y = 0; y < part.rows; y++) {
+            for (int x = 0; x < part.width; x++) {
+                uint8_t &pixel = glyph.pixels[(top - part.top + y) * glyph.width + part.left - left + x];
+                pixel = std::max(pixel, part.pixels[y * part.width + x]);
+            }
+        }
+    }
+    return true;
 }
 
 // load font
@@ -1392,12 +7633,8 @@ static void BuildFontAtlas() {
             // already loaded
             if (newChars.count({charCode, fnt.opts.weight}))
                 continue;
-            FT_ULong glyphIndex = FT_Get_Char_Index(face, charCode);
-            // allow NUL to be loaded
-            if (!charCode || glyphIndex) {
-                FT_Load_Glyph(face, glyphIndex, FT_LOAD_RENDER);
-            }
-            else {
+            glyph_bitmap bits;
+            if (!LoadGlyph(face, charCode, bits)) {
                 if (&fnt == &fonts.back()) {
                     newChars[{charCode, font_weight::regular}] = newChars[{0, font_weight::regular}];
                 }
@@ -1407,13 +7644,8 @@ static void BuildFontAtlas() {
             LOG_INFO(
                         "Weight: %d Char: %d(0x%x) Glyph: %d %d Left: "
                         "%d "
-                        "Top: %d "
-                        "Advance: %ld",
-                        fnt.weight, charCode, charCode, face->glyph->bitmap.width, face->glyph->bitmap.rows, face->glyph->bitmap_left,
-                        face->glyph->bitmap_top, face->glyph->advance.x);
-
-            auto glyph = face->glyph;
-            auto bits = face->glyph->bitmap;
+                        "Top: %d",
+                        fnt.weight, charCode, charCode, bits.width, bits.rows, bits.left, bits.top);
 
             int row_start;
             // if current row can't fit new char, extend a row
@@ -1438,7 +7670,7 @@ static void BuildFontAtlas() {
                         atlas_width * (col_start + i)
                         + row_start + j
                     ] =
-                    bits.buffer[bits.width * i + j];
+                    bits.pixels[bits.width * i + j];
                 }
             }
 
@@ -1449,8 +7681,8 @@ static void BuildFontAtlas() {
                 .right = float(row_start + bits.width - 1),
                 .top = float(col_start),
                 .bottom = float(col_start + bits.rows - 1),
-                .xoff = glyph->bitmap_left,
-                .yoff = int(baseline_height + glyph->bitmap_top - bits.rows),
+                .xoff = bits.left,
+                .yoff = int(baseline_height + bits.top - bits.rows),
                 .width = int(bits.width),
                 .height = int(bits.rows),
             };
@@ -1504,6 +7736,357 @@ static GLuint vertex_buffer;
 static GLuint text_color_buffer;
 // vec3 backGroundColor
 static GLuint background_color_buffer;
+static GLint text_color_location = -1;
+static GLint background_color_location = -1;
+static GLint max_texture_size = 0;
+
+// textures of images keyed by serial, only used by render thread
+struct image_texture {
+    GLuint id;
+    size_t bytes;
+    // last frame it is drawn in
+    uint64_t frame;
+};
+static std::map<uint64_t, image_texture> image_textures;
+static size_t image_texture_bytes = 0;
+// least recently drawn textures are freed beyond it
+static const size_t max_image_texture_bytes = 128 * 1024 * 1024;
+
+// texture of image, uploaded on first use, 0 if too large
+static GLuint ImageTexture(const graphics_image &image) {
+    auto it = image_textures.find(image.serial);
+    if (it != image_textures.end()) {
+        it->second.frame = frame_count;
+        return it->second.id;
+    }
+    if (image.width > max_texture_size || image.height > max_texture_size) {
+        return 0;
+    }
+    GLuint id;
+    glGenTextures(1, &id);
+    glBindTexture(GL_TEXTURE_2D, id);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                 image.pixels.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    image_textures[image.serial] = {id, image.pixels.size(), frame_count};
+    image_texture_bytes += image.pixels.size();
+    return id;
+}
+
+// free least recently drawn textures beyond max_image_texture_bytes,
+// those drawn in current frame are kept
+static void EvictImageTextures() {
+    if (image_texture_bytes <= max_image_texture_bytes) {
+        return;
+    }
+    std::vector<std::pair<uint64_t, uint64_t>> order;
+    for (auto &pair : image_textures) {
+        order.push_back({pair.second.frame, pair.first});
+    }
+    std::sort(order.begin(), order.end());
+    for (auto &pair : order) {
+        if (image_texture_bytes <= max_image_texture_bytes || pair.first == frame_count) {
+            break;
+        }
+        image_texture &texture = image_textures[pair.second];
+        glDeleteTextures(1, &texture.id);
+        image_texture_bytes -= texture.bytes;
+        image_textures.erase(pair.second);
+    }
+}
+
+// draw image quads, one texture per 6 vertices
+static void DrawImages(const std::vector<GLfloat> &vertices, const std::vector<GLuint> &textures) {
+    if (textures.empty()) {
+        return;
+    }
+    // colors are not used by images
+    glDisableVertexAttribArray(text_color_location);
+    glDisableVertexAttribArray(background_color_location);
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * vertices.size(), vertices.data(), GL_STREAM_DRAW);
+    glUniform1i(render_pass_location, 2);
+    for (size_t i = 0; i < textures.size(); i++) {
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        glDrawArrays(GL_TRIANGLES, i * 6, 6);
+    }
+    glEnableVertexAttribArray(text_color_location);
+    glEnableVertexAttribArray(background_color_location);
+    glBindTexture(GL_TEXTURE_2D, atlas_texture_id);
+}
+
+// pointer position in pixels, see SetHover
+static std::atomic<int> hover_x(-1);
+static std::atomic<int> hover_y(-1);
+
+// line shown at i-th row of screen, null if none
+static const std::vector<term_char> *ScreenLine(const terminal_context &term, int i, int scroll_rows) {
+    int i_row = i - scroll_rows;
+    if (i_row >= 0 && i_row < term.num_rows) {
+        return &term.buffer[i_row];
+    } else if (i_row < 0 && (int)term.history.size() + i_row >= 0) {
+        return &term.history[term.history.size() + i_row];
+    }
+    return nullptr;
+}
+
+void SetHover(int x, int y) {
+    hover_x = x;
+    hover_y = y;
+}
+
+std::string GetLinkAt(int x, int y, int session) {
+    std::string uri;
+    pthread_rwlock_rdlock(&sessions_lock);
+    terminal_context *ctx = active_term;
+    if (session != -1) {
+        auto it = sessions.find(session);
+        ctx = it == sessions.end() ? nullptr : it->second;
+    }
+    if (ctx && x >= 0 && y >= 0) {
+        pthread_mutex_lock(&ctx->lock);
+        // only the session on screen is scrolled
+        int scroll_rows = ctx == active_term ? scroll_offset / font_height : 0;
+        const std::vector<term_char> *line = ScreenLine(*ctx, y / font_height, scroll_rows);
+        if (line && x / font_width < (int)line->size()) {
+            uri = ctx->links.Uri((*line)[x / font_width].style.link);
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return uri;
+}
+
+std::string GetMatchAt(int x, int y, int session) {
+    std::string text;
+    pthread_rwlock_rdlock(&sessions_lock);
+    terminal_context *ctx = active_term;
+    if (session != -1) {
+        auto it = sessions.find(session);
+        ctx = it == sessions.end() ? nullptr : it->second;
+    }
+    if (ctx && x >= 0 && y >= 0) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->ScanMatches();
+        // only the session on screen is scrolled
+        int scroll_rows = ctx == active_term ? scroll_offset / font_height : 0;
+        int64_t line = (int64_t)ctx->scrolled_lines + y / font_height - scroll_rows;
+        auto it = line >= 0 ? ctx->matches.find(line) : ctx->matches.end();
+        if (it != ctx->matches.end()) {
+            for (const text_match &m : it->second) {
+                if (x / font_width >= m.start_col && x / font_width < m.end_col) {
+                    text = m.text;
+                }
+            }
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return text;
+}
+
+bool SetTriggers(std::vector<trigger_pattern> patterns, std::string &error) {
+    // output is parsed by daemon, it compiles them again
+    std::string payload;
+    PutVarint(payload, patterns.size());
+    for (auto &pattern : patterns) {
+        PutString(payload, pattern.text);
+        PutVarint(payload, pattern.notify | (pattern.highlight << 1));
+        PutVarint(payload, pattern.color.value);
+    }
+
+    std::shared_ptr<trigger_automaton> automaton;
+    if (!patterns.empty()) {
+        automaton = std::make_shared<trigger_automaton>();
+        if (!automaton->Compile(std::move(patterns), error)) {
+            return false;
+        }
+    }
+
+    pthread_rwlock_wrlock(&sessions_lock);
+    triggers = automaton;
+    for (auto &pair : sessions) {
+        pthread_mutex_lock(&pair.second->lock);
+        pair.second->UseTriggers(triggers);
+        pthread_mutex_unlock(&pair.second->lock);
+    }
+    if (daemon_fd != -1) {
+        QueueDaemonRequest(daemon_triggers, payload);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return true;
+}
+
+bool ScrollToPrompt(int64_t n) {
+    bool found = false;
+    pthread_rwlock_wrlock(&sessions_lock);
+    if (active_term) {
+        pthread_mutex_lock(&active_term->lock);
+        const command_mark *command = active_term->Command(n);
+        if (command) {
+            // prompt on screen needs no scrolling
+            int64_t rows = (int64_t)active_term->scrolled_lines - command->line[mark_prompt];
+            scroll_offset = std::max<int64_t>(rows, 0) * font_height;
+            found = true;
+        }
+        pthread_mutex_unlock(&active_term->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return found;
+}
+
+bool JumpToPrompt(int delta) {
+    int64_t n = -1;
+    pthread_rwlock_rdlock(&sessions_lock);
+    if (active_term && delta != 0) {
+        terminal_context *ctx = active_term;
+        pthread_mutex_lock(&ctx->lock);
+        // commands are ordered by prompt line, find those around the top of screen
+        int64_t top = (int64_t)ctx->scrolled_lines - (int64_t)(scroll_offset / font_height);
+        auto it = std::partition_point(ctx->commands.begin(), ctx->commands.end(), [&](const command_mark &c) {
+            return (int64_t)c.line[mark_prompt] < top + (delta > 0);
+        });
+        n = (it - ctx->commands.begin()) + (delta > 0 ? delta - 1 : delta) + ctx->commands_evicted;
+        if (n < (int64_t)ctx->commands_evicted) {
+            n = -1;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return n >= 0 && ScrollToPrompt(n);
+}
+
+bool CopyCommandOutput(int64_t n, int session) {
+    bool found = false;
+    std::string output;
+    pthread_rwlock_rdlock(&sessions_lock);
+    terminal_context *ctx = active_term;
+    if (session != -1) {
+        auto it = sessions.find(session);
+        ctx = it == sessions.end() ? nullptr : it->second;
+    }
+    if (ctx) {
+        pthread_mutex_lock(&ctx->lock);
+        const command_mark *command = ctx->Command(n);
+        if (command && command->stage >= mark_output) {
+            output = ctx->CommandOutput(*command);
+            found = true;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    if (found) {
+        Copy(output);
+    }
+    return found;
+}
+
+bool GetCommand(int64_t n, command_mark &command, int64_t &index, int session) {
+    bool found = false;
+    pthread_rwlock_rdlock(&sessions_lock);
+    terminal_context *ctx = active_term;
+    if (session != -1) {
+        auto it = sessions.find(session);
+        ctx = it == sessions.end() ? nullptr : it->second;
+    }
+    if (ctx) {
+        pthread_mutex_lock(&ctx->lock);
+        const command_mark *found_command = ctx->Command(n);
+        if (found_command) {
+            command = *found_command;
+            index = n < 0 ? (int64_t)(ctx->commands_evicted + ctx->commands.size()) + n : n;
+            found = true;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return found;
+}
+
+// cell, or boundary between cells, at position in pixels of session on
+// screen, clamped to history and screen, lock must be held
+static cell_position PositionAt(const terminal_context &term, int x, int y, bool boundary) {
+    int scroll_rows = scroll_offset / font_height;
+    int64_t first = (int64_t)term.scrolled_lines - (int64_t)term.history.size();
+    int64_t line = (int64_t)term.scrolled_lines + std::max(y, 0) / font_height - scroll_rows;
+    line = std::max(first, std::min(line, (int64_t)term.scrolled_lines + term.num_rows - 1));
+    int col = (std::max(x, 0) + (boundary ? font_width / 2 : 0)) / font_width;
+    col = std::min(col, boundary ? term.num_cols : term.num_cols - 1);
+    return {(uint64_t)line, col};
+}
+
+void StartSelection(int x, int y, int mode) {
+    pthread_rwlock_rdlock(&sessions_lock);
+    if (active_term) {
+        pthread_mutex_lock(&active_term->lock);
+        cell_position pos =
+            PositionAt(*active_term, x, y, mode == selection_char || mode == selection_block);
+        active_term->selection = {mode, pos, pos};
+        pthread_mutex_unlock(&active_term->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+}
+
+void ExtendSelection(int x, int y) {
+    pthread_rwlock_rdlock(&sessions_lock);
+    if (active_term) {
+        pthread_mutex_lock(&active_term->lock);
+        text_selection &selection = active_term->selection;
+        if (selection.mode != selection_none) {
+            selection.extent = PositionAt(*active_term, x, y,
+                                          selection.mode == selection_char || selection.mode == selection_block);
+        }
+        pthread_mutex_unlock(&active_term->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+}
+
+void SelectAll() {
+    pthread_rwlock_rdlock(&sessions_lock);
+    if (active_term) {
+        pthread_mutex_lock(&active_term->lock);
+        terminal_context *ctx = active_term;
+        ctx->selection = {selection_char,
+                          {ctx->scrolled_lines - ctx->history.size(), 0},
+                          {ctx->scrolled_lines + ctx->num_rows - 1, ctx->num_cols}};
+        pthread_mutex_unlock(&active_term->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+}
+
+void ClearSelection() {
+    pthread_rwlock_rdlock(&sessions_lock);
+    if (active_term) {
+        pthread_mutex_lock(&active_term->lock);
+        active_term->selection.mode = selection_none;
+        pthread_mutex_unlock(&active_term->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+}
+
+std::string GetSelection() {
+    std::string text;
+    pthread_rwlock_rdlock(&sessions_lock);
+    if (active_term) {
+        pthread_mutex_lock(&active_term->lock);
+        text = active_term->SelectedText();
+        pthread_mutex_unlock(&active_term->lock);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+    return text;
+}
+
+bool CopySelection() {
+    std::string text = GetSelection();
+    if (text.empty()) {
+        return false;
+    }
+    Copy(text);
+    return true;
+}
 
 static void Draw() {
     // blink every 0.5s
@@ -1518,6 +8101,16 @@ static void Draw() {
     }
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+    // draw the session shown on screen
+    pthread_rwlock_rdlock(&sessions_lock);
+    if (!active_term) {
+        pthread_rwlock_unlock(&sessions_lock);
+        glFlush();
+        AfterDraw();
+        return;
+    }
+    terminal_context &term = *active_term;
+
     // update surface size
     pthread_mutex_lock(&term.lock);
     int aligned_width = vw100 / font_width * font_width;
@@ -1557,19 +8150,55 @@ static void Draw() {
         scroll_rows = scroll_offset / font_height;
     }
 
+    // keep detected urls and paths up to date once per frame
+    term.ScanMatches();
+
+    // predicted echo is drawn dimmed, cursor moves past it
+    bool show_predictions = term.ShowPredictions(current_msec);
+    int cursor_col = term.col;
+    if (show_predictions) {
+        cursor_col = std::min(term.prediction_col + (int)term.predictions.size(), term.num_cols - 1);
+    }
+
+    // link under pointer is underlined, drawn with backgrounds
+    uint16_t hover_link = 0;
+    int pointer_x = hover_x, pointer_y = hover_y;
+    if (pointer_x >= 0 && pointer_y >= 0) {
+        const std::vector<term_char> *line = ScreenLine(term, pointer_y / font_height, scroll_rows);
+        if (line && pointer_x / font_width < (int)line->size()) {
+            hover_link = (*line)[pointer_x / font_width].style.link;
+        }
+    }
+    static std::vector<GLfloat> underline_vertex_data;
+    static std::vector<GLfloat> underline_color_data;
+    underline_vertex_data.clear();
+    underline_color_data.clear();
+
+    // selected cells are drawn with text and background colors swapped
+    cell_position selection_from, selection_to;
+    bool has_selection = term.SelectionBounds(selection_from, selection_to);
+
     for (int i = 0; i < max_lines; i++) {
         // (aligned_height - font_height) is terminal[0] when scroll_offset is zero
         float x = 0.0;
         float y = aligned_height - (i + 1) * font_height;
         int i_row = i - scroll_rows;
-        std::vector<term_char> row;
-        if (i_row >= 0 && i_row < term.num_rows) {
-            row = term.buffer[i_row];
-        } else if (i_row < 0 && (int)term.history.size() + i_row >= 0) {
-            row = term.history[term.history.size() + i_row];
-        } else {
+        const std::vector<term_char> *line = ScreenLine(term, i, scroll_rows);
+        if (!line) {
             continue;
         }
+        std::vector<term_char> row = *line;
+        int selected_begin = 0, selected_end = 0;
+        if (has_selection) {
+            term.SelectedColumns(selection_from, selection_to, (int64_t)term.scrolled_lines + i_row, selected_begin,
+                                 selected_end);
+        }
+        if (show_predictions && i_row == term.prediction_row) {
+            for (size_t k = 0; k < term.predictions.size() && term.prediction_col + k < row.size(); k++) {
+                row[term.prediction_col + k].code = term.predictions[k].code;
+                row[term.prediction_col + k].style.fore = predefined_colors[brcyan];
+            }
+        }
 
         int cur_col = 0;
         for (auto c : row) {
@@ -1611,6 +8240,22 @@ static void Draw() {
                                                0.0, 0.0};
             vertex_pass0_data.insert(vertex_pass0_data.end(), &g_vertex_pass0_data[0], &g_vertex_pass0_data[24]);
 
+            if (hover_link != 0 && c.style.link == hover_link) {
+                float thickness = std::max(1, font_height / 16);
+                GLfloat g_underline_data[24] = {// first triangle: 1->3->4
+                                                xpos, ypos + thickness, 0.0, 0.0, xpos, ypos, 0.0, 0.0, xpos + w, ypos,
+                                                0.0, 0.0,
+                                                // second triangle: 1->4->2
+                                                xpos, ypos + thickness, 0.0, 0.0, xpos + w, ypos, 0.0, 0.0, xpos + w,
+                                                ypos + thickness, 0.0, 0.0};
+                underline_vertex_data.insert(underline_vertex_data.end(), &g_underline_data[0], &g_underline_data[24]);
+                for (int k = 0; k < 6; k++) {
+                    GLfloat color[3];
+                    c.style.fore.put_f3(color);
+                    underline_color_data.insert(underline_color_data.end(), &color[0], &color[3]);
+                }
+            }
+
             // pass 1: draw text
             xpos = x + ch.xoff;
             ypos = y + ch.yoff;
@@ -1632,7 +8277,13 @@ static void Draw() {
                 c.style.back.put_f3(&g_background_color_buffer_data[i*3]);
             }
 
-            if ((term.show_cursor && i_row == term.row && cur_col == term.col) ^ term.reverse_video) {
+            if (cur_col >= selected_begin && cur_col < selected_end) {
+                for (int i = 0; i < 18; i++) {
+                    std::swap(g_text_color_buffer_data[i], g_background_color_buffer_data[i]);
+                }
+            }
+
+            if ((term.show_cursor && i_row == term.row && cur_col == cursor_col) ^ term.reverse_video) {
                 // invert all colors
                 for (int i = 0; i < 18; i++) {
                     g_text_color_buffer_data[i] = 1.0 - g_text_color_buffer_data[i];
@@ -1655,9 +8306,69 @@ static void Draw() {
             cur_col++;
         }
     }
+
+    // underlines follow cells in the first pass, the second pass only draws cells
+    vertex_pass0_data.insert(vertex_pass0_data.end(), underline_vertex_data.begin(), underline_vertex_data.end());
+    background_color_data.insert(background_color_data.end(), underline_color_data.begin(), underline_color_data.end());
+    text_color_data.insert(text_color_data.end(), underline_color_data.begin(), underline_color_data.end());
+
+    // images, textures are uploaded while pixels are locked
+    // vec4 vertex, and texture for each 6 vertices
+    static std::vector<GLfloat> image_below_data;
+    static std::vector<GLfloat> image_above_data;
+    static std::vector<GLuint> image_below_textures;
+    static std::vector<GLuint> image_above_textures;
+    image_below_data.clear();
+    image_above_data.clear();
+    image_below_textures.clear();
+    image_above_textures.clear();
+    for (auto &placement : term.placements) {
+        // first line on screen
+        int top = placement.row + scroll_rows;
+        if (top >= max_lines || top + placement.rows <= 0) {
+            continue;
+        }
+        auto it = term.images.find(placement.image_id);
+        if (it == term.images.end()) {
+            continue;
+        }
+        const graphics_image &image = it->second;
+        GLuint texture = ImageTexture(image);
+        if (texture == 0) {
+            continue;
+        }
+
+        float x0 = placement.col * font_width + placement.offset_x;
+        float x1 = x0 + placement.width;
+        float y1 = aligned_height - top * font_height - placement.offset_y;
+        float y0 = y1 - placement.height;
+        float u0 = (float)placement.source_x / image.width;
+        float u1 = (float)(placement.source_x + placement.source_width) / image.width;
+        float v0 = (float)placement.source_y / image.height;
+        float v1 = (float)(placement.source_y + placement.source_height) / image.height;
+        GLfloat g_image_data[24] = {// first triangle: 1->3->4
+                                    x0, y1, u0, v0, x0, y0, u0, v1, x1, y0, u1, v1,
+                                    // second triangle: 1->4->2
+                                    x0, y1, u0, v0, x1, y0, u1, v1, x1, y1, u1, v0};
+        std::vector<GLfloat> &data = placement.z < 0 ? image_below_data : image_above_data;
+        data.insert(data.end(), &g_image_data[0], &g_image_data[24]);
+        (placement.z < 0 ? image_below_textures : image_above_textures).push_back(texture);
+    }
+    glBindTexture(GL_TEXTURE_2D, atlas_texture_id);
+
+    // cursor rectangle in pixels from top left of surface, for IME
+    static int last_cursor[4] = {-1, -1, -1, -1};
+    int cursor[4] = {cursor_col * font_width, (term.row + scroll_rows) * font_height, font_width, font_height};
+    bool cursor_moved = memcmp(cursor, last_cursor, sizeof(cursor)) != 0;
+    memcpy(last_cursor, cursor, sizeof(cursor));
     pthread_mutex_unlock(&term.lock);
+    pthread_rwlock_unlock(&sessions_lock);
+
+    if (cursor_moved) {
+        CursorMoved(cursor[0], cursor[1], cursor[2], cursor[3]);
+    }
 
-    // draw in two pass
+    // draw in two pass, with images in between or after
     glBindBuffer(GL_ARRAY_BUFFER, text_color_buffer);
     glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * text_color_data.size(), text_color_data.data(), GL_STREAM_DRAW);
     glBindBuffer(GL_ARRAY_BUFFER, background_color_buffer);
@@ -1670,17 +8381,26 @@ static void Draw() {
     glUniform1i(render_pass_location, 0);
     glDrawArrays(GL_TRIANGLES, 0, vertex_pass0_data.size() / 4);
 
+    // images below text
+    DrawImages(image_below_data, image_below_textures);
+
     // second pass
     glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
     glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * vertex_pass1_data.size(), vertex_pass1_data.data(), GL_STREAM_DRAW);
     glUniform1i(render_pass_location, 1);
     glDrawArrays(GL_TRIANGLES, 0, vertex_pass1_data.size() / 4);
 
+    // images above text
+    DrawImages(image_above_data, image_above_textures);
+    EvictImageTextures();
+
     glBindVertexArray(0);
     glBindTexture(GL_TEXTURE_2D, 0);
     glFlush();
     glFinish();
     AfterDraw();
+    frame_count++;
+    FlushMouseMotion();
 }
 
 
@@ -1733,6 +8453,9 @@ static void *RenderWorker(void *) {
                                   "void main() {\n"
                                   "  if (renderPass == 0) {\n"
                                   "    color = vec4(fragBackgroundColor, 1.0);\n"
+                                  "  } else if (renderPass == 2) {\n"
+                                  "    vec4 pixel = texture(text, texCoords);\n"
+                                  "    color = vec4(pixel.rgb * pixel.a, pixel.a);\n"
                                   "  } else {\n"
                                   "    float alpha = texture(text, texCoords).r;\n"
                                   "    color = vec4(fragTextColor, 1.0) * alpha;\n"
@@ -1743,6 +8466,7 @@ static void *RenderWorker(void *) {
     // first pass: src = (fragBackgroundColor, 1.0), dest = (1.0, 1.0, 1.0, 1.0), final = (fragBackgroundColor, 1.0)
     // second pass: src = (fragTextColor * alpha, alpha), dest = (fragBackgroundColor, 1.0), final = (fragTextColor *
     // alpha + fragBackgroundColor * (1 - alpha), 1.0)
+    // image pass: src = (pixel.rgb * pixel.a, pixel.a), drawn before second pass if z < 0, after it otherwise
     glShaderSource(fragment_shader_id, 1, &fragment_source, NULL);
     glCompileShader(fragment_shader_id);
 
@@ -1783,6 +8507,7 @@ static void *RenderWorker(void *) {
         codepoints_to_load.insert(i);
     }
     glGetIntegerv(GL_MAX_TEXTURE_SIZE, &atlas_width);
+    max_texture_size = atlas_width;
     BuildFontAtlas();
 
     // create buffers for drawing
@@ -1806,7 +8531,7 @@ static void *RenderWorker(void *) {
     // vec3 textColor
     glGenBuffers(1, &text_color_buffer);
     glBindBuffer(GL_ARRAY_BUFFER, text_color_buffer);
-    GLint text_color_location = glGetAttribLocation(program_id, "textColor");
+    text_color_location = glGetAttribLocation(program_id, "textColor");
     assert(text_color_location != -1);
     glEnableVertexAttribArray(text_color_location);
     glVertexAttribPointer(text_color_location, // attribute 0
@@ -1820,7 +8545,7 @@ static void *RenderWorker(void *) {
     // vec3 backgroundColor
     glGenBuffers(1, &background_color_buffer);
     glBindBuffer(GL_ARRAY_BUFFER, background_color_buffer);
-    GLint background_color_location = glGetAttribLocation(program_id, "backgroundColor");
+    background_color_location = glGetAttribLocation(program_id, "backgroundColor");
     assert(background_color_location != -1);
     glEnableVertexAttribArray(background_color_location);
     glVertexAttribPointer(background_color_location, // attribute 0
@@ -1885,23 +8610,23 @@ static void *RenderWorker(void *) {
 
 // on resize
 void Resize(int new_width, int new_height) {
-    pthread_mutex_lock(&term.lock);
+    pthread_rwlock_wrlock(&sessions_lock);
     vw100 = new_width;
     vh100 = new_height;
 
     ResizeTo(vh100 / font_height, vw100 / font_width, false);
-    pthread_mutex_unlock(&term.lock);
+    pthread_rwlock_unlock(&sessions_lock);
 }
 
 // handle scrolling
 void ScrollBy(double offset) {
-    pthread_mutex_lock(&term.lock);
+    pthread_rwlock_wrlock(&sessions_lock);
     // natural scrolling
     scroll_offset -= offset;
     if (scroll_offset < 0) {
         scroll_offset = 0.0;
     }
-    pthread_mutex_unlock(&term.lock);
+    pthread_rwlock_unlock(&sessions_lock);
 }
 
 // start render thread
@@ -1922,41 +8647,163 @@ void AfterDraw() {
     glfwSwapBuffers(window);
 }
 
+// keypad keys also produce a char event, which is skipped
+static bool skip_char = false;
+
+// convert GLFW modifier bits
+static int GlfwModifiers(int mode) {
+    return ((mode & GLFW_MOD_SHIFT) ? mod_shift : 0) | ((mode & GLFW_MOD_ALT) ? mod_alt : 0) |
+           ((mode & GLFW_MOD_CONTROL) ? mod_ctrl : 0) | ((mode & GLFW_MOD_SUPER) ? mod_super : 0);
+}
+
 void KeyCallback(GLFWwindow *window, int key, int scancode, int action,
                   int mode) {
     if (action == GLFW_PRESS || action == GLFW_REPEAT) {
-        if (key == GLFW_KEY_ENTER) {
-            uint8_t data[] = {0x0d};
-            SendData(data, 1);
+        int modifiers = GlfwModifiers(mode);
+        int term_key = key_none;
+        std::string text;
+        if (key == GLFW_KEY_V && (mode & GLFW_MOD_CONTROL) && (mode & GLFW_MOD_SHIFT)) {
+            // Ctrl-Shift-V, paste from clipboard
+            const char *content = glfwGetClipboardString(window);
+            if (content) {
+                Paste((const uint8_t *)content, strlen(content));
+            }
+            return;
+        } else if ((key == GLFW_KEY_UP || key == GLFW_KEY_DOWN) && (mode & GLFW_MOD_CONTROL) &&
+                   (mode & GLFW_MOD_SHIFT)) {
+            // Ctrl-Shift-Up/Down, jump to previous or next prompt
+            JumpToPrompt(key == GLFW_KEY_UP ? -1 : 1);
+            return;
+        } else if (key == GLFW_KEY_O && (mode & GLFW_MOD_CONTROL) && (mode & GLFW_MOD_SHIFT)) {
+            // Ctrl-Shift-O, copy output of last command
+            CopyCommandOutput();
+            return;
+        } else if (key == GLFW_KEY_ENTER) {
+            term_key = key_enter;
+        } else if (key == GLFW_KEY_TAB) {
+            term_key = key_tab;
         } else if (key == GLFW_KEY_BACKSPACE) {
-            uint8_t data[] = {0x7f};
-            SendData(data, 1);
+            term_key = key_backspace;
+        } else if (key == GLFW_KEY_ESCAPE) {
+            term_key = key_escape;
         } else if (key == GLFW_KEY_UP) {
-            uint8_t data[] = {0x1b, 0x5b, 0x41};
-            SendData(data, 3);
+            term_key = key_up;
         } else if (key == GLFW_KEY_DOWN) {
-            uint8_t data[] = {0x1b, 0x5b, 0x42};
-            SendData(data, 3);
+            term_key = key_down;
         } else if (key == GLFW_KEY_RIGHT) {
-            uint8_t data[] = {0x1b, 0x5b, 0x43};
-            SendData(data, 3);
+            term_key = key_right;
         } else if (key == GLFW_KEY_LEFT) {
-            uint8_t data[] = {0x1b, 0x5b, 0x44};
-            SendData(data, 3);
-        } else if (key == GLFW_KEY_TAB) {
-            uint8_t data[] = {0x09};
-            SendData(data, 1);
+            term_key = key_left;
+        } else if (key == GLFW_KEY_HOME) {
+            term_key = key_home;
+        } else if (key == GLFW_KEY_END) {
+            term_key = key_end;
+        } else if (key == GLFW_KEY_INSERT) {
+            term_key = key_insert;
+        } else if (key == GLFW_KEY_DELETE) {
+            term_key = key_delete;
+        } else if (key == GLFW_KEY_PAGE_UP) {
+            term_key = key_page_up;
+        } else if (key == GLFW_KEY_PAGE_DOWN) {
+            term_key = key_page_down;
+        } else if (key >= GLFW_KEY_F1 && key <= GLFW_KEY_F12) {
+            term_key = key_f1 + (key - GLFW_KEY_F1);
+        } else if (key >= GLFW_KEY_KP_0 && key <= GLFW_KEY_KP_EQUAL) {
+            // same order in GLFW
+            term_key = key_kp_0 + (key - GLFW_KEY_KP_0);
+            text = std::string(1, "0123456789./*-+\r="[key - GLFW_KEY_KP_0]);
+            skip_char = key != GLFW_KEY_KP_ENTER;
+        } else if (key >= GLFW_KEY_SPACE && key <= GLFW_KEY_GRAVE_ACCENT &&
+                   (modifiers & (mod_ctrl | mod_alt | mod_super))) {
+            // no char event when modifiers are pressed, printable keys are ascii
+            text = std::string(1, (key >= GLFW_KEY_A && key <= GLFW_KEY_Z) ? key - GLFW_KEY_A + 'a' : key);
+        } else {
+            return;
         }
+        SendKey(term_key, modifiers, text);
     }
 }
 
 void CharCallback(GLFWwindow* window, uint32_t codepoint) {
-    // TODO: encode utf8 properly
-    SendData((uint8_t *)&codepoint, 1);
+    if (skip_char) {
+        skip_char = false;
+        return;
+    }
+    std::string text;
+    AppendUtf8(text, codepoint);
+    SendKey(key_none, 0, text);
+}
+
+// modifiers of last mouse button event, for motion reports
+static int mouse_modifiers = 0;
+// local selection while the program does not track mouse
+static bool selecting = false;
+static double last_click_time = 0.0;
+static int click_count = 0;
+
+void MouseButtonCallback(GLFWwindow *window, int button, int action, int mode) {
+    int term_button = button == GLFW_MOUSE_BUTTON_LEFT     ? mouse_left
+                      : button == GLFW_MOUSE_BUTTON_MIDDLE ? mouse_middle
+                      : button == GLFW_MOUSE_BUTTON_RIGHT  ? mouse_right
+                                                           : -1;
+    if (term_button == -1) {
+        return;
+    }
+    double x, y;
+    glfwGetCursorPos(window, &x, &y);
+    mouse_modifiers = GlfwModifiers(mode);
+    if (term_button == mouse_left && action == GLFW_PRESS && (mouse_modifiers & mod_ctrl)) {
+        // Ctrl-click on link
+        std::string uri = GetLinkAt(x, y);
+        if (uri.empty()) {
+            uri = GetMatchAt(x, y);
+        }
+        if (!uri.empty()) {
+            LOG_INFO("Open link: %s", uri.c_str());
+        }
+    }
+    if (SendMouse(action == GLFW_PRESS ? mouse_press : mouse_release, term_button, mouse_modifiers, x, y) ||
+        term_button != mouse_left) {
+        return;
+    }
+    if (action == GLFW_PRESS) {
+        // double click selects words, triple click lines, Alt a block
+        double now = glfwGetTime();
+        click_count = now - last_click_time < 0.3 ? click_count % 3 + 1 : 1;
+        last_click_time = now;
+        int selection_mode = (mouse_modifiers & mod_alt) ? selection_block
+                             : click_count == 2          ? selection_word
+                             : click_count == 3          ? selection_line
+                                                         : selection_char;
+        StartSelection(x, y, selection_mode);
+        selecting = true;
+    } else if (selecting) {
+        selecting = false;
+        std::string text = GetSelection();
+        if (!text.empty()) {
+            glfwSetClipboardString(window, text.c_str());
+        }
+    }
+}
+
+void CursorPosCallback(GLFWwindow *window, double x, double y) {
+    SetHover(x, y);
+    if (!SendMouse(mouse_motion, mouse_no_button, mouse_modifiers, x, y) && selecting) {
+        ExtendSelection(x, y);
+    }
 }
 
+void ScrollCallback(GLFWwindow *window, double x_offset, double y_offset) {
+    double x, y;
+    glfwGetCursorPos(window, &x, &y);
+    int button = y_offset > 0 ? mouse_wheel_up : mouse_wheel_down;
+    if (y_offset != 0 && !SendMouse(mouse_press, button, mouse_modifiers, x, y)) {
+        // program does not track mouse, scroll history
+        ScrollBy(-y_offset * font_height);
+    }
+}
 
-void Copy(std::string base64) {
+void Copy(std::string text) {
     // TODO
 }
 
@@ -1969,6 +8816,41 @@ std::string GetPaste() {
     return "";
 }
 
+void Bell(int session) {
+    // Do nothing
+}
+
+// window title can only be changed in main thread
+static pthread_mutex_t title_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::string pending_title;
+static bool title_changed = false;
+
+// io thread holds sessions_lock
+void SetTitle(int session, std::string title) {
+    if (active_term && active_term->id == session) {
+        pthread_mutex_lock(&title_lock);
+        pending_title = std::move(title);
+        title_changed = true;
+        pthread_mutex_unlock(&title_lock);
+    }
+}
+
+void ProgramExited(int session, int status) {
+    // Do nothing
+}
+
+void SessionChanged(int session, bool opened) {
+    // Do nothing
+}
+
+void TriggerMatched(int session, int pattern, const std::string &text) {
+    LOG_INFO("Trigger %d matched in session %d: %s", pattern, session, text.c_str());
+}
+
+void CursorMoved(int x, int y, int width, int height) {
+    // Do nothing
+}
+
 #ifdef TESTING
 
 void ResizeWidth(int new_width) {
@@ -1982,32 +8864,93 @@ void ResizeWidth(int new_width) {
     glfwSetWindowSize(window, new_width, current_height);
 }
 
-int main() {
-    // Init GLFW
-    glfwInit();
-
-    // Set all the required options for GLFW
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+int main(int argc, char **argv) {
+    // termony --daemon socket, exec'ed by AttachDaemon, runs sessions without window
+    bool serve_daemon = argc == 3 && strcmp(argv[1], "--daemon") == 0;
 
-    // Create a GLFWwindow object that we can use for GLFW's functions
     int window_width = 80 * font_width;
     int window_height = 30 * font_height;
-    window =
-        glfwCreateWindow(window_width, window_height, "Terminal", nullptr, nullptr);
-    glfwSetKeyCallback(window, KeyCallback);
-    glfwSetCharCallback(window, CharCallback);
+    if (!serve_daemon) {
+        // Init GLFW
+        glfwInit();
+
+        // Set all the required options for GLFW
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+
+        // Create a GLFWwindow object that we can use for GLFW's functions
+        window = glfwCreateWindow(window_width, window_height, "Terminal", nullptr, nullptr);
+        glfwSetKeyCallback(window, KeyCallback);
+        glfwSetCharCallback(window, CharCallback);
+        glfwSetMouseButtonCallback(window, MouseButtonCallback);
+        glfwSetCursorPosCallback(window, CursorPosCallback);
+        glfwSetScrollCallback(window, ScrollCallback);
+    }
+
+    // TERMONY_TRIGGERS=pattern,pattern..., highlighted and logged
+    const char *trigger_list = getenv("TERMONY_TRIGGERS");
+    if (trigger_list) {
+        std::vector<trigger_pattern> patterns;
+        for (auto &text : SplitString(trigger_list, ",")) {
+            trigger_pattern pattern;
+            pattern.text = text;
+            pattern.highlight = true;
+            pattern.color.set_rgb(255, 255, 0);
+            patterns.push_back(pattern);
+        }
+        std::string error;
+        if (!SetTriggers(patterns, error)) {
+            LOG_WARN("Invalid triggers: %s", error.c_str());
+        }
+    }
+
+    // TERMONY_SNAPSHOT=dir, sessions are restored from it and saved on exit
+    const char *snapshot = getenv("TERMONY_SNAPSHOT");
+    if (snapshot) {
+        SetSnapshotDir(snapshot);
+    }
+
+    if (serve_daemon) {
+        RunDaemon(argv[2]);
+        return 0;
+    }
+
+    // TERMONY_VIEWERS=socket, screen is mirrored to viewers connecting to it
+    const char *viewers = getenv("TERMONY_VIEWERS");
+    if (viewers) {
+        ServeGridViewers(viewers);
+    }
+
+    // TERMONY_DAEMON=socket, sessions keep running after window is closed
+    const char *daemon = getenv("TERMONY_DAEMON");
+    if (daemon) {
+        SetDaemonSocket(daemon);
+    }
 
     Start();
+    // TERMONY_RECORD=file, output of first session is recorded as asciicast
+    const char *record = getenv("TERMONY_RECORD");
+    if (record) {
+        StartRecording(record);
+    }
     StartRender();
     Resize(window_width, window_height);
     while (!glfwWindowShouldClose(window)) {
         // Check if any events have been activated (key pressed, mouse moved etc.)
         // and call corresponding response functions
         glfwPollEvents();
+
+        pthread_mutex_lock(&title_lock);
+        if (title_changed) {
+            glfwSetWindowTitle(window, pending_title.c_str());
+            title_changed = false;
+        }
+        pthread_mutex_unlock(&title_lock);
     }
+    SaveSnapshot();
+    FinishRecordings();
 }
 #endif
 #endif
@@ -1,13 +1,17 @@
 #ifndef __TERMINAL_H__
 #define __TERMINAL_H__
 
+#include <atomic>
 #include <cstdint>
 #include <deque>
+#include <map>
+#include <memory>
 #include <string>
 #include <vector>
 #include <stdlib.h>
 #include <optional>
 #include <pthread.h>
+#include <sys/uio.h>
 
 
 // font weight
@@ -72,6 +76,10 @@ struct term_style {
     font_weight weight = regular;
     // blinking
     bool blink = false;
+    // only on last cell of a row, which is continued on the next row
+    bool wrap = false;
+    // OSC 8 hyperlink, see link_table, 0 for none
+    uint16_t link = 0;
     // constuctor
     term_style();
 };
@@ -81,17 +89,557 @@ struct term_char {
     // way beyond valid utf8
     static constexpr uint32_t
         WIDE_TAIL = 'wcht';
+    // grapheme clusters of several codepoints, see InternCluster
+    static constexpr uint32_t CLUSTER_BASE = 0x80000000;
     uint32_t code = ' ';
     term_style style;
 };
 
+// clusters are interned for all sessions and never freed
+static const size_t max_clusters = 1 << 20;
+// further marks are dropped, so each cell interns a few short prefixes at most
+static const size_t max_cluster_codepoints = 32;
+// code of cell for codepoints, the first codepoint if table is full
+uint32_t InternCluster(const std::u32string &codepoints);
+// codepoints of cell code, one unless it is a cluster
+std::u32string ClusterCodepoints(uint32_t code);
+// columns taken by cell code, cached for clusters
+int CodeWidth(uint32_t code);
+// append utf8 of cell code
+void AppendCode(std::string &out, uint32_t code);
+
+// OSC 8 hyperlinks, interned so that cells only carry an id
+// ids are reference counted by sweeping buffer and history,
+// which keeps writing cells free of bookkeeping
+static const size_t max_links = 65535;
+// evicted history lines with links before a sweep
+static const int link_sweep_interval = 64;
+struct link_table {
+    // "id param" \n uri of each id - 1, empty if free
+    std::vector<std::string> keys;
+    // cells referring to each id - 1, as of the last sweep
+    std::vector<uint32_t> refs;
+    std::map<std::string, uint16_t> ids;
+    std::vector<uint16_t> free_ids;
+    // evicted history lines with links since the last sweep
+    int evicted = 0;
+
+    // id of link, 0 if table is full
+    uint16_t Intern(const std::string &key);
+    std::string Uri(uint16_t id) const;
+    // free links without references
+    void Sweep();
+};
+
+// url or file path found in output, spanning columns of one row,
+// text is the whole match which may continue on wrapped rows
+struct text_match {
+    int start_col;
+    // exclusive
+    int end_col;
+    std::string text;
+};
+// wrapped rows scanned around a changed row, longer lines are cut
+static const int max_match_rows = 16;
+
+// output trigger, matched against text as it is committed to cells
+struct trigger_pattern {
+    std::string text;
+    // post an event on match
+    bool notify = true;
+    // recolor background of matched cells
+    bool highlight = false;
+    term_style::color color;
+};
+static const size_t max_trigger_patterns = 256;
+// matched cells are remembered this many bytes back
+static const size_t max_trigger_length = 256;
+// states * byte classes
+static const size_t max_trigger_table = 1 << 22;
+
+// patterns compiled into one aho-corasick automaton with every
+// transition filled in, so a byte costs one lookup whatever the patterns
+struct trigger_automaton {
+    std::vector<trigger_pattern> patterns;
+    // bytes in no pattern share class 0
+    uint16_t classes[256] = {};
+    size_t num_classes = 1;
+    // next state of state * num_classes + class
+    std::vector<uint32_t> next;
+    // longest pattern ending at state, -1 if none
+    std::vector<int32_t> output;
+
+    bool Compile(std::vector<trigger_pattern> &&new_patterns, std::string &error);
+    uint32_t Step(uint32_t state, uint8_t byte) const { return next[state * num_classes + classes[byte]]; }
+};
+
+// absolute line (see scrolled_lines) and column of a cell
+struct cell_position {
+    uint64_t line;
+    int col;
+};
+
+enum selection_modes {
+    selection_none,
+    // cells from anchor to extent in reading order
+    selection_char,
+    // extended to whole words at both ends
+    selection_word,
+    // extended to whole lines, following soft wraps
+    selection_line,
+    // rectangle with anchor and extent at its corners
+    selection_block,
+};
+
+struct text_selection {
+    int mode = selection_none;
+    cell_position anchor = {};
+    cell_position extent = {};
+};
+
+// OSC 133 shell integration marks
+enum command_marks {
+    // A, prompt starts
+    mark_prompt,
+    // B, command line starts
+    mark_input,
+    // C, command is executed
+    mark_output,
+    // D, command finished
+    mark_end,
+};
+// one prompt and the command run from it, positions are absolute lines
+// (see scrolled_lines) and columns, marks after stage are not seen yet
+struct command_mark {
+    uint64_t line[4] = {};
+    int col[4] = {};
+    // last mark seen
+    int stage = mark_prompt;
+    // given by D, -1 if unknown
+    int exit_status = -1;
+    // time of C and D
+    uint64_t start_msec = 0;
+    uint64_t end_msec = 0;
+};
+
+// character typed but not echoed by program yet
+struct prediction {
+    uint32_t code;
+    // when it was typed
+    uint64_t msec;
+};
+// predictions are shown when echo takes at least this long
+static const int prediction_show_latency = 30;
+// typed characters not echoed within this time are rolled back
+static const int prediction_timeout = 2000;
+
+// sessions saved when app goes to background, see SaveSnapshot
+// varints throughout, rows are run length encoded with a style
+// only where it changes
+// "TMSN" read as a big endian number
+static const uint32_t snapshot_magic = 0x544d534e;
+static const uint32_t snapshot_version = 2;
+// sessions restored at most, and largest screen accepted
+static const int max_snapshot_sessions = 16;
+static const int max_snapshot_size = 4096;
+
+// reader of snapshot data, ok is cleared once it runs out
+struct snapshot_reader {
+    const uint8_t *data;
+    const uint8_t *end;
+    bool ok = true;
+
+    uint64_t Varint();
+    std::string String();
+};
+
+// messages between session daemon and ui, each is varint type and
+// payload length then payload, sessions are numbered by daemon
+enum daemon_messages {
+    // to ui: session, tag of create request or 0, snapshot state and history
+    daemon_session,
+    // to ui: session, lines scrolled, then those still in history
+    daemon_history,
+    // to ui: session and its modes, see EncodeModes
+    daemon_modes,
+    // to ui: session and a frame of grid_encoder
+    daemon_rows,
+    // to ui: session, one of daemon_events, code and text
+    daemon_event,
+    // to ui: session
+    daemon_closed,
+    // to ui: all sessions are sent after attaching
+    daemon_ready,
+    // to daemon: session and bytes for its program
+    daemon_input,
+    // to daemon: rows and cols of all sessions
+    daemon_resize,
+    // to daemon: tag to find the session created
+    daemon_create,
+    // to daemon: session
+    daemon_close,
+    // to daemon: count, then text, notify, highlight and color of patterns
+    daemon_triggers,
+};
+
+// notifications of daemon sessions, see ForwardEvent
+enum daemon_events {
+    daemon_event_bell,
+    daemon_event_title,
+    daemon_event_exit,
+    daemon_event_trigger,
+    daemon_event_copy,
+};
+
+// screens are compared with what ui has this often
+static const int daemon_update_msec = 16;
+// events kept while no ui is attached
+static const size_t max_daemon_events = 1024 * 1024;
+// input and requests queued for daemon, sessions wait beyond it
+static const size_t max_daemon_outgoing = 1024 * 1024;
+// input from ui that a session did not take yet, ui is not read beyond it
+// so that pastes wait in ui like they wait for a local pty
+static const size_t max_daemon_pending_input = 65536;
+
+// screen of a session as a frame of ops for viewers, see grid_encoder
+enum grid_ops {
+    // rows and cols, viewer starts over from blank rows and no styles
+    grid_keyframe,
+    // lines scrolled up, rows below are blank
+    grid_scroll,
+    // index and style, added to style table
+    grid_style,
+    // row, col and cells like rows of snapshot, styles by index
+    grid_span,
+    // row, col and whether cursor is shown
+    grid_cursor,
+};
+// frames between keyframes, so that errors do not last
+static const int grid_keyframe_frames = 600;
+// unchanged cells between two spans that join them
+static const int grid_span_gap = 4;
+// styles in table before a keyframe clears it
+static const size_t max_grid_styles = 4096;
+
+struct terminal_context;
+// changes of screen since the last frame, for one viewer
+struct grid_encoder {
+    int session = -1;
+    int num_rows = 0;
+    int num_cols = 0;
+    uint64_t scrolled_lines = 0;
+    int row = -1;
+    int col = -1;
+    bool show_cursor = false;
+    int frames = 0;
+    // rows as viewer has them, and their hashes, 0 if they must be compared
+    std::vector<std::vector<term_char>> rows;
+    std::vector<uint64_t> hashes;
+    // index of styles viewer has, by packed style
+    std::map<std::pair<uint64_t, uint32_t>, uint32_t> styles;
+
+    // viewer has screen of session, e.g. from a snapshot, lock must be held
+    void Sync(const terminal_context &ctx);
+    // append ops of changes, false if there are none, lock must be held
+    bool Encode(const terminal_context &ctx, std::string &out);
+    void Keyframe(const terminal_context &ctx, std::string &out);
+    uint32_t StyleIndex(const term_style &style, std::string &out);
+};
+
+// screen rebuilt from frames of grid_encoder
+struct grid_mirror {
+    int num_rows = 0;
+    int num_cols = 0;
+    int row = 0;
+    int col = 0;
+    bool show_cursor = true;
+    std::vector<std::vector<term_char>> rows;
+    // rows changed by frames, cleared by user
+    std::vector<bool> dirty_rows;
+    std::vector<term_style> styles;
+
+    // apply one frame, false if it is invalid
+    bool Apply(snapshot_reader &in);
+    // start from screen of session, as grid_encoder::Sync
+    void Sync(const std::vector<std::vector<term_char>> &screen, int new_row, int new_col);
+    // apply frames of ServeGridViewers at start of buffer, they are
+    // removed from it, false if one is invalid
+    bool Receive(std::string &buffer);
+};
+
 // escape sequence state machine
 enum escape_states {
     state_idle,
     state_esc,
     state_csi,
     state_osc,
+    // OSC 52 payload, decoded as it streams in
+    state_osc_52,
     state_dcs,
+    // tmux control mode, line based until ST
+    state_tmux,
+    // APC, only kitty graphics protocol is handled
+    state_apc,
+    // APC G payload, decoded as it streams in
+    state_graphics,
+    // DCS q sixel data, decoded as it streams in
+    state_sixel,
+};
+
+// commands sent to tmux in control mode,
+// each is answered by a %begin/%end block in order
+enum tmux_command_kinds {
+    tmux_command_ignore,
+    // window ids and layouts
+    tmux_command_list_windows,
+    // initial content of a pane
+    tmux_command_capture,
+    // cursor position of a pane, its held output is released after it
+    tmux_command_cursor,
+};
+
+struct tmux_command {
+    tmux_command_kinds kind;
+    int pane;
+};
+
+// pane found in a layout, its session is created by io thread later
+struct tmux_new_pane {
+    int window;
+    int rows;
+    int cols;
+};
+
+// largest output held for a pane that is not ready
+static const size_t max_tmux_held_output = 1024 * 1024;
+// longest line from tmux, control mode is left beyond it
+// since it is not tmux, e.g. a binary file was printed
+static const size_t max_tmux_line = 1024 * 1024;
+// largest commands queued for tmux, input is refused beyond it
+static const size_t max_tmux_outgoing = 65536;
+
+// state of tmux control mode client, see tmux -CC
+struct tmux_client {
+    // line being received
+    std::string line;
+    // commands sent, answered in order
+    std::deque<tmux_command> commands;
+    // lines of %begin/%end block being received
+    bool in_block = false;
+    std::vector<std::string> block;
+    // commands to write, moved into replies by io thread
+    std::string outgoing;
+    // pane id to session id
+    std::map<int, int> panes;
+    // pane id to window id
+    std::map<int, int> pane_windows;
+    // panes waiting for a session
+    std::map<int, tmux_new_pane> new_panes;
+    // output of panes without session or initial content yet
+    std::map<int, std::string> held_output;
+    // sessions of closed panes, freed by io thread later
+    std::vector<int> closed_sessions;
+};
+
+// longest escape sequence kept, longer ones are ignored
+static const size_t max_escape_length = 4096;
+// largest OSC 52 copy accepted, after decoding
+static const size_t max_clipboard_size = 8 * 1024 * 1024;
+
+// largest image data accepted in one transmission, after decoding
+static const size_t max_graphics_transfer = 64 * 1024 * 1024;
+// pixels kept by a session, images are evicted beyond it
+static const size_t max_graphics_storage = 256 * 1024 * 1024;
+// pixels of a side of an image placement, so its cells fit int
+static const int max_placement_pixels = 1 << 20;
+
+// image of kitty graphics protocol, decoded to RGBA
+struct graphics_image {
+    // i= and I= keys
+    uint32_t id = 0;
+    uint32_t number = 0;
+    int width = 0;
+    int height = 0;
+    std::string pixels;
+    // unique among all sessions, keys the texture cache of render thread
+    uint64_t serial = 0;
+};
+
+// image placed on screen, covers rows x cols cells from row, col
+struct graphics_placement {
+    uint32_t image_id = 0;
+    // p= key
+    uint32_t id = 0;
+    // relative to first row of buffer, negative in history
+    int row = 0;
+    int col = 0;
+    int rows = 0;
+    int cols = 0;
+    // part of image shown, in pixels
+    int source_x = 0;
+    int source_y = 0;
+    int source_width = 0;
+    int source_height = 0;
+    // offset within first cell, in pixels
+    int offset_x = 0;
+    int offset_y = 0;
+    // size on screen, in pixels
+    int width = 0;
+    int height = 0;
+    // drawn below text if negative
+    int z = 0;
+};
+
+// largest sixel image, in pixels
+static const size_t max_sixel_pixels = 4096 * 4096;
+static const int sixel_registers = 256;
+
+// incremental sixel decoder, rasterizes bands as data arrives
+struct sixel_decoder {
+    // command waiting for its numeric parameters: '!', '#', '"' or 0
+    uint8_t command = 0;
+    std::vector<int> params;
+    // repeat count of next sixel
+    int repeat = 1;
+    // position of next sixel, y is the top of current band
+    int x = 0;
+    int y = 0;
+    int color = 0;
+    // 0xRRGGBB of color registers
+    uint32_t palette[sixel_registers];
+    // color register + 1 of painted pixels, 0 for others
+    std::vector<std::vector<uint16_t>> rows;
+    int width = 0;
+    // unpainted pixels are transparent, DCS P2 = 1
+    bool transparent = false;
+    // exceeded max_sixel_pixels, the rest is dropped
+    bool overflow = false;
+
+    // reset with DCS parameters
+    void Start(const std::string &params);
+    // decode sixel data, return bytes consumed, stops at ESC
+    size_t Decode(const uint8_t *src, size_t length);
+    // convert to RGBA, false if empty
+    bool Finish(graphics_image &image, uint32_t background);
+    // run command with its parameters
+    void EndCommand();
+    // draw sixel at x, repeat times
+    void Paint(int bits);
+    // image is too large, free it and ignore the rest
+    void Drop();
+};
+
+// incremental base64 decoder, input may be split anywhere
+struct base64_decoder {
+    uint32_t bits = 0;
+    int count = 0;
+
+    // decode base64 characters and append to out, or drop them if out is null
+    // return bytes consumed, stops at the first non base64 character
+    size_t Decode(const uint8_t *src, size_t length, std::string *out);
+    void Reset() {
+        bits = 0;
+        count = 0;
+    }
+};
+
+// keys that do not produce text, see terminal_context::EncodeKey
+enum terminal_keys {
+    key_none, // text key
+    key_enter,
+    key_tab,
+    key_backspace,
+    key_escape,
+    key_up,
+    key_down,
+    key_right,
+    key_left,
+    key_home,
+    key_end,
+    key_insert,
+    key_delete,
+    key_page_up,
+    key_page_down,
+    key_f1,
+    key_f2,
+    key_f3,
+    key_f4,
+    key_f5,
+    key_f6,
+    key_f7,
+    key_f8,
+    key_f9,
+    key_f10,
+    key_f11,
+    key_f12,
+    // keypad, text is what the key produces in numeric mode
+    key_kp_0,
+    key_kp_1,
+    key_kp_2,
+    key_kp_3,
+    key_kp_4,
+    key_kp_5,
+    key_kp_6,
+    key_kp_7,
+    key_kp_8,
+    key_kp_9,
+    key_kp_decimal,
+    key_kp_divide,
+    key_kp_multiply,
+    key_kp_subtract,
+    key_kp_add,
+    key_kp_enter,
+    key_kp_equal,
+};
+
+// modifier bits, xterm and kitty send them as 1 + bits
+enum key_modifiers {
+    mod_shift = 1,
+    mod_alt = 2,
+    mod_ctrl = 4,
+    mod_super = 8,
+};
+
+// kitty keyboard protocol progressive enhancement flags
+enum kitty_keyboard_flags {
+    kitty_disambiguate = 1,
+    kitty_report_events = 2,
+    kitty_report_alternates = 4,
+    kitty_report_all_keys = 8,
+    kitty_report_text = 16,
+};
+// entries kept in kitty keyboard flags stack
+static const size_t max_kitty_keyboard_stack = 16;
+
+// mouse tracking modes, see DECSET 9/1000/1002/1003
+enum mouse_tracking_modes {
+    mouse_tracking_off,
+    mouse_tracking_x10,    // press only
+    mouse_tracking_normal, // press and release
+    mouse_tracking_button, // and motion while a button is held
+    mouse_tracking_any,    // and all motion
+};
+
+// mouse coordinate encodings, see DECSET 1005/1006
+enum mouse_encodings {
+    mouse_encoding_default,
+    mouse_encoding_utf8,
+    mouse_encoding_sgr,
+};
+
+enum mouse_actions {
+    mouse_press,
+    mouse_release,
+    mouse_motion,
+};
+
+enum mouse_buttons {
+    mouse_left,
+    mouse_middle,
+    mouse_right,
+    mouse_no_button,
+    mouse_wheel_up,
+    mouse_wheel_down,
 };
 
 // utf8 decode state machine
@@ -108,16 +656,125 @@ enum utf8_states {
     state_4byte_4,        // expected 4th byte of 4-byte sequence
 };
 
+// lock-free single producer single consumer byte queue
+struct spsc_ring {
+    // must be a power of two
+    static constexpr size_t capacity = 65536;
+    std::vector<uint8_t> data = std::vector<uint8_t>(capacity);
+    // only written by producer
+    std::atomic<size_t> head{0};
+    // only written by consumer
+    std::atomic<size_t> tail{0};
+
+    // producer: copy as much as possible, return bytes accepted
+    size_t Push(const uint8_t *src, size_t length);
+    // producer: copy all bytes or nothing
+    bool PushAll(const uint8_t *src, size_t length);
+    // consumer: get the next contiguous readable span
+    size_t Peek(const uint8_t **ptr) const;
+    // consumer: release bytes that have been consumed
+    void Pop(size_t length);
+
+    size_t Size() const;
+    size_t Free() const;
+};
+
+// pty output of a session in asciicast v2 format, see StartRecording
+struct session_recording {
+    int fd = -1;
+    uint64_t start_usec = 0;
+    // output waiting for writer thread, each a recording_event then its
+    // bytes, protected by recording_lock
+    std::string pending;
+    // bytes dropped when writer did not keep up
+    uint64_t dropped = 0;
+    // writer only: incomplete utf8 at end of the last output
+    std::string utf8_tail;
+};
+struct recording_event {
+    uint64_t usec;
+    uint32_t length;
+    // 'o' for output, 'r' for resize
+    char type;
+};
+// output waiting for disk before more is dropped, parser never waits
+static const size_t max_recording_pending = 16 * 1024 * 1024;
+// events written with one writev
+static const int recording_batch = 64;
+
 struct terminal_context {
     // protect multithreaded usage
     pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
+    // session id, addressable from napi
+    int id = 0;
+
     // pty
     int fd = -1;
+    // child process
+    pid_t pid = -1;
+    // pidfd of child process, readable when it exits
+    int pid_fd = -1;
+    // exit status of last program, -1 if none exited yet
+    // killed by signal N is reported as 128+N like shells do
+    int exit_status = -1;
+
+    // pending writes to pty, drained by io thread
+    // keyboard input, produced by ui thread
+    spsc_ring input;
+    // replies to escape sequences, produced by io thread
+    spsc_ring replies;
+    // replies that do not fit into ring yet, only accessed by io thread
+    std::string replies_overflow;
+    // eventfd to wake up io thread
+    int wake_fd = -1;
+    // whether io thread waits for pty to become writable
+    bool want_write = false;
+    // whether program asked for clipboard content via OSC 52
+    bool paste_requested = false;
+
+    // pastes waiting to be streamed to pty, protected by lock
+    std::deque<std::string> paste_queue;
+    // bytes of all pastes since the last one finished, and how many are written
+    // protected by lock
+    size_t paste_total = 0;
+    size_t paste_written = 0;
+    // paste being written, only accessed by io thread
+    std::string paste_buffer;
+    size_t paste_offset = 0;
 
     // escape sequence state machine
     escape_states escape_state = state_idle;
     std::string escape_buffer;
+    // escape sequence exceeded max_escape_length, it is ignored
+    bool escape_overflow = false;
+
+    // OSC 52 copy being received
+    base64_decoder clipboard_decoder;
+    std::string clipboard;
+    // exceeded max_clipboard_size, the rest is dropped
+    bool clipboard_rejected = false;
+
+    // set by OSC 0/2
+    std::string title;
+    // OSC 8 hyperlinks referenced by cells
+    link_table links;
+
+    // kitty graphics protocol
+    std::map<uint32_t, graphics_image> images;
+    std::vector<graphics_placement> placements;
+    // bytes of pixels in images
+    size_t graphics_storage = 0;
+    // transmission being received, may be split into chunks by m=1,
+    // keys come with the first chunk
+    std::string graphics_keys;
+    std::string graphics_payload;
+    base64_decoder graphics_decoder;
+    bool graphics_more = false;
+    // exceeded max_graphics_transfer, the rest is dropped
+    bool graphics_rejected = false;
+    // sixel image being received
+    sixel_decoder sixel;
 
     // utf8 decode state machine
     utf8_states utf8_state = state_initial;
@@ -134,6 +791,54 @@ struct terminal_context {
     bool origin_mode = false;
     // IRM, Insert Mode
     bool insert_mode = false;
+    // bracketed paste mode
+    bool bracketed_paste = false;
+    // DECCKM, Application Cursor Keys
+    bool application_cursor = false;
+    // DECKPAM/DECKPNM, Application Keypad
+    bool application_keypad = false;
+    // XTMODKEYS, modifyOtherKeys level
+    int modify_other_keys = 0;
+    // kitty keyboard protocol, see CSI > flags u
+    int kitty_keyboard = 0;
+    std::vector<int> kitty_keyboard_stack;
+    // alternate screen buffer, DECSET 47/1047/1049
+    // content is not switched yet, it disables predictive echo
+    bool alternate_screen = false;
+    // tmux control mode client, when escape_state is state_tmux
+    tmux_client tmux;
+    // recording of output, see StartRecording
+    std::shared_ptr<session_recording> recording;
+    // append to recording, lock must be held
+    void Record(char type, const uint8_t *data, size_t length);
+    // session of daemon shown by this one in ui, -1 if local
+    // and -2 until daemon has created it, see SetDaemonSocket
+    int remote_session = -1;
+    // its screen as daemon sent it
+    grid_mirror remote_grid;
+    // session of tmux control mode client if this is one of its panes
+    int tmux_parent = -1;
+    int tmux_pane = -1;
+    // mouse reporting
+    int mouse_tracking = mouse_tracking_off;
+    int mouse_encoding = mouse_encoding_default;
+    // state of reporting, only used by ui thread with lock held
+    // held button, last reported cell, and motion coalesced in current frame
+    int mouse_button = mouse_no_button;
+    int mouse_row = -1;
+    int mouse_col = -1;
+    uint64_t mouse_frame = 0;
+    std::string mouse_pending;
+
+    // predictive local echo, see PredictInput
+    // consecutive cells from prediction_row/col, confirmed by program output
+    std::deque<prediction> predictions;
+    int prediction_row = 0;
+    int prediction_col = 0;
+    // smoothed echo latency in milliseconds, -1 until measured
+    int echo_latency = -1;
+    // typed characters were not echoed, e.g. password, resumed by enter
+    bool prediction_paused = false;
 
     // tab handling
     int tab_size = 8;
@@ -151,6 +856,27 @@ struct terminal_context {
     std::deque<std::vector<term_char>> history;
     // terminal content, limited to rows & cols
     std::vector<std::vector<term_char>> buffer;
+    // rows scrolled into history so far, including evicted ones,
+    // so buffer[i] is absolute line scrolled_lines + i
+    uint64_t scrolled_lines = 0;
+    // urls and paths by absolute line, updated by ScanMatches
+    std::map<uint64_t, std::vector<text_match>> matches;
+    // output triggers shared by sessions, matching continues across reads
+    std::shared_ptr<const trigger_automaton> triggers;
+    uint32_t trigger_state = 0;
+    // cells of recent bytes fed, ring of max_trigger_length
+    cell_position trigger_cells[max_trigger_length] = {};
+    uint64_t trigger_fed = 0;
+    // last line each pattern notified on, to notify once per line
+    std::vector<uint64_t> trigger_lines;
+
+    // OSC 133 commands in order, numbered from commands_evicted
+    std::deque<command_mark> commands;
+    uint64_t commands_evicted = 0;
+    // rows changed since the last scan
+    std::vector<bool> dirty_rows;
+    // changed rows that scrolled into history before being scanned
+    std::deque<uint64_t> dirty_history;
     // terminal size
     int num_cols = 0;
     int num_rows = 0;
@@ -165,8 +891,67 @@ struct terminal_context {
     void ResizeTo(int new_term_row, int new_term_col);
 
     void DropFirstRowIfOverflow();
+    // rows from first to last changed, lock must be held
+    void MarkDirty(int first, int last);
+    // find urls and paths on changed rows, lock must be held
+    void ScanMatches();
+    void ScanLine(uint64_t line);
+    // row at absolute line, null if evicted or below screen
+    const std::vector<term_char> *AbsoluteLine(uint64_t line) const;
+    // text between absolute positions, rows are joined by newline unless wrapped
+    std::string TextBetween(uint64_t from_line, int from_col, uint64_t to_line, int to_col) const;
+    void HandleCommandMark(int mark, const std::vector<std::string> &parts);
+    // feed character committed at column of cursor row to triggers
+    void FeedTriggers(uint32_t codepoint, int char_col);
+    void UseTriggers(std::shared_ptr<const trigger_automaton> automaton);
+    // command n counted since start, negative from the last, null if evicted
+    const command_mark *Command(int64_t n) const;
+    // output of command so far
+    std::string CommandOutput(const command_mark &command) const;
+
+    // history lines [snapshot_first, snapshot_end) are in snapshot file
+    // taking snapshot_bytes, it is rewritten when stale
+    uint64_t snapshot_first = 0;
+    uint64_t snapshot_end = 0;
+    uint64_t snapshot_bytes = 0;
+    bool snapshot_stale = true;
+    // snapshot file written last, -1 if none
+    int snapshot_index = -1;
+    // modes, styles, links and commands, rows and cursor are sent apart
+    // to ui of daemon, see daemon_messages
+    void EncodeModes(std::string &out) const;
+    bool DecodeModes(snapshot_reader &in);
+    // modes, cursor and screen
+    void EncodeState(std::string &out) const;
+    bool DecodeState(snapshot_reader &in);
+    // state and whole history, for ui attaching to daemon
+    void EncodeAll(std::string &state, std::string &history_data) const;
+    // encode state and screen, and history lines not in file yet,
+    // file is truncated first if rewrite is set, lock must be held
+    void EncodeSnapshot(std::string &state, std::string &history_data, bool &rewrite);
+    // restore from encoded state and history file, false if state is invalid
+    // history that does not match state is dropped
+    bool DecodeSnapshot(const std::string &state, const std::string &history_data);
+
+    // selection in absolute lines, kept while lines scroll into history
+    text_selection selection;
+    // first and last selected cell after extending words and lines,
+    // false if nothing is selected
+    bool SelectionBounds(cell_position &from, cell_position &to) const;
+    // columns [begin, end) of line within bounds
+    void SelectedColumns(const cell_position &from, const cell_position &to, uint64_t line, int &begin,
+                         int &end) const;
+    std::string SelectedText() const;
 
     void InsertUtf8(uint32_t codepoint);
+    // the last character written, which following codepoints of
+    // its grapheme cluster join
+    int cluster_row = -1;
+    int cluster_col = 0;
+    int cluster_end_col = 0;
+    uint32_t last_codepoint = 0;
+    int32_t grapheme_state = 0;
+    void JoinCluster(uint32_t codepoint);
 
     // clamp cursor to valid range
     void ClampCursor();
@@ -177,31 +962,197 @@ struct terminal_context {
     // move cursor in relative position
     void MoveCursor(int row_diff, int col_diff);
 
-    // write data to pty until fully sent
-    void WriteFull(uint8_t *data, size_t length);
+    // queue reply to pty, keep the order of replies
+    void QueueReply(const uint8_t *data, size_t length);
+    // move overflowed replies into ring
+    void DrainRepliesOverflow();
+    // wake up io thread to flush writes
+    void WakeWriter();
 
+    // append to escape_buffer, up to max_escape_length
+    void AppendEscape(uint8_t current);
     // handle CSI escape sequences
     void HandleCSI(uint8_t current);
+    // handle OSC escape sequences, without terminator
+    void HandleOSC(const std::string &buffer);
+    // decode OSC 52 payload, return bytes consumed
+    size_t ConsumeClipboard(const uint8_t *data, size_t length);
+    // OSC 52 payload is terminated
+    void FinishClipboard();
+    // handle CSI u sequences of kitty keyboard protocol
+    void HandleKittyKeyboard();
+
+    // encode key press according to keyboard modes, lock must be held
+    // key is one of terminal_keys, text is utf8 produced by text keys
+    std::string EncodeKey(int key, int modifiers, const std::string &text) const;
+    // kitty graphics protocol, lock must be held
+    size_t ConsumeGraphics(const uint8_t *data, size_t length);
+    void FinishGraphics();
+    void HandleGraphics(const std::string &keys, std::string &payload);
+    bool LoadImage(const std::map<char, int> &keys, std::string &payload, graphics_image &image,
+                   std::string &error);
+    void PlaceImage(const std::map<char, int> &keys, const graphics_image &image);
+    void DeleteImages(const std::map<char, int> &keys);
+    void StoreImage(graphics_image &&image);
+    void ReplyGraphics(const std::map<char, int> &keys, const std::string &message);
+    uint32_t UnusedImageId() const;
+    // count references to links and free unused ones
+    void CollectLinks();
+    // sixel image is terminated, place it at cursor
+    void FinishSixel();
+    // tmux control mode, lock must be held
+    void StartTmux();
+    void AppendTmuxLine(const char *data, size_t length);
+    void HandleTmuxLine(const std::string &line);
+    void HandleTmuxResponse(const tmux_command &command, bool success);
+    void HandleTmuxLayout(int window, const std::string &layout);
+    void HandleTmuxOutput(int pane, const std::string &data);
+    void CloseTmuxPane(int pane);
+    void ExitTmux();
+    // queue command to tmux, io thread writes it
+    // return false if too many are queued
+    bool SendTmuxCommand(tmux_command_kinds kind, int pane, const std::string &command);
+    // move queued tmux commands into replies, called by io thread
+    void FlushTmuxCommands();
+
+    // predict echo of input sent to program, lock must be held
+    void PredictInput(const uint8_t *data, size_t length);
+    // program wrote codepoint at cursor, confirm or roll back predictions
+    void ConfirmPrediction(uint32_t codepoint);
+    // whether predictions should be drawn now
+    bool ShowPredictions(uint64_t msec) const;
+
+    // encode mouse event according to tracking mode and encoding, empty if not reported
+    std::string EncodeMouse(int action, int button, int modifiers, int mouse_row, int mouse_col) const;
+    // bytes to send for mouse event at cell, lock must be held
+    // motion is reported at most once per frame when cell changes,
+    // the rest is coalesced and sent before the next report or when frame ends
+    std::string MouseReport(int action, int button, int modifiers, int new_row, int new_col, uint64_t frame);
+    // coalesced motion to send when frame ends, lock must be held
+    std::string FlushMouseMotion();
 
 
     void Parse(uint8_t input);
 
-    // wrapper that calls ctx->Worker
-    static void *TerminalWorker(void * data);
-    // poll fds and feed to terminal Parse
-    void Worker();
+    // feed program output to terminal Parse
+    void HandleOutput(const uint8_t *data, size_t length);
+    // read from pty and feed to terminal Parse
+    // called by io thread when pty is readable
+    // return value of read()
+    ssize_t HandleRead();
+    // all slave fds of pty are closed
+    void HandleHangup();
+    // reap child, drain its output and restart
+    // called by io thread when pidfd is readable
+    void HandleExit();
+    // print message and launch a new program
+    void Restart();
+
+    // queue paste to be streamed to pty in chunks
+    void QueuePaste(const uint8_t *data, size_t length);
+    // whether anything waits to be written to pty
+    bool HasPendingWrites();
+    // collect pending writes into iovec: replies, input, then a chunk of paste
+    // return number of iovec used, at most 5
+    int GatherWrites(struct iovec *iov, size_t &reply_bytes, size_t &input_bytes);
+    // release written bytes in the order they were gathered
+    void ReleaseWritten(const struct iovec *iov, int iovcnt, size_t reply_bytes, size_t input_bytes, size_t size);
+    // drop everything pending, pty is gone
+    void DiscardWrites(size_t reply_bytes, size_t input_bytes);
+    // write as much pending data as possible in one syscall
+    // return true if pty is full
+    bool FlushWrites();
+    // ask io thread to wait for POLLOUT or not
+    void UpdateWriteInterest(bool pty_full);
 
-    // fork & create pty
+    // launch shell on a pty, adopting the standby shell if ready,
+    // and register it to io thread
     // assume lock is held
-    void Fork();
+    void Spawn();
 };
 
-// start a terminal
+// start io thread and the first terminal
 void Start();
+// create a new session, return its id
+// screen and history are restored from snapshot path if valid
+int CreateSession(const std::string &snapshot = "");
+// directory of snapshots, sessions in it are restored by Start
+void SetSnapshotDir(const std::string &dir);
+// run sessions without ui in this process, which attaches over unix
+// socket at path, return when the last session is closed
+void RunDaemon(const std::string &path);
+// sessions are run by daemon listening at path, Start attaches to it,
+// forking one if none is running, they outlive ui then
+void SetDaemonSocket(const std::string &path);
+// serve screen of active session to viewers at path, see grid_encoder,
+// each frame is preceded by its varint length
+void ServeGridViewers(const std::string &path);
+// record output of session to asciicast v2 file at path, replacing it,
+// a thread of its own writes it
+bool StartRecording(const std::string &path, int session = -1);
+// stop recording, what was recorded is still written
+bool StopRecording(int session = -1);
+bool IsRecording(int session = -1);
+// stop all recordings and wait until they are written
+void FinishRecordings();
+// save all sessions to snapshot directory, history is appended
+// to what was saved before, false if any could not be written
+bool SaveSnapshot();
+// save session to snapshot file at index, rewritten if it held another session
+bool SaveSessionSnapshot(terminal_context *ctx, int index);
+// show session on screen
+bool SwitchSession(int id);
+// close session and kill its program
+bool CloseSession(int id);
+// exit status of last program in session, -1 if none exited yet
+int GetExitStatus(int id);
+// wake up io thread, e.g. paste is ready
+void WakeEventLoop();
 // start rendering
 void StartRender();
-// send data to terminal
-void SendData(uint8_t *data, size_t length);
+// send data to terminal, return bytes accepted
+// the rest should be retried later
+// session -1 is the one shown on screen
+size_t SendData(const uint8_t *data, size_t length, int session = -1);
+// pointer position in pixels, hovered link is underlined, -1 when it leaves
+void SetHover(int x, int y);
+// uri of link at position in pixels, empty if none
+std::string GetLinkAt(int x, int y, int session = -1);
+// url or file path detected at position in pixels, empty if none
+std::string GetMatchAt(int x, int y, int session = -1);
+// compile output triggers for all sessions, false with error if invalid
+bool SetTriggers(std::vector<trigger_pattern> patterns, std::string &error);
+// shell integration (OSC 133), n counts commands since the session
+// started, negative n counts from the last one
+// scroll so that prompt n of session on screen is at top
+bool ScrollToPrompt(int64_t n);
+// scroll to prompt delta commands away from the top of screen
+bool JumpToPrompt(int delta);
+// copy output of command n, false if unknown or evicted
+bool CopyCommandOutput(int64_t n = -1, int session = -1);
+// marks and timing of command n, index is n counted from start
+bool GetCommand(int64_t n, command_mark &command, int64_t &index, int session = -1);
+// selection in session on screen, position in pixels from top left of surface
+void StartSelection(int x, int y, int mode);
+void ExtendSelection(int x, int y);
+void SelectAll();
+void ClearSelection();
+// selected text as utf8, empty if none
+std::string GetSelection();
+// copy selected text, false if none
+bool CopySelection();
+// encode key press and send it to terminal, return bytes accepted
+// session -1 is the one shown on screen
+size_t SendKey(int key, int modifiers, const std::string &text, int session = -1);
+// report mouse event at pixels from top left of surface
+// return false if program does not track mouse, e.g. scroll locally
+// session -1 is the one shown on screen
+bool SendMouse(int action, int button, int modifiers, int x, int y, int session = -1);
+// paste into terminal, streamed to pty by io thread
+// session -1 is the one shown on screen
+void Paste(const uint8_t *data, size_t length, int session = -1);
+// progress of pastes in session, false if none is in progress
+bool GetPasteProgress(int session, size_t &written, size_t &total);
 // resize window
 void Resize(int width, int height);
 void ScrollBy(double offset);
@@ -210,10 +1161,21 @@ void ScrollBy(double offset);
 extern void BeforeDraw();
 extern void AfterDraw();
 extern void ResizeWidth(int new_width);
-// copy/paste with base64 encoded string
-extern void Copy(std::string base64);
+// copy decoded text, paste with base64 encoded string
+extern void Copy(std::string text);
 extern void RequestPaste();
 extern std::string GetPaste();
+// notifications, called from io thread with sessions_lock held
+extern void Bell(int session);
+extern void SetTitle(int session, std::string title);
+extern void ProgramExited(int session, int status);
+// session of a tmux pane is created or freed, sessions_lock held
+extern void SessionChanged(int session, bool opened);
+// output trigger pattern matched, notified once per line
+extern void TriggerMatched(int session, int pattern, const std::string &text);
+// called from render thread when cursor moves,
+// in pixels from top left of surface
+extern void CursorMoved(int x, int y, int width, int height);
 
 // huge it is intentionally kept here
 static constexpr uint32_t color_map_256[] = {
@@ -1,9 +1,15 @@
 // build with:
-// g++ test.cpp terminal.cpp -I/usr/include/freetype2 -DSTANDALONE -DTESTING -o test -lCatch2Main -lCatch2 -lfreetype -lGLESv2 -lglfw
+// g++ test.cpp terminal.cpp -I/usr/include/freetype2 -DSTANDALONE -DTESTING -o test -lCatch2Main -lCatch2 -lfreetype -lGLESv2 -lglfw -lz
 #include "terminal.h"
 #include <catch2/catch_test_macros.hpp>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 #include <nlohmann/json.hpp>
 using json = nlohmann::json;
 
@@ -340,6 +346,1198 @@ TEST_CASE( "Tab Clear", "" ) {
     REQUIRE( ctx.col == 79 );
 }
 
+TEST_CASE( "Replies are queued in order", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+
+    // CSI c, Primary DA
+    for (char ch : std::string("\x1b[c")) {
+        ctx.Parse(ch);
+    }
+    // CSI 5 n, DSR
+    for (char ch : std::string("\x1b[5n")) {
+        ctx.Parse(ch);
+    }
+
+    std::string expected = "\x1b[?1;2c\x1b[0n";
+    REQUIRE( ctx.replies.Size() == expected.size() );
+    const uint8_t *ptr;
+    size_t len = ctx.replies.Peek(&ptr);
+    REQUIRE( std::string((const char *)ptr, len) == expected );
+    ctx.replies.Pop(len);
+    REQUIRE( ctx.replies.Size() == 0 );
+
+    // fill the ring, later replies must wait in overflow
+    std::vector<uint8_t> filler(spsc_ring::capacity - 2, 'x');
+    REQUIRE( ctx.replies.PushAll(filler.data(), filler.size()) );
+    for (char ch : std::string("\x1b[c")) {
+        ctx.Parse(ch);
+    }
+    REQUIRE( ctx.replies.Free() == 0 );
+    // partially moved into ring, order is kept
+    REQUIRE( ctx.replies_overflow == "?1;2c" );
+}
+
+TEST_CASE( "Base64 decoder", "" ) {
+    base64_decoder decoder;
+    std::string out;
+
+    // split anywhere, padding ends the quantum
+    std::string input = "aGVsbG8sIHdvcmxk";
+    for (size_t split = 0; split <= input.size(); split++) {
+        decoder.Reset();
+        out.clear();
+        REQUIRE( decoder.Decode((const uint8_t *)input.data(), split, &out) == split );
+        REQUIRE( decoder.Decode((const uint8_t *)input.data() + split, input.size() - split, &out) == input.size() - split );
+        REQUIRE( out == "hello, world" );
+    }
+
+    decoder.Reset();
+    out.clear();
+    input = "aGk=\x07";
+    REQUIRE( decoder.Decode((const uint8_t *)input.data(), input.size(), &out) == 4 );
+    REQUIRE( out == "hi" );
+}
+
+TEST_CASE( "OSC 52 copy is decoded while streaming", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+
+    for (char ch : std::string("\x1b]52;c;aGVsbG8=")) {
+        ctx.Parse(ch);
+    }
+    REQUIRE( ctx.escape_state == state_osc_52 );
+    REQUIRE( ctx.clipboard == "hello" );
+    // payload never goes into escape buffer
+    REQUIRE( ctx.escape_buffer == "52;c;" );
+    for (char ch : std::string("\x1b\\")) {
+        ctx.Parse(ch);
+    }
+    REQUIRE( ctx.escape_state == state_idle );
+    REQUIRE( ctx.clipboard.empty() );
+
+    // paste request still works
+    for (char ch : std::string("\x1b]52;c;?\x07")) {
+        ctx.Parse(ch);
+    }
+    REQUIRE( ctx.escape_state == state_idle );
+    REQUIRE( ctx.paste_requested );
+}
+
+TEST_CASE( "Oversized escape sequences are bounded", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+
+    // long title is truncated and ignored
+    ctx.Parse('\x1b');
+    ctx.Parse(']');
+    ctx.Parse('0');
+    ctx.Parse(';');
+    for (size_t i = 0; i < max_escape_length * 2; i++) {
+        ctx.Parse('t');
+    }
+    REQUIRE( ctx.escape_buffer.size() == max_escape_length );
+    ctx.Parse('\x1b');
+    ctx.Parse('\\');
+    REQUIRE( ctx.escape_state == state_idle );
+
+    // oversized copy is dropped as it streams in
+    for (char ch : std::string("\x1b]52;c;")) {
+        ctx.Parse(ch);
+    }
+    std::string chunk(4096, 'A');
+    for (size_t i = 0; i <= max_clipboard_size / 3072; i++) {
+        ctx.ConsumeClipboard((const uint8_t *)chunk.data(), chunk.size());
+    }
+    REQUIRE( ctx.clipboard_rejected );
+    REQUIRE( ctx.clipboard.empty() );
+    ctx.Parse('\x07');
+    REQUIRE( ctx.escape_state == state_idle );
+    REQUIRE( !ctx.clipboard_rejected );
+
+    // text after it is printed as usual
+    ctx.Parse('x');
+    REQUIRE( ctx.buffer[0][0].code == 'x' );
+}
+
+TEST_CASE( "Window title and bell", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+
+    // title may contain ';'
+    for (char ch : std::string("\x1b]2;vim; main.c\x07")) {
+        ctx.Parse(ch);
+    }
+    REQUIRE( ctx.title == "vim; main.c" );
+    for (char ch : std::string("\x1b]0;shell\x1b\\")) {
+        ctx.Parse(ch);
+    }
+    REQUIRE( ctx.title == "shell" );
+
+    // bell does not move cursor
+    ctx.Parse('a');
+    ctx.Parse('\x07');
+    REQUIRE( ctx.row == 0 );
+    REQUIRE( ctx.col == 1 );
+}
+
+TEST_CASE( "Key encoding follows keyboard modes", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+    auto feed = [&](const std::string &s) {
+        for (char ch : s) {
+            ctx.Parse(ch);
+        }
+    };
+
+    // legacy
+    REQUIRE( ctx.EncodeKey(key_up, 0, "") == "\x1b[A" );
+    REQUIRE( ctx.EncodeKey(key_up, mod_ctrl, "") == "\x1b[1;5A" );
+    REQUIRE( ctx.EncodeKey(key_f1, 0, "") == "\x1bOP" );
+    REQUIRE( ctx.EncodeKey(key_f5, mod_shift, "") == "\x1b[15;2~" );
+    REQUIRE( ctx.EncodeKey(key_tab, mod_shift, "") == "\x1b[Z" );
+    REQUIRE( ctx.EncodeKey(key_none, mod_ctrl, "c") == "\x03" );
+    REQUIRE( ctx.EncodeKey(key_none, mod_alt, "x") == "\x1bx" );
+    REQUIRE( ctx.EncodeKey(key_none, mod_shift, "A") == "A" );
+    REQUIRE( ctx.EncodeKey(key_kp_5, 0, "5") == "5" );
+
+    // DECCKM and DECKPAM
+    feed("\x1b[?1h\x1b=");
+    REQUIRE( ctx.EncodeKey(key_up, 0, "") == "\x1bOA" );
+    REQUIRE( ctx.EncodeKey(key_up, mod_shift, "") == "\x1b[1;2A" );
+    REQUIRE( ctx.EncodeKey(key_kp_5, 0, "5") == "\x1bOu" );
+    REQUIRE( ctx.EncodeKey(key_kp_enter, 0, "\r") == "\x1bOM" );
+    feed("\x1b[?1l\x1b>");
+    REQUIRE( ctx.EncodeKey(key_up, 0, "") == "\x1b[A" );
+    REQUIRE( ctx.EncodeKey(key_kp_enter, 0, "\r") == "\r" );
+
+    // modifyOtherKeys
+    feed("\x1b[>4;1m");
+    REQUIRE( ctx.modify_other_keys == 1 );
+    REQUIRE( ctx.EncodeKey(key_none, mod_ctrl, "c") == "\x03" );
+    REQUIRE( ctx.EncodeKey(key_none, mod_ctrl, ",") == "\x1b[27;5;44~" );
+    feed("\x1b[>4;2m");
+    REQUIRE( ctx.EncodeKey(key_none, mod_ctrl, "c") == "\x1b[27;5;99~" );
+    REQUIRE( ctx.EncodeKey(key_enter, mod_ctrl, "") == "\x1b[27;5;13~" );
+    REQUIRE( ctx.EncodeKey(key_none, mod_shift, "A") == "A" );
+    feed("\x1b[>4m");
+    REQUIRE( ctx.modify_other_keys == 0 );
+
+    // kitty keyboard protocol
+    feed("\x1b[>1u");
+    REQUIRE( ctx.kitty_keyboard == kitty_disambiguate );
+    REQUIRE( ctx.EncodeKey(key_escape, 0, "") == "\x1b[27u" );
+    REQUIRE( ctx.EncodeKey(key_none, mod_ctrl | mod_shift, "A") == "\x1b[97;6u" );
+    REQUIRE( ctx.EncodeKey(key_none, 0, "a") == "a" );
+    REQUIRE( ctx.EncodeKey(key_enter, 0, "") == "\r" );
+    REQUIRE( ctx.EncodeKey(key_f3, 0, "") == "\x1b[13~" );
+    REQUIRE( ctx.EncodeKey(key_kp_0, 0, "0") == "\x1b[57399u" );
+    feed("\x1b[=8;2u");
+    REQUIRE( ctx.kitty_keyboard == (kitty_disambiguate | kitty_report_all_keys) );
+    REQUIRE( ctx.EncodeKey(key_none, 0, "a") == "\x1b[97u" );
+    REQUIRE( ctx.EncodeKey(key_enter, 0, "") == "\x1b[13u" );
+    REQUIRE( ctx.EncodeKey(key_none, 0, "\xc3\xa9") == "\x1b[233u" );
+
+    // query
+    feed("\x1b[?u");
+    const uint8_t *reply;
+    size_t length = ctx.replies.Peek(&reply);
+    REQUIRE( std::string((const char *)reply, length) == "\x1b[?9u" );
+    ctx.replies.Pop(length);
+
+    // pop restores legacy encoding
+    feed("\x1b[<u");
+    REQUIRE( ctx.kitty_keyboard == 0 );
+    REQUIRE( ctx.EncodeKey(key_escape, 0, "") == "\x1b" );
+}
+
+TEST_CASE( "Mouse reporting", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+    auto feed = [&](const std::string &s) {
+        for (char ch : s) {
+            ctx.Parse(ch);
+        }
+    };
+
+    REQUIRE( ctx.EncodeMouse(mouse_press, mouse_left, 0, 0, 0) == "" );
+
+    // X10 reports press only, without modifiers
+    feed("\x1b[?9h");
+    REQUIRE( ctx.EncodeMouse(mouse_press, mouse_left, mod_ctrl, 2, 4) == "\x1b[M\x20\x25\x23" );
+    REQUIRE( ctx.EncodeMouse(mouse_release, mouse_left, 0, 2, 4) == "" );
+
+    // normal tracking, release is button 3
+    feed("\x1b[?1000h");
+    REQUIRE( ctx.EncodeMouse(mouse_press, mouse_right, mod_ctrl, 0, 0) == "\x1b[M\x32\x21\x21" );
+    REQUIRE( ctx.EncodeMouse(mouse_release, mouse_right, 0, 0, 0) == "\x1b[M\x23\x21\x21" );
+    REQUIRE( ctx.EncodeMouse(mouse_press, mouse_wheel_down, 0, 0, 0) == "\x1b[M\x61\x21\x21" );
+    REQUIRE( ctx.EncodeMouse(mouse_motion, mouse_left, 0, 0, 1) == "" );
+    // too far for a byte
+    REQUIRE( ctx.EncodeMouse(mouse_press, mouse_left, 0, 0, 300) == "" );
+
+    // utf8 encoding
+    feed("\x1b[?1005h");
+    REQUIRE( ctx.EncodeMouse(mouse_press, mouse_left, 0, 0, 300) == "\x1b[M\x20\xc5\x8d\x21" );
+
+    // SGR encoding keeps button on release
+    feed("\x1b[?1006h");
+    REQUIRE( ctx.EncodeMouse(mouse_press, mouse_left, 0, 9, 19) == "\x1b[<0;20;10M" );
+    REQUIRE( ctx.EncodeMouse(mouse_release, mouse_left, 0, 9, 19) == "\x1b[<0;20;10m" );
+
+    // button event tracking reports motion while button is held
+    feed("\x1b[?1002h");
+    REQUIRE( ctx.EncodeMouse(mouse_motion, mouse_no_button, 0, 1, 1) == "" );
+    REQUIRE( ctx.EncodeMouse(mouse_motion, mouse_left, 0, 1, 1) == "\x1b[<32;2;2M" );
+    feed("\x1b[?1003h");
+    REQUIRE( ctx.EncodeMouse(mouse_motion, mouse_no_button, 0, 1, 1) == "\x1b[<35;2;2M" );
+
+    feed("\x1b[?1003l\x1b[?1006l");
+    REQUIRE( ctx.mouse_tracking == mouse_tracking_off );
+    REQUIRE( ctx.mouse_encoding == mouse_encoding_default );
+}
+
+TEST_CASE( "Mouse motion is coalesced per frame", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+    for (char ch : std::string("\x1b[?1002h\x1b[?1006h")) {
+        ctx.Parse(ch);
+    }
+
+    REQUIRE( ctx.MouseReport(mouse_press, mouse_left, 0, 0, 0, 1) == "\x1b[<0;1;1M" );
+    // first cell change in frame is reported
+    REQUIRE( ctx.MouseReport(mouse_motion, mouse_no_button, 0, 0, 1, 1) == "\x1b[<32;2;1M" );
+    // the rest of frame is coalesced
+    for (int col = 2; col < 50; col++) {
+        REQUIRE( ctx.MouseReport(mouse_motion, mouse_no_button, 0, 0, col, 1) == "" );
+    }
+    // same cell is never reported
+    REQUIRE( ctx.MouseReport(mouse_motion, mouse_no_button, 0, 0, 49, 1) == "" );
+    // release flushes the last motion first
+    REQUIRE( ctx.MouseReport(mouse_release, mouse_left, 0, 0, 49, 1) == "\x1b[<32;50;1M\x1b[<0;50;1m" );
+    REQUIRE( ctx.FlushMouseMotion() == "" );
+    // no button held, no motion reported
+    REQUIRE( ctx.MouseReport(mouse_motion, mouse_no_button, 0, 1, 1, 3) == "" );
+
+    // last motion is sent when frame ends
+    REQUIRE( ctx.MouseReport(mouse_press, mouse_left, 0, 0, 0, 4) == "\x1b[<0;1;1M" );
+    REQUIRE( ctx.MouseReport(mouse_motion, mouse_no_button, 0, 0, 1, 4) == "\x1b[<32;2;1M" );
+    REQUIRE( ctx.MouseReport(mouse_motion, mouse_no_button, 0, 0, 5, 4) == "" );
+    REQUIRE( ctx.FlushMouseMotion() == "\x1b[<32;6;1M" );
+    REQUIRE( ctx.FlushMouseMotion() == "" );
+    // next frame reports at once, nothing left to flush
+    REQUIRE( ctx.MouseReport(mouse_motion, mouse_no_button, 0, 0, 6, 5) == "\x1b[<32;7;1M" );
+    REQUIRE( ctx.FlushMouseMotion() == "" );
+    REQUIRE( ctx.MouseReport(mouse_release, mouse_left, 0, 0, 6, 5) == "\x1b[<0;7;1m" );
+}
+
+TEST_CASE( "Predictive echo", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+    auto feed = [&](const std::string &s) {
+        for (char ch : s) {
+            ctx.Parse(ch);
+        }
+    };
+    auto type = [&](const std::string &s) {
+        ctx.PredictInput((const uint8_t *)s.data(), s.size());
+    };
+
+    feed("$ ");
+    type("ls");
+    REQUIRE( ctx.predictions.size() == 2 );
+    REQUIRE( ctx.prediction_col == 2 );
+    // fast echo is measured but not shown
+    feed("l");
+    REQUIRE( ctx.predictions.size() == 1 );
+    REQUIRE( ctx.echo_latency >= 0 );
+    REQUIRE( !ctx.ShowPredictions(ctx.predictions.front().msec) );
+
+    // slow link shows them until echoed
+    ctx.echo_latency = 200;
+    REQUIRE( ctx.ShowPredictions(ctx.predictions.front().msec) );
+    REQUIRE( !ctx.ShowPredictions(ctx.predictions.front().msec + prediction_timeout + 1) );
+    feed("s");
+    REQUIRE( ctx.predictions.empty() );
+
+    // backspace erases prediction, mismatch rolls back
+    type("ab\x7f");
+    REQUIRE( ctx.predictions.size() == 1 );
+    feed("x");
+    REQUIRE( ctx.predictions.empty() );
+
+    // control keys and escape sequences are not predicted
+    type("c\x1b[A");
+    REQUIRE( ctx.predictions.empty() );
+
+    // no prediction after password prompt until enter
+    feed("\r\nPassword: ");
+    type("secret");
+    REQUIRE( ctx.predictions.empty() );
+    REQUIRE( ctx.prediction_paused );
+    type("\r");
+    feed("\r\n$ ");
+    type("v");
+    REQUIRE( ctx.predictions.size() == 1 );
+
+    // nor on alternate screen
+    feed("v\x1b[?1049h");
+    type("i");
+    REQUIRE( ctx.predictions.empty() );
+}
+
+TEST_CASE( "tmux control mode", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+    auto feed = [&](const std::string &s) {
+        for (char ch : s) {
+            ctx.Parse(ch);
+        }
+    };
+
+    // DCS 1000 p enters control mode and asks for size and windows
+    feed("\x1bP1000p");
+    REQUIRE( ctx.escape_state == state_tmux );
+    REQUIRE( ctx.tmux.outgoing == "refresh-client -C 80x24\n"
+                                  "list-windows -F \"#{window_id} #{window_layout}\"\n" );
+    feed("%begin 1 1 0\r\n%end 1 1 0\r\n");
+    feed("%begin 1 2 0\n%end 1 2 0\n");
+    REQUIRE( ctx.tmux.commands.size() == 1 );
+
+    // windows with two panes split horizontally
+    feed("%begin 1 3 0\n@1 b25d,80x24,0,0{40x24,0,0,1,39x24,41,0,2}\n%end 1 3 0\n");
+    REQUIRE( ctx.tmux.commands.empty() );
+    REQUIRE( ctx.tmux.new_panes.size() == 2 );
+    REQUIRE( ctx.tmux.new_panes[1].cols == 40 );
+    REQUIRE( ctx.tmux.new_panes[2].cols == 39 );
+    REQUIRE( ctx.tmux.new_panes[2].window == 1 );
+
+    // output is unescaped and held until pane is ready
+    feed("%output %1 a\\033[1mb\\134c\n");
+    REQUIRE( ctx.tmux.held_output[1] == "a\x1b[1mb\\c" );
+
+    // pane leaves layout
+    feed("%layout-change @1 5c1d,80x24,0,0,1 5c1d,80x24,0,0,1 *\n");
+    REQUIRE( ctx.tmux.new_panes.size() == 1 );
+    REQUIRE( ctx.tmux.new_panes[1].cols == 80 );
+
+    // nothing on screen of control mode
+    REQUIRE( ctx.row == 0 );
+    REQUIRE( ctx.col == 0 );
+
+    feed("%exit\n\x1b\\");
+    REQUIRE( ctx.escape_state == state_idle );
+    REQUIRE( ctx.tmux.new_panes.empty() );
+    feed("a");
+    REQUIRE( ctx.col == 1 );
+
+    // endless line is not tmux, control mode is left
+    feed("\x1bP1000p");
+    REQUIRE( ctx.escape_state == state_tmux );
+    feed(std::string(max_tmux_line, 'x'));
+    REQUIRE( ctx.escape_state == state_tmux );
+    REQUIRE( ctx.tmux.line.size() == max_tmux_line );
+    feed("x");
+    REQUIRE( ctx.escape_state == state_idle );
+    REQUIRE( ctx.tmux.line.empty() );
+}
+
+static std::string Base64(const std::string &data) {
+    const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < data.size(); i += 3) {
+        uint32_t quantum = (uint8_t)data[i] << 16;
+        if (i + 1 < data.size()) {
+            quantum |= (uint8_t)data[i + 1] << 8;
+        }
+        if (i + 2 < data.size()) {
+            quantum |= (uint8_t)data[i + 2];
+        }
+        // n bytes give n + 1 characters, padded to 4
+        size_t n = std::min(data.size() - i, (size_t)3);
+        for (size_t j = 0; j < 4; j++) {
+            out += j <= n ? alphabet[(quantum >> (18 - j * 6)) & 63] : '=';
+        }
+    }
+    return out;
+}
+
+static std::string Deflate(const std::string &data) {
+    std::string out(compressBound(data.size()), '\0');
+    uLongf length = out.size();
+    compress((Bytef *)&out[0], &length, (const Bytef *)data.data(), data.size());
+    out.resize(length);
+    return out;
+}
+
+TEST_CASE( "Kitty graphics", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+    auto feed = [&](const std::string &s) {
+        for (char ch : s) {
+            ctx.Parse(ch);
+        }
+    };
+    auto reply = [&]() {
+        std::string result;
+        const uint8_t *ptr;
+        size_t len;
+        while ((len = ctx.replies.Peek(&ptr)) > 0) {
+            result.append((const char *)ptr, len);
+            ctx.replies.Pop(len);
+        }
+        return result;
+    };
+
+    // 2x1 RGB, transmitted and displayed at cursor
+    feed("\x1b_Ga=T,f=24,s=2,v=1,i=1;" + Base64(std::string("\xff\x00\x00\x00\xff\x00", 6)) + "\x1b\\");
+    REQUIRE( reply() == "\x1b_Gi=1;OK\x1b\\" );
+    REQUIRE( ctx.images[1].width == 2 );
+    REQUIRE( ctx.images[1].pixels == std::string("\xff\x00\x00\xff\x00\xff\x00\xff", 8) );
+    REQUIRE( ctx.placements.size() == 1 );
+    REQUIRE( ctx.placements[0].cols == 1 );
+    REQUIRE( ctx.placements[0].rows == 1 );
+    REQUIRE( ctx.col == 1 );
+
+    // chunked and compressed, quiet
+    std::string payload = Base64(Deflate(std::string(4 * 4 * 4, '\x7f')));
+    feed("\x1b_Ga=t,f=32,s=4,v=4,o=z,i=2,q=1,m=1;" + payload.substr(0, 8) + "\x1b\\");
+    REQUIRE( ctx.images.count(2) == 0 );
+    feed("\x1b_Gm=1;" + payload.substr(8, 8) + "\x1b\\");
+    feed("\x1b_Gm=0;" + payload.substr(16) + "\x1b\\");
+    REQUIRE( reply() == "" );
+    REQUIRE( ctx.images[2].pixels == std::string(64, '\x7f') );
+
+    // placed scaled to 4 columns, cursor stays with C=1
+    feed("\x1b_Ga=p,i=2,p=7,c=4,C=1\x1b\\");
+    REQUIRE( reply() == "\x1b_Gi=2,p=7;OK\x1b\\" );
+    REQUIRE( ctx.placements[1].cols == 4 );
+    REQUIRE( ctx.col == 1 );
+    feed("\x1b_Ga=p,i=3\x1b\\");
+    REQUIRE( reply() == "\x1b_Gi=3;ENOENT:image not found\x1b\\" );
+
+    // PNG: 2x1 RGB with sub filter
+    auto chunk = [](const std::string &type, const std::string &data) {
+        uint32_t length = data.size();
+        std::string result = {(char)(length >> 24), (char)(length >> 16), (char)(length >> 8), (char)length};
+        return result + type + data + "crc!";
+    };
+    std::string png = "\x89PNG\r\n\x1a\n";
+    png += chunk("IHDR", std::string("\0\0\0\x02\0\0\0\x01\x08\x02\0\0\0", 13));
+    png += chunk("IDAT", Deflate(std::string("\x01\x10\x20\x30\x01\x01\x01", 7)));
+    png += chunk("IEND", "");
+    feed("\x1b_Ga=t,f=100,I=5;" + Base64(png) + "\x1b\\");
+    REQUIRE( reply() == "\x1b_Gi=2147483648,I=5;OK\x1b\\" );
+    REQUIRE( ctx.images[0x80000000].pixels == std::string("\x10\x20\x30\xff\x11\x21\x31\xff", 8) );
+
+    // file and shared memory are removed after reading
+    char path[] = "/tmp/tty-graphics-protocol-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE( write(fd, "\x01\x02\x03\x04", 4) == 4 );
+    close(fd);
+    feed("\x1b_Ga=t,t=t,s=1,v=1,i=6;" + Base64(path) + "\x1b\\");
+    REQUIRE( reply() == "\x1b_Gi=6;OK\x1b\\" );
+    REQUIRE( ctx.images[6].pixels == "\x01\x02\x03\x04" );
+    REQUIRE( access(path, F_OK) != 0 );
+
+    // temporary files elsewhere are neither read nor removed
+    mkdir("/tmp/termony-victim", 0700);
+    close(open("/tmp/termony-victim/important.txt", O_CREAT | O_WRONLY, 0600));
+    feed("\x1b_Ga=t,t=t,s=1,v=1,i=6;" + Base64("/tmp/tty-graphics-protocol/../termony-victim/important.txt") + "\x1b\\");
+    REQUIRE( reply() == "\x1b_Gi=6;EINVAL:not a temporary file of graphics protocol\x1b\\" );
+    feed("\x1b_Ga=t,t=t,s=1,v=1,i=6;" + Base64("/tmp/termony-victim/tty-graphics-protocol") + "\x1b\\");
+    REQUIRE( reply() == "\x1b_Gi=6;EINVAL:not a temporary file of graphics protocol\x1b\\" );
+    unlink("/tmp/tty-graphics-protocol-termony-link");
+    REQUIRE( symlink("/tmp/termony-victim/important.txt", "/tmp/tty-graphics-protocol-termony-link") == 0 );
+    feed("\x1b_Ga=t,t=t,s=1,v=1,i=6;" + Base64("/tmp/tty-graphics-protocol-termony-link") + "\x1b\\");
+    REQUIRE( reply().find("\x1b_Gi=6;EBADF:") == 0 );
+    REQUIRE( access("/tmp/termony-victim/important.txt", F_OK) == 0 );
+    unlink("/tmp/termony-victim/important.txt");
+    rmdir("/tmp/termony-victim");
+
+    fd = shm_open("/termony-test", O_CREAT | O_RDWR, 0600);
+    REQUIRE( write(fd, "\x05\x06\x07\x08", 4) == 4 );
+    close(fd);
+    feed("\x1b_Ga=t,t=s,s=1,v=1,i=7;" + Base64("/termony-test") + "\x1b\\");
+    REQUIRE( reply() == "\x1b_Gi=7;OK\x1b\\" );
+    REQUIRE( ctx.images[7].pixels == "\x05\x06\x07\x08" );
+    REQUIRE( shm_open("/termony-test", O_RDONLY, 0) == -1 );
+
+    feed("\x1b_Ga=q,t=f,i=8;" + Base64("/proc/self/environ") + "\x1b\\");
+    REQUIRE( reply() == "\x1b_Gi=8;EINVAL:path is not allowed\x1b\\" );
+
+    // images scroll with text
+    for (int i = 0; i < 24; i++) {
+        feed("\n");
+    }
+    REQUIRE( ctx.placements[0].row == -1 );
+
+    // delete placements, and free image 2 without placement
+    feed("\x1b_Ga=d,d=I,i=2\x1b\\");
+    REQUIRE( ctx.images.count(2) == 0 );
+    REQUIRE( ctx.placements.size() == 1 );
+    feed("\x1b_Ga=d,d=i,i=1\x1b\\");
+    REQUIRE( ctx.placements.empty() );
+    REQUIRE( ctx.images.count(1) == 1 );
+
+    // huge cell counts are clamped to screen, cursor moves at most a screen
+    uint64_t scrolled = ctx.scrolled_lines;
+    feed("\x1b_Ga=T,f=24,s=1,v=1,i=9,c=2000000000,r=50000000;AAAA\x1b\\");
+    REQUIRE( ctx.placements.back().rows <= 24 );
+    REQUIRE( ctx.placements.back().cols <= 80 );
+    REQUIRE( ctx.scrolled_lines - scrolled <= 24 );
+}
+
+TEST_CASE( "Sixel images are decoded while streaming", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+    auto feed = [&](const std::string &s) {
+        for (char ch : s) {
+            ctx.Parse(ch);
+        }
+    };
+
+    // 3 red columns, then one blue pixel in the next band, transparent background
+    std::string data = "\"1;1;3;7#1;2;100;0;0#1!3~-#2;2;0;0;100@";
+    feed("\x1bP0;1;0q");
+    REQUIRE( ctx.escape_state == state_sixel );
+    ctx.HandleOutput((const uint8_t *)data.data(), data.size());
+    feed("\x1b\\");
+    REQUIRE( ctx.escape_state == state_idle );
+    REQUIRE( ctx.images.size() == 1 );
+    const graphics_image &image = ctx.images.begin()->second;
+    REQUIRE( image.width == 3 );
+    REQUIRE( image.height == 7 );
+    REQUIRE( image.pixels.substr(0, 4) == std::string("\xff\x00\x00\xff", 4) );
+    REQUIRE( image.pixels.substr(6 * 12, 4) == std::string("\x00\x00\xff\xff", 4) );
+    REQUIRE( image.pixels[6 * 12 + 7] == 0 );
+    REQUIRE( ctx.placements.size() == 1 );
+    // cursor moves below image
+    REQUIRE( ctx.row == 1 );
+    REQUIRE( ctx.col == 0 );
+
+    // too many pixels, image is dropped
+    feed("\x1bPq!1000000~-~-~\x1b\\");
+    REQUIRE( ctx.images.size() == 1 );
+    REQUIRE( ctx.row == 1 );
+
+    // so are too many bands or blank sixels, before positions overflow
+    std::string bands(max_sixel_pixels / 6 + 1, '-');
+    feed("\x1bPq");
+    ctx.HandleOutput((const uint8_t *)bands.data(), bands.size());
+    REQUIRE( ctx.sixel.overflow );
+    feed("~\x1b\\");
+    std::string blanks;
+    for (size_t i = 0; i <= max_sixel_pixels / 1000000; i++) {
+        blanks += "!1000000?";
+    }
+    feed("\x1bPq" + blanks + "~\x1b\\");
+    REQUIRE( ctx.images.size() == 1 );
+    REQUIRE( ctx.row == 1 );
+}
+
+TEST_CASE( "OSC 8 hyperlinks", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+    auto feed = [&](const std::string &s) {
+        for (char ch : s) {
+            ctx.Parse(ch);
+        }
+    };
+
+    feed("\x1b]8;;https://example.com\x1b\\ab\x1b[0mc\x1b]8;;\x1b\\d");
+    uint16_t link = ctx.buffer[0][0].style.link;
+    REQUIRE( link != 0 );
+    REQUIRE( ctx.links.Uri(link) == "https://example.com" );
+    REQUIRE( ctx.buffer[0][1].style.link == link );
+    // SGR 0 keeps link, empty uri ends it
+    REQUIRE( ctx.buffer[0][2].style.link == link );
+    REQUIRE( ctx.buffer[0][3].style.link == 0 );
+
+    // same uri shares id, different id param does not
+    feed("\x1b]8;;https://example.com\x1b\\e\x1b]8;id=1;https://example.com\x1b\\f\x1b]8;;\x1b\\");
+    REQUIRE( ctx.buffer[0][4].style.link == link );
+    REQUIRE( ctx.buffer[0][5].style.link != link );
+    REQUIRE( ctx.links.Uri(ctx.buffer[0][5].style.link) == "https://example.com" );
+
+    // erased cells no longer reference links
+    feed("\x1b[2J\x1b[H");
+    ctx.CollectLinks();
+    REQUIRE( ctx.links.Uri(link) == "" );
+    REQUIRE( ctx.links.free_ids.size() == 2 );
+    feed("\x1b]8;;https://example.org\x1b\\g");
+    REQUIRE( ctx.links.Uri(ctx.buffer[0][0].style.link) == "https://example.org" );
+    REQUIRE( ctx.links.keys.size() == 2 );
+}
+
+TEST_CASE( "URLs and paths are detected on changed rows", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(4, 20);
+    auto feed = [&](const std::string &s) {
+        for (char ch : s) {
+            ctx.Parse(ch);
+        }
+    };
+
+    // url wraps to the next row, trailing period is not part of it
+    feed("see https://example.com/abc/def. and\r\n");
+    ctx.ScanMatches();
+    REQUIRE( ctx.buffer[0][19].style.wrap );
+    REQUIRE( ctx.matches[0].size() == 1 );
+    REQUIRE( ctx.matches[0][0].start_col == 4 );
+    REQUIRE( ctx.matches[0][0].end_col == 20 );
+    REQUIRE( ctx.matches[0][0].text == "https://example.com/abc/def" );
+    REQUIRE( ctx.matches[1][0].start_col == 0 );
+    REQUIRE( ctx.matches[1][0].end_col == 11 );
+
+    // paths with line numbers, but not dates
+    feed("src/a.cpp:12:3 1/2\r\n");
+    ctx.ScanMatches();
+    REQUIRE( ctx.matches[2].size() == 1 );
+    REQUIRE( ctx.matches[2][0].text == "src/a.cpp:12:3" );
+    REQUIRE( std::none_of(ctx.dirty_rows.begin(), ctx.dirty_rows.end(), [](bool d) { return d; }) );
+
+    // scrolling into history keeps absolute lines, erased rows lose matches
+    feed("\r\n\r\n~/notes.txt");
+    REQUIRE( ctx.scrolled_lines == 2 );
+    REQUIRE( ctx.matches[0][0].text == "https://example.com/abc/def" );
+    ctx.ScanMatches();
+    REQUIRE( ctx.matches[5][0].text == "~/notes.txt" );
+    feed("\x1b[2K");
+    REQUIRE( ctx.dirty_rows[3] );
+    ctx.ScanMatches();
+    REQUIRE( ctx.matches.count(5) == 0 );
+    REQUIRE( ctx.matches.count(2) == 1 );
+}
+
+TEST_CASE( "OSC 133 command marks", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(4, 20);
+    auto feed = [&](const std::string &s) {
+        for (char ch : s) {
+            ctx.Parse(ch);
+        }
+    };
+    auto command = [&](const std::string &line, const std::string &output, int status) {
+        feed("\x1b]133;A\x07$ \x1b]133;B\x07" + line + "\r\n\x1b]133;C\x07" + output + "\x1b]133;D;" +
+             std::to_string(status) + "\x07");
+    };
+
+    command("ls", "a  b\r\nc\r\n", 0);
+    command("false", "", 1);
+    REQUIRE( ctx.commands.size() == 2 );
+    REQUIRE( ctx.Command(0)->stage == mark_end );
+    REQUIRE( ctx.Command(0)->line[mark_prompt] == 0 );
+    REQUIRE( ctx.Command(0)->col[mark_input] == 2 );
+    REQUIRE( ctx.Command(0)->line[mark_output] == 1 );
+    REQUIRE( ctx.CommandOutput(*ctx.Command(0)) == "a  b\nc\n" );
+    REQUIRE( ctx.Command(-1)->exit_status == 1 );
+    REQUIRE( ctx.Command(-1)->line[mark_prompt] == 3 );
+    REQUIRE( ctx.CommandOutput(*ctx.Command(-1)) == "" );
+    REQUIRE( ctx.Command(2) == nullptr );
+
+    // absolute lines are kept while scrolling into history
+    command("seq 3", "1\r\n2\r\n3\r\n", 0);
+    REQUIRE( ctx.scrolled_lines > 0 );
+    REQUIRE( ctx.Command(-1)->line[mark_prompt] == 4 );
+    REQUIRE( ctx.CommandOutput(*ctx.Command(-1)) == "1\n2\n3\n" );
+    REQUIRE( ctx.CommandOutput(*ctx.Command(0)) == "a  b\nc\n" );
+
+    // running command has output up to cursor, stray marks are ignored
+    feed("\x1b]133;A\x07$ \x1b]133;C\x07xyz\x1b]133;C\x07");
+    REQUIRE( ctx.Command(-1)->stage == mark_output );
+    REQUIRE( ctx.Command(-1)->line[mark_input] == ctx.Command(-1)->line[mark_output] );
+    REQUIRE( ctx.CommandOutput(*ctx.Command(-1)) == "xyz" );
+
+    // evicted prompts keep numbering of the rest
+    feed(std::string(5010, '\n'));
+    command("yes", "y\r\n", 130);
+    REQUIRE( ctx.commands.size() == 1 );
+    REQUIRE( ctx.commands_evicted == 4 );
+    REQUIRE( ctx.Command(3) == nullptr );
+    REQUIRE( ctx.Command(4)->exit_status == 130 );
+}
+
+TEST_CASE( "Output triggers", "" ) {
+    std::vector<trigger_pattern> patterns(4);
+    patterns[0].text = "he";
+    patterns[1].text = "she";
+    patterns[2].text = "hers";
+    patterns[3].text = "error:";
+    patterns[3].highlight = true;
+    patterns[3].color = 0xff0000;
+    auto automaton = std::make_shared<trigger_automaton>();
+    std::string error;
+    REQUIRE( automaton->Compile(std::vector<trigger_pattern>(patterns), error) );
+
+    // longest pattern ending at each byte
+    std::vector<int> found;
+    uint32_t state = 0;
+    for (char ch : std::string("ushers")) {
+        state = automaton->Step(state, ch);
+        found.push_back(automaton->output[state]);
+    }
+    REQUIRE( found == std::vector<int>({-1, -1, -1, 1, -1, 2}) );
+
+    REQUIRE( !automaton->Compile({trigger_pattern()}, error) );
+    REQUIRE( !error.empty() );
+
+    // matching continues across reads, and highlights matched cells
+    terminal_context ctx;
+    ctx.ResizeTo(4, 20);
+    REQUIRE( automaton->Compile(std::move(patterns), error) );
+    ctx.UseTriggers(automaton);
+    std::string first = "x err";
+    std::string second = "or: y\r\nerr\r\nor:";
+    ctx.HandleOutput((const uint8_t *)first.data(), first.size());
+    ctx.HandleOutput((const uint8_t *)second.data(), second.size());
+    REQUIRE( ctx.buffer[0][1].style.back.value != 0xff0000 );
+    for (int i = 2; i < 8; i++) {
+        REQUIRE( ctx.buffer[0][i].style.back.value == 0xff0000 );
+    }
+    REQUIRE( ctx.buffer[0][8].style.back.value != 0xff0000 );
+    REQUIRE( ctx.trigger_lines[3] == 0 );
+    // not across lines
+    REQUIRE( ctx.buffer[1][0].style.back.value != 0xff0000 );
+    REQUIRE( ctx.buffer[2][0].style.back.value != 0xff0000 );
+}
+
+TEST_CASE( "Grapheme clusters", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(4, 20);
+    auto feed = [&](const std::string &s) {
+        for (char ch : s) {
+            ctx.Parse(ch);
+        }
+    };
+
+    // e with combining acute accent takes one cell
+    feed("e\u0301x");
+    REQUIRE( ctx.buffer[0][0].code >= term_char::CLUSTER_BASE );
+    REQUIRE( ClusterCodepoints(ctx.buffer[0][0].code) == U"e\u0301" );
+    REQUIRE( ctx.buffer[0][1].code == 'x' );
+    REQUIRE( ctx.col == 2 );
+
+    // same cluster is interned once
+    feed("e\u0301");
+    REQUIRE( ctx.buffer[0][2].code == ctx.buffer[0][0].code );
+
+    // ZWJ sequence is one wide cell, emoji presentation widens a narrow symbol
+    feed("\r\n\U0001F468\u200D\U0001F469|\u2764\uFE0F|");
+    REQUIRE( ClusterCodepoints(ctx.buffer[1][0].code) == U"\U0001F468\u200D\U0001F469" );
+    REQUIRE( CodeWidth(ctx.buffer[1][0].code) == 2 );
+    REQUIRE( ctx.buffer[1][1].code == term_char::WIDE_TAIL );
+    REQUIRE( ctx.buffer[1][2].code == '|' );
+    REQUIRE( CodeWidth(ctx.buffer[1][3].code) == 2 );
+    REQUIRE( ctx.buffer[1][4].code == term_char::WIDE_TAIL );
+    REQUIRE( ctx.buffer[1][5].code == '|' );
+
+    std::string text;
+    AppendCode(text, ctx.buffer[1][0].code);
+    REQUIRE( text == "\U0001F468\u200D\U0001F469" );
+
+    // mark after cursor moved does not join, nor does it take a cell
+    feed("a\x1b[Cb\x1b[D\u0301");
+    REQUIRE( ctx.buffer[1][6].code == 'a' );
+    REQUIRE( ctx.buffer[1][8].code == 'b' );
+    REQUIRE( ctx.col == 8 );
+
+    // a flood of marks on one cell is capped
+    std::string marks;
+    for (int i = 0; i < 20000; i++) {
+        marks += "\u0301";
+    }
+    feed("\r\nq" + marks + "z");
+    REQUIRE( ClusterCodepoints(ctx.buffer[2][0].code).size() == max_cluster_codepoints );
+    REQUIRE( ctx.buffer[2][1].code == 'z' );
+}
+
+TEST_CASE( "Selection", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(3, 10);
+    for (char ch : std::string("one two\r\nabcdefghijklm\r\nx(y)z")) {
+        ctx.Parse(ch);
+    }
+    // first line is in history, the second is soft wrapped
+    REQUIRE( ctx.scrolled_lines == 1 );
+    auto select = [&](int mode, cell_position anchor, cell_position extent) {
+        ctx.selection = {mode, anchor, extent};
+        return ctx.SelectedText();
+    };
+
+    REQUIRE( select(selection_char, {0, 4}, {0, 7}) == "two" );
+    REQUIRE( select(selection_char, {0, 7}, {0, 4}) == "two" );
+    REQUIRE( select(selection_char, {0, 4}, {0, 4}) == "" );
+    REQUIRE( select(selection_char, {0, 0}, {3, 0}) == "one two\nabcdefghijklm\n" );
+    REQUIRE( select(selection_char, {0, 4}, {1, 2}) == "two\nab" );
+    cell_position from, to;
+    int begin, end;
+    REQUIRE( ctx.SelectionBounds(from, to) );
+    ctx.SelectedColumns(from, to, 0, begin, end);
+    REQUIRE( (begin == 4 && end == 10) );
+    ctx.SelectedColumns(from, to, 1, begin, end);
+    REQUIRE( (begin == 0 && end == 2) );
+    ctx.SelectedColumns(from, to, 2, begin, end);
+    REQUIRE( begin == end );
+
+    // words and lines follow soft wraps
+    REQUIRE( select(selection_word, {0, 5}, {0, 5}) == "two" );
+    REQUIRE( select(selection_word, {2, 1}, {2, 1}) == "abcdefghijklm" );
+    REQUIRE( select(selection_word, {3, 1}, {3, 2}) == "(y" );
+    REQUIRE( select(selection_line, {2, 1}, {2, 1}) == "abcdefghijklm" );
+    REQUIRE( select(selection_line, {0, 9}, {3, 0}) == "one two\nabcdefghijklm\nx(y)z" );
+
+    // blocks are cut per line
+    REQUIRE( select(selection_block, {3, 3}, {1, 1}) == "bc\nlm\n(y" );
+
+    ctx.selection.mode = selection_none;
+    REQUIRE( !ctx.SelectionBounds(from, to) );
+    REQUIRE( ctx.SelectedText() == "" );
+}
+
+TEST_CASE( "Snapshot", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(4, 20);
+    auto feed = [](terminal_context &term, const std::string &s) {
+        for (char ch : s) {
+            term.Parse(ch);
+        }
+    };
+    auto same_rows = [](const std::vector<term_char> &a, const std::vector<term_char> &b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); i++) {
+            if (a[i].code != b[i].code || a[i].style.fore.value != b[i].style.fore.value ||
+                a[i].style.back.value != b[i].style.back.value || a[i].style.weight != b[i].style.weight ||
+                a[i].style.wrap != b[i].style.wrap || a[i].style.link != b[i].style.link) {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto same_lines = [&](const terminal_context &a, const terminal_context &b) {
+        if (a.history.size() != b.history.size() || a.buffer.size() != b.buffer.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.history.size(); i++) {
+            if (!same_rows(a.history[i], b.history[i])) {
+                return false;
+            }
+        }
+        for (size_t i = 0; i < a.buffer.size(); i++) {
+            if (!same_rows(a.buffer[i], b.buffer[i])) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    feed(ctx, "\x1b]2;title\x07\x1b]8;;http://a\x07link\x1b]8;;\x07 \x1b[1;31mred\x1b[m e\xcc\x81\r\n");
+    feed(ctx, "1\r\n2\r\n3\r\n0123456789012345678901\r\n\x1b[?2004h\x1b[?1h\x1b[2;3r\x1b[3;5H\x1b[4");
+    std::string state, history_data;
+    bool rewrite = false;
+    ctx.EncodeSnapshot(state, history_data, rewrite);
+    REQUIRE( rewrite );
+    // rows of blanks take a few bytes
+    REQUIRE( state.size() < 200 );
+
+    terminal_context restored;
+    REQUIRE( restored.DecodeSnapshot(state, history_data) );
+    REQUIRE( restored.num_rows == 4 );
+    REQUIRE( restored.num_cols == 20 );
+    REQUIRE( (restored.row == 2 && restored.col == 4) );
+    REQUIRE( (restored.scroll_top == 1 && restored.scroll_bottom == 2) );
+    REQUIRE( restored.scrolled_lines == ctx.scrolled_lines );
+    REQUIRE( restored.title == "title" );
+    REQUIRE( restored.bracketed_paste );
+    REQUIRE( restored.application_cursor );
+    REQUIRE( restored.escape_state == state_csi );
+    REQUIRE( restored.escape_buffer == ctx.escape_buffer );
+    REQUIRE( same_lines(ctx, restored) );
+    REQUIRE( restored.links.Uri(restored.history[0][0].style.link) == "http://a" );
+    REQUIRE( restored.TextBetween(0, 0, restored.scrolled_lines + 3, 20) ==
+             ctx.TextBetween(0, 0, ctx.scrolled_lines + 3, 20) );
+
+    // history is appended to what was saved
+    feed(ctx, "\r\x1b[r\x1b[4H\r\n5\r\n6\r\n");
+    std::string more_state, more_history;
+    ctx.EncodeSnapshot(more_state, more_history, rewrite);
+    REQUIRE( !rewrite );
+    REQUIRE( !more_history.empty() );
+    REQUIRE( ctx.snapshot_bytes == history_data.size() + more_history.size() );
+    terminal_context appended;
+    REQUIRE( appended.DecodeSnapshot(more_state, history_data + more_history) );
+    REQUIRE( same_lines(ctx, appended) );
+    REQUIRE( !appended.snapshot_stale );
+
+    // torn history is dropped and written again, invalid state is rejected
+    terminal_context torn;
+    REQUIRE( torn.DecodeSnapshot(more_state, history_data) );
+    REQUIRE( torn.history.empty() );
+    REQUIRE( torn.snapshot_stale );
+    torn.EncodeSnapshot(state, history_data, rewrite);
+    REQUIRE( rewrite );
+    terminal_context invalid;
+    REQUIRE( !invalid.DecodeSnapshot(more_state.substr(0, more_state.size() - 4), more_history) );
+    REQUIRE( !invalid.DecodeSnapshot("TMSN", "") );
+
+    // files follow sessions when they swap places, e.g. after switching
+    char dir[] = "/tmp/termony-snapshot-XXXXXX";
+    REQUIRE( mkdtemp(dir) != nullptr );
+    SetSnapshotDir(dir);
+    terminal_context first, second;
+    first.ResizeTo(2, 10);
+    second.ResizeTo(2, 10);
+    feed(first, "a1\r\na2\r\na3\r\n");
+    feed(second, "b1\r\nb2\r\nb3\r\n");
+    REQUIRE( SaveSessionSnapshot(&first, 0) );
+    REQUIRE( SaveSessionSnapshot(&second, 1) );
+    feed(first, "a4\r\n");
+    feed(second, "b4\r\n");
+    REQUIRE( SaveSessionSnapshot(&second, 0) );
+    REQUIRE( SaveSessionSnapshot(&first, 1) );
+    auto read_file = [&](const std::string &name) {
+        std::ifstream in(std::string(dir) + "/" + name, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    terminal_context restored_second, restored_first;
+    REQUIRE( restored_second.DecodeSnapshot(read_file("session-0"), read_file("session-0.history")) );
+    REQUIRE( restored_first.DecodeSnapshot(read_file("session-1"), read_file("session-1.history")) );
+    REQUIRE( restored_second.history.size() == 3 );
+    REQUIRE( same_lines(second, restored_second) );
+    REQUIRE( same_lines(first, restored_first) );
+    for (auto name : {"session-0", "session-0.history", "session-1", "session-1.history"}) {
+        unlink((std::string(dir) + "/" + name).c_str());
+    }
+    rmdir(dir);
+    SetSnapshotDir("");
+}
+
+TEST_CASE( "Daemon mirror", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(4, 20);
+    for (char ch : std::string("a\r\nb\r\nc\r\nd\r\ne\x1b[?25l\x1b[?1000h\x1b]2;remote\x07")) {
+        ctx.Parse(ch);
+    }
+
+    // attaching ui gets whole history, unlike an incremental snapshot
+    std::string state, history_data;
+    ctx.EncodeAll(state, history_data);
+    terminal_context mirror;
+    REQUIRE( mirror.DecodeSnapshot(state, history_data) );
+    REQUIRE( mirror.history.size() == 1 );
+    REQUIRE( mirror.TextBetween(0, 0, 5, 20) == ctx.TextBetween(0, 0, 5, 20) );
+
+    // modes follow on their own, with size
+    ctx.ResizeTo(6, 30);
+    for (char ch : std::string("\x1b[?25h\x1b[?1000l\x1b]2;other\x07")) {
+        ctx.Parse(ch);
+    }
+    std::string modes;
+    ctx.EncodeModes(modes);
+    snapshot_reader in = {(const uint8_t *)modes.data(), (const uint8_t *)modes.data() + modes.size()};
+    REQUIRE( mirror.DecodeModes(in) );
+    REQUIRE( (mirror.num_rows == 6 && mirror.num_cols == 30) );
+    REQUIRE( mirror.show_cursor );
+    REQUIRE( mirror.mouse_tracking == mouse_tracking_off );
+    REQUIRE( mirror.title == "other" );
+
+    snapshot_reader truncated = {(const uint8_t *)modes.data(), (const uint8_t *)modes.data() + modes.size() / 2};
+    REQUIRE( !mirror.DecodeModes(truncated) );
+}
+
+TEST_CASE( "Grid deltas", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(4, 40);
+    auto feed = [&](const std::string &s) {
+        for (char ch : s) {
+            ctx.Parse(ch);
+        }
+    };
+    grid_encoder encoder;
+    grid_mirror viewer;
+    auto frame = [&]() {
+        std::string out, length;
+        if (!encoder.Encode(ctx, out)) {
+            return (size_t)0;
+        }
+        for (size_t size = out.size(); length.empty() || size > 0; size >>= 7) {
+            length += (char)((size & 0x7f) | (size >= 0x80 ? 0x80 : 0));
+        }
+        std::string buffer = length + out;
+        REQUIRE( viewer.Receive(buffer) );
+        REQUIRE( buffer.empty() );
+        return out.size();
+    };
+    auto same_screen = [&]() {
+        for (int i = 0; i < ctx.num_rows; i++) {
+            for (int j = 0; j < ctx.num_cols; j++) {
+                const term_char &a = ctx.buffer[i][j], &b = viewer.rows[i][j];
+                if (a.code != b.code || a.style.fore.value != b.style.fore.value || a.style.weight != b.style.weight) {
+                    return false;
+                }
+            }
+        }
+        return viewer.row == ctx.row && viewer.col == ctx.col;
+    };
+
+    // keyframe sends only what is not blank
+    feed("hello \x1b[1;32mgreen\x1b[m e\xcc\x81");
+    size_t keyframe = frame();
+    REQUIRE( keyframe > 0 );
+    REQUIRE( keyframe < 64 );
+    REQUIRE( same_screen() );
+    REQUIRE( frame() == 0 );
+
+    // one cell and the cursor
+    feed("\x1b[1;2Ha");
+    REQUIRE( frame() < 16 );
+    REQUIRE( same_screen() );
+
+    // scrolling costs the new row, not the screen
+    feed("\x1b[4H\r\nnext line");
+    REQUIRE( frame() < 32 );
+    REQUIRE( same_screen() );
+    REQUIRE( viewer.dirty_rows[3] );
+
+    // size changes start over
+    ctx.ResizeTo(5, 30);
+    feed("\x1b[1;31mred");
+    REQUIRE( frame() > 0 );
+    REQUIRE( viewer.num_rows == 5 );
+    REQUIRE( same_screen() );
+
+    // cluster of a codepoint that is no character, or of too many
+    std::string bogus_cluster("\x0a\x03\x00\x00\x01\x0a\x80\x80\x80\x80\x08", 11);
+    REQUIRE( !viewer.Receive(bogus_cluster) );
+    std::string long_cluster("\x27\x03\x00\x00\x01\x8a\x02", 7);
+    long_cluster += std::string(max_cluster_codepoints + 1, 'a');
+    REQUIRE( !viewer.Receive(long_cluster) );
+
+    // cursor out of screen
+    std::string far_cursor("\x08\x04\xff\xff\xff\xff\x0f\x00\x01", 9);
+    REQUIRE( !viewer.Receive(far_cursor) );
+    REQUIRE( viewer.row == ctx.row );
+
+    // unknown op
+    std::string invalid = "\x01\x09";
+    REQUIRE( !viewer.Receive(invalid) );
+}
+
+TEST_CASE( "Recording", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(4, 20);
+    ctx.recording = std::make_shared<session_recording>();
+    auto next_event = [&](size_t &offset, std::string &data) {
+        recording_event event;
+        memcpy(&event, &ctx.recording->pending[offset], sizeof(event));
+        data = ctx.recording->pending.substr(offset + sizeof(event), event.length);
+        offset += sizeof(event) + event.length;
+        return event.type;
+    };
+
+    // output and resizes are queued for writer as they are
+    std::string output = "a\x1b[31mb\xe4";
+    ctx.HandleOutput((const uint8_t *)output.data(), output.size());
+    ctx.ResizeTo(5, 30);
+    ctx.ResizeTo(5, 30);
+    size_t offset = 0;
+    std::string data;
+    REQUIRE( next_event(offset, data) == 'o' );
+    REQUIRE( data == output );
+    REQUIRE( next_event(offset, data) == 'r' );
+    REQUIRE( data == "30x5" );
+    REQUIRE( offset == ctx.recording->pending.size() );
+
+    // parser never waits for writer, output is dropped instead
+    ctx.recording->pending.resize(max_recording_pending - 16);
+    ctx.HandleOutput((const uint8_t *)output.data(), output.size());
+    REQUIRE( ctx.recording->pending.size() == max_recording_pending - 16 );
+    REQUIRE( ctx.recording->dropped == output.size() );
+}
+
+TEST_CASE( "Bracketed paste", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+
+    // CSI ? 2004 h, set bracketed paste mode
+    for (char ch : std::string("\x1b[?2004h")) {
+        ctx.Parse(ch);
+    }
+    REQUIRE( ctx.bracketed_paste );
+
+    // newlines become carriage returns, the end marker can not be injected
+    std::string content = "a\r\nb\n\x1b[201~c";
+    ctx.QueuePaste((const uint8_t *)content.data(), content.size());
+
+    struct iovec iov[5];
+    size_t reply_bytes, input_bytes;
+    int iovcnt = ctx.GatherWrites(iov, reply_bytes, input_bytes);
+    REQUIRE( iovcnt == 1 );
+    std::string expected = "\x1b[200~a\rb\rc\x1b[201~";
+    REQUIRE( std::string((const char *)iov[0].iov_base, iov[0].iov_len) == expected );
+
+    // partial write keeps the rest for later
+    ctx.ReleaseWritten(iov, iovcnt, reply_bytes, input_bytes, 3);
+    REQUIRE( ctx.paste_written == 3 );
+    REQUIRE( ctx.paste_total == expected.size() );
+    iovcnt = ctx.GatherWrites(iov, reply_bytes, input_bytes);
+    REQUIRE( std::string((const char *)iov[0].iov_base, iov[0].iov_len) == expected.substr(3) );
+}
+
+TEST_CASE( "Large paste is written in chunks", "" ) {
+    terminal_context ctx;
+
+    ctx.ResizeTo(24, 80);
+
+    std::string content(10000, 'x');
+    ctx.QueuePaste((const uint8_t *)content.data(), content.size());
+
+    // typed keys go before the paste chunk
+    ctx.input.Push((const uint8_t *)"k", 1);
+    struct iovec iov[5];
+    size_t reply_bytes, input_bytes;
+    int iovcnt = ctx.GatherWrites(iov, reply_bytes, input_bytes);
+    REQUIRE( iovcnt == 2 );
+    REQUIRE( input_bytes == 1 );
+    REQUIRE( iov[1].iov_len == 4096 );
+
+    size_t written = 0;
+    while (iovcnt > 0) {
+        size_t size = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            size += iov[i].iov_len;
+        }
+        ctx.ReleaseWritten(iov, iovcnt, reply_bytes, input_bytes, size);
+        written += size;
+        iovcnt = ctx.GatherWrites(iov, reply_bytes, input_bytes);
+    }
+    REQUIRE( written == content.size() + 1 );
+    REQUIRE( ctx.paste_written == ctx.paste_total );
+}
+
 void TestAlacritty(std::string name) {
     terminal_context ctx;
     std::string ref = "alacritty/alacritty_terminal/tests/ref";
@@ -1,12 +1,86 @@
 export const run: () => void;
-export const send: (content: ArrayBuffer) => void;
+// returns bytes accepted, the rest should be retried later
+// session defaults to the one shown on screen
+export const send: (content: ArrayBuffer, session?: number) => number;
+// encode key natively according to keyboard modes (DECCKM, keypad,
+// modifyOtherKeys, kitty), key is KeyEvent.keyText, text is what
+// the key produces, modifiers are shift=1 alt=2 ctrl=4 super=8
+export const sendKey: (key: string, modifiers: number, text: string, session?: number) => number;
+// report mouse to program if it tracks mouse, returns false otherwise
+// action: press=0 release=1 motion=2
+// button: left=0 middle=1 right=2 none=3 wheel up=4 wheel down=5
+// x and y are pixels from top left of surface
+export const sendMouse: (action: number, button: number, modifiers: number, x: number, y: number,
+  session?: number) => boolean;
+// pointer position in pixels, links under it are underlined, -1 when
+// pointer leaves
+export const setHover: (x: number, y: number) => void;
+// OSC 8 hyperlink at pixel position, empty string if none
+export const getLinkAt: (x: number, y: number, session?: number) => string;
+// url or file path detected in output at pixel position, empty string if none
+export const getMatchAt: (x: number, y: number, session?: number) => string;
+// shell integration (OSC 133), n counts commands since the session
+// started, negative n counts from the last one
+export const scrollToPrompt: (n: number) => boolean;
+// scroll to prompt delta commands away from the top of screen
+export const jumpToPrompt: (delta: number) => boolean;
+// output of command is sent as a copy event
+export const copyCommandOutput: (n?: number, session?: number) => boolean;
+// exitStatus is -1 if not reported, durationMsec is -1 until finished
+export const getCommand: (n: number, session?: number) =>
+  { index: number, finished: boolean, exitStatus: number, durationMsec: number } | undefined;
+// output of session recorded natively to asciicast v2 file at path
+export const startRecording: (path: string, session?: number) => boolean;
+export const stopRecording: (session?: number) => boolean;
+export const isRecording: (session?: number) => boolean;
+// selection of session on screen, drawn natively, x and y are pixels
+// from top left of surface, mode: char=1 word=2 line=3 block=4
+export const startSelection: (x: number, y: number, mode?: number) => void;
+export const extendSelection: (x: number, y: number) => void;
+export const clearSelection: () => void;
+export const selectAll: () => void;
+// selected text, empty string if none
+export const getSelection: () => string;
+// selected text is sent as a copy event
+export const copySelection: () => boolean;
+// input buffer shared with native code, write bytes from offset 0
+// then commit them in one call, returns bytes left at the front
+// of buffer that were not accepted and should be retried
+export const getInputBuffer: () => ArrayBuffer;
+export const commitInput: (length: number, session?: number) => number;
+// sessions, all served by one io thread
+export const createSession: () => number;
+export const switchSession: (session: number) => boolean;
+export const closeSession: (session: number) => boolean;
+export const getExitStatus: (session: number) => number;
+// paste is streamed to pty in chunks, wrapped when bracketed paste mode is on
+export const paste: (content: ArrayBuffer, session?: number) => void;
+export const getPasteProgress: (session?: number) => { written: number, total: number };
 export const createSurface: (id: BigInt) => void;
 export const destroySurface: (id: BigInt) => void;
 export const resizeSurface: (id: BigInt, width: number, height: number) => void;
 export const scroll: (offset: number) => void;
-// poll if any thing to copy/paste
-export const checkCopy: () => string | undefined;
-export const checkPaste: () => boolean;
+// output triggers matched as text is written, for all sessions
+// notify (default true) posts a trigger event once per line,
+// highlight recolors background of matched text as 0xRRGGBB
+// returns error message, empty if compiled
+export const setTriggers: (patterns: { text: string, notify?: boolean, highlight?: number }[]) => string;
+// events pushed from native threads:
+// copy (decoded text), paste request, bell, title, program exit,
+// cursor rectangle in pixels from top left of surface,
+// tmux pane sessions opened (code 1) or closed (code 0),
+// and trigger matched (code is pattern index, text is pattern)
+export interface TerminalEvent {
+  type: 'copy' | 'paste' | 'bell' | 'title' | 'exit' | 'cursor' | 'session' | 'trigger';
+  session: number;
+  text?: string;
+  code?: number;
+  x?: number;
+  y?: number;
+  width?: number;
+  height?: number;
+}
+export const setEventHandler: (handler: (event: TerminalEvent) => void) => void;
 // send paste result
 export const pushPaste: (base64: string) => void;
 //